@@ -0,0 +1,37 @@
+// The four STREAM kernels, on elements of STREAM_TYPE (float by default, or
+// float4 when built with -DSTREAM_TYPE=float4). Each work-item handles one
+// element, so the kernels are bound by memory and not by instructions.
+
+#ifndef STREAM_TYPE
+#define STREAM_TYPE float
+#endif
+
+// stream_copy: c = a, 2 accesses per element
+__kernel void stream_copy(__global const STREAM_TYPE *a,
+                          __global STREAM_TYPE *c) {
+  size_t i = get_global_id(0);
+  c[i] = a[i];
+}
+
+// stream_scale: b = q * c, 2 accesses per element
+__kernel void stream_scale(__global STREAM_TYPE *b,
+                           __global const STREAM_TYPE *c, float q) {
+  size_t i = get_global_id(0);
+  b[i] = q * c[i];
+}
+
+// stream_add: c = a + b, 3 accesses per element
+__kernel void stream_add(__global const STREAM_TYPE *a,
+                         __global const STREAM_TYPE *b,
+                         __global STREAM_TYPE *c) {
+  size_t i = get_global_id(0);
+  c[i] = a[i] + b[i];
+}
+
+// stream_triad: a = b + q * c, 3 accesses per element
+__kernel void stream_triad(__global STREAM_TYPE *a,
+                           __global const STREAM_TYPE *b,
+                           __global const STREAM_TYPE *c, float q) {
+  size_t i = get_global_id(0);
+  a[i] = b[i] + q * c[i];
+}
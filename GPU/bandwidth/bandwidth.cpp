@@ -0,0 +1,466 @@
+#include <CL/cl.h>
+#include <CL/cl_ext.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <iostream>  // for standard I/O
+#include <string>
+#include <vector>
+#define STRING_BUFFER_LEN 1024
+using namespace std;
+
+// The STREAM kernels of bandwidth.cl, in the order they run. Each reads and
+// writes some of the buffers a, b and c (0, 1 and 2), listed in the order of
+// its arguments, followed by the float q for scale and triad.
+#define STREAM_KERNELS 4
+const char *const STREAM_KERNEL_NAMES[STREAM_KERNELS] = {
+    "stream_copy", "stream_scale", "stream_add", "stream_triad"};
+const char *const STREAM_TESTS[STREAM_KERNELS] = {"copy", "scale", "add",
+                                                  "triad"};
+const unsigned STREAM_BUFFERS[STREAM_KERNELS] = {2, 2, 3, 3};
+const unsigned STREAM_ARGS[STREAM_KERNELS][3] = {
+    {0, 2, 0}, {1, 2, 0}, {0, 1, 2}, {0, 1, 2}};
+const bool STREAM_SCALED[STREAM_KERNELS] = {false, true, false, true};
+
+// The element types the kernels are built for, and their floats per element
+#define STREAM_TYPES 2
+const char *const STREAM_TYPE_NAMES[STREAM_TYPES] = {"float", "float4"};
+const unsigned STREAM_TYPE_FLOATS[STREAM_TYPES] = {1, 4};
+
+// STREAM_Q is the scalar of scale and triad. One round of the 4 kernels
+// multiplies a by q * (2 + q), which is 1 for sqrt(2) - 1: the values stay
+// the same however many rounds run, so they can be checked exactly enough.
+#define STREAM_Q 0.41421356f
+
+// BandwidthStats summarises the repetitions of a measurement, in
+// milliseconds
+struct BandwidthStats {
+  double mean;
+  double stddev;
+  double min;
+};
+
+// BandwidthReport writes the measurements as JSON to fp and as a table to
+// the standard output
+struct BandwidthReport {
+  FILE *fp;
+  bool first;
+};
+
+void print_clbuild_errors(cl_program program, cl_device_id device) {
+  cout << "Program Build failed\n";
+  size_t length;
+  char buffer[2048];
+  clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, sizeof(buffer),
+                        buffer, &length);
+  cout << "--- Build log ---\n " << buffer << endl;
+  exit(1);
+}
+
+unsigned char **read_file(const char *name) {
+  size_t size;
+  unsigned char **output = (unsigned char **)malloc(sizeof(unsigned char *));
+  FILE *fp = fopen(name, "rb");
+  if (!fp) {
+    printf("no such file:%s", name);
+    exit(-1);
+  }
+
+  fseek(fp, 0, SEEK_END);
+  size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+
+  // The source is passed to clCreateProgramWithSource without a length, so it
+  // has to be null terminated
+  *output = (unsigned char *)malloc(size + 1);
+  if (!*output) {
+    fclose(fp);
+    printf("mem allocate failure:%s", name);
+    exit(-1);
+  }
+
+  if (!fread(*output, size, 1, fp)) printf("failed to read file\n");
+  (*output)[size] = '\0';
+  fclose(fp);
+  return output;
+}
+
+void callback(const char *buffer, size_t length, size_t final,
+              void *user_data) {
+  fwrite(buffer, 1, length, stdout);
+}
+
+void checkError(int status, const char *msg) {
+  if (status != CL_SUCCESS) printf("%s\n", msg);
+}
+
+// initOpenCL prints the first platform and creates a context on its first
+// GPU
+cl_context initOpenCL(cl_platform_id *platform, cl_device_id *device) {
+  char char_buffer[STRING_BUFFER_LEN];
+  cl_context_properties context_properties[] = {CL_CONTEXT_PLATFORM,
+                                                0,
+                                                CL_PRINTF_CALLBACK_ARM,
+                                                (cl_context_properties)callback,
+                                                CL_PRINTF_BUFFERSIZE_ARM,
+                                                0x1000,
+                                                0};
+
+  clGetPlatformIDs(1, platform, NULL);
+
+  clGetPlatformInfo(*platform, CL_PLATFORM_NAME, STRING_BUFFER_LEN,
+                    char_buffer, NULL);
+  printf("%-40s = %s\n", "CL_PLATFORM_NAME", char_buffer);
+  clGetPlatformInfo(*platform, CL_PLATFORM_VENDOR, STRING_BUFFER_LEN,
+                    char_buffer, NULL);
+  printf("%-40s = %s\n", "CL_PLATFORM_VENDOR ", char_buffer);
+  clGetPlatformInfo(*platform, CL_PLATFORM_VERSION, STRING_BUFFER_LEN,
+                    char_buffer, NULL);
+  printf("%-40s = %s\n\n", "CL_PLATFORM_VERSION ", char_buffer);
+
+  context_properties[1] = (cl_context_properties)*platform;
+  clGetDeviceIDs(*platform, CL_DEVICE_TYPE_GPU, 1, device, NULL);
+  return clCreateContext(context_properties, 1, device, NULL, NULL, NULL);
+}
+
+BandwidthStats bandwidthStats(const vector<double> &samples) {
+  BandwidthStats stats = {0, 0, samples.empty() ? 0 : samples[0]};
+  for (unsigned i = 0; i < samples.size(); i++) {
+    stats.mean += samples[i] / samples.size();
+    if (samples[i] < stats.min) stats.min = samples[i];
+  }
+  for (unsigned i = 0; i < samples.size() && samples.size() > 1; i++) {
+    double diff = samples[i] - stats.mean;
+    stats.stddev += diff * diff / (samples.size() - 1);
+  }
+  stats.stddev = sqrt(stats.stddev);
+  return stats;
+}
+
+// eventMillis returns how long a profiled command ran on the device
+double eventMillis(cl_event event) {
+  cl_ulong start = 0, end = 0;
+  clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(start),
+                          &start, NULL);
+  clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(end), &end,
+                          NULL);
+  return (end - start) * 1.0e-6;
+}
+
+// jsonString quotes text as a JSON string
+string jsonString(const char *text) {
+  string quoted = "\"";
+  for (; *text; text++) {
+    if (*text == '"' || *text == '\\') quoted += '\\';
+    if ((unsigned char)*text >= 0x20) quoted += *text;
+  }
+  return quoted + "\"";
+}
+
+// report adds the times of a test that moves bytes per repetition. The
+// bandwidth is that of the best repetition, as in STREAM, and of the mean.
+void report(BandwidthReport *out, const char *test, const char *type,
+            size_t size, size_t bytes, const vector<double> &samples) {
+  BandwidthStats stats = bandwidthStats(samples);
+  double best = stats.min > 0 ? bytes / stats.min * 1.0e-6 : 0.0;
+  double mean = stats.mean > 0 ? bytes / stats.mean * 1.0e-6 : 0.0;
+  fprintf(out->fp, "%s\n    {\"test\": \"%s\", \"type\": \"%s\", "
+          "\"size\": %zu, \"bytes\": %zu, ", out->first ? "" : ",", test,
+          type, size, bytes);
+  fprintf(out->fp, "\"ms\": {\"mean\": %.4f, \"stddev\": %.4f, "
+          "\"min\": %.4f}, \"gbs\": %.3f, \"mean_gbs\": %.3f}",
+          stats.mean, stats.stddev, stats.min, best, mean);
+  out->first = false;
+  printf("%-14s %-7s %8zu KB %9.3f ms %8.3f GB/s\n", test, type, size >> 10,
+         stats.min, best);
+}
+
+// runTransfers times the copies of size bytes between the host and buffer,
+// from and to pageable memory (an ordinary host array) and pinned memory (a
+// mapped CL_MEM_ALLOC_HOST_PTR buffer), and the mapping of buffer itself
+// for reading and for writing, where the time is that of the map and the
+// unmap. The first of the repetitions + 1 runs warms up and is not counted.
+cl_int runTransfers(cl_context context, cl_command_queue queue, cl_mem buffer,
+                    size_t size, unsigned repetitions,
+                    BandwidthReport *out) {
+  vector<float> pageable(size / sizeof(float), 1.0f);
+  cl_int status;
+  cl_mem pinned = clCreateBuffer(
+      context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, size, NULL, &status);
+  if (status != CL_SUCCESS) return status;
+  void *host = clEnqueueMapBuffer(queue, pinned, CL_TRUE,
+                                  CL_MAP_READ | CL_MAP_WRITE, 0, size, 0, NULL,
+                                  NULL, &status);
+  if (status != CL_SUCCESS) {
+    clReleaseMemObject(pinned);
+    return status;
+  }
+  memset(host, 0, size);
+
+  // writes, reads and maps[test][0 or 1], by test of TRANSFER_TESTS
+  const char *const TRANSFER_TESTS[6] = {
+      "write_pageable", "write_pinned", "read_pageable",
+      "read_pinned",    "map_write",    "map_read"};
+  vector<double> samples[6];
+  for (unsigned r = 0; r <= repetitions && status == CL_SUCCESS; r++) {
+    cl_event events[8] = {NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL};
+    void *sources[2] = {pageable.data(), host};
+    for (unsigned k = 0; k < 2; k++) {
+      clEnqueueWriteBuffer(queue, buffer, CL_FALSE, 0, size, sources[k], 0,
+                           NULL, &events[k]);
+      clEnqueueReadBuffer(queue, buffer, CL_FALSE, 0, size, sources[k], 0,
+                          NULL, &events[2 + k]);
+    }
+    const cl_map_flags flags[2] = {CL_MAP_WRITE, CL_MAP_READ};
+    for (unsigned k = 0; k < 2 && status == CL_SUCCESS; k++) {
+      void *mapped = clEnqueueMapBuffer(queue, buffer, CL_TRUE, flags[k], 0,
+                                        size, 0, NULL, &events[4 + 2 * k],
+                                        &status);
+      if (status != CL_SUCCESS) break;
+      status = clEnqueueUnmapMemObject(queue, buffer, mapped, 0, NULL,
+                                       &events[5 + 2 * k]);
+    }
+    clFinish(queue);
+    for (unsigned t = 0; t < 6 && r > 0 && status == CL_SUCCESS; t++) {
+      double millis = t < 4 ? eventMillis(events[t])
+                            : eventMillis(events[2 * t - 4]) +
+                                  eventMillis(events[2 * t - 3]);
+      samples[t].push_back(millis);
+    }
+    for (unsigned e = 0; e < 8; e++) {
+      if (events[e]) clReleaseEvent(events[e]);
+    }
+  }
+  checkError(status, "Failed to map the device buffer");
+  if (status == CL_SUCCESS) {
+    for (unsigned t = 0; t < 6; t++) {
+      report(out, TRANSFER_TESTS[t], "float", size, size, samples[t]);
+    }
+  }
+
+  clEnqueueUnmapMemObject(queue, pinned, host, 0, NULL, NULL);
+  clFinish(queue);
+  clReleaseMemObject(pinned);
+  return status;
+}
+
+// checkValues checks that the size bytes of buffer all hold expected
+bool checkValues(cl_command_queue queue, cl_mem buffer, size_t size,
+                 float expected, const char *name) {
+  vector<float> values(size / sizeof(float));
+  clEnqueueReadBuffer(queue, buffer, CL_TRUE, 0, size, values.data(), 0, NULL,
+                      NULL);
+  for (unsigned i = 0; i < values.size(); i++) {
+    if (fabsf(values[i] - expected) > 1.0e-4f * fabsf(expected)) {
+      printf("Failed verification of %s @ index %u\nOutput: %f\n"
+             "Reference: %f\n",
+             name, i, values[i], expected);
+      return false;
+    }
+  }
+  return true;
+}
+
+// runKernels times the 4 STREAM kernels on buffers of size bytes, in rounds
+// of copy, scale, add and triad as in STREAM, then checks the buffers
+// against the same rounds on a single element on the CPU. The first of the
+// repetitions + 1 rounds warms up and is not counted. Returns false when the
+// check fails.
+bool runKernels(cl_command_queue queue, cl_kernel kernels[STREAM_KERNELS],
+                const char *type, unsigned floats, cl_mem buffers[3],
+                size_t size, unsigned repetitions, BandwidthReport *out) {
+  float values[3] = {1.0f, 2.0f, 0.0f};
+  vector<float> initial(size / sizeof(float));
+  for (unsigned b = 0; b < 3; b++) {
+    fill(initial.begin(), initial.end(), values[b]);
+    clEnqueueWriteBuffer(queue, buffers[b], CL_TRUE, 0, size, initial.data(),
+                         0, NULL, NULL);
+  }
+
+  float q = STREAM_Q;
+  cl_int status = CL_SUCCESS;
+  for (unsigned k = 0; k < STREAM_KERNELS; k++) {
+    unsigned argi = 0;
+    for (unsigned b = 0; b < STREAM_BUFFERS[k]; b++) {
+      status |= clSetKernelArg(kernels[k], argi++, sizeof(cl_mem),
+                               &buffers[STREAM_ARGS[k][b]]);
+    }
+    if (STREAM_SCALED[k]) {
+      status |= clSetKernelArg(kernels[k], argi++, sizeof(q), &q);
+    }
+  }
+  checkError(status, "Failed to set the kernel arguments");
+  if (status != CL_SUCCESS) return false;
+
+  size_t global = size / sizeof(float) / floats;
+  vector<double> samples[STREAM_KERNELS];
+  for (unsigned r = 0; r <= repetitions && status == CL_SUCCESS; r++) {
+    cl_event events[STREAM_KERNELS];
+    for (unsigned k = 0; k < STREAM_KERNELS && status == CL_SUCCESS; k++) {
+      status = clEnqueueNDRangeKernel(queue, kernels[k], 1, NULL, &global,
+                                      NULL, 0, NULL, &events[k]);
+      if (status != CL_SUCCESS) {
+        printf("Failed to launch the %s kernel\n", STREAM_KERNEL_NAMES[k]);
+        clFinish(queue);
+        for (unsigned e = 0; e < k; e++) clReleaseEvent(events[e]);
+      }
+    }
+    if (status != CL_SUCCESS) break;
+    clFinish(queue);
+    for (unsigned k = 0; k < STREAM_KERNELS; k++) {
+      if (r > 0) samples[k].push_back(eventMillis(events[k]));
+      clReleaseEvent(events[k]);
+    }
+    values[2] = values[0];
+    values[1] = q * values[2];
+    values[2] = values[0] + values[1];
+    values[0] = values[1] + q * values[2];
+  }
+  if (status != CL_SUCCESS) return false;
+
+  for (unsigned k = 0; k < STREAM_KERNELS; k++) {
+    report(out, STREAM_TESTS[k], type, size, STREAM_BUFFERS[k] * size,
+           samples[k]);
+  }
+  const char *names[3] = {"a", "b", "c"};
+  bool pass = true;
+  for (unsigned b = 0; b < 3; b++) {
+    pass = checkValues(queue, buffers[b], size, values[b], names[b]) && pass;
+  }
+  return pass;
+}
+
+// Usage: bandwidth [--sizes=S1,S2,...] [--repeat=R] [--output=PATH]
+// Measures the bandwidth of the STREAM kernels on float and float4 buffers,
+// and of the transfers between the host and the device, with buffers of
+// each size S in KB (256,1024,4096,16384,65536 by default). Every test runs
+// R + 1 times (R = 10 by default), the first being a warm-up, and is timed
+// with profiling events. Writes a JSON report to PATH (bandwidth.json by
+// default).
+int main(int argc, char **argv) {
+  cl_platform_id platform;
+  cl_device_id device;
+  cl_context context;
+  cl_command_queue queue;
+  cl_program programs[STREAM_TYPES];
+  cl_kernel kernels[STREAM_TYPES][STREAM_KERNELS];
+
+  //--------------------------------------------------------------------
+  vector<size_t> sizes;
+  unsigned repetitions = 10;
+  const char *output = "bandwidth.json";
+  bool usage = false;
+  for (int arg = 1; arg < argc; arg++) {
+    string option = argv[arg];
+    if (option.compare(0, 8, "--sizes=") == 0) {
+      // Sizes are in KB
+      for (char *size = argv[arg] + 8;; size++) {
+        sizes.push_back(strtoul(size, &size, 10) << 10);
+        usage = usage || sizes.back() == 0 || (*size && *size != ',');
+        if (*size != ',') break;
+      }
+    } else if (option.compare(0, 9, "--repeat=") == 0) {
+      repetitions = atoi(option.c_str() + 9);
+      usage = usage || repetitions == 0;
+    } else if (option.compare(0, 9, "--output=") == 0) {
+      output = argv[arg] + 9;
+    } else {
+      usage = true;
+    }
+  }
+  if (usage) {
+    printf("Usage: %s [--sizes=S1,S2,...] [--repeat=R] [--output=PATH]\n",
+           argv[0]);
+    return 1;
+  }
+  if (sizes.empty()) {
+    for (size_t size = 256 << 10; size <= 64 << 20; size *= 4) {
+      sizes.push_back(size);
+    }
+  }
+
+  FILE *fp = fopen(output, "w");
+  if (!fp) {
+    printf("Could not open %s for writing\n", output);
+    return 1;
+  }
+
+  context = initOpenCL(&platform, &device);
+  // Timestamps are only available on a profiling queue
+  int status;
+  queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE,
+                               &status);
+  checkError(status, "Failed to create a profiling command queue");
+
+  // One program per element type, built from the same source
+  unsigned char **opencl_program = read_file("bandwidth.cl");
+  for (unsigned t = 0; t < STREAM_TYPES; t++) {
+    string options = string("-DSTREAM_TYPE=") + STREAM_TYPE_NAMES[t];
+    programs[t] = clCreateProgramWithSource(
+        context, 1, (const char **)opencl_program, NULL, NULL);
+    if (programs[t] == NULL) {
+      printf("Program creation failed\n");
+      return 1;
+    }
+    int success =
+        clBuildProgram(programs[t], 0, NULL, options.c_str(), NULL, NULL);
+    if (success != CL_SUCCESS) print_clbuild_errors(programs[t], device);
+    for (unsigned k = 0; k < STREAM_KERNELS; k++) {
+      kernels[t][k] =
+          clCreateKernel(programs[t], STREAM_KERNEL_NAMES[k], &status);
+      if (status != CL_SUCCESS) {
+        printf("Failed to create %s kernel\n", STREAM_KERNEL_NAMES[k]);
+        return 1;
+      }
+    }
+  }
+
+  char name[STRING_BUFFER_LEN];
+  clGetDeviceInfo(device, CL_DEVICE_NAME, STRING_BUFFER_LEN, name, NULL);
+  BandwidthReport report = {fp, true};
+  fprintf(fp, "{\n  \"device\": %s,\n", jsonString(name).c_str());
+  fprintf(fp, "  \"repetitions\": %u,\n", repetitions);
+  fprintf(fp, "  \"results\": [");
+
+  bool pass = true;
+  for (unsigned s = 0; s < sizes.size() && status == CL_SUCCESS; s++) {
+    // Whole float4 elements
+    size_t size = sizes[s] / 16 * 16;
+    cl_mem buffers[3] = {NULL, NULL, NULL};
+    for (unsigned b = 0; b < 3 && status == CL_SUCCESS; b++) {
+      buffers[b] =
+          clCreateBuffer(context, CL_MEM_READ_WRITE, size, NULL, &status);
+      checkError(status, "Failed to create a buffer");
+    }
+    if (status == CL_SUCCESS) {
+      status = runTransfers(context, queue, buffers[0], size, repetitions,
+                            &report);
+      checkError(status, "Failed to measure the transfers");
+    }
+    for (unsigned t = 0; t < STREAM_TYPES && status == CL_SUCCESS; t++) {
+      pass = runKernels(queue, kernels[t], STREAM_TYPE_NAMES[t],
+                        STREAM_TYPE_FLOATS[t], buffers, size, repetitions,
+                        &report) &&
+             pass;
+    }
+    for (unsigned b = 0; b < 3; b++) {
+      if (buffers[b]) clReleaseMemObject(buffers[b]);
+    }
+    if (status != CL_SUCCESS) pass = false;
+  }
+  fprintf(fp, "\n  ]\n}\n");
+  fclose(fp);
+  printf("Wrote %s\n", output);
+
+  for (unsigned t = 0; t < STREAM_TYPES; t++) {
+    for (unsigned k = 0; k < STREAM_KERNELS; k++) {
+      clReleaseKernel(kernels[t][k]);
+    }
+    clReleaseProgram(programs[t]);
+  }
+  clReleaseCommandQueue(queue);
+  clReleaseContext(context);
+  return pass ? 0 : 1;
+}
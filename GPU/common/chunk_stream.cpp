@@ -0,0 +1,122 @@
+#include "chunk_stream.hpp"
+#include <string.h>
+
+ChunkStream::ChunkStream(cl_context context, cl_command_queue queue,
+                         size_t chunk, unsigned depth)
+    : context(context),
+      queue(queue),
+      chunk(chunk),
+      depth(depth ? depth : 1),
+      file(NULL),
+      pinned(),
+      mapped(),
+      device(),
+      uploads(),
+      releases(),
+      slot(0) {}
+
+ChunkStream::~ChunkStream() { close(); }
+
+bool ChunkStream::open(const char *path) {
+  close();
+  file = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+  if (!file) {
+    printf("Failed to open %s\n", path);
+    return false;
+  }
+
+  cl_int status = CL_SUCCESS;
+  size_t bytes = chunk * sizeof(float);
+  // Only the handles that were created are kept, for close to free them
+  for (unsigned i = 0; i < depth; i++) {
+    cl_mem host = clCreateBuffer(
+        context, CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR, bytes, NULL,
+        &status);
+    if (status != CL_SUCCESS) break;
+    pinned.push_back(host);
+    float *hostData = (float *)clEnqueueMapBuffer(
+        queue, host, CL_TRUE, CL_MAP_WRITE, 0, bytes, 0, NULL, NULL, &status);
+    if (status != CL_SUCCESS) break;
+    mapped.push_back(hostData);
+    cl_mem buffer =
+        clCreateBuffer(context, CL_MEM_READ_ONLY, bytes, NULL, &status);
+    if (status != CL_SUCCESS) break;
+    device.push_back(buffer);
+    uploads.push_back(NULL);
+    releases.push_back(NULL);
+  }
+  if (status != CL_SUCCESS) {
+    printf("Failed to allocate the stream buffers\n");
+    close();
+    return false;
+  }
+  slot = depth - 1;
+  return true;
+}
+
+// close waits for the uploads and frees everything
+void ChunkStream::close() {
+  for (unsigned i = 0; i < uploads.size(); i++) {
+    if (uploads[i]) {
+      clWaitForEvents(1, &uploads[i]);
+      clReleaseEvent(uploads[i]);
+    }
+    if (releases[i]) {
+      clWaitForEvents(1, &releases[i]);
+      clReleaseEvent(releases[i]);
+    }
+  }
+  for (unsigned i = 0; i < mapped.size(); i++) {
+    clEnqueueUnmapMemObject(queue, pinned[i], mapped[i], 0, NULL, NULL);
+  }
+  if (!mapped.empty()) clFinish(queue);
+  for (unsigned i = 0; i < pinned.size(); i++) clReleaseMemObject(pinned[i]);
+  for (unsigned i = 0; i < device.size(); i++) clReleaseMemObject(device[i]);
+  pinned.clear();
+  mapped.clear();
+  device.clear();
+  uploads.clear();
+  releases.clear();
+  if (file && file != stdin) fclose(file);
+  file = NULL;
+}
+
+size_t ChunkStream::next(cl_mem *buffer, const float **host,
+                         cl_event *uploaded) {
+  if (!file || device.empty()) return 0;
+  slot = (slot + 1) % depth;
+
+  // The pinned buffer may only be refilled once its last upload is over
+  if (uploads[slot]) {
+    clWaitForEvents(1, &uploads[slot]);
+    clReleaseEvent(uploads[slot]);
+    uploads[slot] = NULL;
+  }
+  size_t count = fread(mapped[slot], sizeof(float), chunk, file);
+  if (count == 0) return 0;
+
+  // and the device buffer once the work on its last chunk is over
+  cl_uint numEvents = releases[slot] ? 1 : 0;
+  cl_int status = clEnqueueWriteBuffer(
+      queue, device[slot], CL_FALSE, 0, count * sizeof(float), mapped[slot],
+      numEvents, numEvents ? &releases[slot] : NULL, &uploads[slot]);
+  if (releases[slot]) clReleaseEvent(releases[slot]);
+  releases[slot] = NULL;
+  if (status != CL_SUCCESS) {
+    printf("Failed to upload a chunk\n");
+    uploads[slot] = NULL;
+    return 0;
+  }
+  clFlush(queue);
+
+  *buffer = device[slot];
+  *host = mapped[slot];
+  *uploaded = uploads[slot];
+  return count;
+}
+
+void ChunkStream::done(cl_event event) {
+  if (device.empty()) return;
+  if (releases[slot]) clReleaseEvent(releases[slot]);
+  releases[slot] = event;
+}
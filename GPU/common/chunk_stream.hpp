@@ -0,0 +1,58 @@
+#ifndef COMMON_CHUNK_STREAM_HPP
+#define COMMON_CHUNK_STREAM_HPP
+
+#include <CL/cl.h>
+#include <stdio.h>
+#include <vector>
+
+// ChunkStream reads a stream of raw floats, a file or a pipe, in chunks of a
+// fixed number of elements and uploads them to a ring of device buffers, so
+// that data sets of any size go through a constant amount of memory. Each
+// chunk is read into pinned host memory (a mapped CL_MEM_ALLOC_HOST_PTR
+// buffer, which the driver can copy without staging) and copied on the
+// stream's own queue, so that with a ring of 2 the upload of chunk i + 1
+// overlaps the work on chunk i in another queue.
+class ChunkStream {
+ public:
+  // chunk is the number of floats per chunk, depth the number of chunks in
+  // flight. queue is used for the uploads only.
+  ChunkStream(cl_context context, cl_command_queue queue, size_t chunk,
+              unsigned depth = 2);
+  ~ChunkStream();
+
+  // open starts reading path, "-" for the standard input, and allocates the
+  // buffers. Returns false when either fails.
+  bool open(const char *path);
+
+  // next reads the next chunk and enqueues its upload into the next device
+  // buffer of the ring, once the work given to done for the previous chunk
+  // in that buffer has finished. Returns the number of floats read, 0 at the
+  // end of the stream. buffer receives the device buffer, host the pinned
+  // copy of the chunk, valid until depth more calls, and uploaded the event
+  // of the upload, which belongs to the stream.
+  size_t next(cl_mem *buffer, const float **host, cl_event *uploaded);
+
+  // done gives the event after which the work on the last chunk returned by
+  // next no longer needs its device buffer. The stream releases it.
+  void done(cl_event event);
+
+ private:
+  ChunkStream(const ChunkStream &);
+  ChunkStream &operator=(const ChunkStream &);
+
+  void close();
+
+  cl_context context;
+  cl_command_queue queue;
+  size_t chunk;
+  unsigned depth;
+  FILE *file;
+  std::vector<cl_mem> pinned;    // host side buffers, mapped for good
+  std::vector<float *> mapped;   // their mappings
+  std::vector<cl_mem> device;    // the ring of device buffers
+  std::vector<cl_event> uploads;   // last upload from each pinned buffer
+  std::vector<cl_event> releases;  // end of the work on each device buffer
+  unsigned slot;                   // slot of the last chunk returned
+};
+
+#endif  // COMMON_CHUNK_STREAM_HPP
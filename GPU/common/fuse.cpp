@@ -0,0 +1,103 @@
+#include "fuse.hpp"
+#include <stdio.h>
+
+using namespace std;
+
+// FUSE_KERNEL_NAME is the name of every generated kernel, each in its own
+// program
+#define FUSE_KERNEL_NAME "fused"
+
+void FuseVector::emit(string *code, string *params, unsigned *arg) {
+  string name = "a" + to_string((*arg)++);
+  *code += name + "[i]";
+  *params += ",\n                    __global const float *" + name;
+}
+
+void FuseVector::bind(FuseArgs *args) const {
+  FuseArg arg = {buffer, 0.0f};
+  args->args.push_back(arg);
+  if (args->n && args->n != n) args->mismatch = true;
+  args->n = n;
+}
+
+void FuseScalar::emit(string *code, string *params, unsigned *arg) {
+  string name = "a" + to_string((*arg)++);
+  *code += name;
+  *params += ",\n                    float " + name;
+}
+
+void FuseScalar::bind(FuseArgs *args) const {
+  FuseArg arg = {NULL, value};
+  args->args.push_back(arg);
+}
+
+string fuseKernelSource(const string &code, const string &params) {
+  return "__kernel void " FUSE_KERNEL_NAME "(__global float *z" + params +
+         ") {\n"
+         "  size_t i = get_global_id(0);\n"
+         "  z[i] = " +
+         code + ";\n}\n";
+}
+
+FuseEngine::FuseEngine(cl_context context, cl_device_id device)
+    : context(context), device(device), cache(), programs() {}
+
+FuseEngine::~FuseEngine() {
+  for (map<string, cl_kernel>::iterator it = cache.begin(); it != cache.end();
+       ++it) {
+    clReleaseKernel(it->second);
+  }
+  for (unsigned i = 0; i < programs.size(); i++) {
+    clReleaseProgram(programs[i]);
+  }
+}
+
+cl_kernel FuseEngine::find(const char *signature) const {
+  map<string, cl_kernel>::const_iterator it = cache.find(signature);
+  return it == cache.end() ? NULL : it->second;
+}
+
+cl_kernel FuseEngine::build(const char *signature, const string &source) {
+  const char *text = source.c_str();
+  cl_int status;
+  cl_program program =
+      clCreateProgramWithSource(context, 1, &text, NULL, &status);
+  if (status != CL_SUCCESS) {
+    printf("Failed to create a fused program\n");
+    return NULL;
+  }
+  programs.push_back(program);
+  if (clBuildProgram(program, 1, &device, NULL, NULL, NULL) != CL_SUCCESS) {
+    char log[2048] = "";
+    clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, sizeof(log),
+                          log, NULL);
+    printf("Failed to build the fused kernel\n%s\n%s\n", text, log);
+    return NULL;
+  }
+  cl_kernel kernel = clCreateKernel(program, FUSE_KERNEL_NAME, &status);
+  if (status != CL_SUCCESS) {
+    printf("Failed to create %s kernel\n", FUSE_KERNEL_NAME);
+    return NULL;
+  }
+  cache[signature] = kernel;
+  return kernel;
+}
+
+cl_int FuseEngine::launch(cl_command_queue queue, cl_kernel kernel, cl_mem z,
+                          const FuseArgs &args, cl_uint numEvents,
+                          const cl_event *waitList, cl_event *event) {
+  if (args.n == 0) return CL_INVALID_VALUE;
+  if (args.mismatch) return CL_INVALID_BUFFER_SIZE;
+
+  cl_int status = clSetKernelArg(kernel, 0, sizeof(cl_mem), &z);
+  for (unsigned i = 0; i < args.args.size() && status == CL_SUCCESS; i++) {
+    const FuseArg &arg = args.args[i];
+    status = arg.buffer
+                 ? clSetKernelArg(kernel, i + 1, sizeof(cl_mem), &arg.buffer)
+                 : clSetKernelArg(kernel, i + 1, sizeof(cl_float), &arg.value);
+  }
+  if (status != CL_SUCCESS) return status;
+  size_t globalWorkSize = args.n;
+  return clEnqueueNDRangeKernel(queue, kernel, 1, NULL, &globalWorkSize, NULL,
+                                numEvents, waitList, event);
+}
@@ -0,0 +1,298 @@
+#ifndef COMMON_FUSE_HPP
+#define COMMON_FUSE_HPP
+
+#include <CL/cl.h>
+#include <math.h>
+#include <map>
+#include <string>
+#include <typeinfo>
+#include <vector>
+
+// Element-wise expressions of float buffers, evaluated by one generated
+// OpenCL kernel each. Operators on FuseVector and float build the expression
+// tree as a type, e.g. with FuseVector x, y, w and floats a, b
+//
+//   auto z = a * x + b * y - abs(w);
+//
+// FuseEngine::run then generates a kernel computing the whole expression per
+// element, so a chain of operations reads every input and writes the result
+// once instead of making a pass through memory per operation. The source only
+// depends on the type of the expression, scalars being kernel arguments, so
+// the compiled kernel is cached under the name of the type and built once
+// whatever the values.
+
+// FuseArg is an argument of a fused kernel: a buffer, or a float when buffer
+// is NULL
+struct FuseArg {
+  cl_mem buffer;
+  cl_float value;
+};
+
+// FuseArgs collects the arguments of a fused kernel in the order the leaves
+// of the expression number them, and the length of its vectors: 0 without
+// any, mismatch when they differ
+struct FuseArgs {
+  FuseArgs() : args(), n(0), mismatch(false) {}
+  std::vector<FuseArg> args;
+  unsigned n;
+  bool mismatch;
+};
+
+// FuseExpr is the base of every expression node, E being the node itself
+template <class E>
+struct FuseExpr {
+  const E &self() const { return static_cast<const E &>(*this); }
+};
+
+// Every node provides:
+//   static void emit(std::string *code, std::string *params, unsigned *arg)
+//     appends its OpenCL expression for element i to code, and the parameters
+//     of its leaves, numbered from *arg, to params
+//   void bind(FuseArgs *args) const
+//     appends the values of these parameters
+//   float at(unsigned i) const
+//     computes element i on the CPU, from the host copies of the vectors
+
+// FuseVector is a device buffer of n floats. host is an optional copy of it,
+// only used to evaluate the expression on the CPU.
+struct FuseVector : FuseExpr<FuseVector> {
+  FuseVector(cl_mem buffer, unsigned n, const float *host = NULL)
+      : buffer(buffer), n(n), host(host) {}
+
+  static void emit(std::string *code, std::string *params, unsigned *arg);
+  void bind(FuseArgs *args) const;
+  float at(unsigned i) const { return host[i]; }
+
+  cl_mem buffer;
+  unsigned n;
+  const float *host;
+};
+
+// FuseScalar is a float, the same for every element
+struct FuseScalar : FuseExpr<FuseScalar> {
+  explicit FuseScalar(float value) : value(value) {}
+
+  static void emit(std::string *code, std::string *params, unsigned *arg);
+  void bind(FuseArgs *args) const;
+  float at(unsigned) const { return value; }
+
+  float value;
+};
+
+// The operations: symbol is an infix operator when infix is set and a
+// function of OpenCL otherwise, apply the same on the CPU
+struct FuseAdd {
+  static const bool infix = true;
+  static const char *symbol() { return "+"; }
+  static float apply(float a, float b) { return a + b; }
+};
+
+struct FuseSub {
+  static const bool infix = true;
+  static const char *symbol() { return "-"; }
+  static float apply(float a, float b) { return a - b; }
+};
+
+struct FuseMul {
+  static const bool infix = true;
+  static const char *symbol() { return "*"; }
+  static float apply(float a, float b) { return a * b; }
+};
+
+struct FuseDiv {
+  static const bool infix = true;
+  static const char *symbol() { return "/"; }
+  static float apply(float a, float b) { return a / b; }
+};
+
+struct FuseMin {
+  static const bool infix = false;
+  static const char *symbol() { return "fmin"; }
+  static float apply(float a, float b) { return fminf(a, b); }
+};
+
+struct FuseMax {
+  static const bool infix = false;
+  static const char *symbol() { return "fmax"; }
+  static float apply(float a, float b) { return fmaxf(a, b); }
+};
+
+struct FuseNeg {
+  static const char *symbol() { return "-"; }
+  static float apply(float a) { return -a; }
+};
+
+struct FuseAbs {
+  static const char *symbol() { return "fabs"; }
+  static float apply(float a) { return fabsf(a); }
+};
+
+struct FuseSqrt {
+  static const char *symbol() { return "sqrt"; }
+  static float apply(float a) { return sqrtf(a); }
+};
+
+struct FuseExp {
+  static const char *symbol() { return "exp"; }
+  static float apply(float a) { return expf(a); }
+};
+
+struct FuseLog {
+  static const char *symbol() { return "log"; }
+  static float apply(float a) { return logf(a); }
+};
+
+// FuseUnary applies Op to an expression. Operands are held by value, so an
+// expression stays valid after the temporaries it was built from.
+template <class Op, class A>
+struct FuseUnary : FuseExpr<FuseUnary<Op, A> > {
+  explicit FuseUnary(const A &a) : a(a) {}
+
+  static void emit(std::string *code, std::string *params, unsigned *arg) {
+    *code += Op::symbol();
+    *code += "(";
+    A::emit(code, params, arg);
+    *code += ")";
+  }
+  void bind(FuseArgs *args) const { a.bind(args); }
+  float at(unsigned i) const { return Op::apply(a.at(i)); }
+
+  A a;
+};
+
+// FuseBinary applies Op to two expressions
+template <class Op, class A, class B>
+struct FuseBinary : FuseExpr<FuseBinary<Op, A, B> > {
+  FuseBinary(const A &a, const B &b) : a(a), b(b) {}
+
+  static void emit(std::string *code, std::string *params, unsigned *arg) {
+    if (!Op::infix) *code += Op::symbol();
+    *code += "(";
+    A::emit(code, params, arg);
+    if (Op::infix) {
+      *code += " ";
+      *code += Op::symbol();
+      *code += " ";
+    } else {
+      *code += ", ";
+    }
+    B::emit(code, params, arg);
+    *code += ")";
+  }
+  void bind(FuseArgs *args) const {
+    a.bind(args);
+    b.bind(args);
+  }
+  float at(unsigned i) const { return Op::apply(a.at(i), b.at(i)); }
+
+  A a;
+  B b;
+};
+
+// FUSE_BINARY defines function name for two expressions, or an expression
+// and a float on either side, as a FuseBinary of Op
+#define FUSE_BINARY(name, Op)                                             \
+  template <class A, class B>                                             \
+  FuseBinary<Op, A, B> name(const FuseExpr<A> &a, const FuseExpr<B> &b) { \
+    return FuseBinary<Op, A, B>(a.self(), b.self());                      \
+  }                                                                       \
+  template <class A>                                                      \
+  FuseBinary<Op, A, FuseScalar> name(const FuseExpr<A> &a, float b) {     \
+    return FuseBinary<Op, A, FuseScalar>(a.self(), FuseScalar(b));        \
+  }                                                                       \
+  template <class B>                                                      \
+  FuseBinary<Op, FuseScalar, B> name(float a, const FuseExpr<B> &b) {     \
+    return FuseBinary<Op, FuseScalar, B>(FuseScalar(a), b.self());        \
+  }
+
+FUSE_BINARY(operator+, FuseAdd)
+FUSE_BINARY(operator-, FuseSub)
+FUSE_BINARY(operator*, FuseMul)
+FUSE_BINARY(operator/, FuseDiv)
+FUSE_BINARY(fmin, FuseMin)
+FUSE_BINARY(fmax, FuseMax)
+
+#undef FUSE_BINARY
+
+// FUSE_UNARY defines function name of an expression as a FuseUnary of Op
+#define FUSE_UNARY(name, Op)                              \
+  template <class A>                                      \
+  FuseUnary<Op, A> name(const FuseExpr<A> &a) {           \
+    return FuseUnary<Op, A>(a.self());                    \
+  }
+
+FUSE_UNARY(operator-, FuseNeg)
+FUSE_UNARY(abs, FuseAbs)
+FUSE_UNARY(sqrt, FuseSqrt)
+FUSE_UNARY(exp, FuseExp)
+FUSE_UNARY(log, FuseLog)
+
+#undef FUSE_UNARY
+
+// fuseKernelSource returns the source of the fused kernel computing code for
+// every element i, with the leaf parameters params
+std::string fuseKernelSource(const std::string &code,
+                             const std::string &params);
+
+// fuseSource returns the source of the fused kernel of an expression
+template <class E>
+std::string fuseSource(const FuseExpr<E> &) {
+  std::string code, params;
+  unsigned arg = 0;
+  E::emit(&code, &params, &arg);
+  return fuseKernelSource(code, params);
+}
+
+// cpuFuse computes the n elements of an expression into z on the CPU, from
+// the host copies of its vectors
+template <class E>
+void cpuFuse(const FuseExpr<E> &expr, float *z, unsigned n) {
+  const E &e = expr.self();
+  for (unsigned i = 0; i < n; i++) z[i] = e.at(i);
+}
+
+// FuseEngine builds and runs the fused kernels of expressions on a device,
+// building each kind of expression once
+class FuseEngine {
+ public:
+  FuseEngine(cl_context context, cl_device_id device);
+  ~FuseEngine();
+
+  // run enqueues the kernel writing every element of expr to z, after the
+  // events of waitList, building it on the first run of an expression of this
+  // type. z may be one of the vectors of expr. Returns CL_INVALID_VALUE for
+  // an expression without vectors, CL_INVALID_BUFFER_SIZE for vectors of
+  // different lengths and CL_INVALID_KERNEL when the kernel does not build.
+  template <class E>
+  cl_int run(cl_command_queue queue, cl_mem z, const FuseExpr<E> &expr,
+             cl_uint numEvents = 0, const cl_event *waitList = NULL,
+             cl_event *event = NULL) {
+    FuseArgs args;
+    expr.self().bind(&args);
+    const char *signature = typeid(E).name();
+    cl_kernel kernel = find(signature);
+    if (!kernel) kernel = build(signature, fuseSource(expr));
+    if (!kernel) return CL_INVALID_KERNEL;
+    return launch(queue, kernel, z, args, numEvents, waitList, event);
+  }
+
+  // kernels returns the number of fused kernels built so far
+  size_t kernels() const { return cache.size(); }
+
+ private:
+  FuseEngine(const FuseEngine &);
+  FuseEngine &operator=(const FuseEngine &);
+
+  cl_kernel find(const char *signature) const;
+  cl_kernel build(const char *signature, const std::string &source);
+  cl_int launch(cl_command_queue queue, cl_kernel kernel, cl_mem z,
+                const FuseArgs &args, cl_uint numEvents,
+                const cl_event *waitList, cl_event *event);
+
+  cl_context context;
+  cl_device_id device;
+  std::map<std::string, cl_kernel> cache;  // by expression signature
+  std::vector<cl_program> programs;
+};
+
+#endif  // COMMON_FUSE_HPP
@@ -0,0 +1,50 @@
+// Philox4x32-10, the same stream as cpuPhiloxUniform in philox.cpp
+
+// The multiplication and the addition of the scaling must round separately,
+// as on the CPU, for the streams to match
+#pragma OPENCL FP_CONTRACT OFF
+
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+
+// philoxRound is one round: two 32 x 32 -> 64 bit multiplications whose
+// halves are mixed with the other words and the key
+uint4 philoxRound(uint4 c, uint2 k) {
+  uint hi0 = mul_hi(PHILOX_M0, c.x), lo0 = PHILOX_M0 * c.x;
+  uint hi1 = mul_hi(PHILOX_M1, c.z), lo1 = PHILOX_M1 * c.z;
+  return (uint4)(hi1 ^ c.y ^ k.x, lo1, hi0 ^ c.w ^ k.y, lo0);
+}
+
+// philox4x32 computes the 4 words of counter c under key k
+uint4 philox4x32(uint4 c, uint2 k) {
+  for (int r = 0; r < 10; r++) {
+    if (r > 0) k += (uint2)(PHILOX_W0, PHILOX_W1);
+    c = philoxRound(c, k);
+  }
+  return c;
+}
+
+// philox_uniform writes elements first to first + n - 1 of the stream of
+// key to x, scale * u + lo with u in [0, 1). Work-item i computes block
+// first / 4 + i, which may start before first or end after the last element.
+__kernel void philox_uniform(__global float *x, ulong first, uint n,
+                             uint2 key, float lo, float scale) {
+  ulong block = first / 4 + get_global_id(0);
+  uint4 words = philox4x32((uint4)((uint)block, (uint)(block >> 32), 0, 0),
+                           key);
+  float4 v = convert_float4(words >> 8) * (1.0f / 16777216.0f) * scale + lo;
+
+  ulong start = block * 4;
+  if (start >= first && start + 4 <= first + n) {
+    vstore4(v, 0, x + (start - first));
+  } else {
+    float values[4] = {v.x, v.y, v.z, v.w};
+    for (uint w = 0; w < 4; w++) {
+      if (start + w >= first && start + w < first + n) {
+        x[start + w - first] = values[w];
+      }
+    }
+  }
+}
@@ -0,0 +1,209 @@
+#include "philox.hpp"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+using namespace std;
+
+// The constants of Philox4x32: the multipliers of the rounds and the
+// increments of the key between them, the same as in philox.cl
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+
+// PHILOX_UNIT is 2^-24, the step between the values of u in [0, 1)
+#define PHILOX_UNIT (1.0f / 16777216.0f)
+
+// PHILOX_TASK_BLOCKS is the number of blocks of 4 elements per task of the
+// thread pool
+#define PHILOX_TASK_BLOCKS 16384
+
+// private non-exported function declarations
+void philoxBlocks(cl_ulong block, size_t blocks, const cl_uint key[2],
+                  float *x, float lo, float scale);
+void philoxPartial(cl_ulong element, size_t count, const cl_uint key[2],
+                   float *x, float lo, float scale);
+
+void philox4x32(const cl_uint counter[4], const cl_uint key[2],
+                cl_uint result[4]) {
+  cl_uint c[4] = {counter[0], counter[1], counter[2], counter[3]};
+  cl_uint k[2] = {key[0], key[1]};
+  for (int r = 0; r < 10; r++) {
+    if (r > 0) {
+      k[0] += PHILOX_W0;
+      k[1] += PHILOX_W1;
+    }
+    cl_ulong p0 = (cl_ulong)PHILOX_M0 * c[0];
+    cl_ulong p1 = (cl_ulong)PHILOX_M1 * c[2];
+    cl_uint next[4] = {(cl_uint)(p1 >> 32) ^ c[1] ^ k[0], (cl_uint)p1,
+                       (cl_uint)(p0 >> 32) ^ c[3] ^ k[1], (cl_uint)p0};
+    for (int w = 0; w < 4; w++) c[w] = next[w];
+  }
+  for (int w = 0; w < 4; w++) result[w] = c[w];
+}
+
+bool philoxSelfTest() {
+  static const cl_uint counters[3][4] = {
+      {0, 0, 0, 0},
+      {0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff},
+      {0x243f6a88, 0x85a308d3, 0x13198a2e, 0x03707344}};
+  static const cl_uint keys[3][2] = {
+      {0, 0}, {0xffffffff, 0xffffffff}, {0xa4093822, 0x299f31d0}};
+  static const cl_uint answers[3][4] = {
+      {0x6627e8d5, 0xe169c58d, 0xbc57ac4c, 0x9b00dbd8},
+      {0x408f276d, 0x41c83b0e, 0xa20bc7c6, 0x6d5451fd},
+      {0xd16cfe09, 0x94fdcceb, 0x5001e420, 0x24126ea1}};
+  for (unsigned t = 0; t < 3; t++) {
+    cl_uint words[4];
+    philox4x32(counters[t], keys[t], words);
+    if (memcmp(words, answers[t], sizeof(words)) != 0) {
+      printf("Philox4x32 known answer %u: %08x %08x %08x %08x, expected "
+             "%08x %08x %08x %08x\n",
+             t, words[0], words[1], words[2], words[3], answers[t][0],
+             answers[t][1], answers[t][2], answers[t][3]);
+      return false;
+    }
+  }
+  return true;
+}
+
+// philoxBlocks writes the elements of blocks block to block + blocks - 1 to
+// x. With NEON, the words of 4 blocks are computed in the lanes of 4
+// registers, the 32 x 32 -> 64 bit products coming from vmull_u32, and
+// vst4q_f32 interleaves them back into the order of the stream.
+void philoxBlocks(cl_ulong block, size_t blocks, const cl_uint key[2],
+                  float *x, float lo, float scale) {
+  size_t b = 0;
+#ifdef __ARM_NEON
+  const uint32x2_t m0 = vdup_n_u32(PHILOX_M0), m1 = vdup_n_u32(PHILOX_M1);
+  const float32x4_t unit = vdupq_n_f32(PHILOX_UNIT);
+  const float32x4_t scales = vdupq_n_f32(scale), los = vdupq_n_f32(lo);
+  for (; b + 4 <= blocks; b += 4) {
+    uint32_t lows[4], highs[4];
+    for (int j = 0; j < 4; j++) {
+      lows[j] = (uint32_t)(block + b + j);
+      highs[j] = (uint32_t)((block + b + j) >> 32);
+    }
+    uint32x4_t c[4] = {vld1q_u32(lows), vld1q_u32(highs), vdupq_n_u32(0),
+                       vdupq_n_u32(0)};
+    uint32x4_t k0 = vdupq_n_u32(key[0]), k1 = vdupq_n_u32(key[1]);
+    for (int r = 0; r < 10; r++) {
+      if (r > 0) {
+        k0 = vaddq_u32(k0, vdupq_n_u32(PHILOX_W0));
+        k1 = vaddq_u32(k1, vdupq_n_u32(PHILOX_W1));
+      }
+      uint64x2_t p0l = vmull_u32(vget_low_u32(c[0]), m0);
+      uint64x2_t p0h = vmull_u32(vget_high_u32(c[0]), m0);
+      uint64x2_t p1l = vmull_u32(vget_low_u32(c[2]), m1);
+      uint64x2_t p1h = vmull_u32(vget_high_u32(c[2]), m1);
+      uint32x4_t hi0 = vcombine_u32(vshrn_n_u64(p0l, 32), vshrn_n_u64(p0h, 32));
+      uint32x4_t hi1 = vcombine_u32(vshrn_n_u64(p1l, 32), vshrn_n_u64(p1h, 32));
+      c[0] = veorq_u32(veorq_u32(hi1, c[1]), k0);
+      c[1] = vcombine_u32(vmovn_u64(p1l), vmovn_u64(p1h));
+      c[2] = veorq_u32(veorq_u32(hi0, c[3]), k1);
+      c[3] = vcombine_u32(vmovn_u64(p0l), vmovn_u64(p0h));
+    }
+    // Multiply and add apart, as on the device
+    float32x4x4_t v;
+    for (int w = 0; w < 4; w++) {
+      float32x4_t u = vmulq_f32(vcvtq_f32_u32(vshrq_n_u32(c[w], 8)), unit);
+      v.val[w] = vaddq_f32(vmulq_f32(u, scales), los);
+    }
+    vst4q_f32(x + b * 4, v);
+  }
+#endif
+  for (; b < blocks; b++) {
+    cl_ulong counter = block + b;
+    cl_uint c[4] = {(cl_uint)counter, (cl_uint)(counter >> 32), 0, 0};
+    cl_uint words[4];
+    philox4x32(c, key, words);
+    for (int w = 0; w < 4; w++) {
+      x[b * 4 + w] = (float)(words[w] >> 8) * PHILOX_UNIT * scale + lo;
+    }
+  }
+}
+
+// philoxPartial writes count elements from element to x, all in the same
+// block
+void philoxPartial(cl_ulong element, size_t count, const cl_uint key[2],
+                   float *x, float lo, float scale) {
+  float values[4];
+  philoxBlocks(element / 4, 1, key, values, lo, scale);
+  for (size_t i = 0; i < count; i++) x[i] = values[element % 4 + i];
+}
+
+void cpuPhiloxUniform(cl_ulong seed, cl_ulong first, float *x, size_t n,
+                      float lo, float hi, ThreadPool *pool) {
+  const cl_uint key[2] = {(cl_uint)seed, (cl_uint)(seed >> 32)};
+  float scale = hi - lo;
+
+  // The elements before the first whole block, the whole blocks split across
+  // the threads, then the elements after the last one
+  size_t head = min(n, (size_t)((4 - first % 4) % 4));
+  if (head) philoxPartial(first, head, key, x, lo, scale);
+  cl_ulong block = (first + head) / 4;
+  size_t blocks = (n - head) / 4;
+  float *body = x + head;
+  unsigned tasks = (blocks + PHILOX_TASK_BLOCKS - 1) / PHILOX_TASK_BLOCKS;
+  auto task = [&](unsigned t) {
+    size_t b = (size_t)t * PHILOX_TASK_BLOCKS;
+    philoxBlocks(block + b, min((size_t)PHILOX_TASK_BLOCKS, blocks - b), key,
+                 body + b * 4, lo, scale);
+  };
+  if (pool && tasks > 1) {
+    pool->parallelFor(tasks, task);
+  } else {
+    for (unsigned t = 0; t < tasks; t++) task(t);
+  }
+  size_t done = head + blocks * 4;
+  if (done < n) philoxPartial(first + done, n - done, key, x + done, lo, scale);
+}
+
+DevicePhilox::DevicePhilox(cl_context context, cl_device_id device,
+                           const char *source)
+    : program(NULL), kernel(NULL) {
+  program = clCreateProgramWithSource(context, 1, &source, NULL, NULL);
+  if (!program ||
+      clBuildProgram(program, 1, &device, NULL, NULL, NULL) != CL_SUCCESS) {
+    printf("Failed to build philox.cl\n");
+    return;
+  }
+  cl_int status;
+  kernel = clCreateKernel(program, "philox_uniform", &status);
+  if (status != CL_SUCCESS) {
+    printf("Failed to create philox_uniform kernel\n");
+    kernel = NULL;
+  }
+}
+
+DevicePhilox::~DevicePhilox() {
+  if (kernel) clReleaseKernel(kernel);
+  if (program) clReleaseProgram(program);
+}
+
+cl_int DevicePhilox::uniform(cl_command_queue queue, cl_mem x, cl_ulong seed,
+                             cl_ulong first, cl_uint n, float lo, float hi,
+                             cl_uint numEvents, const cl_event *waitList,
+                             cl_event *event) {
+  if (!kernel) return CL_INVALID_KERNEL;
+  cl_uint key[2] = {(cl_uint)seed, (cl_uint)(seed >> 32)};
+  float scale = hi - lo;
+  cl_int status = CL_SUCCESS;
+  unsigned argi = 0;
+  status |= clSetKernelArg(kernel, argi++, sizeof(cl_mem), &x);
+  status |= clSetKernelArg(kernel, argi++, sizeof(cl_ulong), &first);
+  status |= clSetKernelArg(kernel, argi++, sizeof(cl_uint), &n);
+  status |= clSetKernelArg(kernel, argi++, sizeof(key), key);
+  status |= clSetKernelArg(kernel, argi++, sizeof(float), &lo);
+  status |= clSetKernelArg(kernel, argi++, sizeof(float), &scale);
+  if (status != CL_SUCCESS) return CL_INVALID_KERNEL_ARGS;
+
+  // One work-item per block, from the one of first to the one of the last
+  size_t globalWorkSize = (first + n + 3) / 4 - first / 4;
+  return clEnqueueNDRangeKernel(queue, kernel, 1, NULL, &globalWorkSize, NULL,
+                                numEvents, waitList, event);
+}
@@ -0,0 +1,57 @@
+#ifndef COMMON_PHILOX_HPP
+#define COMMON_PHILOX_HPP
+
+#include <CL/cl.h>
+#include "common/thread_pool.hpp"
+
+// Philox4x32-10, the counter-based generator of Salmon et al. ("Parallel
+// random numbers: as easy as 1, 2, 3", SC 2011): 10 rounds of multiplications
+// and xors turn a 128-bit counter and a 64-bit key into 4 random words. Any
+// part of a stream can be computed on its own, so threads and work-items fill
+// their share of an array without sharing any state, and the device and the
+// CPU produce the same stream for the same key.
+//
+// Element e of the float stream of a seed is word e % 4 of the counter
+// {e / 4 (low, high), 0, 0} under the key {seed (low, high)}. Its top 24
+// bits give u in [0, 1), exactly, and the element is u * (hi - lo) + lo,
+// computed as a float multiplication then addition on both sides.
+
+// philox4x32 computes the 4 words of counter under key
+void philox4x32(const cl_uint counter[4], const cl_uint key[2],
+                cl_uint result[4]);
+
+// philoxSelfTest compares philox4x32 to the known answers of the Random123
+// reference implementation (all zeros, all ones and the digits of pi) and
+// prints the first mismatch. Returns false when there is one.
+bool philoxSelfTest();
+
+// cpuPhiloxUniform writes elements first to first + n - 1 of the stream of
+// seed, uniform in [lo, hi), to x. The blocks of 4 elements are split across
+// the threads of pool, 4 blocks at a time with NEON.
+void cpuPhiloxUniform(cl_ulong seed, cl_ulong first, float *x, size_t n,
+                      float lo, float hi, ThreadPool *pool = NULL);
+
+// DevicePhilox generates the same streams into device buffers
+class DevicePhilox {
+ public:
+  // source is the text of philox.cl
+  DevicePhilox(cl_context context, cl_device_id device, const char *source);
+  ~DevicePhilox();
+
+  // uniform enqueues the generation of elements first to first + n - 1 of
+  // the stream of seed into the floats of x, after the events of waitList.
+  // Each work-item computes a block of 4 elements.
+  cl_int uniform(cl_command_queue queue, cl_mem x, cl_ulong seed,
+                 cl_ulong first, cl_uint n, float lo, float hi,
+                 cl_uint numEvents = 0, const cl_event *waitList = NULL,
+                 cl_event *event = NULL);
+
+ private:
+  DevicePhilox(const DevicePhilox &);
+  DevicePhilox &operator=(const DevicePhilox &);
+
+  cl_program program;
+  cl_kernel kernel;
+};
+
+#endif  // COMMON_PHILOX_HPP
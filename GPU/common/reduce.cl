@@ -0,0 +1,255 @@
+// Reductions and prefix scans, generated from one template by the operation
+// in REDUCE_OP, set with -DREDUCE_OP=<n> when the program is built. Every
+// operation defines the State it accumulates and three functions:
+//   reduceIdentity()     the state of no elements
+//   reduceLoad(x, i)     the state of element x at index i
+//   reduceCombine(a, b)  the state of the elements of a followed by those of b
+// reduceCombine must be associative, it does not have to be commutative. The
+// values must match ReduceOp in reduce.hpp, and the states ReduceIndex,
+// ReduceMoments and ReduceCompensated.
+#define REDUCE_SUM 0
+#define REDUCE_MIN 1
+#define REDUCE_MAX 2
+#define REDUCE_ARGMIN 3
+#define REDUCE_ARGMAX 4
+#define REDUCE_MOMENTS 5
+#define REDUCE_COMPENSATED 6
+
+typedef struct {
+  float value;
+  uint index;
+} ReduceIndex;
+
+typedef struct {
+  uint count;
+  float mean;
+  float m2;  // sum of the squared differences to the mean
+} ReduceMoments;
+
+typedef struct {
+  float sum;
+  float error;  // what the rounding of sum lost
+} ReduceCompensated;
+
+#if REDUCE_OP == REDUCE_SUM || REDUCE_OP == REDUCE_MIN || \
+    REDUCE_OP == REDUCE_MAX
+typedef float State;
+
+State reduceIdentity(void) {
+#if REDUCE_OP == REDUCE_SUM
+  return 0.0f;
+#elif REDUCE_OP == REDUCE_MIN
+  return INFINITY;
+#else
+  return -INFINITY;
+#endif
+}
+
+State reduceLoad(float x, uint i) { return x; }
+
+State reduceCombine(State a, State b) {
+#if REDUCE_OP == REDUCE_SUM
+  return a + b;
+#elif REDUCE_OP == REDUCE_MIN
+  return fmin(a, b);
+#else
+  return fmax(a, b);
+#endif
+}
+
+#elif REDUCE_OP == REDUCE_ARGMIN || REDUCE_OP == REDUCE_ARGMAX
+typedef ReduceIndex State;
+
+State reduceIdentity(void) {
+  State s;
+  s.value = REDUCE_OP == REDUCE_ARGMIN ? INFINITY : -INFINITY;
+  s.index = UINT_MAX;
+  return s;
+}
+
+State reduceLoad(float x, uint i) {
+  State s;
+  s.value = x;
+  s.index = i;
+  return s;
+}
+
+// reduceCombine keeps the first index of equal values, so the result does
+// not depend on the order of the reduction
+State reduceCombine(State a, State b) {
+#if REDUCE_OP == REDUCE_ARGMIN
+  bool better = b.value < a.value;
+#else
+  bool better = b.value > a.value;
+#endif
+  return better || (b.value == a.value && b.index < a.index) ? b : a;
+}
+
+#elif REDUCE_OP == REDUCE_MOMENTS
+typedef ReduceMoments State;
+
+State reduceIdentity(void) {
+  State s;
+  s.count = 0;
+  s.mean = 0.0f;
+  s.m2 = 0.0f;
+  return s;
+}
+
+State reduceLoad(float x, uint i) {
+  State s;
+  s.count = 1;
+  s.mean = x;
+  s.m2 = 0.0f;
+  return s;
+}
+
+// reduceCombine merges two sets with Chan's update of Welford's algorithm,
+// which never subtracts sums of squares from each other
+State reduceCombine(State a, State b) {
+  uint count = a.count + b.count;
+  if (count == 0) return a;
+  float delta = b.mean - a.mean;
+  float weight = (float)b.count / count;
+  State s;
+  s.count = count;
+  s.mean = a.mean + delta * weight;
+  s.m2 = a.m2 + b.m2 + delta * delta * a.count * weight;
+  return s;
+}
+
+#elif REDUCE_OP == REDUCE_COMPENSATED
+typedef ReduceCompensated State;
+
+State reduceIdentity(void) {
+  State s;
+  s.sum = 0.0f;
+  s.error = 0.0f;
+  return s;
+}
+
+State reduceLoad(float x, uint i) {
+  State s;
+  s.sum = x;
+  s.error = 0.0f;
+  return s;
+}
+
+// reduceCombine adds the sums with Knuth's TwoSum, which recovers the
+// rounding error of the addition exactly whatever the order of magnitude of
+// the terms, and adds the errors up separately. Nothing may be reassociated,
+// so the program must not be built with -cl-fast-relaxed-math.
+State reduceCombine(State a, State b) {
+  State s;
+  s.sum = a.sum + b.sum;
+  float bv = s.sum - a.sum;
+  float av = s.sum - bv;
+  s.error = a.error + b.error + ((a.sum - av) + (b.sum - bv));
+  return s;
+}
+
+#else
+#error "REDUCE_OP must be one of the REDUCE_* operations"
+#endif
+
+// reduceGroup combines the states of the work-items of the work-group in a
+// tree in scratch, one state per work-item, and returns the result. The local
+// size must be a power of two.
+State reduceGroup(State state, __local State *scratch) {
+  uint lid = get_local_id(0);
+  scratch[lid] = state;
+  barrier(CLK_LOCAL_MEM_FENCE);
+  for (uint stride = get_local_size(0) / 2; stride > 0; stride /= 2) {
+    if (lid < stride) {
+      scratch[lid] = reduceCombine(scratch[lid], scratch[lid + stride]);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+  return scratch[0];
+}
+
+// reduce writes the state of the n elements of x to partials, one per
+// work-group. Work-item i accumulates elements i, i + get_global_size(0),
+// etc., so any n is covered by any number of work-items.
+__kernel void reduce(__global const float *x, __global State *partials,
+                     uint n, __local State *scratch) {
+  State state = reduceIdentity();
+  for (uint i = get_global_id(0); i < n; i += get_global_size(0)) {
+    state = reduceCombine(state, reduceLoad(x[i], i));
+  }
+  state = reduceGroup(state, scratch);
+  if (get_local_id(0) == 0) partials[get_group_id(0)] = state;
+}
+
+// reduce_partials combines the n partial states of reduce into result, run
+// as a single work-group
+__kernel void reduce_partials(__global const State *partials,
+                              __global State *result, uint n,
+                              __local State *scratch) {
+  State state = reduceIdentity();
+  for (uint i = get_local_id(0); i < n; i += get_local_size(0)) {
+    state = reduceCombine(state, partials[i]);
+  }
+  state = reduceGroup(state, scratch);
+  if (get_local_id(0) == 0) *result = state;
+}
+
+#if REDUCE_OP == REDUCE_SUM || REDUCE_OP == REDUCE_MIN || \
+    REDUCE_OP == REDUCE_MAX
+// scan_blocks scans blocks of 2 * get_local_size(0) elements of x into y
+// with the work-efficient algorithm of Blelloch: an up-sweep builds the
+// reduction tree in scratch, a down-sweep turns it into the exclusive scan.
+// The total of every block goes to sums, for the scan of the blocks. y may
+// be x.
+__kernel void scan_blocks(__global const float *x, __global float *y,
+                          __global float *sums, uint n, int inclusive,
+                          __local float *scratch) {
+  // Work-item lid loads element lid of the block and element lid + the local
+  // size, so that the loads of the work-group are contiguous
+  uint lid = get_local_id(0);
+  uint mid = lid + get_local_size(0);
+  uint size = 2 * get_local_size(0);
+  uint base = get_group_id(0) * size;
+  float a = base + lid < n ? x[base + lid] : reduceIdentity();
+  float b = base + mid < n ? x[base + mid] : reduceIdentity();
+  scratch[lid] = a;
+  scratch[mid] = b;
+
+  for (uint stride = 1; stride < size; stride *= 2) {
+    barrier(CLK_LOCAL_MEM_FENCE);
+    uint i = (lid + 1) * 2 * stride - 1;
+    if (i < size) scratch[i] = reduceCombine(scratch[i - stride], scratch[i]);
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+  if (lid == 0) {
+    sums[get_group_id(0)] = scratch[size - 1];
+    scratch[size - 1] = reduceIdentity();
+  }
+
+  for (uint stride = size / 2; stride > 0; stride /= 2) {
+    barrier(CLK_LOCAL_MEM_FENCE);
+    uint i = (lid + 1) * 2 * stride - 1;
+    if (i < size) {
+      float left = scratch[i - stride];
+      scratch[i - stride] = scratch[i];
+      scratch[i] = reduceCombine(scratch[i], left);
+    }
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  if (base + lid < n) {
+    y[base + lid] = inclusive ? reduceCombine(scratch[lid], a) : scratch[lid];
+  }
+  if (base + mid < n) {
+    y[base + mid] = inclusive ? reduceCombine(scratch[mid], b) : scratch[mid];
+  }
+}
+
+// scan_add combines the exclusive scan of the block totals, carries, with
+// the n elements of y, blocks of block elements
+__kernel void scan_add(__global float *y, __global const float *carries,
+                       uint n, uint block) {
+  uint i = get_global_id(0);
+  if (i < n) y[i] = reduceCombine(carries[i / block], y[i]);
+}
+#endif
@@ -0,0 +1,485 @@
+#include "reduce.hpp"
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <algorithm>
+
+using namespace std;
+
+// The operations on the CPU, the same as in reduce.cl: State, identity, load
+// and combine
+struct ReduceSum {
+  typedef float State;
+  static State identity() { return 0.0f; }
+  static State load(float x, unsigned) { return x; }
+  static State combine(State a, State b) { return a + b; }
+};
+
+struct ReduceMin {
+  typedef float State;
+  static State identity() { return INFINITY; }
+  static State load(float x, unsigned) { return x; }
+  static State combine(State a, State b) { return fminf(a, b); }
+};
+
+struct ReduceMax {
+  typedef float State;
+  static State identity() { return -INFINITY; }
+  static State load(float x, unsigned) { return x; }
+  static State combine(State a, State b) { return fmaxf(a, b); }
+};
+
+template <bool largest>
+struct ReduceArg {
+  typedef ReduceIndex State;
+  static State identity() {
+    State s = {largest ? -INFINITY : INFINITY, UINT_MAX};
+    return s;
+  }
+  static State load(float x, unsigned i) {
+    State s = {x, i};
+    return s;
+  }
+  static State combine(State a, State b) {
+    bool better = largest ? b.value > a.value : b.value < a.value;
+    return better || (b.value == a.value && b.index < a.index) ? b : a;
+  }
+};
+
+struct ReduceWelford {
+  typedef ReduceMoments State;
+  static State identity() {
+    State s = {0, 0.0f, 0.0f};
+    return s;
+  }
+  static State load(float x, unsigned) {
+    State s = {1, x, 0.0f};
+    return s;
+  }
+  static State combine(State a, State b) {
+    unsigned count = a.count + b.count;
+    if (count == 0) return a;
+    float delta = b.mean - a.mean;
+    float weight = (float)b.count / count;
+    State s = {count, a.mean + delta * weight,
+               a.m2 + b.m2 + delta * delta * a.count * weight};
+    return s;
+  }
+};
+
+// ReduceKahan adds with TwoSum and keeps the rounding errors apart. The
+// additions must stay in this order, which the compiler respects as long as
+// it is not allowed to reassociate (-ffast-math).
+struct ReduceKahan {
+  typedef ReduceCompensated State;
+  static State identity() {
+    State s = {0.0f, 0.0f};
+    return s;
+  }
+  static State load(float x, unsigned) {
+    State s = {x, 0.0f};
+    return s;
+  }
+  static State combine(State a, State b) {
+    State s;
+    s.sum = a.sum + b.sum;
+    float bv = s.sum - a.sum;
+    float av = s.sum - bv;
+    s.error = a.error + b.error + ((a.sum - av) + (b.sum - bv));
+    return s;
+  }
+};
+
+// private non-exported function declarations
+template <class Op>
+void cpuReduceWith(const float *x, unsigned n, typename Op::State *result,
+                   ThreadPool *pool);
+template <class Op>
+void cpuScanWith(const float *x, float *y, unsigned n, bool inclusive,
+                 ThreadPool *pool);
+template <class Op>
+void combineWith(const void *a, const void *b, void *result);
+size_t reduceStateSize(ReduceOp op);
+
+// cpuReduceWith reduces blocks of x on the threads of pool, then combines
+// the block states in order
+template <class Op>
+void cpuReduceWith(const float *x, unsigned n, typename Op::State *result,
+                   ThreadPool *pool) {
+  unsigned blocks = pool ? pool->size() : 1;
+  unsigned block = (n + blocks - 1) / blocks;
+  vector<typename Op::State> states(blocks, Op::identity());
+  auto task = [&](unsigned b) {
+    unsigned end = min(n, (b + 1) * block);
+    for (unsigned i = b * block; i < end; i++) {
+      states[b] = Op::combine(states[b], Op::load(x[i], i));
+    }
+  };
+  if (pool) {
+    pool->parallelFor(blocks, task);
+  } else {
+    task(0);
+  }
+
+  *result = Op::identity();
+  for (unsigned b = 0; b < blocks; b++) {
+    *result = Op::combine(*result, states[b]);
+  }
+}
+
+// cpuScanWith computes the total of every block of x, scans the totals and
+// scans every block starting from the total of the blocks before it
+template <class Op>
+void cpuScanWith(const float *x, float *y, unsigned n, bool inclusive,
+                 ThreadPool *pool) {
+  unsigned blocks = pool ? pool->size() : 1;
+  unsigned block = (n + blocks - 1) / blocks;
+  vector<float> carries(blocks + 1, Op::identity());
+  auto total = [&](unsigned b) {
+    unsigned end = min(n, (b + 1) * block);
+    for (unsigned i = b * block; i < end; i++) {
+      carries[b + 1] = Op::combine(carries[b + 1], x[i]);
+    }
+  };
+  auto scan = [&](unsigned b) {
+    unsigned end = min(n, (b + 1) * block);
+    float carry = carries[b];
+    for (unsigned i = b * block; i < end; i++) {
+      float next = Op::combine(carry, x[i]);
+      y[i] = inclusive ? next : carry;
+      carry = next;
+    }
+  };
+
+  if (pool) pool->parallelFor(blocks, total);
+  for (unsigned b = 1; b <= blocks; b++) {
+    carries[b] = Op::combine(carries[b - 1], carries[b]);
+  }
+  if (pool) {
+    pool->parallelFor(blocks, scan);
+  } else {
+    scan(0);
+  }
+}
+
+// combineWith combines two states of Op
+template <class Op>
+void combineWith(const void *a, const void *b, void *result) {
+  typedef typename Op::State State;
+  *(State *)result = Op::combine(*(const State *)a, *(const State *)b);
+}
+
+// reduceStateSize returns the size of the state of the operation
+size_t reduceStateSize(ReduceOp op) {
+  switch (op) {
+    case REDUCE_ARGMIN:
+    case REDUCE_ARGMAX:
+      return sizeof(ReduceIndex);
+    case REDUCE_MOMENTS:
+      return sizeof(ReduceMoments);
+    case REDUCE_COMPENSATED:
+      return sizeof(ReduceCompensated);
+    default:
+      return sizeof(float);
+  }
+}
+
+const char *reduceName(ReduceOp op) {
+  switch (op) {
+    case REDUCE_SUM:
+      return "sum";
+    case REDUCE_MIN:
+      return "min";
+    case REDUCE_MAX:
+      return "max";
+    case REDUCE_ARGMIN:
+      return "argmin";
+    case REDUCE_ARGMAX:
+      return "argmax";
+    case REDUCE_MOMENTS:
+      return "moments";
+    case REDUCE_COMPENSATED:
+      return "compensated sum";
+    default:
+      return "unknown";
+  }
+}
+
+void cpuReduce(ReduceOp op, const float *x, unsigned n, void *result,
+               ThreadPool *pool) {
+  switch (op) {
+    case REDUCE_SUM:
+      cpuReduceWith<ReduceSum>(x, n, (float *)result, pool);
+      break;
+    case REDUCE_MIN:
+      cpuReduceWith<ReduceMin>(x, n, (float *)result, pool);
+      break;
+    case REDUCE_MAX:
+      cpuReduceWith<ReduceMax>(x, n, (float *)result, pool);
+      break;
+    case REDUCE_ARGMIN:
+      cpuReduceWith<ReduceArg<false> >(x, n, (ReduceIndex *)result, pool);
+      break;
+    case REDUCE_ARGMAX:
+      cpuReduceWith<ReduceArg<true> >(x, n, (ReduceIndex *)result, pool);
+      break;
+    case REDUCE_MOMENTS:
+      cpuReduceWith<ReduceWelford>(x, n, (ReduceMoments *)result, pool);
+      break;
+    case REDUCE_COMPENSATED:
+      cpuReduceWith<ReduceKahan>(x, n, (ReduceCompensated *)result, pool);
+      break;
+    default:
+      break;
+  }
+}
+
+void reduceCombine(ReduceOp op, const void *a, const void *b, void *result) {
+  switch (op) {
+    case REDUCE_SUM:
+      combineWith<ReduceSum>(a, b, result);
+      break;
+    case REDUCE_MIN:
+      combineWith<ReduceMin>(a, b, result);
+      break;
+    case REDUCE_MAX:
+      combineWith<ReduceMax>(a, b, result);
+      break;
+    case REDUCE_ARGMIN:
+      combineWith<ReduceArg<false> >(a, b, result);
+      break;
+    case REDUCE_ARGMAX:
+      combineWith<ReduceArg<true> >(a, b, result);
+      break;
+    case REDUCE_MOMENTS:
+      combineWith<ReduceWelford>(a, b, result);
+      break;
+    case REDUCE_COMPENSATED:
+      combineWith<ReduceKahan>(a, b, result);
+      break;
+    default:
+      break;
+  }
+}
+
+bool cpuScan(ReduceOp op, const float *x, float *y, unsigned n,
+             bool inclusive, ThreadPool *pool) {
+  switch (op) {
+    case REDUCE_SUM:
+      cpuScanWith<ReduceSum>(x, y, n, inclusive, pool);
+      return true;
+    case REDUCE_MIN:
+      cpuScanWith<ReduceMin>(x, y, n, inclusive, pool);
+      return true;
+    case REDUCE_MAX:
+      cpuScanWith<ReduceMax>(x, y, n, inclusive, pool);
+      return true;
+    default:
+      return false;
+  }
+}
+
+// DeviceReduce builds reduce.cl for every operation and sizes the launches
+// for the device
+DeviceReduce::DeviceReduce(cl_context context, cl_device_id device,
+                           const char *source)
+    : context(context),
+      localSize(1),
+      groups(1),
+      programs(),
+      reduceKernels(),
+      partialKernels(),
+      scanKernels(),
+      scanAddKernels(),
+      partials(NULL),
+      result(NULL),
+      carries(),
+      carryBytes() {
+  size_t limit;
+  clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size_t),
+                  &limit, NULL);
+  cl_int status;
+  char options[32];
+  for (int op = 0; op < REDUCE_OPS; op++) {
+    programs[op] = clCreateProgramWithSource(context, 1, &source, NULL, NULL);
+    snprintf(options, sizeof(options), "-DREDUCE_OP=%d", op);
+    if (!programs[op] ||
+        clBuildProgram(programs[op], 1, &device, options, NULL, NULL) !=
+            CL_SUCCESS) {
+      printf("Failed to build reduce.cl for %s\n", reduceName((ReduceOp)op));
+      continue;
+    }
+
+    cl_kernel *kernels[4] = {&reduceKernels[op], &partialKernels[op],
+                             op < REDUCE_SCAN_OPS ? &scanKernels[op] : NULL,
+                             op < REDUCE_SCAN_OPS ? &scanAddKernels[op] : NULL};
+    const char *names[4] = {"reduce", "reduce_partials", "scan_blocks",
+                            "scan_add"};
+    for (unsigned k = 0; k < 4 && kernels[k]; k++) {
+      *kernels[k] = clCreateKernel(programs[op], names[k], &status);
+      if (status != CL_SUCCESS) {
+        printf("Failed to create %s kernel\n", names[k]);
+        *kernels[k] = NULL;
+        continue;
+      }
+      size_t size;
+      clGetKernelWorkGroupInfo(*kernels[k], device, CL_KERNEL_WORK_GROUP_SIZE,
+                               sizeof(size_t), &size, NULL);
+      limit = min(limit, size);
+    }
+  }
+
+  // The trees need a power of two. A few work-groups per compute unit keep
+  // the device busy, and no more than the second pass covers in one step.
+  while (localSize * 2 <= limit) localSize *= 2;
+  cl_uint computeUnits;
+  clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint),
+                  &computeUnits, NULL);
+  groups = min((size_t)computeUnits * 4, localSize);
+
+  partials = clCreateBuffer(context, CL_MEM_READ_WRITE,
+                            groups * sizeof(ReduceMoments), NULL, &status);
+  if (status != CL_SUCCESS) partials = NULL;
+  result = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(ReduceMoments),
+                          NULL, &status);
+  if (status != CL_SUCCESS) result = NULL;
+}
+
+DeviceReduce::~DeviceReduce() {
+  for (int op = 0; op < REDUCE_OPS; op++) {
+    if (reduceKernels[op]) clReleaseKernel(reduceKernels[op]);
+    if (partialKernels[op]) clReleaseKernel(partialKernels[op]);
+    if (op < REDUCE_SCAN_OPS && scanKernels[op]) {
+      clReleaseKernel(scanKernels[op]);
+    }
+    if (op < REDUCE_SCAN_OPS && scanAddKernels[op]) {
+      clReleaseKernel(scanAddKernels[op]);
+    }
+    if (programs[op]) clReleaseProgram(programs[op]);
+  }
+  if (partials) clReleaseMemObject(partials);
+  if (result) clReleaseMemObject(result);
+  for (unsigned i = 0; i < carries.size(); i++) {
+    clReleaseMemObject(carries[i]);
+  }
+}
+
+cl_int DeviceReduce::reduce(cl_command_queue queue, ReduceOp op, cl_mem x,
+                            unsigned n, void *result, cl_uint numEvents,
+                            const cl_event *waitList) {
+  cl_event event;
+  cl_int status =
+      enqueueReduce(queue, op, x, n, result, numEvents, waitList, &event);
+  if (status != CL_SUCCESS) return status;
+  status = clWaitForEvents(1, &event);
+  clReleaseEvent(event);
+  return status;
+}
+
+cl_int DeviceReduce::enqueueReduce(cl_command_queue queue, ReduceOp op,
+                                   cl_mem x, unsigned n, void *result,
+                                   cl_uint numEvents, const cl_event *waitList,
+                                   cl_event *event) {
+  if (op < 0 || op >= REDUCE_OPS) return CL_INVALID_VALUE;
+  cl_kernel kernels[2] = {reduceKernels[op], partialKernels[op]};
+  if (!kernels[0] || !kernels[1] || !partials || !this->result) {
+    return CL_INVALID_KERNEL;
+  }
+
+  // Fewer work-groups for inputs that do not fill them
+  size_t stateSize = reduceStateSize(op);
+  cl_uint count[2] = {n, (cl_uint)min(groups, (n + localSize - 1) / localSize)};
+  count[1] = max(count[1], (cl_uint)1);
+  cl_mem inputs[2] = {x, partials};
+  cl_mem outputs[2] = {partials, this->result};
+  size_t globalWorkSize[2] = {count[1] * localSize, localSize};
+
+  cl_int status = CL_SUCCESS;
+  for (unsigned pass = 0; pass < 2 && status == CL_SUCCESS; pass++) {
+    cl_kernel kernel = kernels[pass];
+    unsigned argi = 0;
+    status |= clSetKernelArg(kernel, argi++, sizeof(cl_mem), &inputs[pass]);
+    status |= clSetKernelArg(kernel, argi++, sizeof(cl_mem), &outputs[pass]);
+    status |= clSetKernelArg(kernel, argi++, sizeof(cl_uint), &count[pass]);
+    status |= clSetKernelArg(kernel, argi++, localSize * stateSize, NULL);
+    if (status != CL_SUCCESS) return CL_INVALID_KERNEL_ARGS;
+    status = clEnqueueNDRangeKernel(
+        queue, kernel, 1, NULL, &globalWorkSize[pass], &localSize,
+        pass ? 0 : numEvents, pass || !numEvents ? NULL : waitList, NULL);
+  }
+  if (status != CL_SUCCESS) return status;
+  return clEnqueueReadBuffer(queue, this->result, CL_FALSE, 0, stateSize,
+                             result, 0, NULL, event);
+}
+
+cl_int DeviceReduce::scan(cl_command_queue queue, ReduceOp op, cl_mem x,
+                          cl_mem y, unsigned n, bool inclusive,
+                          cl_uint numEvents, const cl_event *waitList,
+                          cl_event *event) {
+  if (op < 0 || op >= REDUCE_OPS) return CL_INVALID_VALUE;
+  if (op >= REDUCE_SCAN_OPS) return CL_INVALID_OPERATION;
+  if (!scanKernels[op] || !scanAddKernels[op]) return CL_INVALID_KERNEL;
+  if (n == 0) return CL_INVALID_VALUE;
+  return scanLevel(queue, op, x, y, n, inclusive, 0, numEvents, waitList,
+                   event);
+}
+
+// scanLevel scans the blocks of x into y and, when there is more than one,
+// scans their totals at the next level and combines them with the blocks.
+// Only the last command takes the event.
+cl_int DeviceReduce::scanLevel(cl_command_queue queue, ReduceOp op, cl_mem x,
+                               cl_mem y, unsigned n, bool inclusive,
+                               unsigned level, cl_uint numEvents,
+                               const cl_event *waitList, cl_event *event) {
+  cl_uint block = 2 * localSize;
+  cl_uint blocks = (n + block - 1) / block;
+  size_t bytes = blocks * sizeof(float);
+  cl_int status = CL_SUCCESS;
+  if (level == carries.size()) {
+    carries.push_back(NULL);
+    carryBytes.push_back(0);
+  }
+  if (carryBytes[level] < bytes) {
+    if (carries[level]) clReleaseMemObject(carries[level]);
+    carries[level] =
+        clCreateBuffer(context, CL_MEM_READ_WRITE, bytes, NULL, &status);
+    carryBytes[level] = status == CL_SUCCESS ? bytes : 0;
+    if (status != CL_SUCCESS) {
+      carries[level] = NULL;
+      return status;
+    }
+  }
+
+  cl_kernel kernel = scanKernels[op];
+  cl_int inclusiveArg = inclusive;
+  unsigned argi = 0;
+  status |= clSetKernelArg(kernel, argi++, sizeof(cl_mem), &x);
+  status |= clSetKernelArg(kernel, argi++, sizeof(cl_mem), &y);
+  status |= clSetKernelArg(kernel, argi++, sizeof(cl_mem), &carries[level]);
+  status |= clSetKernelArg(kernel, argi++, sizeof(cl_uint), &n);
+  status |= clSetKernelArg(kernel, argi++, sizeof(cl_int), &inclusiveArg);
+  status |= clSetKernelArg(kernel, argi++, block * sizeof(float), NULL);
+  if (status != CL_SUCCESS) return CL_INVALID_KERNEL_ARGS;
+  size_t globalWorkSize = blocks * localSize;
+  status = clEnqueueNDRangeKernel(queue, kernel, 1, NULL, &globalWorkSize,
+                                  &localSize, numEvents,
+                                  numEvents ? waitList : NULL,
+                                  blocks == 1 ? event : NULL);
+  if (status != CL_SUCCESS || blocks == 1) return status;
+
+  // The block totals are scanned in place into the carries of every block
+  status = scanLevel(queue, op, carries[level], carries[level], blocks, false,
+                     level + 1, 0, NULL, NULL);
+  if (status != CL_SUCCESS) return status;
+
+  kernel = scanAddKernels[op];
+  argi = 0;
+  status |= clSetKernelArg(kernel, argi++, sizeof(cl_mem), &y);
+  status |= clSetKernelArg(kernel, argi++, sizeof(cl_mem), &carries[level]);
+  status |= clSetKernelArg(kernel, argi++, sizeof(cl_uint), &n);
+  status |= clSetKernelArg(kernel, argi++, sizeof(cl_uint), &block);
+  if (status != CL_SUCCESS) return CL_INVALID_KERNEL_ARGS;
+  globalWorkSize = (n + localSize - 1) / localSize * localSize;
+  return clEnqueueNDRangeKernel(queue, kernel, 1, NULL, &globalWorkSize,
+                                &localSize, 0, NULL, event);
+}
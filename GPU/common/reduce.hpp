@@ -0,0 +1,135 @@
+#ifndef COMMON_REDUCE_HPP
+#define COMMON_REDUCE_HPP
+
+#include <CL/cl.h>
+#include <vector>
+#include "common/thread_pool.hpp"
+
+// ReduceOp selects the operation of a reduction or a scan. The values are
+// those of REDUCE_OP in reduce.cl. Scans only take the first REDUCE_SCAN_OPS
+// operations, whose state is a float.
+enum ReduceOp {
+  REDUCE_SUM,
+  REDUCE_MIN,
+  REDUCE_MAX,
+  REDUCE_ARGMIN,
+  REDUCE_ARGMAX,
+  REDUCE_MOMENTS,
+  REDUCE_COMPENSATED,
+  REDUCE_OPS,
+  REDUCE_SCAN_OPS = REDUCE_ARGMIN
+};
+
+// ReduceIndex is the result of REDUCE_ARGMIN and REDUCE_ARGMAX: the smallest
+// or largest value and its first index, UINT_MAX for no elements
+struct ReduceIndex {
+  cl_float value;
+  cl_uint index;
+};
+
+// ReduceMoments is the result of REDUCE_MOMENTS: the number of elements,
+// their mean and the sum of their squared differences to the mean, m2 /
+// count being the variance and m2 / (count - 1) the sample variance
+struct ReduceMoments {
+  cl_uint count;
+  cl_float mean;
+  cl_float m2;
+};
+
+// ReduceCompensated is the result of REDUCE_COMPENSATED: the float sum and
+// the rounding error it accumulated, tracked exactly at every addition.
+// (double)sum + error is the sum to within about 2 epsilons of the sum of |x|
+// plus N epsilons squared, instead of N epsilons for a float sum, at the
+// bandwidth of a float reduction.
+struct ReduceCompensated {
+  cl_float sum;
+  cl_float error;
+};
+
+// reduceName returns a printable name for the operation
+const char *reduceName(ReduceOp op);
+
+// cpuReduce computes the same reduction as DeviceReduce::reduce on the CPU,
+// split in blocks across the threads of pool. result is a float, a
+// ReduceIndex, a ReduceMoments or a ReduceCompensated depending on op.
+void cpuReduce(ReduceOp op, const float *x, unsigned n, void *result,
+               ThreadPool *pool = NULL);
+
+// reduceCombine combines the results of two reductions with op into
+// result, which may be a or b: the result of the elements of a followed by
+// those of b. The indices of REDUCE_ARGMIN and REDUCE_ARGMAX must already be
+// relative to the same start.
+void reduceCombine(ReduceOp op, const void *a, const void *b, void *result);
+
+// cpuScan computes the same scan as DeviceReduce::scan on the CPU: y[i]
+// combines x[0] to x[i] (inclusive) or x[0] to x[i - 1] (exclusive). Each
+// thread of pool scans one block, after the totals of the blocks before it.
+// y may be x. Returns false for an operation that cannot scan.
+bool cpuScan(ReduceOp op, const float *x, float *y, unsigned n,
+             bool inclusive, ThreadPool *pool = NULL);
+
+// DeviceReduce runs reductions and prefix scans of float buffers on a device.
+// reduce.cl is built once per operation with REDUCE_OP set, so every
+// operation shares the same kernels. A reduction is two launches: a few
+// work-groups per compute unit accumulate with a grid-stride loop and a
+// tree in local memory, then a single work-group combines their partial
+// states. A scan is work-efficient per block of two elements per work-item,
+// and scans the block totals recursively to carry them into the blocks.
+class DeviceReduce {
+ public:
+  // source is the text of reduce.cl
+  DeviceReduce(cl_context context, cl_device_id device, const char *source);
+  ~DeviceReduce();
+
+  // reduce enqueues the reduction of the n floats of x after the events of
+  // waitList and reads the result into result, a float, a ReduceIndex, a
+  // ReduceMoments or a ReduceCompensated depending on op. Blocks until result
+  // holds it.
+  cl_int reduce(cl_command_queue queue, ReduceOp op, cl_mem x, unsigned n,
+                void *result, cl_uint numEvents = 0,
+                const cl_event *waitList = NULL);
+
+  // enqueueReduce enqueues the same reduction without waiting: result holds
+  // it once event completes. The reductions enqueued on a queue share device
+  // buffers, so the queue must execute in order.
+  cl_int enqueueReduce(cl_command_queue queue, ReduceOp op, cl_mem x,
+                       unsigned n, void *result, cl_uint numEvents,
+                       const cl_event *waitList, cl_event *event);
+
+  // scan enqueues the inclusive or exclusive prefix scan of the n floats of
+  // x into y, which may be x. The commands are ordered by the queue, which
+  // must execute in order. Returns CL_INVALID_OPERATION for an operation
+  // that cannot scan.
+  cl_int scan(cl_command_queue queue, ReduceOp op, cl_mem x, cl_mem y,
+              unsigned n, bool inclusive, cl_uint numEvents = 0,
+              const cl_event *waitList = NULL, cl_event *event = NULL);
+
+  // threads returns the work-items of the first pass of a reduction, each of
+  // which accumulates about n / threads elements in a row
+  size_t threads() const { return groups * localSize; }
+
+ private:
+  DeviceReduce(const DeviceReduce &);
+  DeviceReduce &operator=(const DeviceReduce &);
+
+  cl_int scanLevel(cl_command_queue queue, ReduceOp op, cl_mem x, cl_mem y,
+                   unsigned n, bool inclusive, unsigned level,
+                   cl_uint numEvents, const cl_event *waitList,
+                   cl_event *event);
+
+  cl_context context;
+  size_t localSize;  // a power of two that every kernel can run with
+  size_t groups;     // work-groups of the first pass of a reduction
+  cl_program programs[REDUCE_OPS];
+  cl_kernel reduceKernels[REDUCE_OPS];
+  cl_kernel partialKernels[REDUCE_OPS];
+  cl_kernel scanKernels[REDUCE_SCAN_OPS];
+  cl_kernel scanAddKernels[REDUCE_SCAN_OPS];
+  cl_mem partials;  // the partial states of the first pass
+  cl_mem result;    // the state of the second pass
+  // partials and result are sized for ReduceMoments, the largest state
+  std::vector<cl_mem> carries;  // the block totals of every scan level
+  std::vector<size_t> carryBytes;
+};
+
+#endif  // COMMON_REDUCE_HPP
@@ -0,0 +1,76 @@
+#include "thread_pool.hpp"
+
+using namespace std;
+
+// ThreadPool starts threads - 1 workers, the caller of parallelFor being the
+// last thread
+ThreadPool::ThreadPool(unsigned threads)
+    : lock(),
+      wake(),
+      done(),
+      workers(),
+      task(NULL),
+      count(0),
+      next(0),
+      pending(0),
+      loop(0),
+      stopping(false) {
+  if (threads == 0) threads = thread::hardware_concurrency();
+  for (unsigned i = 1; i < threads; i++) {
+    workers.push_back(thread(&ThreadPool::work, this));
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    lock_guard<mutex> guard(lock);
+    stopping = true;
+  }
+  wake.notify_all();
+  for (unsigned i = 0; i < workers.size(); i++) workers[i].join();
+}
+
+void ThreadPool::parallelFor(unsigned count,
+                             const function<void(unsigned)> &task) {
+  if (workers.empty() || count <= 1) {
+    for (unsigned i = 0; i < count; i++) task(i);
+    return;
+  }
+
+  unique_lock<mutex> guard(lock);
+  this->task = &task;
+  this->count = count;
+  next = 0;
+  pending = count;
+  loop++;
+  wake.notify_all();
+
+  runTasks(guard);
+  while (pending > 0) done.wait(guard);
+  this->task = NULL;
+}
+
+// work is the body of the worker threads: wait for a loop, help with it
+void ThreadPool::work() {
+  unique_lock<mutex> guard(lock);
+  unsigned long seen = 0;
+  while (true) {
+    while (!stopping && loop == seen) wake.wait(guard);
+    if (stopping) return;
+    seen = loop;
+    runTasks(guard);
+  }
+}
+
+// runTasks takes tasks of the current loop until there are none left. The
+// lock is held between tasks, and released while running them.
+void ThreadPool::runTasks(unique_lock<mutex> &guard) {
+  while (next < count) {
+    unsigned i = next++;
+    const function<void(unsigned)> *current = task;
+    guard.unlock();
+    (*current)(i);
+    guard.lock();
+    if (--pending == 0) done.notify_all();
+  }
+}
@@ -0,0 +1,48 @@
+#ifndef COMMON_THREAD_POOL_HPP
+#define COMMON_THREAD_POOL_HPP
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// ThreadPool keeps worker threads alive between parallel loops, so splitting
+// a computation across the cores costs a wake-up instead of thread creations.
+// Shared by the host side routines of the GPU exercises; include it as
+// "common/thread_pool.hpp" and build common/thread_pool.cpp with -pthread.
+class ThreadPool {
+ public:
+  // threads counts the calling thread as well, 0 uses one thread per core
+  explicit ThreadPool(unsigned threads = 0);
+  ~ThreadPool();
+
+  // size returns the number of threads taking part in parallelFor
+  unsigned size() const { return workers.size() + 1; }
+
+  // parallelFor runs task(i) for every i < count and returns once all of them
+  // are done. The calling thread runs tasks too, and tasks are handed out one
+  // at a time, so uneven tasks balance themselves. Only one parallelFor may
+  // run on a pool at a time.
+  void parallelFor(unsigned count, const std::function<void(unsigned)> &task);
+
+ private:
+  ThreadPool(const ThreadPool &);
+  ThreadPool &operator=(const ThreadPool &);
+
+  void work();
+  void runTasks(std::unique_lock<std::mutex> &guard);
+
+  std::mutex lock;
+  std::condition_variable wake;  // a new loop started, or the pool stops
+  std::condition_variable done;  // the last task of the loop finished
+  std::vector<std::thread> workers;
+  const std::function<void(unsigned)> *task;
+  unsigned count;    // tasks of the current loop
+  unsigned next;     // next task to hand out
+  unsigned pending;  // tasks not finished yet
+  unsigned long loop;
+  bool stopping;
+};
+
+#endif  // COMMON_THREAD_POOL_HPP
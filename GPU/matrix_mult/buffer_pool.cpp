@@ -0,0 +1,43 @@
+#include "buffer_pool.hpp"
+
+using namespace std;
+
+BufferPool::BufferPool(cl_context context) : context(context), entries() {}
+
+BufferPool::~BufferPool() {
+  for (unsigned i = 0; i < entries.size(); i++) {
+    clReleaseMemObject(entries[i].buffer);
+  }
+}
+
+cl_mem BufferPool::acquire(size_t bytes, cl_int *status) {
+  Entry *best = NULL;
+  for (unsigned i = 0; i < entries.size(); i++) {
+    if (entries[i].used || entries[i].bytes < bytes) continue;
+    if (!best || entries[i].bytes < best->bytes) best = &entries[i];
+  }
+  *status = CL_SUCCESS;
+  if (best) {
+    best->used = true;
+    return best->buffer;
+  }
+
+  Entry entry = {NULL, bytes, true};
+  entry.buffer =
+      clCreateBuffer(context, CL_MEM_READ_WRITE, bytes, NULL, status);
+  if (*status != CL_SUCCESS) return NULL;
+  entries.push_back(entry);
+  return entry.buffer;
+}
+
+void BufferPool::release(cl_mem buffer) {
+  for (unsigned i = 0; i < entries.size(); i++) {
+    if (entries[i].buffer == buffer) entries[i].used = false;
+  }
+}
+
+size_t BufferPool::allocated() const {
+  size_t bytes = 0;
+  for (unsigned i = 0; i < entries.size(); i++) bytes += entries[i].bytes;
+  return bytes;
+}
@@ -0,0 +1,42 @@
+#ifndef BUFFER_POOL_HPP
+#define BUFFER_POOL_HPP
+
+#include <CL/cl.h>
+#include <stddef.h>
+#include <vector>
+
+// BufferPool hands out device buffers for temporaries and keeps them once
+// released, so that algorithms allocating the same sizes over and over (the
+// levels of a recursion, the panels of a loop) only create each buffer once.
+// A buffer may be released while commands using it are still queued, as long
+// as the next user enqueues on the same in-order queue.
+class BufferPool {
+ public:
+  explicit BufferPool(cl_context context);
+  ~BufferPool();
+
+  // acquire returns a read-write buffer of at least bytes, the smallest free
+  // one when there is one, or NULL with the error in status
+  cl_mem acquire(size_t bytes, cl_int *status);
+
+  // release gives a buffer from acquire back to the pool
+  void release(cl_mem buffer);
+
+  // allocated returns the bytes of all the buffers created by the pool
+  size_t allocated() const;
+
+ private:
+  BufferPool(const BufferPool &);
+  BufferPool &operator=(const BufferPool &);
+
+  struct Entry {
+    cl_mem buffer;
+    size_t bytes;
+    bool used;
+  };
+
+  cl_context context;
+  std::vector<Entry> entries;
+};
+
+#endif  // BUFFER_POOL_HPP
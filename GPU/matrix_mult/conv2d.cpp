@@ -0,0 +1,305 @@
+#include "conv2d.hpp"
+#include <stdio.h>
+
+// private non-exported function declarations
+unsigned convOutputSize(unsigned size, unsigned kernel, unsigned stride,
+                        unsigned pad, unsigned dilation);
+
+// Names of the Winograd transform kernels in matrix_mult.cl
+const char *const CONV_WINOGRAD_KERNEL_NAMES[3] = {
+    "conv_winograd_filter", "conv_winograd_input", "conv_winograd_output"};
+
+// convOutputSize returns the number of positions of a dilated filter of
+// kernel taps moving by stride over size + 2 * pad elements
+unsigned convOutputSize(unsigned size, unsigned kernel, unsigned stride,
+                        unsigned pad, unsigned dilation) {
+  unsigned span = dilation * (kernel - 1) + 1;
+  if (kernel == 0 || stride == 0 || size + 2 * pad < span) return 0;
+  return (size + 2 * pad - span) / stride + 1;
+}
+
+unsigned convOutputHeight(const ConvShape &shape) {
+  return convOutputSize(shape.height, shape.kernelH, shape.strideH, shape.padH,
+                        shape.dilationH);
+}
+
+unsigned convOutputWidth(const ConvShape &shape) {
+  return convOutputSize(shape.width, shape.kernelW, shape.strideW, shape.padW,
+                        shape.dilationW);
+}
+
+double convFlops(const ConvShape &shape) {
+  return 2.0 * shape.batch * shape.filters * convOutputHeight(shape) *
+         convOutputWidth(shape) * shape.channels * shape.kernelH *
+         shape.kernelW;
+}
+
+bool convWinograd(const ConvShape &shape) {
+  return shape.kernelH == 3 && shape.kernelW == 3 && shape.strideH == 1 &&
+         shape.strideW == 1 && shape.dilationH == 1 && shape.dilationW == 1;
+}
+
+ConvAlgorithm convAlgorithm(const ConvShape &shape) {
+  return convWinograd(shape) && shape.filters >= CONV_WINOGRAD_FILTERS
+             ? CONV_WINOGRAD
+             : CONV_IM2COL;
+}
+
+const char *convAlgorithmName(ConvAlgorithm algorithm) {
+  switch (algorithm) {
+    case CONV_AUTO:
+      return "auto";
+    case CONV_IM2COL:
+      return "im2col";
+    case CONV_WINOGRAD:
+      return "winograd";
+    default:
+      return "unknown";
+  }
+}
+
+void cpuConv2d(const ConvShape &shape, const float *input,
+               const float *weights, float *output) {
+  unsigned outH = convOutputHeight(shape), outW = convOutputWidth(shape);
+  unsigned C = shape.channels, H = shape.height, W = shape.width;
+  unsigned F = shape.filters, KH = shape.kernelH, KW = shape.kernelW;
+  bool nhwc = shape.layout == CONV_NHWC;
+
+  for (unsigned n = 0; n < shape.batch; n++) {
+    for (unsigned f = 0; f < F; f++) {
+      for (unsigned y = 0; y < outH; y++) {
+        for (unsigned x = 0; x < outW; x++) {
+          float sum = 0.0f;
+          for (unsigned c = 0; c < C; c++) {
+            for (unsigned kh = 0; kh < KH; kh++) {
+              int iy = (int)(y * shape.strideH + kh * shape.dilationH) -
+                       (int)shape.padH;
+              if (iy < 0 || iy >= (int)H) continue;
+              for (unsigned kw = 0; kw < KW; kw++) {
+                int ix = (int)(x * shape.strideW + kw * shape.dilationW) -
+                         (int)shape.padW;
+                if (ix < 0 || ix >= (int)W) continue;
+                size_t in, w;
+                if (nhwc) {
+                  in = (((size_t)n * H + iy) * W + ix) * C + c;
+                  w = (((size_t)f * KH + kh) * KW + kw) * C + c;
+                } else {
+                  in = (((size_t)n * C + c) * H + iy) * W + ix;
+                  w = (((size_t)f * C + c) * KH + kh) * KW + kw;
+                }
+                sum += input[in] * weights[w];
+              }
+            }
+          }
+          size_t out = nhwc ? (((size_t)n * outH + y) * outW + x) * F + f
+                            : (((size_t)n * F + f) * outH + y) * outW + x;
+          output[out] = sum;
+        }
+      }
+    }
+  }
+}
+
+// Conv2d creates the im2col and Winograd transform kernels, the products are
+// left to the engine
+Conv2d::Conv2d(cl_context context, cl_program program, GemmEngine *engine)
+    : engine(engine), im2colKernel(NULL), winogradKernels(), pool(context) {
+  int status;
+  im2colKernel = clCreateKernel(program, "conv_im2col", &status);
+  if (status != CL_SUCCESS) {
+    printf("Failed to create conv_im2col kernel\n");
+    im2colKernel = NULL;
+  }
+  for (int i = 0; i < 3; i++) {
+    winogradKernels[i] =
+        clCreateKernel(program, CONV_WINOGRAD_KERNEL_NAMES[i], &status);
+    if (status != CL_SUCCESS) {
+      printf("Failed to create %s kernel\n", CONV_WINOGRAD_KERNEL_NAMES[i]);
+      winogradKernels[i] = NULL;
+    }
+  }
+}
+
+Conv2d::~Conv2d() {
+  if (im2colKernel) clReleaseKernel(im2colKernel);
+  for (int i = 0; i < 3; i++) {
+    if (winogradKernels[i]) clReleaseKernel(winogradKernels[i]);
+  }
+}
+
+cl_int Conv2d::forward(cl_command_queue queue, const ConvShape &shape,
+                       cl_mem input, cl_mem weights, cl_mem output,
+                       cl_uint numEvents, const cl_event *waitList,
+                       cl_event *event, ConvAlgorithm algorithm) {
+  if (convOutputHeight(shape) == 0 || convOutputWidth(shape) == 0 ||
+      shape.batch == 0 || shape.channels == 0 || shape.filters == 0 ||
+      (algorithm == CONV_WINOGRAD && !convWinograd(shape))) {
+    return CL_INVALID_VALUE;
+  }
+  if (algorithm == CONV_AUTO) algorithm = convAlgorithm(shape);
+  if (algorithm == CONV_WINOGRAD) {
+    return winograd(queue, shape, input, weights, output, numEvents, waitList,
+                    event);
+  }
+  return im2col(queue, shape, input, weights, output, numEvents, waitList,
+                event);
+}
+
+// im2col expands the batch into the patch matrix and multiplies it with the
+// weights
+cl_int Conv2d::im2col(cl_command_queue queue, const ConvShape &shape,
+                      cl_mem input, cl_mem weights, cl_mem output,
+                      cl_uint numEvents, const cl_event *waitList,
+                      cl_event *event) {
+  if (!im2colKernel) return CL_INVALID_KERNEL;
+  unsigned outH = convOutputHeight(shape), outW = convOutputWidth(shape);
+  unsigned pixels = outH * outW;
+  unsigned depth = shape.channels * shape.kernelH * shape.kernelW;
+
+  cl_int status;
+  unsigned rows = shape.batch * pixels;
+  cl_mem patches = pool.acquire((size_t)rows * depth * sizeof(float), &status);
+  if (status != CL_SUCCESS) return status;
+
+  int nhwc = shape.layout == CONV_NHWC;
+  int args[14] = {(int)shape.channels,  (int)shape.height,
+                  (int)shape.width,     (int)shape.kernelH,
+                  (int)shape.kernelW,   (int)shape.strideH,
+                  (int)shape.strideW,   (int)shape.padH,
+                  (int)shape.padW,      (int)shape.dilationH,
+                  (int)shape.dilationW, (int)outH,
+                  (int)outW,            nhwc};
+  unsigned argi = 0;
+  status |= clSetKernelArg(im2colKernel, argi++, sizeof(cl_mem), &input);
+  status |= clSetKernelArg(im2colKernel, argi++, sizeof(cl_mem), &patches);
+  for (unsigned i = 0; i < 14; i++) {
+    status |= clSetKernelArg(im2colKernel, argi++, sizeof(int), &args[i]);
+  }
+  if (status != CL_SUCCESS) {
+    pool.release(patches);
+    return CL_INVALID_KERNEL_ARGS;
+  }
+  size_t globalWorkSize[2] = {depth, rows};
+  status = clEnqueueNDRangeKernel(queue, im2colKernel, 2, NULL, globalWorkSize,
+                                  NULL, numEvents,
+                                  numEvents ? waitList : NULL, NULL);
+
+  // The queue orders the GEMMs after the expansion, only the last one
+  // returns an event
+  if (status == CL_SUCCESS && nhwc) {
+    status = engine->sgemm(queue, 'N', 'T', rows, shape.filters, depth, 1.0f,
+                           patches, 0, depth, weights, 0, depth, 0.0f, output,
+                           0, shape.filters, 0, NULL, event);
+  }
+  for (unsigned n = 0; n < shape.batch && status == CL_SUCCESS && !nhwc; n++) {
+    status = engine->sgemm(queue, 'N', 'T', shape.filters, pixels, depth, 1.0f,
+                           weights, 0, depth, patches,
+                           (size_t)n * pixels * depth, depth, 0.0f, output,
+                           (size_t)n * shape.filters * pixels, pixels, 0, NULL,
+                           n + 1 == shape.batch ? event : NULL);
+  }
+
+  pool.release(patches);
+  return status;
+}
+
+// winograd transforms the filters and the input tiles, multiplies the 16
+// transformed elements as one batch of GEMMs and transforms the products
+// back into the output
+cl_int Conv2d::winograd(cl_command_queue queue, const ConvShape &shape,
+                        cl_mem input, cl_mem weights, cl_mem output,
+                        cl_uint numEvents, const cl_event *waitList,
+                        cl_event *event) {
+  for (int i = 0; i < 3; i++) {
+    if (!winogradKernels[i]) return CL_INVALID_KERNEL;
+  }
+  int outH = convOutputHeight(shape), outW = convOutputWidth(shape);
+  int tilesH = (outH + 1) / 2, tilesW = (outW + 1) / 2;
+  unsigned tiles = shape.batch * tilesH * tilesW;
+  unsigned C = shape.channels, F = shape.filters;
+  int channels = C, filters = F, height = shape.height, width = shape.width;
+  int padH = shape.padH, padW = shape.padW;
+  int nhwc = shape.layout == CONV_NHWC;
+
+  // U[16][C][F], V[16][tiles][C] and M[16][tiles][F]
+  size_t counts[3] = {(size_t)16 * C * F, (size_t)16 * tiles * C,
+                      (size_t)16 * tiles * F};
+  cl_mem buffers[3] = {NULL, NULL, NULL};
+  cl_int status = CL_SUCCESS;
+  for (unsigned i = 0; i < 3 && status == CL_SUCCESS; i++) {
+    buffers[i] = pool.acquire(counts[i] * sizeof(float), &status);
+  }
+
+  if (status == CL_SUCCESS) {
+    cl_kernel kernel = winogradKernels[0];
+    unsigned argi = 0;
+    status |= clSetKernelArg(kernel, argi++, sizeof(cl_mem), &weights);
+    status |= clSetKernelArg(kernel, argi++, sizeof(cl_mem), &buffers[0]);
+    status |= clSetKernelArg(kernel, argi++, sizeof(int), &channels);
+    status |= clSetKernelArg(kernel, argi++, sizeof(int), &filters);
+    status |= clSetKernelArg(kernel, argi++, sizeof(int), &nhwc);
+    size_t globalWorkSize[2] = {F, C};
+    if (status != CL_SUCCESS) {
+      status = CL_INVALID_KERNEL_ARGS;
+    } else {
+      status = clEnqueueNDRangeKernel(queue, kernel, 2, NULL, globalWorkSize,
+                                      NULL, numEvents,
+                                      numEvents ? waitList : NULL, NULL);
+    }
+  }
+  if (status == CL_SUCCESS) {
+    cl_kernel kernel = winogradKernels[1];
+    unsigned argi = 0;
+    status |= clSetKernelArg(kernel, argi++, sizeof(cl_mem), &input);
+    status |= clSetKernelArg(kernel, argi++, sizeof(cl_mem), &buffers[1]);
+    status |= clSetKernelArg(kernel, argi++, sizeof(int), &channels);
+    status |= clSetKernelArg(kernel, argi++, sizeof(int), &height);
+    status |= clSetKernelArg(kernel, argi++, sizeof(int), &width);
+    status |= clSetKernelArg(kernel, argi++, sizeof(int), &padH);
+    status |= clSetKernelArg(kernel, argi++, sizeof(int), &padW);
+    status |= clSetKernelArg(kernel, argi++, sizeof(int), &tilesH);
+    status |= clSetKernelArg(kernel, argi++, sizeof(int), &tilesW);
+    status |= clSetKernelArg(kernel, argi++, sizeof(int), &nhwc);
+    size_t globalWorkSize[2] = {C, tiles};
+    if (status != CL_SUCCESS) {
+      status = CL_INVALID_KERNEL_ARGS;
+    } else {
+      status = clEnqueueNDRangeKernel(queue, kernel, 2, NULL, globalWorkSize,
+                                      NULL, 0, NULL, NULL);
+    }
+  }
+
+  // The blocked kernel handles ragged edges as well as the tiled one and
+  // reuses more of each load, the tiled one is the fallback
+  if (status == CL_SUCCESS) {
+    GemmVariant variant =
+        engine->supports(GEMM_BLOCKED) ? GEMM_BLOCKED : GEMM_TILED;
+    status = engine->multiplyBatched(queue, variant, buffers[1], tiles * C,
+                                     buffers[0], C * F, buffers[2], tiles * F,
+                                     tiles, F, C, 16, 0, NULL, NULL);
+  }
+  if (status == CL_SUCCESS) {
+    cl_kernel kernel = winogradKernels[2];
+    unsigned argi = 0;
+    status |= clSetKernelArg(kernel, argi++, sizeof(cl_mem), &buffers[2]);
+    status |= clSetKernelArg(kernel, argi++, sizeof(cl_mem), &output);
+    status |= clSetKernelArg(kernel, argi++, sizeof(int), &filters);
+    status |= clSetKernelArg(kernel, argi++, sizeof(int), &outH);
+    status |= clSetKernelArg(kernel, argi++, sizeof(int), &outW);
+    status |= clSetKernelArg(kernel, argi++, sizeof(int), &tilesH);
+    status |= clSetKernelArg(kernel, argi++, sizeof(int), &tilesW);
+    status |= clSetKernelArg(kernel, argi++, sizeof(int), &nhwc);
+    size_t globalWorkSize[2] = {F, tiles};
+    if (status != CL_SUCCESS) {
+      status = CL_INVALID_KERNEL_ARGS;
+    } else {
+      status = clEnqueueNDRangeKernel(queue, kernel, 2, NULL, globalWorkSize,
+                                      NULL, 0, NULL, event);
+    }
+  }
+
+  for (unsigned i = 0; i < 3; i++) {
+    if (buffers[i]) pool.release(buffers[i]);
+  }
+  return status;
+}
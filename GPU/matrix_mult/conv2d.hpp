@@ -0,0 +1,114 @@
+#ifndef CONV2D_HPP
+#define CONV2D_HPP
+
+#include <CL/cl.h>
+#include "buffer_pool.hpp"
+#include "gemm.hpp"
+
+// Filter count from which 3x3 layers use Winograd F(2x2, 3x3). It takes 16
+// multiplications for a 2x2 output tile where im2col takes 36, but the GEMMs
+// of the transformed domain are only filters wide and the transforms move
+// 16 / 4 times the input and output through memory, so narrow layers are
+// faster with im2col.
+#ifndef CONV_WINOGRAD_FILTERS
+#define CONV_WINOGRAD_FILTERS 32
+#endif
+
+// ConvLayout is the order of the dimensions of the input and output tensors.
+// NCHW weights are F x C x KH x KW, NHWC weights F x KH x KW x C.
+enum ConvLayout { CONV_NCHW, CONV_NHWC };
+
+// ConvShape describes a 2D convolution layer: a batch of images of channels
+// x height x width convolved with a number of kernelH x kernelW filters. The
+// filters move by stride, the input is padded with pad zeros on every side
+// and the filter taps are dilation pixels apart.
+struct ConvShape {
+  unsigned batch;
+  unsigned channels;
+  unsigned height;
+  unsigned width;
+  unsigned filters;
+  unsigned kernelH;
+  unsigned kernelW;
+  unsigned strideH;
+  unsigned strideW;
+  unsigned padH;
+  unsigned padW;
+  unsigned dilationH;
+  unsigned dilationW;
+  ConvLayout layout;
+};
+
+// ConvAlgorithm selects how Conv2d computes a layer. CONV_AUTO picks
+// CONV_WINOGRAD when convWinograd allows it and the layer has at least
+// CONV_WINOGRAD_FILTERS filters, CONV_IM2COL otherwise.
+enum ConvAlgorithm { CONV_AUTO, CONV_IM2COL, CONV_WINOGRAD };
+
+// convOutputHeight and convOutputWidth return the size of the output images,
+// 0 when the filter does not fit in the padded input
+unsigned convOutputHeight(const ConvShape &shape);
+unsigned convOutputWidth(const ConvShape &shape);
+
+// convFlops returns the multiply-adds of the layer, counted as 2 flops
+double convFlops(const ConvShape &shape);
+
+// convWinograd tells whether Winograd F(2x2, 3x3) can compute the layer: 3x3
+// filters, stride 1 and no dilation
+bool convWinograd(const ConvShape &shape);
+
+// convAlgorithm returns the algorithm CONV_AUTO resolves to for the layer
+ConvAlgorithm convAlgorithm(const ConvShape &shape);
+
+// convAlgorithmName returns a printable name for the algorithm
+const char *convAlgorithmName(ConvAlgorithm algorithm);
+
+// cpuConv2d computes the convolution directly on the CPU, as a reference
+void cpuConv2d(const ConvShape &shape, const float *input,
+               const float *weights, float *output);
+
+// Conv2d runs convolution layers as GEMMs on the device. conv_im2col expands
+// the whole batch into a patch matrix with one row per output pixel and one
+// column per weight, and the product with the weights gives the output:
+//   NHWC: output (batch * outH * outW x F) = patches * weights^T, one GEMM
+//         for the whole batch
+//   NCHW: output[n] (F x outH * outW) = weights * patches[n]^T, one GEMM per
+//         image as the filters are the outer dimension of every image
+// Both use GemmEngine::sgemm with a transposed operand, so nothing else is
+// rearranged. 3x3 layers may use Winograd F(2x2, 3x3) instead: the filters
+// and the 4x4 input tiles are transformed by kernels, the 16 transformed
+// elements are multiplied as one batch of tiles x C by C x F GEMMs, and the
+// products are transformed back into 2x2 output tiles. The temporaries are
+// kept in a buffer pool between calls.
+class Conv2d {
+ public:
+  Conv2d(cl_context context, cl_program program, GemmEngine *engine);
+  ~Conv2d();
+
+  // forward enqueues the convolution of input with weights into output, all
+  // device buffers in the layout of the shape. The commands are ordered by
+  // the queue, which must execute in order. Returns CL_INVALID_VALUE for
+  // CONV_WINOGRAD on a layer it cannot compute.
+  cl_int forward(cl_command_queue queue, const ConvShape &shape, cl_mem input,
+                 cl_mem weights, cl_mem output, cl_uint numEvents,
+                 const cl_event *waitList, cl_event *event,
+                 ConvAlgorithm algorithm = CONV_AUTO);
+
+ private:
+  Conv2d(const Conv2d &);
+  Conv2d &operator=(const Conv2d &);
+
+  cl_int im2col(cl_command_queue queue, const ConvShape &shape, cl_mem input,
+                cl_mem weights, cl_mem output, cl_uint numEvents,
+                const cl_event *waitList, cl_event *event);
+  cl_int winograd(cl_command_queue queue, const ConvShape &shape,
+                  cl_mem input, cl_mem weights, cl_mem output,
+                  cl_uint numEvents, const cl_event *waitList,
+                  cl_event *event);
+
+  GemmEngine *engine;
+  cl_kernel im2colKernel;
+  cl_kernel winogradKernels[3];  // filter, input and output transforms
+  BufferPool pool;
+};
+
+#endif  // CONV2D_HPP
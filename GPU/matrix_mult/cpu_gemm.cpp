@@ -0,0 +1,227 @@
+#include "cpu_gemm.hpp"
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+using namespace std;
+
+// GemmOperand is a row major matrix whose rows are ld elements apart, used
+// as it is or transposed
+struct GemmOperand {
+  const float *data;
+  unsigned ld;
+  bool trans;
+};
+
+// private non-exported function declarations
+float operandAt(const GemmOperand &X, unsigned row, unsigned col);
+GemmOperand operandOffset(const GemmOperand &X, unsigned row, unsigned col);
+void packA(const GemmOperand &A, unsigned mc, unsigned kc, float *packed);
+void packB(const GemmOperand &B, unsigned kc, unsigned nc, float *packed);
+void microKernel(unsigned kc, const float *a, const float *b, float *acc);
+void gemmBlock(const GemmOperand &A, const GemmOperand &B, float *X,
+               unsigned ldx, unsigned M, unsigned N, unsigned K, float alpha,
+               float beta);
+
+// operandAt returns element (row, col) of op(X)
+inline float operandAt(const GemmOperand &X, unsigned row, unsigned col) {
+  return X.trans ? X.data[(size_t)col * X.ld + row]
+                 : X.data[(size_t)row * X.ld + col];
+}
+
+// operandOffset returns the submatrix of op(X) starting at (row, col)
+GemmOperand operandOffset(const GemmOperand &X, unsigned row, unsigned col) {
+  GemmOperand offset = X;
+  offset.data += X.trans ? (size_t)col * X.ld + row : (size_t)row * X.ld + col;
+  return offset;
+}
+
+// packA copies an mc x kc block of op(A) into panels of CPU_GEMM_MR rows.
+// Panel p holds, for each k, the CPU_GEMM_MR elements of column k, padded
+// with zeros past the last row. Packing is where a transposed A is read in
+// its own order, the micro-kernel never sees the difference.
+void packA(const GemmOperand &A, unsigned mc, unsigned kc, float *packed) {
+  for (unsigned p = 0; p < mc; p += CPU_GEMM_MR) {
+    unsigned rows = min((unsigned)CPU_GEMM_MR, mc - p);
+    for (unsigned k = 0; k < kc; k++) {
+      for (unsigned r = 0; r < CPU_GEMM_MR; r++) {
+        *packed++ = r < rows ? operandAt(A, p + r, k) : 0.0f;
+      }
+    }
+  }
+}
+
+// packB copies a kc x nc block of op(B) into panels of CPU_GEMM_NR columns.
+// Panel p holds, for each k, the CPU_GEMM_NR elements of row k, padded with
+// zeros past the last column.
+void packB(const GemmOperand &B, unsigned kc, unsigned nc, float *packed) {
+  for (unsigned p = 0; p < nc; p += CPU_GEMM_NR) {
+    unsigned cols = min((unsigned)CPU_GEMM_NR, nc - p);
+    for (unsigned k = 0; k < kc; k++) {
+      for (unsigned c = 0; c < CPU_GEMM_NR; c++) {
+        *packed++ = c < cols ? operandAt(B, k, p + c) : 0.0f;
+      }
+    }
+  }
+}
+
+// microKernel multiplies a packed A panel by a packed B panel over kc and
+// writes the CPU_GEMM_MR x CPU_GEMM_NR product to acc
+void microKernel(unsigned kc, const float *a, const float *b, float *acc) {
+#ifdef __ARM_NEON
+  float32x4_t c0l = vdupq_n_f32(0.0f), c0h = vdupq_n_f32(0.0f);
+  float32x4_t c1l = vdupq_n_f32(0.0f), c1h = vdupq_n_f32(0.0f);
+  float32x4_t c2l = vdupq_n_f32(0.0f), c2h = vdupq_n_f32(0.0f);
+  float32x4_t c3l = vdupq_n_f32(0.0f), c3h = vdupq_n_f32(0.0f);
+  for (unsigned k = 0; k < kc; k++) {
+    float32x4_t av = vld1q_f32(a);
+    float32x4_t bl = vld1q_f32(b);
+    float32x4_t bh = vld1q_f32(b + 4);
+    float32x2_t a01 = vget_low_f32(av);
+    float32x2_t a23 = vget_high_f32(av);
+    c0l = vmlaq_lane_f32(c0l, bl, a01, 0);
+    c0h = vmlaq_lane_f32(c0h, bh, a01, 0);
+    c1l = vmlaq_lane_f32(c1l, bl, a01, 1);
+    c1h = vmlaq_lane_f32(c1h, bh, a01, 1);
+    c2l = vmlaq_lane_f32(c2l, bl, a23, 0);
+    c2h = vmlaq_lane_f32(c2h, bh, a23, 0);
+    c3l = vmlaq_lane_f32(c3l, bl, a23, 1);
+    c3h = vmlaq_lane_f32(c3h, bh, a23, 1);
+    a += CPU_GEMM_MR;
+    b += CPU_GEMM_NR;
+  }
+  vst1q_f32(acc + 0, c0l);
+  vst1q_f32(acc + 4, c0h);
+  vst1q_f32(acc + 8, c1l);
+  vst1q_f32(acc + 12, c1h);
+  vst1q_f32(acc + 16, c2l);
+  vst1q_f32(acc + 20, c2h);
+  vst1q_f32(acc + 24, c3l);
+  vst1q_f32(acc + 28, c3h);
+#else
+  float c[CPU_GEMM_MR][CPU_GEMM_NR] = {{0}};
+  for (unsigned k = 0; k < kc; k++) {
+    for (unsigned r = 0; r < CPU_GEMM_MR; r++) {
+      for (unsigned j = 0; j < CPU_GEMM_NR; j++) c[r][j] += a[r] * b[j];
+    }
+    a += CPU_GEMM_MR;
+    b += CPU_GEMM_NR;
+  }
+  memcpy(acc, c, sizeof(c));
+#endif
+}
+
+// gemmBlock computes an M x N block of X = alpha * op(A) * op(B) + beta * X
+// with the blocked algorithm: for every CPU_GEMM_NC wide block of op(B) and
+// CPU_GEMM_KC deep slice of K, pack op(B) once, then pack CPU_GEMM_MC rows of
+// op(A) at a time and sweep the micro-kernel over them. X has leading
+// dimension ldx and is not read when beta is 0.
+void gemmBlock(const GemmOperand &A, const GemmOperand &B, float *X,
+               unsigned ldx, unsigned M, unsigned N, unsigned K, float alpha,
+               float beta) {
+  if (K == 0) {
+    for (unsigned i = 0; i < M; i++) {
+      float *x = X + (size_t)i * ldx;
+      if (beta == 0.0f) {
+        memset(x, 0, N * sizeof(float));
+      } else {
+        for (unsigned j = 0; j < N; j++) x[j] *= beta;
+      }
+    }
+    return;
+  }
+
+  vector<float> packedA(CPU_GEMM_MC * CPU_GEMM_KC);
+  vector<float> packedB(CPU_GEMM_KC * (CPU_GEMM_NC + CPU_GEMM_NR));
+  float acc[CPU_GEMM_MR * CPU_GEMM_NR];
+
+  for (unsigned jc = 0; jc < N; jc += CPU_GEMM_NC) {
+    unsigned nc = min((unsigned)CPU_GEMM_NC, N - jc);
+    for (unsigned pc = 0; pc < K; pc += CPU_GEMM_KC) {
+      unsigned kc = min((unsigned)CPU_GEMM_KC, K - pc);
+      packB(operandOffset(B, pc, jc), kc, nc, packedB.data());
+
+      for (unsigned ic = 0; ic < M; ic += CPU_GEMM_MC) {
+        unsigned mc = min((unsigned)CPU_GEMM_MC, M - ic);
+        packA(operandOffset(A, ic, pc), mc, kc, packedA.data());
+
+        for (unsigned jr = 0; jr < nc; jr += CPU_GEMM_NR) {
+          unsigned cols = min((unsigned)CPU_GEMM_NR, nc - jr);
+          for (unsigned ir = 0; ir < mc; ir += CPU_GEMM_MR) {
+            unsigned rows = min((unsigned)CPU_GEMM_MR, mc - ir);
+            microKernel(kc, &packedA[ir * kc], &packedB[jr * kc], acc);
+
+            // The first slice of K scales X by beta, the others accumulate
+            float *x = X + (size_t)(ic + ir) * ldx + jc + jr;
+            for (unsigned r = 0; r < rows; r++) {
+              for (unsigned c = 0; c < cols; c++) {
+                float value = alpha * acc[r * CPU_GEMM_NR + c];
+                float &out = x[(size_t)r * ldx + c];
+                if (pc > 0) {
+                  out += value;
+                } else {
+                  out = beta == 0.0f ? value : value + beta * out;
+                }
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+bool gemmTranspose(char trans, bool *transposed) {
+  *transposed = trans == 'T' || trans == 't' || trans == 'C' || trans == 'c';
+  return *transposed || trans == 'N' || trans == 'n';
+}
+
+bool cpuSgemm(char transA, char transB, unsigned M, unsigned N, unsigned K,
+              float alpha, const float *A, unsigned lda, const float *B,
+              unsigned ldb, float beta, float *C, unsigned ldc,
+              ThreadPool *pool) {
+  GemmOperand a = {A, lda, false};
+  GemmOperand b = {B, ldb, false};
+  if (!gemmTranspose(transA, &a.trans) || !gemmTranspose(transB, &b.trans) ||
+      lda < (a.trans ? M : K) || ldb < (b.trans ? K : N) || ldc < N) {
+    return false;
+  }
+  // As in BLAS, an empty C is a quick return. With K == 0, gemmBlock only
+  // scales C by beta.
+  if (M == 0 || N == 0) return true;
+  if (!pool || pool->size() == 1) {
+    gemmBlock(a, b, C, ldc, M, N, K, alpha, beta);
+    return true;
+  }
+
+  // Split the larger dimension of X across the threads, in whole micro-tiles.
+  // Every thread packs its own blocks, so they never wait on each other.
+  unsigned threads = pool->size();
+  bool splitRows = M >= N;
+  unsigned extent = splitRows ? M : N;
+  unsigned unit = splitRows ? CPU_GEMM_MR : CPU_GEMM_NR;
+  unsigned part = (extent + threads - 1) / threads;
+  part = (part + unit - 1) / unit * unit;
+  unsigned parts = (extent + part - 1) / part;
+
+  pool->parallelFor(parts, [&](unsigned i) {
+    unsigned start = i * part;
+    unsigned length = min(part, extent - start);
+    if (splitRows) {
+      gemmBlock(operandOffset(a, start, 0), b, C + (size_t)start * ldc, ldc,
+                length, N, K, alpha, beta);
+    } else {
+      gemmBlock(a, operandOffset(b, 0, start), C + start, ldc, M, length, K,
+                alpha, beta);
+    }
+  });
+  return true;
+}
+
+void cpuGemm(const float *A, const float *B, float *X, unsigned M, unsigned N,
+             unsigned K, ThreadPool *pool) {
+  cpuSgemm('N', 'N', M, N, K, 1.0f, A, K, B, N, 0.0f, X, N, pool);
+}
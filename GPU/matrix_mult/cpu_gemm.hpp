@@ -0,0 +1,52 @@
+#ifndef CPU_GEMM_HPP
+#define CPU_GEMM_HPP
+
+#include "common/thread_pool.hpp"
+
+// Register block of the micro-kernel: it computes CPU_GEMM_MR x CPU_GEMM_NR
+// elements of the result, 8 float32x4 accumulators with NEON
+#define CPU_GEMM_MR 4
+#define CPU_GEMM_NR 8
+
+// Cache blocks. A CPU_GEMM_KC x CPU_GEMM_NR panel of B stays in L1 while the
+// micro-kernel sweeps over a CPU_GEMM_MC x CPU_GEMM_KC block of A kept in L2,
+// and each thread packs a CPU_GEMM_KC x CPU_GEMM_NC block of B that is reused
+// for all of its rows. The defaults fit the 32KB L1 and 2MB shared L2 of the
+// Cortex-A15 cluster with 4 threads.
+#ifndef CPU_GEMM_MC
+#define CPU_GEMM_MC 128
+#endif
+#ifndef CPU_GEMM_KC
+#define CPU_GEMM_KC 256
+#endif
+#ifndef CPU_GEMM_NC
+#define CPU_GEMM_NC 512
+#endif
+
+// gemmTranspose reads a BLAS transpose flag: 'N' for the matrix as it is,
+// 'T' (or 'C', the same for real matrices) for its transpose, in either case.
+// Returns false for anything else.
+bool gemmTranspose(char trans, bool *transposed);
+
+// cpuSgemm computes C = alpha * op(A) * op(B) + beta * C like BLAS sgemm, for
+// row major matrices: op(X) is X for transX 'N' and its transpose for 'T'.
+// op(A) is M x K, op(B) is K x N and C is M x N, and the rows of A, B and C
+// are lda, ldb and ldc elements apart, so any of them can be a submatrix of
+// a larger matrix. C is not read when beta is 0. Transposed operands are
+// read in their own order when packed, nothing is copied beforehand. Nothing
+// is done when M or N is 0, and C is only scaled by beta when K is 0. Returns
+// false, leaving C untouched, for an invalid flag or leading dimension.
+bool cpuSgemm(char transA, char transB, unsigned M, unsigned N, unsigned K,
+              float alpha, const float *A, unsigned lda, const float *B,
+              unsigned ldb, float beta, float *C, unsigned ldc,
+              ThreadPool *pool = NULL);
+
+// cpuGemm computes X = A * B on the CPU for a row major M x K matrix A and a
+// K x N matrix B, overwriting X. Blocks of A and B are packed into contiguous
+// panels, multiplied by a NEON micro-kernel (plain C that the compiler can
+// vectorize elsewhere) and the result is split across the threads of pool.
+// Without a pool it runs on the calling thread.
+void cpuGemm(const float *A, const float *B, float *X, unsigned M, unsigned N,
+             unsigned K, ThreadPool *pool = NULL);
+
+#endif  // CPU_GEMM_HPP
@@ -0,0 +1,369 @@
+#include "gemm.hpp"
+#include <stdio.h>
+#include <vector>
+#include "cpu_gemm.hpp"
+
+using namespace std;
+
+// private non-exported function declarations
+void gemmBlock(GemmVariant variant, const GemmShape &shape, size_t block[2]);
+
+// Names of the kernels of every variant in matrix_mult.cl
+const char *const GEMM_KERNEL_NAMES[GEMM_VARIANTS] = {"matrix_mult_tiled",
+                                                       "matrix_mult_blocked"};
+const char *const GEMM_BATCHED_KERNEL_NAMES[GEMM_VARIANTS] = {
+    "matrix_mult_batched_tiled", "matrix_mult_batched_blocked"};
+const char *const GEMM_SGEMM_KERNEL_NAMES[4] = {
+    "matrix_sgemm_nn", "matrix_sgemm_nt", "matrix_sgemm_tn", "matrix_sgemm_tt"};
+
+// gemmBlock returns the elements of the result computed by a work-group of
+// the variant
+void gemmBlock(GemmVariant variant, const GemmShape &shape, size_t block[2]) {
+  block[0] = variant == GEMM_TILED ? shape.tile : shape.blockCols;
+  block[1] = variant == GEMM_TILED ? shape.tile : shape.blockRows;
+}
+
+const char *gemmVariantName(GemmVariant variant) {
+  switch (variant) {
+    case GEMM_TILED:
+      return "tiled";
+    case GEMM_BLOCKED:
+      return "blocked";
+    default:
+      return "unknown";
+  }
+}
+
+void gemmBuildOptions(char *options, size_t length, const GemmShape &shape) {
+  snprintf(options, length,
+           "-DTS=%u -DTSM=%u -DTSN=%u -DTSK=%u -DWPTM=%u -DWPTN=%u", shape.tile,
+           shape.blockRows, shape.blockCols, shape.blockDepth, shape.wptRows,
+           shape.wptCols);
+}
+
+void gemmWorkGroup(GemmVariant variant, const GemmShape &shape,
+                   size_t local[2]) {
+  if (variant == GEMM_TILED) {
+    local[0] = shape.tile;
+    local[1] = shape.tile;
+  } else {
+    local[0] = shape.blockCols / shape.wptCols;
+    local[1] = shape.blockRows / shape.wptRows;
+  }
+}
+
+// GemmEngine creates the kernel instances of every variant. Staging buffers
+// are allocated by the first multiplyBatched call on host matrices.
+GemmEngine::GemmEngine(cl_context context, cl_device_id device,
+                       cl_program program, const GemmShape &shape)
+    : context(context),
+      device(device),
+      shape(shape),
+      kernels(),
+      batchedKernels(),
+      quantizedKernel(NULL),
+      sgemmKernels(),
+      stagingA(NULL),
+      stagingB(NULL),
+      stagingX(NULL),
+      capacityA(0),
+      capacityB(0),
+      capacityX(0) {
+  int status;
+  for (int v = 0; v < GEMM_VARIANTS; v++) {
+    kernels[v] = clCreateKernel(program, GEMM_KERNEL_NAMES[v], &status);
+    if (status != CL_SUCCESS) {
+      printf("Failed to create %s kernel\n", GEMM_KERNEL_NAMES[v]);
+      kernels[v] = NULL;
+    }
+    batchedKernels[v] =
+        clCreateKernel(program, GEMM_BATCHED_KERNEL_NAMES[v], &status);
+    if (status != CL_SUCCESS) {
+      printf("Failed to create %s kernel\n", GEMM_BATCHED_KERNEL_NAMES[v]);
+      batchedKernels[v] = NULL;
+    }
+  }
+  quantizedKernel = clCreateKernel(program, "matrix_mult_q8", &status);
+  if (status != CL_SUCCESS) {
+    printf("Failed to create matrix_mult_q8 kernel\n");
+    quantizedKernel = NULL;
+  }
+  for (int i = 0; i < 4; i++) {
+    sgemmKernels[i] =
+        clCreateKernel(program, GEMM_SGEMM_KERNEL_NAMES[i], &status);
+    if (status != CL_SUCCESS) {
+      printf("Failed to create %s kernel\n", GEMM_SGEMM_KERNEL_NAMES[i]);
+      sgemmKernels[i] = NULL;
+    }
+  }
+}
+
+GemmEngine::~GemmEngine() {
+  for (int v = 0; v < GEMM_VARIANTS; v++) {
+    if (kernels[v]) clReleaseKernel(kernels[v]);
+    if (batchedKernels[v]) clReleaseKernel(batchedKernels[v]);
+  }
+  if (quantizedKernel) clReleaseKernel(quantizedKernel);
+  for (int i = 0; i < 4; i++) {
+    if (sgemmKernels[i]) clReleaseKernel(sgemmKernels[i]);
+  }
+  cl_mem buffers[] = {stagingA, stagingB, stagingX};
+  for (unsigned i = 0; i < sizeof(buffers) / sizeof(cl_mem); i++) {
+    if (buffers[i]) clReleaseMemObject(buffers[i]);
+  }
+}
+
+bool GemmEngine::supports(GemmVariant variant) {
+  cl_kernel all[] = {kernels[variant], batchedKernels[variant]};
+  size_t local[2];
+  gemmWorkGroup(variant, shape, local);
+  for (unsigned i = 0; i < sizeof(all) / sizeof(cl_kernel); i++) {
+    // Kernels using many registers may be limited to smaller work-groups than
+    // the device maximum
+    size_t maxWorkGroup = 0;
+    if (!all[i]) return false;
+    clGetKernelWorkGroupInfo(all[i], device, CL_KERNEL_WORK_GROUP_SIZE,
+                             sizeof(maxWorkGroup), &maxWorkGroup, NULL);
+    if (local[0] * local[1] > maxWorkGroup) return false;
+  }
+  return true;
+}
+
+cl_int GemmEngine::multiply(cl_command_queue queue, GemmVariant variant,
+                            cl_mem A, cl_mem B, cl_mem X, unsigned M,
+                            unsigned N, unsigned K, cl_uint numEvents,
+                            const cl_event *waitList, cl_event *event) {
+  cl_kernel kernel = kernels[variant];
+  if (!kernel) return CL_INVALID_KERNEL;
+
+  cl_int status = CL_SUCCESS;
+  unsigned argi = 0;
+  status |= clSetKernelArg(kernel, argi++, sizeof(cl_mem), &A);
+  status |= clSetKernelArg(kernel, argi++, sizeof(cl_mem), &B);
+  status |= clSetKernelArg(kernel, argi++, sizeof(cl_mem), &X);
+  status |= clSetKernelArg(kernel, argi++, sizeof(int), &M);
+  status |= clSetKernelArg(kernel, argi++, sizeof(int), &N);
+  status |= clSetKernelArg(kernel, argi++, sizeof(int), &K);
+  if (status != CL_SUCCESS) return CL_INVALID_KERNEL_ARGS;
+  return launch(queue, variant, false, M, N, 1, numEvents, waitList, event);
+}
+
+cl_int GemmEngine::multiplyBatched(cl_command_queue queue, GemmVariant variant,
+                                   cl_mem A, size_t strideA, cl_mem B,
+                                   size_t strideB, cl_mem X, size_t strideX,
+                                   unsigned M, unsigned N, unsigned K,
+                                   unsigned batch, cl_uint numEvents,
+                                   const cl_event *waitList, cl_event *event) {
+  cl_kernel kernel = batchedKernels[variant];
+  if (!kernel) return CL_INVALID_KERNEL;
+
+  int strides[3] = {(int)strideA, (int)strideB, (int)strideX};
+  cl_int status = CL_SUCCESS;
+  unsigned argi = 0;
+  status |= clSetKernelArg(kernel, argi++, sizeof(cl_mem), &A);
+  status |= clSetKernelArg(kernel, argi++, sizeof(int), &strides[0]);
+  status |= clSetKernelArg(kernel, argi++, sizeof(cl_mem), &B);
+  status |= clSetKernelArg(kernel, argi++, sizeof(int), &strides[1]);
+  status |= clSetKernelArg(kernel, argi++, sizeof(cl_mem), &X);
+  status |= clSetKernelArg(kernel, argi++, sizeof(int), &strides[2]);
+  // No offsets, the strides locate the matrices
+  status |= clSetKernelArg(kernel, argi++, sizeof(cl_mem), NULL);
+  status |= clSetKernelArg(kernel, argi++, sizeof(int), &M);
+  status |= clSetKernelArg(kernel, argi++, sizeof(int), &N);
+  status |= clSetKernelArg(kernel, argi++, sizeof(int), &K);
+  if (status != CL_SUCCESS) return CL_INVALID_KERNEL_ARGS;
+  return launch(queue, variant, true, M, N, batch, numEvents, waitList, event);
+}
+
+cl_int GemmEngine::multiplyBatched(cl_command_queue queue, GemmVariant variant,
+                                   cl_mem A, cl_mem B, cl_mem X,
+                                   cl_mem offsets, unsigned M, unsigned N,
+                                   unsigned K, unsigned batch,
+                                   cl_uint numEvents, const cl_event *waitList,
+                                   cl_event *event) {
+  cl_kernel kernel = batchedKernels[variant];
+  if (!kernel) return CL_INVALID_KERNEL;
+
+  int unused = 0;
+  cl_int status = CL_SUCCESS;
+  unsigned argi = 0;
+  status |= clSetKernelArg(kernel, argi++, sizeof(cl_mem), &A);
+  status |= clSetKernelArg(kernel, argi++, sizeof(int), &unused);
+  status |= clSetKernelArg(kernel, argi++, sizeof(cl_mem), &B);
+  status |= clSetKernelArg(kernel, argi++, sizeof(int), &unused);
+  status |= clSetKernelArg(kernel, argi++, sizeof(cl_mem), &X);
+  status |= clSetKernelArg(kernel, argi++, sizeof(int), &unused);
+  status |= clSetKernelArg(kernel, argi++, sizeof(cl_mem), &offsets);
+  status |= clSetKernelArg(kernel, argi++, sizeof(int), &M);
+  status |= clSetKernelArg(kernel, argi++, sizeof(int), &N);
+  status |= clSetKernelArg(kernel, argi++, sizeof(int), &K);
+  if (status != CL_SUCCESS) return CL_INVALID_KERNEL_ARGS;
+  return launch(queue, variant, true, M, N, batch, numEvents, waitList, event);
+}
+
+cl_int GemmEngine::multiplyBatched(cl_command_queue queue, GemmVariant variant,
+                                   const float *const *A,
+                                   const float *const *B, float *const *X,
+                                   unsigned M, unsigned N, unsigned K,
+                                   unsigned batch) {
+  size_t bytesA = (size_t)M * K * sizeof(float);
+  size_t bytesB = (size_t)K * N * sizeof(float);
+  size_t bytesX = (size_t)M * N * sizeof(float);
+  cl_int status;
+  if ((status = reserve(&stagingA, &capacityA, bytesA * batch)) ||
+      (status = reserve(&stagingB, &capacityB, bytesB * batch)) ||
+      (status = reserve(&stagingX, &capacityX, bytesX * batch))) {
+    return status;
+  }
+
+  // Gather the matrices into the strided layout. The queue may execute out of
+  // order, so every step waits on the events of the previous one.
+  vector<cl_event> writes(2 * batch), reads(batch);
+  for (unsigned i = 0; i < batch && status == CL_SUCCESS; i++) {
+    status = clEnqueueWriteBuffer(queue, stagingA, CL_FALSE, i * bytesA,
+                                  bytesA, A[i], 0, NULL, &writes[2 * i]);
+    if (status == CL_SUCCESS) {
+      status = clEnqueueWriteBuffer(queue, stagingB, CL_FALSE, i * bytesB,
+                                    bytesB, B[i], 0, NULL, &writes[2 * i + 1]);
+    }
+  }
+
+  cl_event kernelEvent = NULL;
+  if (status == CL_SUCCESS) {
+    status = multiplyBatched(queue, variant, stagingA, (size_t)M * K, stagingB,
+                             (size_t)K * N, stagingX, (size_t)M * N, M, N, K,
+                             batch, 2 * batch, writes.data(), &kernelEvent);
+  }
+  for (unsigned i = 0; i < batch && status == CL_SUCCESS; i++) {
+    status = clEnqueueReadBuffer(queue, stagingX, CL_FALSE, i * bytesX,
+                                 bytesX, X[i], 1, &kernelEvent, &reads[i]);
+  }
+  clFlush(queue);
+
+  // Wait for whatever was enqueued, even after a failure, before releasing
+  // the events and handing the host matrices back
+  vector<cl_event> all;
+  for (unsigned i = 0; i < writes.size(); i++) {
+    if (writes[i]) all.push_back(writes[i]);
+  }
+  for (unsigned i = 0; i < reads.size(); i++) {
+    if (reads[i]) all.push_back(reads[i]);
+  }
+  if (kernelEvent) all.push_back(kernelEvent);
+  if (!all.empty()) clWaitForEvents(all.size(), all.data());
+  for (unsigned i = 0; i < all.size(); i++) clReleaseEvent(all[i]);
+  return status;
+}
+
+cl_int GemmEngine::sgemm(cl_command_queue queue, char transA, char transB,
+                         unsigned M, unsigned N, unsigned K, float alpha,
+                         cl_mem A, size_t offA, unsigned lda, cl_mem B,
+                         size_t offB, unsigned ldb, float beta, cl_mem C,
+                         size_t offC, unsigned ldc, cl_uint numEvents,
+                         const cl_event *waitList, cl_event *event) {
+  bool ta, tb;
+  if (!gemmTranspose(transA, &ta) || !gemmTranspose(transB, &tb) ||
+      lda < (ta ? M : K) || ldb < (tb ? K : N) || ldc < N) {
+    return CL_INVALID_VALUE;
+  }
+  // As in BLAS, an empty C is a quick return: only the event is enqueued, as
+  // a marker after the wait list. With K == 0 the kernel only scales C.
+  if (M == 0 || N == 0) {
+    if (!event) return CL_SUCCESS;
+    return clEnqueueMarkerWithWaitList(queue, numEvents,
+                                       numEvents ? waitList : NULL, event);
+  }
+  cl_kernel kernel = sgemmKernels[2 * ta + tb];
+  if (!kernel) return CL_INVALID_KERNEL;
+
+  int offsets[3] = {(int)offA, (int)offB, (int)offC};
+  cl_int status = CL_SUCCESS;
+  unsigned argi = 0;
+  status |= clSetKernelArg(kernel, argi++, sizeof(int), &M);
+  status |= clSetKernelArg(kernel, argi++, sizeof(int), &N);
+  status |= clSetKernelArg(kernel, argi++, sizeof(int), &K);
+  status |= clSetKernelArg(kernel, argi++, sizeof(float), &alpha);
+  status |= clSetKernelArg(kernel, argi++, sizeof(cl_mem), &A);
+  status |= clSetKernelArg(kernel, argi++, sizeof(int), &offsets[0]);
+  status |= clSetKernelArg(kernel, argi++, sizeof(int), &lda);
+  status |= clSetKernelArg(kernel, argi++, sizeof(cl_mem), &B);
+  status |= clSetKernelArg(kernel, argi++, sizeof(int), &offsets[1]);
+  status |= clSetKernelArg(kernel, argi++, sizeof(int), &ldb);
+  status |= clSetKernelArg(kernel, argi++, sizeof(float), &beta);
+  status |= clSetKernelArg(kernel, argi++, sizeof(cl_mem), &C);
+  status |= clSetKernelArg(kernel, argi++, sizeof(int), &offsets[2]);
+  status |= clSetKernelArg(kernel, argi++, sizeof(int), &ldc);
+  if (status != CL_SUCCESS) return CL_INVALID_KERNEL_ARGS;
+
+  size_t localWorkSize[2] = {shape.tile, shape.tile};
+  size_t globalWorkSize[2] = {(N + shape.tile - 1) / shape.tile * shape.tile,
+                              (M + shape.tile - 1) / shape.tile * shape.tile};
+  return clEnqueueNDRangeKernel(queue, kernel, 2, NULL, globalWorkSize,
+                                localWorkSize, numEvents,
+                                numEvents ? waitList : NULL, event);
+}
+
+cl_int GemmEngine::multiplyQuantized(cl_command_queue queue, cl_mem A,
+                                     GemmQuant quantA, cl_mem Bt,
+                                     GemmQuant quantB, cl_mem X,
+                                     GemmQuant quantX, unsigned M, unsigned N,
+                                     unsigned K, cl_uint numEvents,
+                                     const cl_event *waitList,
+                                     cl_event *event) {
+  cl_kernel kernel = quantizedKernel;
+  if (!kernel) return CL_INVALID_KERNEL;
+
+  float scale = gemmRequantScale(quantA, quantB, quantX);
+  cl_int status = CL_SUCCESS;
+  unsigned argi = 0;
+  status |= clSetKernelArg(kernel, argi++, sizeof(cl_mem), &A);
+  status |= clSetKernelArg(kernel, argi++, sizeof(cl_mem), &Bt);
+  status |= clSetKernelArg(kernel, argi++, sizeof(cl_mem), &X);
+  status |= clSetKernelArg(kernel, argi++, sizeof(int), &M);
+  status |= clSetKernelArg(kernel, argi++, sizeof(int), &N);
+  status |= clSetKernelArg(kernel, argi++, sizeof(int), &K);
+  status |= clSetKernelArg(kernel, argi++, sizeof(int), &quantA.zeroPoint);
+  status |= clSetKernelArg(kernel, argi++, sizeof(int), &quantB.zeroPoint);
+  status |= clSetKernelArg(kernel, argi++, sizeof(int), &quantX.zeroPoint);
+  status |= clSetKernelArg(kernel, argi++, sizeof(float), &scale);
+  if (status != CL_SUCCESS) return CL_INVALID_KERNEL_ARGS;
+
+  // One output per work-item like the tiled kernel
+  size_t localWorkSize[2] = {shape.tile, shape.tile};
+  size_t globalWorkSize[2] = {(N + shape.tile - 1) / shape.tile * shape.tile,
+                              (M + shape.tile - 1) / shape.tile * shape.tile};
+  return clEnqueueNDRangeKernel(queue, kernel, 2, NULL, globalWorkSize,
+                                localWorkSize, numEvents,
+                                numEvents ? waitList : NULL, event);
+}
+
+// launch enqueues the kernel of the variant, whose arguments are already set,
+// over an M x N result and the given number of multiplications
+cl_int GemmEngine::launch(cl_command_queue queue, GemmVariant variant,
+                          bool batched, unsigned M, unsigned N, unsigned batch,
+                          cl_uint numEvents, const cl_event *waitList,
+                          cl_event *event) {
+  // The ragged edges are handled by the kernels, the global size only has to
+  // cover the result with whole work-groups
+  size_t local[2], block[2];
+  gemmWorkGroup(variant, shape, local);
+  gemmBlock(variant, shape, block);
+  size_t localWorkSize[3] = {local[0], local[1], 1};
+  size_t globalWorkSize[3] = {(N + block[0] - 1) / block[0] * local[0],
+                              (M + block[1] - 1) / block[1] * local[1], batch};
+  cl_kernel kernel = batched ? batchedKernels[variant] : kernels[variant];
+  return clEnqueueNDRangeKernel(queue, kernel, batched ? 3 : 2, NULL,
+                                globalWorkSize, localWorkSize, numEvents,
+                                numEvents ? waitList : NULL, event);
+}
+
+// reserve makes sure buffer holds at least bytes, keeping it when it does
+cl_int GemmEngine::reserve(cl_mem *buffer, size_t *capacity, size_t bytes) {
+  cl_int status = CL_SUCCESS;
+  if (*buffer && *capacity >= bytes) return status;
+  if (*buffer) clReleaseMemObject(*buffer);
+  *buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, bytes, NULL, &status);
+  *capacity = status == CL_SUCCESS ? bytes : 0;
+  if (status != CL_SUCCESS) *buffer = NULL;
+  return status;
+}
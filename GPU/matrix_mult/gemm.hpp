@@ -0,0 +1,167 @@
+#ifndef GEMM_HPP
+#define GEMM_HPP
+
+#include <CL/cl.h>
+#include <stddef.h>
+#include "gemm_quant.hpp"
+
+// Side of the square tiles loaded into local memory by the tiled kernels,
+// passed to matrix_mult.cl as TS. Work-groups are GEMM_TILE x GEMM_TILE.
+#ifndef GEMM_TILE
+#define GEMM_TILE 16
+#endif
+
+// Shape of the register-blocked kernels, passed to matrix_mult.cl as TSM, TSN,
+// TSK, WPTM and WPTN: a work-group computes a GEMM_BLOCK_ROWS x
+// GEMM_BLOCK_COLS block of the result, every work-item a GEMM_WPT_ROWS x
+// GEMM_WPT_COLS micro-tile of it. GEMM_WPT_COLS must be a multiple of 4. The
+// defaults give 8 x 8 work-groups, which fit the work-group size Mali allows
+// for kernels using this many registers. Override them with -D to try other
+// shapes.
+#ifndef GEMM_BLOCK_ROWS
+#define GEMM_BLOCK_ROWS 32
+#endif
+#ifndef GEMM_BLOCK_COLS
+#define GEMM_BLOCK_COLS 32
+#endif
+#ifndef GEMM_BLOCK_DEPTH
+#define GEMM_BLOCK_DEPTH 16
+#endif
+#ifndef GEMM_WPT_ROWS
+#define GEMM_WPT_ROWS 4
+#endif
+#ifndef GEMM_WPT_COLS
+#define GEMM_WPT_COLS 4
+#endif
+
+// GemmVariant selects the kernel used for a multiplication
+enum GemmVariant { GEMM_TILED, GEMM_BLOCKED, GEMM_VARIANTS };
+
+// gemmVariantName returns a printable name for the variant
+const char *gemmVariantName(GemmVariant variant);
+
+// GemmShape is the work decomposition the kernels are compiled for. The
+// tiled kernels use tile x tile work-groups, the blocked ones compute
+// blockRows x blockCols elements per work-group and wptRows x wptCols per
+// work-item.
+struct GemmShape {
+  unsigned tile;
+  unsigned blockRows;
+  unsigned blockCols;
+  unsigned blockDepth;
+  unsigned wptRows;
+  unsigned wptCols;
+};
+
+// The shape set by the GEMM_* defines
+const GemmShape GEMM_DEFAULT_SHAPE = {GEMM_TILE,       GEMM_BLOCK_ROWS,
+                                      GEMM_BLOCK_COLS, GEMM_BLOCK_DEPTH,
+                                      GEMM_WPT_ROWS,   GEMM_WPT_COLS};
+
+// gemmBuildOptions writes the options matrix_mult.cl has to be built with
+void gemmBuildOptions(char *options, size_t length,
+                      const GemmShape &shape = GEMM_DEFAULT_SHAPE);
+
+// gemmWorkGroup returns the work-group size of the variant for the shape.
+// Dimension 0 runs along the columns of the result, dimension 1 along its
+// rows.
+void gemmWorkGroup(GemmVariant variant, const GemmShape &shape,
+                   size_t local[2]);
+
+// GemmEngine launches the GEMM kernels of a program built from matrix_mult.cl
+// with the gemmBuildOptions of the same shape. Matrices are row major and
+// dense, except for sgemm; M, N and K can be anything. The engine keeps its
+// own kernel instances and host staging buffers, so it must not be used by
+// several threads at once: give each thread its own engine.
+class GemmEngine {
+ public:
+  GemmEngine(cl_context context, cl_device_id device, cl_program program,
+             const GemmShape &shape = GEMM_DEFAULT_SHAPE);
+  ~GemmEngine();
+
+  // supports tells whether the device can run the variant with the compiled
+  // work-group shape
+  bool supports(GemmVariant variant);
+
+  // multiply enqueues X = A * B for an M x K matrix A and a K x N matrix B in
+  // device buffers
+  cl_int multiply(cl_command_queue queue, GemmVariant variant, cl_mem A,
+                  cl_mem B, cl_mem X, unsigned M, unsigned N, unsigned K,
+                  cl_uint numEvents, const cl_event *waitList,
+                  cl_event *event);
+
+  // multiplyBatched enqueues X[i] = A[i] * B[i] for i < batch as a single
+  // NDRange, with the batch index in dimension 2. Strided layout: matrix i of
+  // A starts at element i * strideA of the buffer, and likewise for B and X. A
+  // stride of 0 uses the same matrix for the whole batch.
+  cl_int multiplyBatched(cl_command_queue queue, GemmVariant variant, cl_mem A,
+                         size_t strideA, cl_mem B, size_t strideB, cl_mem X,
+                         size_t strideX, unsigned M, unsigned N, unsigned K,
+                         unsigned batch, cl_uint numEvents,
+                         const cl_event *waitList, cl_event *event);
+
+  // multiplyBatched with the pointer array layout: offsets is a device buffer
+  // of 3 * batch ints, the element offsets of A[i], B[i] and X[i] in A, B and X
+  cl_int multiplyBatched(cl_command_queue queue, GemmVariant variant, cl_mem A,
+                         cl_mem B, cl_mem X, cl_mem offsets, unsigned M,
+                         unsigned N, unsigned K, unsigned batch,
+                         cl_uint numEvents, const cl_event *waitList,
+                         cl_event *event);
+
+  // multiplyBatched on host matrices: A[i], B[i] and X[i] point to separate
+  // matrices. They are gathered into device buffers that are kept from one
+  // call to the next, multiplied in one NDRange and scattered back. Blocks
+  // until X holds the results.
+  cl_int multiplyBatched(cl_command_queue queue, GemmVariant variant,
+                         const float *const *A, const float *const *B,
+                         float *const *X, unsigned M, unsigned N, unsigned K,
+                         unsigned batch);
+
+  // sgemm enqueues C = alpha * op(A) * op(B) + beta * C with the arguments of
+  // BLAS sgemm (see cpuSgemm) on row major device matrices: transA and transB
+  // are 'N' or 'T', and A, B and C start at element offA, offB and offC of
+  // their buffers with rows lda, ldb and ldc elements apart, so submatrices
+  // are multiplied in place. Each transpose combination has its own kernel,
+  // transposed operands are never copied. Uses the tiled shape. Nothing is
+  // computed when M or N is 0, but event is still set. Returns
+  // CL_INVALID_VALUE for an invalid flag or leading dimension.
+  cl_int sgemm(cl_command_queue queue, char transA, char transB, unsigned M,
+               unsigned N, unsigned K, float alpha, cl_mem A, size_t offA,
+               unsigned lda, cl_mem B, size_t offB, unsigned ldb, float beta,
+               cl_mem C, size_t offC, unsigned ldc, cl_uint numEvents,
+               const cl_event *waitList, cl_event *event);
+
+  // multiplyQuantized enqueues the int8 product X = A * B of an M x K matrix
+  // A and a K x N matrix B given transposed (Bt is N x K), with int32
+  // accumulation and the result requantized to quantX. Uses the tiled shape.
+  cl_int multiplyQuantized(cl_command_queue queue, cl_mem A, GemmQuant quantA,
+                           cl_mem Bt, GemmQuant quantB, cl_mem X,
+                           GemmQuant quantX, unsigned M, unsigned N,
+                           unsigned K, cl_uint numEvents,
+                           const cl_event *waitList, cl_event *event);
+
+ private:
+  GemmEngine(const GemmEngine &);
+  GemmEngine &operator=(const GemmEngine &);
+
+  cl_int launch(cl_command_queue queue, GemmVariant variant, bool batched,
+                unsigned M, unsigned N, unsigned batch, cl_uint numEvents,
+                const cl_event *waitList, cl_event *event);
+  cl_int reserve(cl_mem *buffer, size_t *capacity, size_t bytes);
+
+  cl_context context;
+  cl_device_id device;
+  GemmShape shape;
+  cl_kernel kernels[GEMM_VARIANTS];
+  cl_kernel batchedKernels[GEMM_VARIANTS];
+  cl_kernel quantizedKernel;
+  cl_kernel sgemmKernels[4];  // indexed by 2 * transA + transB
+  cl_mem stagingA;  // device copies of the host matrices of multiplyBatched
+  cl_mem stagingB;
+  cl_mem stagingX;
+  size_t capacityA;  // bytes allocated in the staging buffers
+  size_t capacityB;
+  size_t capacityX;
+};
+
+#endif  // GEMM_HPP
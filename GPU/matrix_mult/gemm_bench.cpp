@@ -0,0 +1,283 @@
+#include "gemm_bench.hpp"
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <chrono>
+#include <string>
+#include "common/philox.hpp"
+#include "cpu_gemm.hpp"
+#include "gemm.hpp"
+
+using namespace std;
+
+#define NAME_BUFFER_LEN 1024
+
+// SWEEP_SEED seeds the Philox streams of A, and of B with SWEEP_SEED + 1
+#define SWEEP_SEED 2018
+
+// SweepCase is a kernel variant compiled for a work-group shape
+struct SweepCase {
+  GemmVariant variant;
+  GemmShape shape;
+};
+
+// The shapes the sweep compares. Blocked shapes with more than 64 work-items
+// may be refused by Mali because of their register usage, they are then
+// skipped.
+const SweepCase SWEEP_CASES[] = {
+    {GEMM_TILED, {8, 32, 32, 16, 4, 4}},
+    {GEMM_TILED, {16, 32, 32, 16, 4, 4}},
+    {GEMM_BLOCKED, {16, 32, 32, 16, 4, 4}},
+    {GEMM_BLOCKED, {16, 32, 64, 16, 4, 8}},
+    {GEMM_BLOCKED, {16, 64, 64, 16, 8, 4}},
+};
+
+// SweepStats summarises the repetitions of a measurement, in milliseconds
+struct SweepStats {
+  double mean;
+  double stddev;
+  double min;
+};
+
+// private non-exported function declarations
+SweepStats sweepStats(const vector<double> &samples);
+double eventMillis(cl_event event);
+string jsonString(const char *text);
+void writeStats(FILE *fp, const char *name, const SweepStats &stats);
+bool sweepVerify(const float *reference, const float *actual, unsigned M,
+                 unsigned N, unsigned K);
+
+SweepStats sweepStats(const vector<double> &samples) {
+  SweepStats stats = {0, 0, samples.empty() ? 0 : samples[0]};
+  for (unsigned i = 0; i < samples.size(); i++) {
+    stats.mean += samples[i] / samples.size();
+    if (samples[i] < stats.min) stats.min = samples[i];
+  }
+  for (unsigned i = 0; i < samples.size() && samples.size() > 1; i++) {
+    double diff = samples[i] - stats.mean;
+    stats.stddev += diff * diff / (samples.size() - 1);
+  }
+  stats.stddev = sqrt(stats.stddev);
+  return stats;
+}
+
+// eventMillis returns how long a profiled command ran on the device
+double eventMillis(cl_event event) {
+  cl_ulong start = 0, end = 0;
+  clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(start),
+                          &start, NULL);
+  clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(end), &end,
+                          NULL);
+  return (end - start) * 1.0e-6;
+}
+
+// jsonString quotes text as a JSON string
+string jsonString(const char *text) {
+  string quoted = "\"";
+  for (; *text; text++) {
+    if (*text == '"' || *text == '\\') quoted += '\\';
+    if ((unsigned char)*text >= 0x20) quoted += *text;
+  }
+  return quoted + "\"";
+}
+
+void writeStats(FILE *fp, const char *name, const SweepStats &stats) {
+  fprintf(fp, "\"%s\": {\"mean\": %.4f, \"stddev\": %.4f, \"min\": %.4f}",
+          name, stats.mean, stats.stddev, stats.min);
+}
+
+// sweepVerify compares a result with the CPU one. The order of the additions
+// differs between the implementations, so the error is bounded relative to
+// the largest element and grows with K.
+bool sweepVerify(const float *reference, const float *actual, unsigned M,
+                 unsigned N, unsigned K) {
+  float largest = 0.0f, error = 0.0f;
+  for (unsigned i = 0; i < M * N; i++) {
+    largest = fmaxf(largest, fabsf(reference[i]));
+    error = fmaxf(error, fabsf(reference[i] - actual[i]));
+  }
+  return error <= 4.0f * K * FLT_EPSILON * fmaxf(largest, 1.0f);
+}
+
+int gemmSweep(cl_context context, cl_device_id device, const char *source,
+              const GemmSweepConfig &config) {
+  const unsigned cases = sizeof(SWEEP_CASES) / sizeof(SweepCase);
+  char name[NAME_BUFFER_LEN];
+  char options[NAME_BUFFER_LEN];
+  int status;
+
+  FILE *fp = fopen(config.output, "w");
+  if (!fp) {
+    printf("Could not open %s for writing\n", config.output);
+    return 1;
+  }
+
+  // Timestamps are only available on a profiling queue
+  cl_command_queue queue = clCreateCommandQueue(
+      context, device, CL_QUEUE_PROFILING_ENABLE, &status);
+  if (status != CL_SUCCESS) {
+    printf("Failed to create a profiling command queue\n");
+    fclose(fp);
+    return 1;
+  }
+
+  // One program per shape, as the shape is compiled into the kernels
+  cl_program programs[cases];
+  GemmEngine *engines[cases];
+  for (unsigned c = 0; c < cases; c++) {
+    programs[c] =
+        clCreateProgramWithSource(context, 1, &source, NULL, &status);
+    gemmBuildOptions(options, NAME_BUFFER_LEN, SWEEP_CASES[c].shape);
+    status = clBuildProgram(programs[c], 0, NULL, options, NULL, NULL);
+    engines[c] = NULL;
+    if (status != CL_SUCCESS) {
+      printf("Failed to build matrix_mult.cl with %s\n", options);
+      continue;
+    }
+    engines[c] =
+        new GemmEngine(context, device, programs[c], SWEEP_CASES[c].shape);
+    if (!engines[c]->supports(SWEEP_CASES[c].variant)) {
+      printf("Skipping %s with %s: work-group too large for the device\n",
+             gemmVariantName(SWEEP_CASES[c].variant), options);
+      delete engines[c];
+      engines[c] = NULL;
+    }
+  }
+
+  clGetDeviceInfo(device, CL_DEVICE_NAME, NAME_BUFFER_LEN, name, NULL);
+  ThreadPool pool(config.threads);
+  fprintf(fp, "{\n  \"device\": %s,\n", jsonString(name).c_str());
+  fprintf(fp, "  \"cpu_threads\": %u,\n", pool.size());
+  fprintf(fp, "  \"repetitions\": %u,\n", config.repetitions);
+  fprintf(fp, "  \"results\": [");
+
+  bool first = true;
+  int failures = 0;
+  unsigned count = config.sizes.size();
+  unsigned combinations = config.full ? count * count * count : count;
+  for (unsigned s = 0; s < combinations; s++) {
+    unsigned M = config.sizes[config.full ? s / (count * count) : s];
+    unsigned N = config.sizes[config.full ? s / count % count : s];
+    unsigned K = config.sizes[config.full ? s % count : s];
+    size_t bytesA = (size_t)M * K * sizeof(float);
+    size_t bytesB = (size_t)K * N * sizeof(float);
+    size_t bytesX = (size_t)M * N * sizeof(float);
+    double flops = 2.0 * M * N * K;
+    double kernelBytes = bytesA + bytesB + bytesX;
+
+    vector<float> A(M * K), B(K * N), X(M * N), reference(M * N);
+    cpuPhiloxUniform(SWEEP_SEED, 0, A.data(), A.size(), -1.0f, 1.0f, &pool);
+    cpuPhiloxUniform(SWEEP_SEED + 1, 0, B.data(), B.size(), -1.0f, 1.0f,
+                     &pool);
+
+    // The CPU run is timed on the host clock and gives the reference
+    vector<double> cpuTimes;
+    for (unsigned r = 0; r <= config.repetitions; r++) {
+      auto start = chrono::high_resolution_clock::now();
+      cpuGemm(A.data(), B.data(), reference.data(), M, N, K, &pool);
+      chrono::duration<double, milli> elapsed =
+          chrono::high_resolution_clock::now() - start;
+      if (r > 0) cpuTimes.push_back(elapsed.count());
+    }
+    SweepStats cpu = sweepStats(cpuTimes);
+    fprintf(fp, "%s\n    {\"variant\": \"cpu\", \"M\": %u, \"N\": %u, "
+            "\"K\": %u, ", first ? "" : ",", M, N, K);
+    writeStats(fp, "kernel_ms", cpu);
+    fprintf(fp, ", \"gflops\": %.3f, \"verified\": true}",
+            flops / cpu.mean * 1.0e-6);
+    first = false;
+    printf("%4ux%4ux%4u cpu             %9.3f ms %8.3f GFLOPS\n", M, N, K,
+           cpu.mean, flops / cpu.mean * 1.0e-6);
+
+    int statusA, statusB;
+    cl_mem bufferA = clCreateBuffer(context, CL_MEM_READ_ONLY, bytesA, NULL,
+                                    &statusA);
+    cl_mem bufferB = clCreateBuffer(context, CL_MEM_READ_ONLY, bytesB, NULL,
+                                    &statusB);
+    cl_mem bufferX = clCreateBuffer(context, CL_MEM_WRITE_ONLY, bytesX, NULL,
+                                    &status);
+    if (statusA != CL_SUCCESS) status = statusA;
+    if (statusB != CL_SUCCESS) status = statusB;
+    if (status != CL_SUCCESS) {
+      printf("Failed to allocate the buffers for %ux%ux%u\n", M, N, K);
+      failures++;
+    }
+
+    for (unsigned c = 0; c < cases && status == CL_SUCCESS; c++) {
+      if (!engines[c]) continue;
+      GemmVariant variant = SWEEP_CASES[c].variant;
+      size_t local[2];
+      gemmWorkGroup(variant, SWEEP_CASES[c].shape, local);
+
+      vector<double> writeTimes, kernelTimes, readTimes;
+      for (unsigned r = 0; r <= config.repetitions && status == CL_SUCCESS;
+           r++) {
+        cl_event events[4];
+        clEnqueueWriteBuffer(queue, bufferA, CL_FALSE, 0, bytesA, A.data(), 0,
+                             NULL, &events[0]);
+        clEnqueueWriteBuffer(queue, bufferB, CL_FALSE, 0, bytesB, B.data(), 0,
+                             NULL, &events[1]);
+        status = engines[c]->multiply(queue, variant, bufferA, bufferB,
+                                      bufferX, M, N, K, 2, events, &events[2]);
+        if (status != CL_SUCCESS) {
+          clFinish(queue);
+          clReleaseEvent(events[0]);
+          clReleaseEvent(events[1]);
+          break;
+        }
+        clEnqueueReadBuffer(queue, bufferX, CL_TRUE, 0, bytesX, X.data(), 1,
+                            &events[2], &events[3]);
+        if (r > 0) {
+          writeTimes.push_back(eventMillis(events[0]) +
+                               eventMillis(events[1]));
+          kernelTimes.push_back(eventMillis(events[2]));
+          readTimes.push_back(eventMillis(events[3]));
+        }
+        for (int e = 0; e < 4; e++) clReleaseEvent(events[e]);
+      }
+      if (status != CL_SUCCESS) {
+        printf("Failed to launch the %s kernel\n", gemmVariantName(variant));
+        failures++;
+        break;
+      }
+
+      bool verified = sweepVerify(reference.data(), X.data(), M, N, K);
+      if (!verified) failures++;
+      SweepStats write = sweepStats(writeTimes);
+      SweepStats kernel = sweepStats(kernelTimes);
+      SweepStats read = sweepStats(readTimes);
+      fprintf(fp, ",\n    {\"variant\": \"%s\", \"M\": %u, \"N\": %u, "
+              "\"K\": %u, \"local\": [%u, %u], ", gemmVariantName(variant),
+              M, N, K, (unsigned)local[0], (unsigned)local[1]);
+      writeStats(fp, "write_ms", write);
+      fprintf(fp, ", ");
+      writeStats(fp, "kernel_ms", kernel);
+      fprintf(fp, ", ");
+      writeStats(fp, "read_ms", read);
+      fprintf(fp, ", \"gflops\": %.3f, \"kernel_gbs\": %.3f, "
+              "\"transfer_gbs\": %.3f, \"verified\": %s}",
+              flops / kernel.mean * 1.0e-6, kernelBytes / kernel.mean * 1.0e-6,
+              kernelBytes / (write.mean + read.mean) * 1.0e-6,
+              verified ? "true" : "false");
+      printf("%4ux%4ux%4u %-7s %2ux%-2u  %9.3f ms %8.3f GFLOPS%s\n", M, N, K,
+             gemmVariantName(variant), (unsigned)local[0], (unsigned)local[1],
+             kernel.mean, flops / kernel.mean * 1.0e-6,
+             verified ? "" : " FAILED VERIFICATION");
+    }
+
+    cl_mem buffers[] = {bufferA, bufferB, bufferX};
+    for (unsigned i = 0; i < sizeof(buffers) / sizeof(cl_mem); i++) {
+      if (buffers[i]) clReleaseMemObject(buffers[i]);
+    }
+  }
+  fprintf(fp, "\n  ]\n}\n");
+  fclose(fp);
+
+  for (unsigned c = 0; c < cases; c++) {
+    delete engines[c];
+    if (programs[c]) clReleaseProgram(programs[c]);
+  }
+  clReleaseCommandQueue(queue);
+  printf("Wrote %s\n", config.output);
+  return failures == 0 && status == CL_SUCCESS ? 0 : 1;
+}
@@ -0,0 +1,29 @@
+#ifndef GEMM_BENCH_HPP
+#define GEMM_BENCH_HPP
+
+#include <CL/cl.h>
+#include <vector>
+
+// GemmSweepConfig selects what gemmSweep measures
+struct GemmSweepConfig {
+  GemmSweepConfig()
+      : sizes(), full(false), repetitions(5), threads(0), output(NULL) {}
+  GemmSweepConfig(const GemmSweepConfig &) = default;
+  GemmSweepConfig &operator=(const GemmSweepConfig &) = default;
+
+  std::vector<unsigned> sizes;  // values of M, N and K
+  bool full;             // every M x N x K combination instead of M = N = K
+  unsigned repetitions;  // timed runs of every case, after one warm-up run
+  unsigned threads;      // threads of the CPU runs, 0 for one per core
+  const char *output;    // path of the JSON report
+};
+
+// gemmSweep times the CPU GEMM and every GPU kernel variant and work-group
+// shape over the configured sizes, and writes a JSON report to
+// config.output. GPU times come from event profiling, so transfers and
+// kernel execution are reported separately. Every result is verified against
+// the CPU. source is the text of matrix_mult.cl. Returns 0 on success.
+int gemmSweep(cl_context context, cl_device_id device, const char *source,
+              const GemmSweepConfig &config);
+
+#endif  // GEMM_BENCH_HPP
@@ -0,0 +1,236 @@
+#include "gemm_multi.hpp"
+#include <stdio.h>
+#include "common/philox.hpp"
+
+using namespace std;
+
+#define NAME_BUFFER_LEN 1024
+
+// CALIBRATION_SEED seeds the Philox streams of the calibration inputs
+#define CALIBRATION_SEED 2018
+
+GemmMulti::GemmMulti(const char *source, GemmVariant variant,
+                     const GemmShape &shape)
+    : shape(shape),
+      names(),
+      contexts(),
+      queues(),
+      programs(),
+      engines(),
+      pools(),
+      variants(),
+      throughputs(),
+      rowsPerDevice() {
+  cl_uint numPlatforms = 0;
+  clGetPlatformIDs(0, NULL, &numPlatforms);
+  vector<cl_platform_id> platforms(numPlatforms);
+  if (numPlatforms) clGetPlatformIDs(numPlatforms, platforms.data(), NULL);
+
+  for (unsigned p = 0; p < numPlatforms; p++) {
+    cl_uint numDevices = 0;
+    clGetDeviceIDs(platforms[p], CL_DEVICE_TYPE_ALL, 0, NULL, &numDevices);
+    vector<cl_device_id> devices(numDevices);
+    if (numDevices == 0) continue;
+    clGetDeviceIDs(platforms[p], CL_DEVICE_TYPE_ALL, numDevices,
+                   devices.data(), NULL);
+    for (unsigned d = 0; d < numDevices; d++) {
+      addDevice(platforms[p], devices[d], source, variant);
+    }
+  }
+}
+
+GemmMulti::~GemmMulti() {
+  for (unsigned i = 0; i < size(); i++) {
+    delete engines[i];
+    delete pools[i];
+    clReleaseProgram(programs[i]);
+    clReleaseCommandQueue(queues[i]);
+    clReleaseContext(contexts[i]);
+  }
+}
+
+unsigned GemmMulti::size() const { return names.size(); }
+
+const char *GemmMulti::name(unsigned i) const { return names[i].c_str(); }
+
+GemmVariant GemmMulti::variant(unsigned i) const { return variants[i]; }
+
+double GemmMulti::throughput(unsigned i) const { return throughputs[i]; }
+
+unsigned GemmMulti::rows(unsigned i) const { return rowsPerDevice[i]; }
+
+cl_int GemmMulti::calibrate(unsigned size, ThreadPool *pool) {
+  vector<float> A((size_t)size * size), B((size_t)size * size),
+      X((size_t)size * size);
+  cpuPhiloxUniform(CALIBRATION_SEED, 0, A.data(), A.size(), -1.0f, 1.0f, pool);
+  cpuPhiloxUniform(CALIBRATION_SEED + 1, 0, B.data(), B.size(), -1.0f, 1.0f,
+                   pool);
+
+  // Every device runs alone, once to warm up and once timed
+  cl_int status = CL_SUCCESS;
+  for (unsigned d = 0; d < this->size() && status == CL_SUCCESS; d++) {
+    for (unsigned i = 0; i < this->size(); i++) {
+      rowsPerDevice[i] = i == d ? size : 0;
+    }
+    for (unsigned r = 0; r < 2 && status == CL_SUCCESS; r++) {
+      status = run(A.data(), B.data(), X.data(), size, size, size);
+    }
+  }
+  return status;
+}
+
+cl_int GemmMulti::multiply(const float *A, const float *B, float *X,
+                           unsigned M, unsigned N, unsigned K) {
+  if (size() == 0) return CL_DEVICE_NOT_FOUND;
+  partition(M);
+  return run(A, B, X, M, N, K);
+}
+
+// addDevice creates the objects of a device and adds it to the list when it
+// can run one of the kernels
+void GemmMulti::addDevice(cl_platform_id platform, cl_device_id device,
+                          const char *source, GemmVariant variant) {
+  char name[NAME_BUFFER_LEN];
+  char options[NAME_BUFFER_LEN];
+  cl_int status;
+  clGetDeviceInfo(device, CL_DEVICE_NAME, NAME_BUFFER_LEN, name, NULL);
+
+  // Devices of different platforms cannot share a context
+  cl_context_properties properties[] = {CL_CONTEXT_PLATFORM,
+                                        (cl_context_properties)platform, 0};
+  cl_context context =
+      clCreateContext(properties, 1, &device, NULL, NULL, &status);
+  if (status != CL_SUCCESS) {
+    printf("Skipping %s: failed to create a context\n", name);
+    return;
+  }
+  // Timestamps are only available on a profiling queue
+  cl_command_queue queue = clCreateCommandQueue(
+      context, device, CL_QUEUE_PROFILING_ENABLE, &status);
+  cl_program program = NULL;
+  if (status == CL_SUCCESS) {
+    program = clCreateProgramWithSource(context, 1, &source, NULL, &status);
+  }
+  if (status == CL_SUCCESS) {
+    gemmBuildOptions(options, NAME_BUFFER_LEN, shape);
+    status = clBuildProgram(program, 1, &device, options, NULL, NULL);
+  }
+
+  GemmEngine *engine = NULL;
+  if (status == CL_SUCCESS) {
+    engine = new GemmEngine(context, device, program, shape);
+    if (!engine->supports(variant)) variant = GEMM_TILED;
+    if (!engine->supports(variant)) status = CL_INVALID_WORK_GROUP_SIZE;
+  }
+  if (status != CL_SUCCESS) {
+    printf("Skipping %s: cannot run the kernels\n", name);
+    delete engine;
+    if (program) clReleaseProgram(program);
+    if (queue) clReleaseCommandQueue(queue);
+    clReleaseContext(context);
+    return;
+  }
+
+  names.push_back(name);
+  contexts.push_back(context);
+  queues.push_back(queue);
+  programs.push_back(program);
+  engines.push_back(engine);
+  pools.push_back(new BufferPool(context));
+  variants.push_back(variant);
+  throughputs.push_back(1.0);  // equal shares until measured
+  rowsPerDevice.push_back(0);
+}
+
+// partition divides M rows in multiples of GEMM_MULTI_ROWS in proportion to
+// the throughputs. The rows left by the rounding go to the fastest device.
+void GemmMulti::partition(unsigned M) {
+  double total = 0.0;
+  unsigned fastest = 0;
+  for (unsigned i = 0; i < size(); i++) {
+    total += throughputs[i];
+    if (throughputs[i] > throughputs[fastest]) fastest = i;
+  }
+  unsigned assigned = 0;
+  for (unsigned i = 0; i < size(); i++) {
+    unsigned share = (unsigned)(M * throughputs[i] / total);
+    rowsPerDevice[i] = share / GEMM_MULTI_ROWS * GEMM_MULTI_ROWS;
+    assigned += rowsPerDevice[i];
+  }
+  rowsPerDevice[fastest] += M - assigned;
+}
+
+// run multiplies rowsPerDevice[i] rows of A on every device i, the devices
+// taking consecutive rows, and measures their throughput
+cl_int GemmMulti::run(const float *A, const float *B, float *X, unsigned M,
+                      unsigned N, unsigned K) {
+  cl_int result = CL_SUCCESS;
+  vector<cl_mem> buffers(3 * size(), (cl_mem)NULL);
+  vector<cl_event> events(4 * size(), (cl_event)NULL);
+  unsigned first = 0;
+  for (unsigned i = 0; i < size(); i++) {
+    unsigned rows = rowsPerDevice[i];
+    if (rows == 0) continue;
+    cl_int status = CL_SUCCESS;
+    cl_mem *buffer = &buffers[3 * i];
+    cl_event *event = &events[4 * i];
+    size_t bytesA = (size_t)rows * K * sizeof(float);
+    size_t bytesB = (size_t)K * N * sizeof(float);
+    size_t bytesX = (size_t)rows * N * sizeof(float);
+    buffer[0] = pools[i]->acquire(bytesA, &status);
+    if (status == CL_SUCCESS) buffer[1] = pools[i]->acquire(bytesB, &status);
+    if (status == CL_SUCCESS) buffer[2] = pools[i]->acquire(bytesX, &status);
+
+    if (status == CL_SUCCESS) {
+      status = clEnqueueWriteBuffer(queues[i], buffer[0], CL_FALSE, 0, bytesA,
+                                    A + (size_t)first * K, 0, NULL, &event[0]);
+    }
+    if (status == CL_SUCCESS) {
+      status = clEnqueueWriteBuffer(queues[i], buffer[1], CL_FALSE, 0, bytesB,
+                                    B, 0, NULL, &event[1]);
+    }
+    if (status == CL_SUCCESS) {
+      status = engines[i]->multiply(queues[i], variants[i], buffer[0],
+                                    buffer[1], buffer[2], rows, N, K, 2, event,
+                                    &event[2]);
+    }
+    if (status == CL_SUCCESS) {
+      status = clEnqueueReadBuffer(queues[i], buffer[2], CL_FALSE, 0, bytesX,
+                                   X + (size_t)first * N, 1, &event[2],
+                                   &event[3]);
+    }
+    // Start this device before enqueueing the work of the next one
+    clFlush(queues[i]);
+    if (status != CL_SUCCESS) {
+      printf("Failed to enqueue the multiplication on %s\n", name(i));
+      result = status;
+    }
+    first += rows;
+  }
+
+  // Wait for every device, even after a failure, before releasing the
+  // buffers and handing X back
+  for (unsigned i = 0; i < size(); i++) {
+    if (rowsPerDevice[i]) clFinish(queues[i]);
+  }
+  for (unsigned i = 0; i < size(); i++) {
+    cl_event *event = &events[4 * i];
+    if (result == CL_SUCCESS && rowsPerDevice[i]) {
+      cl_ulong start = 0, end = 0;
+      clGetEventProfilingInfo(event[0], CL_PROFILING_COMMAND_START,
+                              sizeof(start), &start, NULL);
+      clGetEventProfilingInfo(event[3], CL_PROFILING_COMMAND_END, sizeof(end),
+                              &end, NULL);
+      if (end > start) {
+        throughputs[i] = 2.0 * rowsPerDevice[i] * N * K / (end - start);
+      }
+    }
+    for (unsigned e = 0; e < 4; e++) {
+      if (event[e]) clReleaseEvent(event[e]);
+    }
+    for (unsigned b = 0; b < 3; b++) {
+      if (buffers[3 * i + b]) pools[i]->release(buffers[3 * i + b]);
+    }
+  }
+  return result;
+}
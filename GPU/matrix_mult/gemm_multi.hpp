@@ -0,0 +1,90 @@
+#ifndef GEMM_MULTI_HPP
+#define GEMM_MULTI_HPP
+
+#include <CL/cl.h>
+#include <string>
+#include <vector>
+#include "buffer_pool.hpp"
+#include "common/thread_pool.hpp"
+#include "gemm.hpp"
+
+// Rows of the result given to a device are a multiple of this, so that every
+// device gets whole work-groups of the kernels
+#ifndef GEMM_MULTI_ROWS
+#define GEMM_MULTI_ROWS 32
+#endif
+
+// Side of the square multiplication timed on every device by calibrate
+#ifndef GEMM_MULTI_CALIBRATION
+#define GEMM_MULTI_CALIBRATION 256
+#endif
+
+// GemmMulti splits a multiplication over every OpenCL device of every
+// platform, the Mali GPU and a CPU runtime for instance. Each device has its
+// own context, profiling queue, program and engine, like the per-device
+// objects of the FPGA vector_add host. The rows of the result are divided in
+// proportion to the throughput of the devices: every device receives its rows
+// of A and the whole of B, computes its rows of X and sends them back, all
+// devices running at the same time. The throughputs are measured by calibrate
+// and updated after every multiply from the event timestamps, so the
+// partition follows the devices as their load changes.
+class GemmMulti {
+ public:
+  // GemmMulti builds source (matrix_mult.cl) for every device. Devices that
+  // cannot build it or run the variant with the shape fall back to the tiled
+  // kernel, or are left out.
+  GemmMulti(const char *source, GemmVariant variant,
+            const GemmShape &shape = GEMM_DEFAULT_SHAPE);
+  ~GemmMulti();
+
+  // size returns the number of devices used
+  unsigned size() const;
+
+  // name returns the name of device i
+  const char *name(unsigned i) const;
+
+  // variant returns the kernel variant run by device i
+  GemmVariant variant(unsigned i) const;
+
+  // throughput returns the last measured GFLOPS of device i, transfers
+  // included
+  double throughput(unsigned i) const;
+
+  // rows returns the rows of the result computed by device i in the last
+  // multiply
+  unsigned rows(unsigned i) const;
+
+  // calibrate times a size x size multiplication alone on every device. The
+  // random inputs are generated across the threads of pool.
+  cl_int calibrate(unsigned size = GEMM_MULTI_CALIBRATION,
+                   ThreadPool *pool = NULL);
+
+  // multiply computes X = A * B for an M x K host matrix A and a K x N host
+  // matrix B over all the devices. Blocks until X holds the result.
+  cl_int multiply(const float *A, const float *B, float *X, unsigned M,
+                  unsigned N, unsigned K);
+
+ private:
+  GemmMulti(const GemmMulti &);
+  GemmMulti &operator=(const GemmMulti &);
+
+  void addDevice(cl_platform_id platform, cl_device_id device,
+                 const char *source, GemmVariant variant);
+  void partition(unsigned M);
+  cl_int run(const float *A, const float *B, float *X, unsigned M, unsigned N,
+             unsigned K);
+
+  GemmShape shape;
+  // Per-device objects
+  std::vector<std::string> names;
+  std::vector<cl_context> contexts;
+  std::vector<cl_command_queue> queues;
+  std::vector<cl_program> programs;
+  std::vector<GemmEngine *> engines;
+  std::vector<BufferPool *> pools;
+  std::vector<GemmVariant> variants;
+  std::vector<double> throughputs;  // GFLOPS
+  std::vector<unsigned> rowsPerDevice;
+};
+
+#endif  // GEMM_MULTI_HPP
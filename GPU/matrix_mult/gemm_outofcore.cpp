@@ -0,0 +1,209 @@
+#include "gemm_outofcore.hpp"
+#include <stdio.h>
+#include <algorithm>
+
+using namespace std;
+
+// Panels on the device at the same time, see GemmOutOfCore
+#define OUTOFCORE_PANELS 7
+
+unsigned gemmPanelSize(cl_device_id device) {
+  cl_ulong globalBytes = 0, allocBytes = 0;
+  clGetDeviceInfo(device, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(globalBytes),
+                  &globalBytes, NULL);
+  clGetDeviceInfo(device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(allocBytes),
+                  &allocBytes, NULL);
+  unsigned panel = 256;
+  for (;;) {
+    cl_ulong bytes = (cl_ulong)(panel + 256) * (panel + 256) * sizeof(float);
+    if (bytes > allocBytes || OUTOFCORE_PANELS * bytes > globalBytes / 2) {
+      return panel;
+    }
+    panel += 256;
+  }
+}
+
+GemmOutOfCore::GemmOutOfCore(cl_context context, cl_device_id device,
+                             cl_program program, GemmEngine *engine,
+                             GemmVariant variant, unsigned panel)
+    : engine(engine),
+      variant(variant),
+      panelSize(panel ? panel : gemmPanelSize(device)),
+      addKernel(NULL),
+      uploadQueue(NULL),
+      computeQueue(NULL),
+      downloadQueue(NULL),
+      panelsA(),
+      panelsB(),
+      blocksX(),
+      product(NULL) {
+  int status;
+  addKernel = clCreateKernel(program, "matrix_add", &status);
+  if (status != CL_SUCCESS) {
+    printf("Failed to create matrix_add kernel\n");
+    addKernel = NULL;
+  }
+  uploadQueue = clCreateCommandQueue(context, device, 0, NULL);
+  computeQueue = clCreateCommandQueue(context, device, 0, NULL);
+  downloadQueue = clCreateCommandQueue(context, device, 0, NULL);
+
+  size_t bytes = (size_t)panelSize * panelSize * sizeof(float);
+  cl_mem *buffers[OUTOFCORE_PANELS] = {&panelsA[0], &panelsA[1], &panelsB[0],
+                                       &panelsB[1], &blocksX[0], &blocksX[1],
+                                       &product};
+  for (unsigned i = 0; i < OUTOFCORE_PANELS; i++) {
+    *buffers[i] =
+        clCreateBuffer(context, CL_MEM_READ_WRITE, bytes, NULL, &status);
+    if (status != CL_SUCCESS) {
+      printf("Failed to allocate the %ux%u panels\n", panelSize, panelSize);
+      *buffers[i] = NULL;
+    }
+  }
+}
+
+GemmOutOfCore::~GemmOutOfCore() {
+  cl_mem buffers[OUTOFCORE_PANELS] = {panelsA[0], panelsA[1], panelsB[0],
+                                      panelsB[1], blocksX[0], blocksX[1],
+                                      product};
+  for (unsigned i = 0; i < OUTOFCORE_PANELS; i++) {
+    if (buffers[i]) clReleaseMemObject(buffers[i]);
+  }
+  cl_command_queue queues[] = {uploadQueue, computeQueue, downloadQueue};
+  for (unsigned i = 0; i < sizeof(queues) / sizeof(cl_command_queue); i++) {
+    if (queues[i]) clReleaseCommandQueue(queues[i]);
+  }
+  if (addKernel) clReleaseKernel(addKernel);
+}
+
+unsigned GemmOutOfCore::panel() const { return panelSize; }
+
+cl_int GemmOutOfCore::multiply(const float *A, const float *B, float *X,
+                               unsigned M, unsigned N, unsigned K) {
+  if (!addKernel) return CL_INVALID_KERNEL;
+  cl_mem buffers[OUTOFCORE_PANELS] = {panelsA[0], panelsA[1], panelsB[0],
+                                      panelsB[1], blocksX[0], blocksX[1],
+                                      product};
+  for (unsigned i = 0; i < OUTOFCORE_PANELS; i++) {
+    if (!buffers[i]) return CL_MEM_OBJECT_ALLOCATION_FAILURE;
+  }
+
+  // The slots of the doubled buffers are free once these events complete:
+  // the last kernel reading an input slot, the last read of an output slot
+  cl_event inputFree[2] = {NULL, NULL};
+  cl_event outputFree[2] = {NULL, NULL};
+  cl_int status = CL_SUCCESS;
+  unsigned step = 0, block = 0;
+  for (unsigned row = 0; row < M && status == CL_SUCCESS; row += panelSize) {
+    for (unsigned col = 0; col < N && status == CL_SUCCESS;
+         col += panelSize) {
+      unsigned rows = min(panelSize, M - row);
+      unsigned cols = min(panelSize, N - col);
+      unsigned out = block++ % 2;
+      cl_mem blockX = blocksX[out];
+
+      cl_event done = NULL;  // last command writing the block of X
+      for (unsigned depth = 0; depth < K && status == CL_SUCCESS;
+           depth += panelSize) {
+        unsigned length = min(panelSize, K - depth);
+        unsigned in = step++ % 2;
+        cl_event uploads[3] = {NULL, NULL, outputFree[out]};
+        status = upload(panelsA[in], A + (size_t)row * K + depth, rows, length,
+                        K, inputFree[in], &uploads[0]);
+        if (status == CL_SUCCESS) {
+          status = upload(panelsB[in], B + (size_t)depth * N + col, length,
+                          cols, N, inputFree[in], &uploads[1]);
+        }
+
+        // The first product initialises the block, once its previous
+        // contents were read back, the others go through product
+        cl_event kernel = NULL;
+        bool first = depth == 0;
+        if (status == CL_SUCCESS) {
+          status = engine->multiply(
+              computeQueue, variant, panelsA[in], panelsB[in],
+              first ? blockX : product, rows, cols, length,
+              first && outputFree[out] ? 3 : 2, uploads, &kernel);
+        }
+        if (done) clReleaseEvent(done);
+        done = NULL;
+        if (status == CL_SUCCESS && first) {
+          clRetainEvent(kernel);
+          done = kernel;
+        } else if (status == CL_SUCCESS) {
+          status = accumulate(blockX, rows, cols, &done);
+        }
+        clFlush(uploadQueue);
+        clFlush(computeQueue);
+
+        for (unsigned i = 0; i < 2; i++) {
+          if (uploads[i]) clReleaseEvent(uploads[i]);
+        }
+        if (inputFree[in]) clReleaseEvent(inputFree[in]);
+        inputFree[in] = kernel;
+      }
+
+      if (outputFree[out]) clReleaseEvent(outputFree[out]);
+      outputFree[out] = NULL;
+      if (status == CL_SUCCESS) {
+        size_t origin[3] = {0, 0, 0};
+        size_t region[3] = {cols * sizeof(float), rows, 1};
+        status = clEnqueueReadBufferRect(
+            downloadQueue, blockX, CL_FALSE, origin, origin, region,
+            cols * sizeof(float), 0, (size_t)N * sizeof(float), 0,
+            X + (size_t)row * N + col, 1, &done, &outputFree[out]);
+        clFlush(downloadQueue);
+      }
+      if (done) clReleaseEvent(done);
+    }
+  }
+
+  // Wait for everything enqueued, even after a failure, before X is handed
+  // back and the host matrices may be unmapped
+  clFinish(uploadQueue);
+  clFinish(computeQueue);
+  clFinish(downloadQueue);
+  for (unsigned i = 0; i < 2; i++) {
+    if (inputFree[i]) clReleaseEvent(inputFree[i]);
+    if (outputFree[i]) clReleaseEvent(outputFree[i]);
+  }
+  return status;
+}
+
+// upload copies the rows x cols submatrix at source, whose rows are ld
+// apart, to the dense buffer once wait (if any) has completed
+cl_int GemmOutOfCore::upload(cl_mem buffer, const float *source,
+                             unsigned rows, unsigned cols, size_t ld,
+                             cl_event wait, cl_event *event) {
+  size_t origin[3] = {0, 0, 0};
+  size_t region[3] = {cols * sizeof(float), rows, 1};
+  return clEnqueueWriteBufferRect(uploadQueue, buffer, CL_FALSE, origin,
+                                  origin, region, cols * sizeof(float), 0,
+                                  ld * sizeof(float), 0, source, wait ? 1 : 0,
+                                  wait ? &wait : NULL, event);
+}
+
+// accumulate enqueues X += product for a rows x cols block
+cl_int GemmOutOfCore::accumulate(cl_mem X, unsigned rows, unsigned cols,
+                                 cl_event *event) {
+  float one = 1.0f;
+  unsigned zero = 0;
+  cl_mem operands[2] = {X, product};
+  cl_int status = CL_SUCCESS;
+  unsigned argi = 0;
+  for (unsigned i = 0; i < 2; i++) {
+    status |= clSetKernelArg(addKernel, argi++, sizeof(cl_mem), &operands[i]);
+    status |= clSetKernelArg(addKernel, argi++, sizeof(int), &zero);
+    status |= clSetKernelArg(addKernel, argi++, sizeof(int), &cols);
+    status |= clSetKernelArg(addKernel, argi++, sizeof(int), &rows);
+    status |= clSetKernelArg(addKernel, argi++, sizeof(int), &cols);
+    status |= clSetKernelArg(addKernel, argi++, sizeof(float), &one);
+  }
+  status |= clSetKernelArg(addKernel, argi++, sizeof(cl_mem), &X);
+  status |= clSetKernelArg(addKernel, argi++, sizeof(int), &zero);
+  status |= clSetKernelArg(addKernel, argi++, sizeof(int), &cols);
+  if (status != CL_SUCCESS) return CL_INVALID_KERNEL_ARGS;
+
+  size_t globalWorkSize[2] = {cols, rows};
+  return clEnqueueNDRangeKernel(computeQueue, addKernel, 2, NULL,
+                                globalWorkSize, NULL, 0, NULL, event);
+}
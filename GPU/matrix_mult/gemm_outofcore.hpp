@@ -0,0 +1,62 @@
+#ifndef GEMM_OUTOFCORE_HPP
+#define GEMM_OUTOFCORE_HPP
+
+#include <CL/cl.h>
+#include "gemm.hpp"
+
+// gemmPanelSize returns the largest panel side, a multiple of 256, whose
+// device buffers fit in half of the device memory and in its largest
+// allocation
+unsigned gemmPanelSize(cl_device_id device);
+
+// GemmOutOfCore multiplies host matrices of any size through a fixed set of
+// device buffers. X is computed in panel x panel blocks, each the sum over K
+// of the products of a panel of A and a panel of B, so that A, B and X never
+// have to fit on the device. The host matrices may be memory-mapped files
+// (MappedMatrix), in which case they need not fit in the host memory either.
+//
+// Three in-order queues run at the same time: one uploads panels, one runs
+// the kernels and one reads the blocks of X back. The input and output
+// buffers are doubled, so the next panels are uploaded while the current
+// ones are multiplied, and a finished block is read back while the next one
+// is computed. The device holds 7 panels: two of A, two of B, two blocks of
+// X and the product being accumulated.
+class GemmOutOfCore {
+ public:
+  // GemmOutOfCore allocates the device buffers, for panels of
+  // gemmPanelSize(device) when panel is 0. program must contain matrix_add,
+  // products use the variant of the engine.
+  GemmOutOfCore(cl_context context, cl_device_id device, cl_program program,
+                GemmEngine *engine, GemmVariant variant, unsigned panel = 0);
+  ~GemmOutOfCore();
+
+  // panel returns the side of the panels
+  unsigned panel() const;
+
+  // multiply computes X = A * B for an M x K host matrix A and a K x N host
+  // matrix B. Blocks until X holds the result.
+  cl_int multiply(const float *A, const float *B, float *X, unsigned M,
+                  unsigned N, unsigned K);
+
+ private:
+  GemmOutOfCore(const GemmOutOfCore &);
+  GemmOutOfCore &operator=(const GemmOutOfCore &);
+
+  cl_int upload(cl_mem buffer, const float *source, unsigned rows,
+                unsigned cols, size_t ld, cl_event wait, cl_event *event);
+  cl_int accumulate(cl_mem X, unsigned rows, unsigned cols, cl_event *event);
+
+  GemmEngine *engine;
+  GemmVariant variant;
+  unsigned panelSize;
+  cl_kernel addKernel;
+  cl_command_queue uploadQueue;
+  cl_command_queue computeQueue;
+  cl_command_queue downloadQueue;
+  cl_mem panelsA[2];
+  cl_mem panelsB[2];
+  cl_mem blocksX[2];
+  cl_mem product;  // product of the panels added to the block of X
+};
+
+#endif  // GEMM_OUTOFCORE_HPP
@@ -0,0 +1,115 @@
+#include "gemm_quant.hpp"
+#include <math.h>
+#include <algorithm>
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+using namespace std;
+
+// Rows of Bt multiplied with a row of A before moving to the next row, sized
+// so that they stay in L2 for K up to a few thousand
+#define Q8_COLS_BLOCK 64
+
+// private non-exported function declarations
+int32_t dotQ8(const int8_t *a, const int8_t *b, unsigned K, int32_t *sumA,
+              int32_t *sumB);
+int8_t requantize(float scale, int32_t value, int zeroPoint);
+
+GemmQuant gemmQuantRange(float low, float high) {
+  low = fminf(low, 0.0f);
+  high = fmaxf(high, 0.0f);
+  GemmQuant quant = {1.0f, 0};
+  if (high > low) quant.scale = (high - low) / 255.0f;
+  quant.zeroPoint = (int)lrintf(-128.0f - low / quant.scale);
+  quant.zeroPoint = max(-128, min(127, quant.zeroPoint));
+  return quant;
+}
+
+void gemmQuantize(const float *input, int8_t *output, size_t count,
+                  GemmQuant quant) {
+  for (size_t i = 0; i < count; i++) {
+    long q = lrintf(input[i] / quant.scale) + quant.zeroPoint;
+    output[i] = (int8_t)max(-128L, min(127L, q));
+  }
+}
+
+void gemmDequantize(const int8_t *input, float *output, size_t count,
+                    GemmQuant quant) {
+  for (size_t i = 0; i < count; i++) {
+    output[i] = quant.scale * (input[i] - quant.zeroPoint);
+  }
+}
+
+float gemmRequantScale(GemmQuant quantA, GemmQuant quantB, GemmQuant quantX) {
+  return quantA.scale * quantB.scale / quantX.scale;
+}
+
+// dotQ8 returns the raw dot product of two int8 rows of length K and adds
+// their sums to sumA and sumB
+int32_t dotQ8(const int8_t *a, const int8_t *b, unsigned K, int32_t *sumA,
+              int32_t *sumB) {
+  int32_t dot = 0, sa = 0, sb = 0;
+  unsigned k = 0;
+#ifdef __ARM_NEON
+  // 8 products of int8 fit in int16, pairs of them are accumulated in int32
+  int32x4_t accDot = vdupq_n_s32(0);
+  int32x4_t accA = vdupq_n_s32(0);
+  int32x4_t accB = vdupq_n_s32(0);
+  for (; k + 8 <= K; k += 8) {
+    int8x8_t va = vld1_s8(a + k);
+    int8x8_t vb = vld1_s8(b + k);
+    accDot = vpadalq_s16(accDot, vmull_s8(va, vb));
+    accA = vpadalq_s16(accA, vmovl_s8(va));
+    accB = vpadalq_s16(accB, vmovl_s8(vb));
+  }
+  int32_t lanes[4];
+  vst1q_s32(lanes, accDot);
+  dot = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  vst1q_s32(lanes, accA);
+  sa = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  vst1q_s32(lanes, accB);
+  sb = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+  for (; k < K; k++) {
+    dot += a[k] * b[k];
+    sa += a[k];
+    sb += b[k];
+  }
+  *sumA += sa;
+  *sumB += sb;
+  return dot;
+}
+
+// requantize rounds to nearest even and saturates, like convert_char_sat_rte
+int8_t requantize(float scale, int32_t value, int zeroPoint) {
+  float real = nearbyintf(scale * value + zeroPoint);
+  return (int8_t)fmaxf(-128.0f, fminf(127.0f, real));
+}
+
+void cpuGemmQ8(const int8_t *A, GemmQuant quantA, const int8_t *Bt,
+               GemmQuant quantB, int8_t *X, GemmQuant quantX, unsigned M,
+               unsigned N, unsigned K, ThreadPool *pool) {
+  float scale = gemmRequantScale(quantA, quantB, quantX);
+  int zeroA = quantA.zeroPoint;
+  int zeroB = quantB.zeroPoint;
+  int32_t zeroProduct = (int32_t)K * zeroA * zeroB;
+
+  auto rows = [&](unsigned i) {
+    for (unsigned jb = 0; jb < N; jb += Q8_COLS_BLOCK) {
+      unsigned jEnd = min(N, jb + Q8_COLS_BLOCK);
+      for (unsigned j = jb; j < jEnd; j++) {
+        int32_t sumA = 0, sumB = 0;
+        int32_t dot = dotQ8(A + (size_t)i * K, Bt + (size_t)j * K, K, &sumA,
+                            &sumB);
+        int32_t value = dot - zeroB * sumA - zeroA * sumB + zeroProduct;
+        X[(size_t)i * N + j] = requantize(scale, value, quantX.zeroPoint);
+      }
+    }
+  };
+  if (pool) {
+    pool->parallelFor(M, rows);
+  } else {
+    for (unsigned i = 0; i < M; i++) rows(i);
+  }
+}
@@ -0,0 +1,40 @@
+#ifndef GEMM_QUANT_HPP
+#define GEMM_QUANT_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include "common/thread_pool.hpp"
+
+// GemmQuant is the per-tensor quantization of an int8 matrix: the real value
+// of an element q is scale * (q - zeroPoint)
+struct GemmQuant {
+  float scale;
+  int zeroPoint;
+};
+
+// gemmQuantRange returns the quantization mapping [low, high] onto the 256
+// int8 values. The range is widened to contain 0, so that 0 is exact.
+GemmQuant gemmQuantRange(float low, float high);
+
+// gemmQuantize rounds count real values to int8 with saturation
+void gemmQuantize(const float *input, int8_t *output, size_t count,
+                  GemmQuant quant);
+
+// gemmDequantize converts count int8 values back to real values
+void gemmDequantize(const int8_t *input, float *output, size_t count,
+                    GemmQuant quant);
+
+// gemmRequantScale returns the factor that converts the int32 accumulator of
+// a product of quantA and quantB matrices to the quantization of the result
+float gemmRequantScale(GemmQuant quantA, GemmQuant quantB, GemmQuant quantX);
+
+// cpuGemmQ8 computes the quantized product X = A * B on the CPU, for an M x K
+// int8 matrix A and a K x N matrix B given transposed (Bt is N x K), like
+// matrix_mult_q8: products are accumulated in int32 (with NEON vmull_s8 and
+// vpadalq_s16), the zero points are applied to the sums and the result is
+// requantized to quantX. Rows of X are split across the threads of pool.
+void cpuGemmQ8(const int8_t *A, GemmQuant quantA, const int8_t *Bt,
+               GemmQuant quantB, int8_t *X, GemmQuant quantX, unsigned M,
+               unsigned N, unsigned K, ThreadPool *pool = NULL);
+
+#endif  // GEMM_QUANT_HPP
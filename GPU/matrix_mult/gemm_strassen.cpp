@@ -0,0 +1,218 @@
+#include "gemm_strassen.hpp"
+#include <stdio.h>
+
+// Quadrants of a matrix, in row major order
+enum { Q11, Q12, Q21, Q22, QNONE };
+
+// StrassenTerm is a quadrant with a sign, QNONE for no term
+struct StrassenTerm {
+  int quadrant;
+  float sign;
+};
+
+// StrassenProduct is one of the 7 products: (a0 + a1) * (b0 + b1), added to
+// the quadrants of the result in targets. The first product added to a
+// quadrant initialises it.
+struct StrassenProduct {
+  StrassenTerm a[2];
+  StrassenTerm b[2];
+  StrassenTerm targets[2];
+  bool init[2];
+};
+
+// M1 = (A11 + A22)(B11 + B22)  M2 = (A21 + A22) B11  M3 = A11 (B12 - B22)
+// M4 = A22 (B21 - B11)  M5 = (A11 + A12) B22  M6 = (A21 - A11)(B11 + B12)
+// M7 = (A12 - A22)(B21 + B22), and
+// X11 = M1 + M4 - M5 + M7  X12 = M3 + M5  X21 = M2 + M4
+// X22 = M1 - M2 + M3 + M6
+// Accumulating every product as soon as it is computed needs a single
+// temporary for the products instead of 7.
+const StrassenProduct STRASSEN_PRODUCTS[7] = {
+    {{{Q11, 1}, {Q22, 1}}, {{Q11, 1}, {Q22, 1}}, {{Q11, 1}, {Q22, 1}},
+     {true, true}},
+    {{{Q21, 1}, {Q22, 1}}, {{Q11, 1}, {QNONE, 0}}, {{Q21, 1}, {Q22, -1}},
+     {true, false}},
+    {{{Q11, 1}, {QNONE, 0}}, {{Q12, 1}, {Q22, -1}}, {{Q12, 1}, {Q22, 1}},
+     {true, false}},
+    {{{Q22, 1}, {QNONE, 0}}, {{Q21, 1}, {Q11, -1}}, {{Q11, 1}, {Q21, 1}},
+     {false, false}},
+    {{{Q11, 1}, {Q12, 1}}, {{Q22, 1}, {QNONE, 0}}, {{Q11, -1}, {Q12, 1}},
+     {false, false}},
+    {{{Q21, 1}, {Q11, -1}}, {{Q11, 1}, {Q12, 1}}, {{Q22, 1}, {QNONE, 0}},
+     {false, false}},
+    {{{Q12, 1}, {Q22, -1}}, {{Q21, 1}, {Q22, 1}}, {{Q11, 1}, {QNONE, 0}},
+     {false, false}},
+};
+
+// private non-exported function declarations
+bool strassenLeaf(unsigned n, unsigned cutoff);
+
+// strassenLeaf tells whether an n x n multiplication is left to the kernels
+bool strassenLeaf(unsigned n, unsigned cutoff) { return n <= cutoff || n < 2; }
+
+unsigned strassenLevels(unsigned n, unsigned cutoff) {
+  unsigned levels = 0;
+  for (; !strassenLeaf(n, cutoff); n = (n + 1) / 2) levels++;
+  return levels;
+}
+
+double strassenFlops(unsigned n, unsigned cutoff) {
+  if (strassenLeaf(n, cutoff)) return 2.0 * n * n * n;
+  // 7 products and 18 additions of half-size matrices
+  double half = (n + 1) / 2;
+  return 7 * strassenFlops((n + 1) / 2, cutoff) + 18 * half * half;
+}
+
+// GemmStrassen creates the matrix_add kernel, the products are left to the
+// engine
+GemmStrassen::GemmStrassen(cl_context context, cl_program program,
+                           GemmEngine *engine, unsigned cutoff,
+                           GemmVariant variant)
+    : engine(engine),
+      variant(variant),
+      cutoff(cutoff),
+      addKernel(NULL),
+      pool(context),
+      queue(NULL),
+      pendingEvents(0),
+      pendingWaitList(NULL) {
+  int status;
+  addKernel = clCreateKernel(program, "matrix_add", &status);
+  if (status != CL_SUCCESS) {
+    printf("Failed to create matrix_add kernel\n");
+    addKernel = NULL;
+  }
+}
+
+GemmStrassen::~GemmStrassen() {
+  if (addKernel) clReleaseKernel(addKernel);
+}
+
+cl_int GemmStrassen::multiply(cl_command_queue queue, cl_mem A, cl_mem B,
+                              cl_mem X, unsigned n, cl_uint numEvents,
+                              const cl_event *waitList, cl_event *event) {
+  if (!addKernel) return CL_INVALID_KERNEL;
+  this->queue = queue;
+  pendingEvents = numEvents;
+  pendingWaitList = waitList;
+  return recurse(A, B, X, n, event);
+}
+
+size_t GemmStrassen::poolBytes() const { return pool.allocated(); }
+
+// recurse enqueues X = A * B for dense n x n matrices. Only the last command
+// returns an event, the queue orders the others.
+cl_int GemmStrassen::recurse(cl_mem A, cl_mem B, cl_mem X, unsigned n,
+                             cl_event *event) {
+  if (strassenLeaf(n, cutoff)) {
+    const cl_event *waitList;
+    cl_uint numEvents = takeWaitList(&waitList);
+    return engine->multiply(queue, variant, A, B, X, n, n, n, numEvents,
+                            waitList, event);
+  }
+
+  // The first quadrants take the odd row and column, the others read as
+  // zeros beyond them
+  unsigned half = (n + 1) / 2;
+  unsigned rest = n - half;
+  View quadrantsA[4], quadrantsB[4], quadrantsX[4];
+  for (unsigned q = 0; q < 4; q++) {
+    unsigned row = q / 2, col = q % 2;
+    View view = {NULL, row * half * n + col * half, n, row ? rest : half,
+                 col ? rest : half};
+    quadrantsA[q] = quadrantsB[q] = quadrantsX[q] = view;
+    quadrantsA[q].buffer = A;
+    quadrantsB[q].buffer = B;
+    quadrantsX[q].buffer = X;
+  }
+
+  cl_int status;
+  size_t bytes = (size_t)half * half * sizeof(float);
+  cl_mem temporaries[3] = {NULL, NULL, NULL};
+  for (unsigned i = 0; i < 3; i++) {
+    temporaries[i] = pool.acquire(bytes, &status);
+    if (status != CL_SUCCESS) break;
+  }
+  View S = {temporaries[0], 0, half, half, half};
+  View T = {temporaries[1], 0, half, half, half};
+  View P = {temporaries[2], 0, half, half, half};
+
+  for (unsigned p = 0; p < 7 && status == CL_SUCCESS; p++) {
+    const StrassenProduct &product = STRASSEN_PRODUCTS[p];
+    const View none = {NULL, 0, 0, 0, 0};
+    View operands[2][2] = {{none, none}, {none, none}};
+    for (unsigned t = 0; t < 2; t++) {
+      if (product.a[t].quadrant != QNONE) {
+        operands[0][t] = quadrantsA[product.a[t].quadrant];
+      }
+      if (product.b[t].quadrant != QNONE) {
+        operands[1][t] = quadrantsB[product.b[t].quadrant];
+      }
+    }
+    status = add(S, operands[0][0], product.a[0].sign, operands[0][1],
+                 product.a[1].sign, NULL);
+    if (status == CL_SUCCESS) {
+      status = add(T, operands[1][0], product.b[0].sign, operands[1][1],
+                   product.b[1].sign, NULL);
+    }
+    if (status == CL_SUCCESS) {
+      status = recurse(S.buffer, T.buffer, P.buffer, half, NULL);
+    }
+
+    for (unsigned t = 0; t < 2 && status == CL_SUCCESS; t++) {
+      const StrassenTerm &target = product.targets[t];
+      if (target.quadrant == QNONE) continue;
+      const View &Z = quadrantsX[target.quadrant];
+      if (product.init[t]) {
+        status = add(Z, P, target.sign, none, 0.0f, NULL);
+      } else {
+        status = add(Z, Z, 1.0f, P, target.sign, p == 6 ? event : NULL);
+      }
+    }
+  }
+
+  for (unsigned i = 0; i < 3; i++) {
+    if (temporaries[i]) pool.release(temporaries[i]);
+  }
+  return status;
+}
+
+// add enqueues Z = alpha * X + beta * Y over Z, with X and Y read as zeros
+// beyond their own size. A view without buffer is not read.
+cl_int GemmStrassen::add(const View &Z, const View &X, float alpha,
+                         const View &Y, float beta, cl_event *event) {
+  const View *operands[2] = {&X, Y.buffer ? &Y : &X};
+  float factors[2] = {alpha, Y.buffer ? beta : 0.0f};
+  cl_int status = CL_SUCCESS;
+  unsigned argi = 0;
+  for (unsigned i = 0; i < 2; i++) {
+    const View *operand = operands[i];
+    status |=
+        clSetKernelArg(addKernel, argi++, sizeof(cl_mem), &operand->buffer);
+    status |= clSetKernelArg(addKernel, argi++, sizeof(int), &operand->offset);
+    status |= clSetKernelArg(addKernel, argi++, sizeof(int), &operand->ld);
+    status |= clSetKernelArg(addKernel, argi++, sizeof(int), &operand->rows);
+    status |= clSetKernelArg(addKernel, argi++, sizeof(int), &operand->cols);
+    status |= clSetKernelArg(addKernel, argi++, sizeof(float), &factors[i]);
+  }
+  status |= clSetKernelArg(addKernel, argi++, sizeof(cl_mem), &Z.buffer);
+  status |= clSetKernelArg(addKernel, argi++, sizeof(int), &Z.offset);
+  status |= clSetKernelArg(addKernel, argi++, sizeof(int), &Z.ld);
+  if (status != CL_SUCCESS) return CL_INVALID_KERNEL_ARGS;
+
+  const cl_event *waitList;
+  cl_uint numEvents = takeWaitList(&waitList);
+  size_t globalWorkSize[2] = {Z.cols, Z.rows};
+  return clEnqueueNDRangeKernel(queue, addKernel, 2, NULL, globalWorkSize,
+                                NULL, numEvents, waitList, event);
+}
+
+// takeWaitList returns the wait list of multiply to the first command
+// enqueued, and an empty one to the others
+cl_uint GemmStrassen::takeWaitList(const cl_event **waitList) {
+  cl_uint numEvents = pendingEvents;
+  *waitList = numEvents ? pendingWaitList : NULL;
+  pendingEvents = 0;
+  pendingWaitList = NULL;
+  return numEvents;
+}
@@ -0,0 +1,79 @@
+#ifndef GEMM_STRASSEN_HPP
+#define GEMM_STRASSEN_HPP
+
+#include <CL/cl.h>
+#include "buffer_pool.hpp"
+#include "gemm.hpp"
+
+// Matrices larger than this are split by the Strassen recursion, smaller ones
+// are multiplied by the classical kernels
+#ifndef GEMM_STRASSEN_CUTOFF
+#define GEMM_STRASSEN_CUTOFF 512
+#endif
+
+// strassenLevels returns the number of times an n x n multiplication is split
+// before the halves fall to the cutoff
+unsigned strassenLevels(unsigned n, unsigned cutoff);
+
+// strassenFlops returns the floating point operations of an n x n Strassen
+// multiplication with the cutoff, additions included. The classical product
+// takes 2 n^3.
+double strassenFlops(unsigned n, unsigned cutoff);
+
+// GemmStrassen multiplies square matrices with Strassen's algorithm: each
+// level splits the matrices in quadrants and replaces the 8 products of the
+// classical method by 7 products of sums of quadrants, recursing until the
+// size falls to the cutoff, where the engine's kernel takes over. Odd sizes
+// are padded with zeros on the fly. Each level needs three temporaries of a
+// quarter of the size, taken from a pool that keeps them from one call to
+// the next.
+//
+// Commands are enqueued one after the other without events between them, so
+// the queue must execute in order. The result buffer is read while the
+// quadrants are accumulated and must not be write only. The error grows
+// faster with the size than the classical method's, by a factor of about
+// 12^levels in the worst case, in exchange for (7/8)^levels of the products.
+class GemmStrassen {
+ public:
+  GemmStrassen(cl_context context, cl_program program, GemmEngine *engine,
+               unsigned cutoff = GEMM_STRASSEN_CUTOFF,
+               GemmVariant variant = GEMM_TILED);
+  ~GemmStrassen();
+
+  // multiply enqueues X = A * B for n x n matrices in device buffers
+  cl_int multiply(cl_command_queue queue, cl_mem A, cl_mem B, cl_mem X,
+                  unsigned n, cl_uint numEvents, const cl_event *waitList,
+                  cl_event *event);
+
+  // poolBytes returns the device memory held by the temporaries
+  size_t poolBytes() const;
+
+ private:
+  GemmStrassen(const GemmStrassen &);
+  GemmStrassen &operator=(const GemmStrassen &);
+
+  // View is a rows x cols submatrix of a buffer
+  struct View {
+    cl_mem buffer;
+    unsigned offset;
+    unsigned ld;
+    unsigned rows;
+    unsigned cols;
+  };
+
+  cl_int recurse(cl_mem A, cl_mem B, cl_mem X, unsigned n, cl_event *event);
+  cl_int add(const View &Z, const View &X, float alpha, const View &Y,
+             float beta, cl_event *event);
+  cl_uint takeWaitList(const cl_event **waitList);
+
+  GemmEngine *engine;
+  GemmVariant variant;
+  unsigned cutoff;
+  cl_kernel addKernel;
+  BufferPool pool;
+  cl_command_queue queue;  // queue and wait list of the current multiply
+  cl_uint pendingEvents;
+  const cl_event *pendingWaitList;
+};
+
+#endif  // GEMM_STRASSEN_HPP
@@ -0,0 +1,48 @@
+#include "mapped_matrix.hpp"
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedMatrix::MappedMatrix() : fd(-1), address(NULL), bytes(0) {}
+
+MappedMatrix::~MappedMatrix() { close(); }
+
+bool MappedMatrix::open(const char *path, unsigned rows, unsigned cols,
+                        bool create) {
+  close();
+  bytes = (size_t)rows * cols * sizeof(float);
+  fd = ::open(path, create ? O_RDWR | O_CREAT : O_RDWR, 0644);
+  if (fd < 0) {
+    printf("Could not open %s\n", path);
+    return false;
+  }
+
+  struct stat info;
+  bool sized = fstat(fd, &info) == 0 && (size_t)info.st_size >= bytes;
+  if (!sized && (!create || ftruncate(fd, bytes) != 0)) {
+    printf("%s does not hold a %ux%u matrix\n", path, rows, cols);
+    close();
+    return false;
+  }
+
+  void *mapping = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (mapping == MAP_FAILED) {
+    printf("Could not map %s\n", path);
+    close();
+    return false;
+  }
+  address = (float *)mapping;
+  return true;
+}
+
+void MappedMatrix::close() {
+  if (address) munmap(address, bytes);
+  if (fd >= 0) ::close(fd);
+  fd = -1;
+  address = NULL;
+  bytes = 0;
+}
+
+float *MappedMatrix::data() { return address; }
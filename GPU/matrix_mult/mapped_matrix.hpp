@@ -0,0 +1,35 @@
+#ifndef MAPPED_MATRIX_HPP
+#define MAPPED_MATRIX_HPP
+
+#include <stddef.h>
+
+// MappedMatrix is a row major float matrix stored in a file and mapped into
+// memory, so that it may be larger than the host memory: the kernel reads
+// pages on first access and writes dirty ones back to the file when it needs
+// the memory. The file holds the raw floats without any header.
+class MappedMatrix {
+ public:
+  MappedMatrix();
+  ~MappedMatrix();
+
+  // open maps the rows x cols matrix in path. With create the file is created
+  // or resized to the matrix, otherwise it must already hold it. Returns
+  // false on failure.
+  bool open(const char *path, unsigned rows, unsigned cols, bool create);
+
+  // close unmaps the matrix, the file keeps its contents
+  void close();
+
+  // data returns the mapped elements, NULL when nothing is mapped
+  float *data();
+
+ private:
+  MappedMatrix(const MappedMatrix &);
+  MappedMatrix &operator=(const MappedMatrix &);
+
+  int fd;
+  float *address;
+  size_t bytes;
+};
+
+#endif  // MAPPED_MATRIX_HPP
@@ -11,3 +11,569 @@ __kernel void matrix_mult(__global const float *A, __global const float *B,
   }
   X[tx * wB + ty] = curVal;
 }
+
+#ifndef TS
+#define TS 16
+#endif
+
+// gemmTiled computes the TS x TS block of X = A * B owned by the work-group,
+// for an M x K matrix A and a K x N matrix B. The work-group cooperatively
+// loads TS x TS tiles of A and B into local memory, so each element is read
+// TS times less from global memory than in matrix_mult. Dimension 0 runs
+// along the columns of X so that neighbouring work-items read neighbouring
+// addresses. Elements outside of the matrices are loaded as zeros: the global
+// size only has to be rounded up to a multiple of TS, and M, N and K can be
+// anything.
+void gemmTiled(__global const float *A, __global const float *B,
+               __global float *X, int M, int N, int K,
+               __local float (*tileA)[TS], __local float (*tileB)[TS]) {
+
+  int col = get_global_id(0);
+  int row = get_global_id(1);
+  int localCol = get_local_id(0);
+  int localRow = get_local_id(1);
+
+  float curVal = 0;
+  int t, i;
+  for (t = 0; t < K; t += TS) {
+    int aCol = t + localCol;
+    int bRow = t + localRow;
+    tileA[localRow][localCol] =
+        (row < M && aCol < K) ? A[row * K + aCol] : 0.0f;
+    tileB[localRow][localCol] =
+        (bRow < K && col < N) ? B[bRow * N + col] : 0.0f;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (i = 0; i < TS; i++) {
+      curVal += tileA[localRow][i] * tileB[i][localCol];
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+
+  if (row < M && col < N) X[row * N + col] = curVal;
+}
+
+// Shape of gemmBlocked: a work-group computes a TSM x TSN block of X, stepping
+// through K by TSK, and every work-item a WPTM x WPTN micro-tile of it held in
+// registers. WPTN must be a multiple of 4, as B and X are accessed as float4.
+// The host overrides the defaults with build options.
+#ifndef TSM
+#define TSM 32
+#endif
+#ifndef TSN
+#define TSN 32
+#endif
+#ifndef TSK
+#define TSK 16
+#endif
+#ifndef WPTM
+#define WPTM 4
+#endif
+#ifndef WPTN
+#define WPTN 4
+#endif
+#define RTSM (TSM / WPTM)  // work-items along the rows
+#define RTSN (TSN / WPTN)  // work-items along the columns
+
+// loadRow4 reads 4 consecutive elements of a row of a rows x cols matrix,
+// with zeros outside of it
+float4 loadRow4(__global const float *matrix, int row, int col, int rows,
+                int cols) {
+  if (row >= rows) return (float4)(0.0f);
+  __global const float *p = matrix + row * cols + col;
+  if (col + 3 < cols) return vload4(0, p);
+
+  float4 value = (float4)(0.0f);
+  if (col < cols) value.s0 = p[0];
+  if (col + 1 < cols) value.s1 = p[1];
+  if (col + 2 < cols) value.s2 = p[2];
+  return value;
+}
+
+// storeRow4 writes the part of value that falls inside the matrix
+void storeRow4(float4 value, __global float *matrix, int row, int col,
+               int rows, int cols) {
+  if (row >= rows) return;
+  __global float *p = matrix + row * cols + col;
+  if (col + 3 < cols) {
+    vstore4(value, 0, p);
+    return;
+  }
+  if (col < cols) p[0] = value.s0;
+  if (col + 1 < cols) p[1] = value.s1;
+  if (col + 2 < cols) p[2] = value.s2;
+}
+
+// gemmBlocked computes the TSM x TSN block of X = A * B owned by the
+// work-group like gemmTiled, but every work-item accumulates a WPTM x WPTN
+// micro-tile of X in registers: for each k it reads WPTM values of A and
+// WPTN / 4 float4 of B from local memory and does WPTM * WPTN multiply-adds,
+// instead of 2 reads per multiply-add. The A tile is stored transposed so that
+// both reads are contiguous across the work-group. The rows of a micro-tile
+// are RTSM apart and its columns contiguous, so results are written with
+// float4 stores.
+void gemmBlocked(__global const float *A, __global const float *B,
+                 __global float *X, int M, int N, int K,
+                 __local float (*tileA)[TSM],
+                 __local float4 (*tileB)[TSN / 4]) {
+
+  int localCol = get_local_id(0);
+  int localRow = get_local_id(1);
+  int groupCol = get_group_id(0) * TSN;
+  int groupRow = get_group_id(1) * TSM;
+  int tid = localRow * RTSN + localCol;
+
+  float4 acc[WPTM][WPTN / 4];
+  int wm, wn, i, k, t;
+  for (wm = 0; wm < WPTM; wm++) {
+    for (wn = 0; wn < WPTN / 4; wn++) acc[wm][wn] = (float4)(0.0f);
+  }
+
+  for (t = 0; t < K; t += TSK) {
+    // Consecutive work-items load consecutive elements of a row of A, and
+    // consecutive float4 of a row of B
+    for (i = tid; i < TSM * TSK; i += RTSM * RTSN) {
+      int row = groupRow + i / TSK;
+      int col = t + i % TSK;
+      tileA[i % TSK][i / TSK] = (row < M && col < K) ? A[row * K + col] : 0.0f;
+    }
+    for (i = tid; i < TSK * TSN / 4; i += RTSM * RTSN) {
+      int row = i / (TSN / 4);
+      int col = i % (TSN / 4);
+      tileB[row][col] = loadRow4(B, t + row, groupCol + col * 4, K, N);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+#pragma unroll
+    for (k = 0; k < TSK; k++) {
+      float4 b[WPTN / 4];
+      for (wn = 0; wn < WPTN / 4; wn++) {
+        b[wn] = tileB[k][localCol * (WPTN / 4) + wn];
+      }
+      for (wm = 0; wm < WPTM; wm++) {
+        float a = tileA[k][localRow + wm * RTSM];
+        for (wn = 0; wn < WPTN / 4; wn++) acc[wm][wn] += a * b[wn];
+      }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+
+  for (wm = 0; wm < WPTM; wm++) {
+    for (wn = 0; wn < WPTN / 4; wn++) {
+      storeRow4(acc[wm][wn], X, groupRow + localRow + wm * RTSM,
+                groupCol + (localCol * (WPTN / 4) + wn) * 4, M, N);
+    }
+  }
+}
+
+// matrix_mult_tiled computes X = A * B with gemmTiled
+__kernel __attribute__((reqd_work_group_size(TS, TS, 1)))
+void matrix_mult_tiled(__global const float *A, __global const float *B,
+                       __global float *X, int M, int N, int K) {
+
+  __local float tileA[TS][TS];
+  __local float tileB[TS][TS];
+  gemmTiled(A, B, X, M, N, K, tileA, tileB);
+}
+
+// matrix_mult_blocked computes X = A * B with gemmBlocked
+__kernel __attribute__((reqd_work_group_size(RTSN, RTSM, 1)))
+void matrix_mult_blocked(__global const float *A, __global const float *B,
+                         __global float *X, int M, int N, int K) {
+
+  __local float tileA[TSK][TSM];
+  __local float4 tileB[TSK][TSN / 4];
+  gemmBlocked(A, B, X, M, N, K, tileA, tileB);
+}
+
+// The batched kernels compute X[i] = A[i] * B[i] for a whole batch of
+// multiplications in one NDRange, with the batch index in dimension 2. The
+// matrices of multiplication i start at element i * stride of A, B and X
+// (a stride of 0 uses the same matrix for the whole batch), or, when offsets
+// is not NULL, at elements offsets[3 * i], offsets[3 * i + 1] and
+// offsets[3 * i + 2].
+#define BATCH_OFFSET(stride, index)                                           \
+  (offsets ? offsets[3 * get_global_id(2) + (index)]                          \
+           : (int)get_global_id(2) * (stride))
+
+__kernel __attribute__((reqd_work_group_size(TS, TS, 1)))
+void matrix_mult_batched_tiled(__global const float *A, int strideA,
+                               __global const float *B, int strideB,
+                               __global float *X, int strideX,
+                               __global const int *offsets, int M, int N,
+                               int K) {
+
+  __local float tileA[TS][TS];
+  __local float tileB[TS][TS];
+  gemmTiled(A + BATCH_OFFSET(strideA, 0), B + BATCH_OFFSET(strideB, 1),
+            X + BATCH_OFFSET(strideX, 2), M, N, K, tileA, tileB);
+}
+
+__kernel __attribute__((reqd_work_group_size(RTSN, RTSM, 1)))
+void matrix_mult_batched_blocked(__global const float *A, int strideA,
+                                 __global const float *B, int strideB,
+                                 __global float *X, int strideX,
+                                 __global const int *offsets, int M, int N,
+                                 int K) {
+
+  __local float tileA[TSK][TSM];
+  __local float4 tileB[TSK][TSN / 4];
+  gemmBlocked(A + BATCH_OFFSET(strideA, 0), B + BATCH_OFFSET(strideB, 1),
+              X + BATCH_OFFSET(strideX, 2), M, N, K, tileA, tileB);
+}
+
+// loadChar4 reads 4 consecutive elements of a row of a rows x cols int8
+// matrix, with zeros outside of it
+char4 loadChar4(__global const char *matrix, int row, int col, int rows,
+                int cols) {
+  if (row >= rows) return (char4)(0);
+  __global const char *p = matrix + row * cols + col;
+  if (col + 3 < cols) return vload4(0, p);
+
+  char4 value = (char4)(0);
+  if (col < cols) value.s0 = p[0];
+  if (col + 1 < cols) value.s1 = p[1];
+  if (col + 2 < cols) value.s2 = p[2];
+  return value;
+}
+
+// matrix_mult_q8 computes the quantized product of an M x K int8 matrix A and
+// a K x N int8 matrix B given transposed (Bt is N x K, the usual layout of
+// weights), so that both operands are read along rows as char4. A real value
+// is scale * (q - zeroPoint). Work-groups load TS x 4 * TS tiles of A and Bt
+// into local memory and accumulate the raw products, and the sums of A and B,
+// with int4 multiply-adds. The zero points are applied once at the end:
+//   sum (a - zA)(b - zB) = sum ab - zB sum a - zA sum b + K zA zB
+// and the int32 result is requantized with scale = sA * sB / sX. Padding is
+// zero, so it does not contribute to any of the sums.
+__kernel __attribute__((reqd_work_group_size(TS, TS, 1)))
+void matrix_mult_q8(__global const char *A, __global const char *Bt,
+                    __global char *X, int M, int N, int K, int zeroA,
+                    int zeroB, int zeroX, float scale) {
+
+  int col = get_global_id(0);
+  int row = get_global_id(1);
+  int localCol = get_local_id(0);
+  int localRow = get_local_id(1);
+  int firstCol = get_group_id(0) * TS;
+
+  __local char4 tileA[TS][TS];
+  __local char4 tileB[TS][TS];
+
+  int4 acc = (int4)(0);
+  int4 sumA = (int4)(0);
+  int4 sumB = (int4)(0);
+  int t, i;
+  for (t = 0; t < K; t += 4 * TS) {
+    tileA[localRow][localCol] = loadChar4(A, row, t + 4 * localCol, M, K);
+    tileB[localRow][localCol] =
+        loadChar4(Bt, firstCol + localRow, t + 4 * localCol, N, K);
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (i = 0; i < TS; i++) {
+      int4 a = convert_int4(tileA[localRow][i]);
+      int4 b = convert_int4(tileB[localCol][i]);
+      acc = mad24(a, b, acc);
+      sumA += a;
+      sumB += b;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+
+  if (row < M && col < N) {
+    int dot = acc.x + acc.y + acc.z + acc.w;
+    int rowSum = sumA.x + sumA.y + sumA.z + sumA.w;
+    int colSum = sumB.x + sumB.y + sumB.z + sumB.w;
+    int value = dot - zeroB * rowSum - zeroA * colSum + K * zeroA * zeroB;
+    X[row * N + col] = convert_char_sat_rte(scale * value + zeroX);
+  }
+}
+
+// matrixRead returns element (row, col) of the rows x cols submatrix that
+// starts at offset and whose rows are ld apart, and 0 outside of it
+float matrixRead(__global const float *X, int offset, int ld, int rows,
+                 int cols, int row, int col) {
+  return row < rows && col < cols ? X[offset + row * ld + col] : 0.0f;
+}
+
+// matrix_add computes Z = alpha * X + beta * Y over the submatrix of Z given
+// by the global size, dimension 0 along its columns. Every operand is a
+// submatrix of a larger row major matrix, given by its offset and leading
+// dimension. X and Y read as 0 beyond rowsX x colsX and rowsY x colsY, which
+// pads the smaller quadrants of odd sizes in the Strassen recursion. Y is not
+// read when beta is 0. Z may be X or Y, every element is read and written by
+// the same work-item.
+__kernel void matrix_add(__global const float *X, int offX, int ldX, int rowsX,
+                         int colsX, float alpha, __global const float *Y,
+                         int offY, int ldY, int rowsY, int colsY, float beta,
+                         __global float *Z, int offZ, int ldZ) {
+
+  int col = get_global_id(0);
+  int row = get_global_id(1);
+
+  float value = alpha * matrixRead(X, offX, ldX, rowsX, colsX, row, col);
+  if (beta != 0.0f) {
+    value += beta * matrixRead(Y, offY, ldY, rowsY, colsY, row, col);
+  }
+  Z[offZ + row * ldZ + col] = value;
+}
+
+// gemmStrided computes the TS x TS block of C = alpha * op(A) * op(B) +
+// beta * C owned by the work-group, like gemmTiled but with the BLAS sgemm
+// conventions: op(X) is X or its transpose, op(A) is M x K, op(B) is K x N,
+// and the rows of A, B and C are lda, ldb and ldc elements apart. C is not
+// read when beta is 0. transA and transB are constants in every kernel
+// below, so each combination compiles to its own loop without branches. A
+// transposed operand is loaded with the roles of the local ids swapped, so
+// that neighbouring work-items still read neighbouring addresses.
+void gemmStrided(bool transA, bool transB, int M, int N, int K, float alpha,
+                 __global const float *A, int lda, __global const float *B,
+                 int ldb, float beta, __global float *C, int ldc,
+                 __local float (*tileA)[TS], __local float (*tileB)[TS]) {
+
+  int col = get_global_id(0);
+  int row = get_global_id(1);
+  int localCol = get_local_id(0);
+  int localRow = get_local_id(1);
+  int firstCol = get_group_id(0) * TS;
+  int firstRow = get_group_id(1) * TS;
+
+  float curVal = 0;
+  int t, i;
+  for (t = 0; t < K; t += TS) {
+    if (transA) {
+      // A is K x M, element (firstRow + localCol, t + localRow) of op(A)
+      int aRow = firstRow + localCol;
+      int aCol = t + localRow;
+      tileA[localCol][localRow] =
+          (aRow < M && aCol < K) ? A[aCol * lda + aRow] : 0.0f;
+    } else {
+      int aCol = t + localCol;
+      tileA[localRow][localCol] =
+          (row < M && aCol < K) ? A[row * lda + aCol] : 0.0f;
+    }
+    if (transB) {
+      // B is N x K, element (t + localCol, firstCol + localRow) of op(B)
+      int bRow = t + localCol;
+      int bCol = firstCol + localRow;
+      tileB[localCol][localRow] =
+          (bRow < K && bCol < N) ? B[bCol * ldb + bRow] : 0.0f;
+    } else {
+      int bRow = t + localRow;
+      tileB[localRow][localCol] =
+          (bRow < K && col < N) ? B[bRow * ldb + col] : 0.0f;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (i = 0; i < TS; i++) {
+      curVal += tileA[localRow][i] * tileB[i][localCol];
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+
+  if (row < M && col < N) {
+    float value = alpha * curVal;
+    if (beta != 0.0f) value += beta * C[row * ldc + col];
+    C[row * ldc + col] = value;
+  }
+}
+
+// The sgemm kernels of every transpose combination, named after the flags of
+// A and B. Operands start at the given element offsets of their buffers, so
+// submatrices are multiplied in place.
+#define SGEMM_KERNEL(name, transA, transB)                                   \
+  __kernel __attribute__((reqd_work_group_size(TS, TS, 1))) void name(       \
+      int M, int N, int K, float alpha, __global const float *A, int offA,   \
+      int lda, __global const float *B, int offB, int ldb, float beta,       \
+      __global float *C, int offC, int ldc) {                                \
+    __local float tileA[TS][TS];                                             \
+    __local float tileB[TS][TS];                                             \
+    gemmStrided(transA, transB, M, N, K, alpha, A + offA, lda, B + offB,     \
+                ldb, beta, C + offC, ldc, tileA, tileB);                     \
+  }
+
+SGEMM_KERNEL(matrix_sgemm_nn, false, false)
+SGEMM_KERNEL(matrix_sgemm_nt, false, true)
+SGEMM_KERNEL(matrix_sgemm_tn, true, false)
+SGEMM_KERNEL(matrix_sgemm_tt, true, true)
+
+// conv_im2col writes the patch matrix of a convolution over a batch of
+// images: row (n * outH + y) * outW + x holds the inputs under the filter at
+// output pixel (y, x) of image n, in the order of the weights (channel, then
+// filter row and column for NCHW; filter row and column, then channel for
+// NHWC), with zeros where the filter covers the padding. Dimension 0 runs
+// along the rows of the patch matrix so that writes are contiguous.
+__kernel void conv_im2col(__global const float *input,
+                          __global float *patches, int channels, int height,
+                          int width, int kernelH, int kernelW, int strideH,
+                          int strideW, int padH, int padW, int dilationH,
+                          int dilationW, int outH, int outW, int nhwc) {
+
+  int k = get_global_id(0);
+  int row = get_global_id(1);
+  int depth = channels * kernelH * kernelW;
+
+  int x = row % outW;
+  int y = row / outW % outH;
+  int n = row / (outW * outH);
+  int c, kh, kw;
+  if (nhwc) {
+    c = k % channels;
+    kw = k / channels % kernelW;
+    kh = k / (channels * kernelW);
+  } else {
+    kw = k % kernelW;
+    kh = k / kernelW % kernelH;
+    c = k / (kernelW * kernelH);
+  }
+
+  int iy = y * strideH - padH + kh * dilationH;
+  int ix = x * strideW - padW + kw * dilationW;
+  float value = 0.0f;
+  if (iy >= 0 && iy < height && ix >= 0 && ix < width) {
+    value = nhwc ? input[((n * height + iy) * width + ix) * channels + c]
+                 : input[((n * channels + c) * height + iy) * width + ix];
+  }
+  patches[row * depth + k] = value;
+}
+
+// Winograd F(2x2, 3x3): the output is computed in 2x2 tiles from 4x4 tiles
+// of the input, Y = A^T [(G g G^T) * (B^T d B)] A, where * multiplies the 16
+// transformed elements one by one. Summed over the channels, each of the 16
+// elements is a GEMM of tiles x channels by channels x filters. The
+// transformed tensors are stored element by element, [16][rows][cols], so
+// that the 16 GEMMs are one strided batch.
+
+// winogradFilterRow returns r G^T for a row r of G g
+float4 winogradFilterRow(float3 r) {
+  return (float4)(r.x, 0.5f * (r.x + r.y + r.z), 0.5f * (r.x - r.y + r.z),
+                  r.z);
+}
+
+// winogradInputRow returns r B for a row r of B^T d
+float4 winogradInputRow(float4 r) {
+  return (float4)(r.x - r.z, r.y + r.z, r.z - r.y, r.y - r.w);
+}
+
+// winogradOutputRow returns r A for a row r of A^T m
+float2 winogradOutputRow(float4 r) {
+  return (float2)(r.x + r.y + r.z, r.y - r.z - r.w);
+}
+
+// conv_winograd_filter transforms the 3x3 filter of channel get_global_id(1)
+// of filter get_global_id(0) into U[16][channels][filters]
+__kernel void conv_winograd_filter(__global const float *weights,
+                                   __global float *transformed, int channels,
+                                   int filters, int nhwc) {
+
+  int f = get_global_id(0);
+  int c = get_global_id(1);
+  float g[9];
+  for (int i = 0; i < 9; i++) {
+    g[i] = nhwc ? weights[(f * 9 + i) * channels + c]
+                : weights[(f * channels + c) * 9 + i];
+  }
+
+  float3 g0 = (float3)(g[0], g[1], g[2]);
+  float3 g1 = (float3)(g[3], g[4], g[5]);
+  float3 g2 = (float3)(g[6], g[7], g[8]);
+  float4 u[4] = {winogradFilterRow(g0),
+                 winogradFilterRow(0.5f * (g0 + g1 + g2)),
+                 winogradFilterRow(0.5f * (g0 - g1 + g2)),
+                 winogradFilterRow(g2)};
+
+  int stride = channels * filters;
+  __global float *out = transformed + c * filters + f;
+  for (int i = 0; i < 4; i++) {
+    out[(4 * i + 0) * stride] = u[i].x;
+    out[(4 * i + 1) * stride] = u[i].y;
+    out[(4 * i + 2) * stride] = u[i].z;
+    out[(4 * i + 3) * stride] = u[i].w;
+  }
+}
+
+// conv_winograd_input transforms the 4x4 input tile of channel
+// get_global_id(0) under output tile get_global_id(1) into
+// V[16][tiles][channels]. Tile (n * tilesH + ty) * tilesW + tx starts at
+// input row 2 * ty - padH and column 2 * tx - padW of image n, and reads
+// zeros outside of the image.
+__kernel void conv_winograd_input(__global const float *input,
+                                  __global float *transformed, int channels,
+                                  int height, int width, int padH, int padW,
+                                  int tilesH, int tilesW, int nhwc) {
+
+  int c = get_global_id(0);
+  int tile = get_global_id(1);
+  int tiles = get_global_size(1);
+  int tx = tile % tilesW;
+  int ty = tile / tilesW % tilesH;
+  int n = tile / (tilesW * tilesH);
+
+  float d[16];
+  for (int i = 0; i < 4; i++) {
+    int y = 2 * ty - padH + i;
+    for (int j = 0; j < 4; j++) {
+      int x = 2 * tx - padW + j;
+      float value = 0.0f;
+      if (y >= 0 && y < height && x >= 0 && x < width) {
+        value = nhwc ? input[((n * height + y) * width + x) * channels + c]
+                     : input[((n * channels + c) * height + y) * width + x];
+      }
+      d[4 * i + j] = value;
+    }
+  }
+
+  float4 d0 = vload4(0, d), d1 = vload4(1, d);
+  float4 d2 = vload4(2, d), d3 = vload4(3, d);
+  float4 v[4] = {winogradInputRow(d0 - d2), winogradInputRow(d1 + d2),
+                 winogradInputRow(d2 - d1), winogradInputRow(d1 - d3)};
+
+  int stride = tiles * channels;
+  __global float *out = transformed + tile * channels + c;
+  for (int i = 0; i < 4; i++) {
+    out[(4 * i + 0) * stride] = v[i].x;
+    out[(4 * i + 1) * stride] = v[i].y;
+    out[(4 * i + 2) * stride] = v[i].z;
+    out[(4 * i + 3) * stride] = v[i].w;
+  }
+}
+
+// conv_winograd_output transforms the products M[16][tiles][filters] of
+// filter get_global_id(0) and tile get_global_id(1) back into a 2x2 tile of
+// the output, leaving out the row and column past an odd output size
+__kernel void conv_winograd_output(__global const float *products,
+                                   __global float *output, int filters,
+                                   int outH, int outW, int tilesH, int tilesW,
+                                   int nhwc) {
+
+  int f = get_global_id(0);
+  int tile = get_global_id(1);
+  int tiles = get_global_size(1);
+  int tx = tile % tilesW;
+  int ty = tile / tilesW % tilesH;
+  int n = tile / (tilesW * tilesH);
+
+  int stride = tiles * filters;
+  __global const float *in = products + tile * filters + f;
+  float m[16];
+  for (int i = 0; i < 16; i++) m[i] = in[i * stride];
+
+  float4 m0 = vload4(0, m), m1 = vload4(1, m);
+  float4 m2 = vload4(2, m), m3 = vload4(3, m);
+  float2 y[2] = {winogradOutputRow(m0 + m1 + m2),
+                 winogradOutputRow(m1 - m2 - m3)};
+
+  for (int i = 0; i < 2; i++) {
+    int row = 2 * ty + i;
+    for (int j = 0; j < 2; j++) {
+      int col = 2 * tx + j;
+      if (row >= outH || col >= outW) continue;
+      float value = j ? y[i].y : y[i].x;
+      if (nhwc) {
+        output[((n * outH + row) * outW + col) * filters + f] = value;
+      } else {
+        output[((n * filters + f) * outH + row) * outW + col] = value;
+      }
+    }
+  }
+}
@@ -1,11 +1,24 @@
 #include <CL/cl.h>
 #include <CL/cl_ext.h>
+#include <float.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 #include <chrono>
 #include <iostream>  // for standard I/O
+#include <string>
+#include <vector>
+#include "common/philox.hpp"
+#include "conv2d.hpp"
+#include "cpu_gemm.hpp"
+#include "gemm.hpp"
+#include "gemm_bench.hpp"
+#include "gemm_multi.hpp"
+#include "gemm_outofcore.hpp"
+#include "gemm_quant.hpp"
+#include "gemm_strassen.hpp"
+#include "mapped_matrix.hpp"
 #define STRING_BUFFER_LEN 1024
 using namespace std;
 
@@ -31,7 +44,9 @@ unsigned char **read_file(const char *name) {
   size = ftell(fp);
   fseek(fp, 0, SEEK_SET);
 
-  *output = (unsigned char *)malloc(size);
+  // The source is passed to clCreateProgramWithSource without a length, so it
+  // has to be null terminated
+  *output = (unsigned char *)malloc(size + 1);
   if (!*output) {
     fclose(fp);
     printf("mem allocate failure:%s", name);
@@ -39,6 +54,7 @@ unsigned char **read_file(const char *name) {
   }
 
   if (!fread(*output, size, 1, fp)) printf("failed to read file\n");
+  (*output)[size] = '\0';
   fclose(fp);
   return output;
 }
@@ -52,8 +68,8 @@ void checkError(int status, const char *msg) {
   if (status != CL_SUCCESS) printf("%s\n", msg);
 }
 
-// Randomly generate a floating-point number between -10 and 10.
-float rand_float() { return float(rand()) / float(RAND_MAX) * 20.0f - 10.0f; }
+// MATRIX_SEED seeds the random inputs, floats between -10 and 10
+#define MATRIX_SEED 39
 
 // perfStart returns the current time in milliseconds
 std::chrono::high_resolution_clock::time_point perfStart() {
@@ -66,13 +82,19 @@ int perfDone(std::chrono::high_resolution_clock::time_point start) {
       .count();
 }
 
-// matrixPopulateRand fills a given matrix with random float values.
-void matrixPopulateRand(float *matrix, unsigned rows, unsigned cols) {
-  for (unsigned i = 0; i < rows; i++) {
-    for (unsigned j = 0; j < cols; j++) {
-      matrix[i * cols + j] = rand_float();
-    }
-  }
+// matrixRandPosition is the number of floats matrixPopulateRand has taken
+// from the stream so far
+cl_ulong matrixRandPosition = 0;
+
+// matrixPopulateRand fills a given matrix with random float values, the next
+// ones of the Philox stream of MATRIX_SEED, so every run sees the same
+// matrices. The rows are split across the threads of pool.
+void matrixPopulateRand(float *matrix, unsigned rows, unsigned cols,
+                        ThreadPool *pool = NULL) {
+  size_t n = (size_t)rows * cols;
+  cpuPhiloxUniform(MATRIX_SEED, matrixRandPosition, matrix, n, -10.0f, 10.0f,
+                   pool);
+  matrixRandPosition += n;
 }
 
 // matrixPrint prints a formatted version of the matrix using printf
@@ -86,69 +108,720 @@ void matrixPrint(float *matrix, unsigned rows, unsigned cols) {
   }
 }
 
-// matrixMultiply multiplies two input matrices with proper dimensions
-void matrixMultiply(float *A, float *B, float *X, unsigned dim1,
-                    unsigned dimShared, unsigned dim2) {
-  for (unsigned i = 0; i < dim1; i++) {
-    for (unsigned j = 0; j < dim2; j++) {
-      for (unsigned k = 0; k < dimShared; k++) {
-        X[i * dim2 + j] += A[i * dimShared + k] * B[k * dim2 + j];
+// initOpenCL prints the first platform and creates a context on its first
+// GPU
+cl_context initOpenCL(cl_platform_id *platform, cl_device_id *device) {
+  char char_buffer[STRING_BUFFER_LEN];
+  cl_context_properties context_properties[] = {CL_CONTEXT_PLATFORM,
+                                                0,
+                                                CL_PRINTF_CALLBACK_ARM,
+                                                (cl_context_properties)callback,
+                                                CL_PRINTF_BUFFERSIZE_ARM,
+                                                0x1000,
+                                                0};
+
+  clGetPlatformIDs(1, platform, NULL);
+
+  clGetPlatformInfo(*platform, CL_PLATFORM_NAME, STRING_BUFFER_LEN,
+                    char_buffer, NULL);
+  printf("%-40s = %s\n", "CL_PLATFORM_NAME", char_buffer);
+  clGetPlatformInfo(*platform, CL_PLATFORM_VENDOR, STRING_BUFFER_LEN,
+                    char_buffer, NULL);
+  printf("%-40s = %s\n", "CL_PLATFORM_VENDOR ", char_buffer);
+  clGetPlatformInfo(*platform, CL_PLATFORM_VERSION, STRING_BUFFER_LEN,
+                    char_buffer, NULL);
+  printf("%-40s = %s\n\n", "CL_PLATFORM_VERSION ", char_buffer);
+
+  context_properties[1] = (cl_context_properties)*platform;
+  clGetDeviceIDs(*platform, CL_DEVICE_TYPE_GPU, 1, device, NULL);
+  return clCreateContext(context_properties, 1, device, NULL, NULL, NULL);
+}
+
+// parseSizes reads a comma separated list of sizes
+vector<unsigned> parseSizes(const char *list) {
+  vector<unsigned> sizes;
+  while (*list) {
+    char *end;
+    unsigned size = strtoul(list, &end, 10);
+    if (end == list || size == 0) return vector<unsigned>();
+    sizes.push_back(size);
+    list = *end == ',' ? end + 1 : end;
+  }
+  return sizes;
+}
+
+// runQuantized quantizes the inputs to int8, multiplies them with int32
+// accumulation on the CPU and on the GPU, and compares the results with each
+// other and with the float product
+int runQuantized(cl_context context, cl_command_queue queue, GemmEngine *gemm,
+                 ThreadPool *pool, const float *input_a, const float *input_b,
+                 const float *reference, unsigned M, unsigned N, unsigned K) {
+  int status;
+  size_t sizeA = (size_t)M * K;
+  size_t sizeB = (size_t)K * N;
+  size_t sizeX = (size_t)M * N;
+
+  // The inputs come from matrixPopulateRand, the output range from the float
+  // result
+  float low = reference[0], high = reference[0];
+  for (size_t i = 0; i < sizeX; i++) {
+    low = fminf(low, reference[i]);
+    high = fmaxf(high, reference[i]);
+  }
+  GemmQuant quantA = gemmQuantRange(-10.0f, 10.0f);
+  GemmQuant quantB = gemmQuantRange(-10.0f, 10.0f);
+  GemmQuant quantX = gemmQuantRange(low, high);
+
+  // B is quantized transposed, both operands are then read along rows
+  vector<float> transposed(sizeB);
+  for (unsigned k = 0; k < K; k++) {
+    for (unsigned j = 0; j < N; j++) transposed[j * K + k] = input_b[k * N + j];
+  }
+  vector<int8_t> a(sizeA), bt(sizeB), cpu(sizeX), gpu(sizeX);
+  gemmQuantize(input_a, a.data(), sizeA, quantA);
+  gemmQuantize(transposed.data(), bt.data(), sizeB, quantB);
+
+  auto perf = perfStart();
+  cpuGemmQ8(a.data(), quantA, bt.data(), quantB, cpu.data(), quantX, M, N, K,
+            pool);
+  printf("CPU int8 computation took %d milliseconds.\n", perfDone(perf));
+
+  cl_mem bufferA = clCreateBuffer(context, CL_MEM_READ_ONLY, sizeA, NULL,
+                                  &status);
+  checkError(status, "Failed to create buffer for input A");
+  cl_mem bufferBt = clCreateBuffer(context, CL_MEM_READ_ONLY, sizeB, NULL,
+                                   &status);
+  checkError(status, "Failed to create buffer for input B");
+  cl_mem bufferX = clCreateBuffer(context, CL_MEM_WRITE_ONLY, sizeX, NULL,
+                                  &status);
+  checkError(status, "Failed to create buffer for output");
+
+  perf = perfStart();
+  cl_event events[4];
+  clEnqueueWriteBuffer(queue, bufferA, CL_FALSE, 0, sizeA, a.data(), 0, NULL,
+                       &events[0]);
+  clEnqueueWriteBuffer(queue, bufferBt, CL_FALSE, 0, sizeB, bt.data(), 0, NULL,
+                       &events[1]);
+  status = gemm->multiplyQuantized(queue, bufferA, quantA, bufferBt, quantB,
+                                   bufferX, quantX, M, N, K, 2, events,
+                                   &events[2]);
+  checkError(status, "Failed to launch kernel");
+  if (status == CL_SUCCESS) {
+    clEnqueueReadBuffer(queue, bufferX, CL_TRUE, 0, sizeX, gpu.data(), 1,
+                        &events[2], &events[3]);
+    printf("GPU int8 computation took %d milliseconds.\n", perfDone(perf));
+    clReleaseEvent(events[2]);
+    clReleaseEvent(events[3]);
+  }
+  clFinish(queue);
+  clReleaseEvent(events[0]);
+  clReleaseEvent(events[1]);
+  clReleaseMemObject(bufferA);
+  clReleaseMemObject(bufferBt);
+  clReleaseMemObject(bufferX);
+  if (status != CL_SUCCESS) return 1;
+
+  // Both sides compute the same integers, the requantization may only round
+  // differently when the GPU fuses its multiply-add
+  float error = 0.0f;
+  for (size_t i = 0; i < sizeX; i++) {
+    if (abs(cpu[i] - gpu[i]) > 1) {
+      printf("Failed verification @ index (%u, %u) \nExpected: %d \nActual: "
+             "%d\n", (unsigned)(i / N), (unsigned)(i % N), cpu[i], gpu[i]);
+      return 1;
+    }
+    float actual = quantX.scale * (gpu[i] - quantX.zeroPoint);
+    error = fmaxf(error, fabsf(actual - reference[i]));
+  }
+  printf("Largest error against the float result %f (output step %f)\n", error,
+         quantX.scale);
+  return 0;
+}
+
+// frobeniusDistance returns the Frobenius norm of X - Y relative to that of Y
+double frobeniusDistance(const float *X, const float *Y, size_t count) {
+  double difference = 0.0, norm = 0.0;
+  for (size_t i = 0; i < count; i++) {
+    difference += ((double)X[i] - Y[i]) * ((double)X[i] - Y[i]);
+    norm += (double)Y[i] * Y[i];
+  }
+  return norm > 0.0 ? sqrt(difference / norm) : sqrt(difference);
+}
+
+// runStrassen multiplies the n x n inputs already on the device with the
+// classical kernel and with Strassen's algorithm, and reports the time and
+// the error of both against the CPU result
+int runStrassen(cl_context context, cl_command_queue queue,
+                cl_program program, GemmEngine *gemm, GemmVariant variant,
+                cl_mem A, cl_mem B, const float *reference, unsigned n,
+                unsigned cutoff) {
+  int status;
+  size_t size = (size_t)n * n;
+  vector<float> classical(size), result(size);
+  cl_mem bufferX = clCreateBuffer(context, CL_MEM_READ_WRITE,
+                                  size * sizeof(float), NULL, &status);
+  checkError(status, "Failed to create buffer for output");
+  if (status != CL_SUCCESS) return 1;
+
+  // The first run of each creates the kernels' resources and the
+  // temporaries, and is not timed
+  GemmStrassen strassen(context, program, gemm, cutoff, variant);
+  for (unsigned method = 0; method < 2 && status == CL_SUCCESS; method++) {
+    int time = 0;
+    for (unsigned run = 0; run < 2 && status == CL_SUCCESS; run++) {
+      cl_event event;
+      auto perf = perfStart();
+      if (method == 0) {
+        status = gemm->multiply(queue, variant, A, B, bufferX, n, n, n, 0,
+                                NULL, &event);
+      } else {
+        status = strassen.multiply(queue, A, B, bufferX, n, 0, NULL, &event);
       }
+      checkError(status, "Failed to launch kernel");
+      if (status != CL_SUCCESS) break;
+      clWaitForEvents(1, &event);
+      time = perfDone(perf);
+      clReleaseEvent(event);
+    }
+    if (status != CL_SUCCESS) break;
+    status = clEnqueueReadBuffer(queue, bufferX, CL_TRUE, 0,
+                                 size * sizeof(float),
+                                 method == 0 ? classical.data() : result.data(),
+                                 0, NULL, NULL);
+    if (method == 0) {
+      printf("GPU classical %s kernel took %d milliseconds.\n",
+             gemmVariantName(variant), time);
+    } else {
+      printf("GPU Strassen took %d milliseconds: %u levels down to the %s "
+             "kernel, %.1f%% of the classical flops, %.1f MB of "
+             "temporaries.\n",
+             time, strassenLevels(n, cutoff), gemmVariantName(variant),
+             100.0 * strassenFlops(n, cutoff) / (2.0 * n * n * n),
+             strassen.poolBytes() / 1048576.0);
+    }
+  }
+  clFinish(queue);
+  clReleaseMemObject(bufferX);
+  if (status != CL_SUCCESS) return 1;
+
+  printf("Relative error against the CPU: classical %.3g, Strassen %.3g\n",
+         frobeniusDistance(classical.data(), reference, size),
+         frobeniusDistance(result.data(), reference, size));
+  printf("Strassen against classical: %.3g\n",
+         frobeniusDistance(result.data(), classical.data(), size));
+  return 0;
+}
+
+// runMultiDevice multiplies the inputs over every OpenCL device, twice: the
+// first partition follows the calibration, the second the throughputs
+// measured by the first run
+int runMultiDevice(const char *source, GemmVariant variant, ThreadPool *pool,
+                   const float *input_a, const float *input_b, float *output,
+                   const float *reference, unsigned M, unsigned N,
+                   unsigned K) {
+  GemmMulti multi(source, variant);
+  if (multi.size() == 0) {
+    printf("No OpenCL device can run the kernels\n");
+    return 1;
+  }
+  int status = multi.calibrate(GEMM_MULTI_CALIBRATION, pool);
+  checkError(status, "Failed to calibrate the devices");
+  for (unsigned run = 0; run < 2 && status == CL_SUCCESS; run++) {
+    auto perf = perfStart();
+    status = multi.multiply(input_a, input_b, output, M, N, K);
+    checkError(status, "Failed to multiply over the devices");
+    if (status != CL_SUCCESS) break;
+    printf("%u devices took %d milliseconds.\n", multi.size(),
+           perfDone(perf));
+    for (unsigned i = 0; i < multi.size(); i++) {
+      printf("  %-40s %s kernel, %5u rows, %.2f GFLOPS\n", multi.name(i),
+             gemmVariantName(multi.variant(i)), multi.rows(i),
+             multi.throughput(i));
+    }
+  }
+  if (status != CL_SUCCESS) return 1;
+
+  for (size_t i = 0; i < (size_t)M * N; i++) {
+    if (fabsf(output[i] - reference[i]) >
+        1.0e-4f * fmaxf(1.0f, fabsf(reference[i]))) {
+      printf("Failed verification @ index (%u, %u) \nExpected: %f \nActual: "
+             "%f\n", (unsigned)(i / N), (unsigned)(i % N), reference[i],
+             output[i]);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// runOutOfCore multiplies an M x K matrix by a K x N one streaming panels of
+// panel x panel through the GPU, 0 for the largest that fits. With a
+// directory the matrices are memory-mapped files a.bin, b.bin and x.bin in
+// it, otherwise they are in host memory. The result is too large to compute
+// again on the CPU, so a sample of its elements is checked.
+int runOutOfCore(const char *directory, unsigned panel, GemmVariant variant,
+                 unsigned M, unsigned N, unsigned K) {
+  const unsigned samples = 64;
+  char path[STRING_BUFFER_LEN];
+  MappedMatrix mapped[3];
+  vector<float> memory[3];
+  unsigned rows[3] = {M, K, M};
+  unsigned cols[3] = {K, N, N};
+  float *matrices[3];
+  for (unsigned m = 0; m < 3; m++) {
+    if (directory) {
+      snprintf(path, STRING_BUFFER_LEN, "%s/%c.bin", directory, "abx"[m]);
+      if (!mapped[m].open(path, rows[m], cols[m], true)) return 1;
+      matrices[m] = mapped[m].data();
+    } else {
+      memory[m].resize((size_t)rows[m] * cols[m]);
+      matrices[m] = memory[m].data();
+    }
+  }
+  float *A = matrices[0], *B = matrices[1], *X = matrices[2];
+  for (unsigned i = 0; i < M; i++) matrixPopulateRand(A + (size_t)i * K, 1, K);
+  for (unsigned i = 0; i < K; i++) matrixPopulateRand(B + (size_t)i * N, 1, N);
+
+  cl_platform_id platform;
+  cl_device_id device;
+  char options[STRING_BUFFER_LEN];
+  cl_context context = initOpenCL(&platform, &device);
+  unsigned char **opencl_program = read_file("matrix_mult.cl");
+  cl_program program = clCreateProgramWithSource(
+      context, 1, (const char **)opencl_program, NULL, NULL);
+  if (program == NULL) {
+    printf("Program creation failed\n");
+    return 1;
+  }
+  gemmBuildOptions(options, STRING_BUFFER_LEN);
+  if (clBuildProgram(program, 0, NULL, options, NULL, NULL) != CL_SUCCESS) {
+    print_clbuild_errors(program, device);
+  }
+
+  int result = 0;
+  GemmEngine *gemm = new GemmEngine(context, device, program);
+  GemmOutOfCore *outOfCore =
+      new GemmOutOfCore(context, device, program, gemm, variant, panel);
+  printf("Streaming %ux%u panels through the %s kernel\n", outOfCore->panel(),
+         outOfCore->panel(), gemmVariantName(variant));
+  auto perf = perfStart();
+  int status = outOfCore->multiply(A, B, X, M, N, K);
+  int time = perfDone(perf);
+  checkError(status, "Failed to multiply out of core");
+  if (status == CL_SUCCESS) {
+    printf("GPU out-of-core computation took %d milliseconds, %.2f GFLOPS.\n",
+           time, 2.0 * M * N * K / (time * 1.0e6));
+  } else {
+    result = 1;
+  }
+
+  // Each sampled element must be within the rounding error of its dot
+  // product, which grows with K
+  for (unsigned s = 0; s < samples && result == 0; s++) {
+    unsigned i = rand() % M, j = rand() % N;
+    double expected = 0.0, magnitude = 0.0;
+    for (unsigned k = 0; k < K; k++) {
+      expected += (double)A[(size_t)i * K + k] * B[(size_t)k * N + j];
+      magnitude += fabs((double)A[(size_t)i * K + k] * B[(size_t)k * N + j]);
+    }
+    float actual = X[(size_t)i * N + j];
+    if (fabs(actual - expected) > 4.0 * K * FLT_EPSILON * magnitude) {
+      printf("Failed verification @ index (%u, %u) \nExpected: %f \nActual: "
+             "%f\n", i, j, expected, actual);
+      result = 1;
+    }
+  }
+
+  delete outOfCore;
+  delete gemm;
+  clReleaseProgram(program);
+  clReleaseContext(context);
+  return result;
+}
+
+// runSgemm checks the sgemm interface: C = 1.5 * op(A) * op(B) + 0.5 * C with
+// the given transpose flags, every matrix stored with padded rows and C a
+// submatrix starting at row 1, column 1 of a larger matrix. The CPU and the
+// GPU results are compared.
+int runSgemm(cl_context context, cl_command_queue queue, GemmEngine *gemm,
+             ThreadPool *pool, char transA, char transB, unsigned M,
+             unsigned N, unsigned K) {
+  const float alpha = 1.5f, beta = 0.5f;
+  bool ta = transA == 'T', tb = transB == 'T';
+  unsigned lda = (ta ? M : K) + 3;
+  unsigned ldb = (tb ? K : N) + 3;
+  unsigned ldc = N + 3;
+  size_t sizeA = (size_t)(ta ? K : M) * lda;
+  size_t sizeB = (size_t)(tb ? N : K) * ldb;
+  size_t sizeC = (size_t)(M + 1) * ldc;
+  size_t offC = ldc + 1;
+  vector<float> A(sizeA), B(sizeB), C(sizeC), expected(sizeC);
+  matrixPopulateRand(A.data(), 1, sizeA);
+  matrixPopulateRand(B.data(), 1, sizeB);
+  matrixPopulateRand(C.data(), 1, sizeC);
+  expected = C;
+
+  auto perf = perfStart();
+  cpuSgemm(transA, transB, M, N, K, alpha, A.data(), lda, B.data(), ldb, beta,
+           expected.data() + offC, ldc, pool);
+  printf("CPU sgemm %c%c took %d milliseconds.\n", transA, transB,
+         perfDone(perf));
+
+  int status;
+  cl_mem buffers[3];
+  float *hosts[3] = {A.data(), B.data(), C.data()};
+  size_t sizes[3] = {sizeA, sizeB, sizeC};
+  for (unsigned i = 0; i < 3; i++) {
+    buffers[i] =
+        clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                       sizes[i] * sizeof(float), hosts[i], &status);
+    checkError(status, "Failed to create buffer");
+    if (status != CL_SUCCESS) return 1;
+  }
+
+  cl_event event;
+  perf = perfStart();
+  status = gemm->sgemm(queue, transA, transB, M, N, K, alpha, buffers[0], 0,
+                       lda, buffers[1], 0, ldb, beta, buffers[2], offC, ldc, 0,
+                       NULL, &event);
+  checkError(status, "Failed to launch kernel");
+  if (status == CL_SUCCESS) {
+    clWaitForEvents(1, &event);
+    printf("GPU sgemm %c%c took %d milliseconds.\n", transA, transB,
+           perfDone(perf));
+    clReleaseEvent(event);
+    status = clEnqueueReadBuffer(queue, buffers[2], CL_TRUE, 0,
+                                 sizeC * sizeof(float), C.data(), 0, NULL,
+                                 NULL);
+  }
+  for (unsigned i = 0; i < 3; i++) clReleaseMemObject(buffers[i]);
+  if (status != CL_SUCCESS) return 1;
+
+  // The padding and the first row and column must be left untouched
+  for (size_t i = 0; i < sizeC; i++) {
+    float tolerance = 1.0e-4f * fmaxf(1.0f, fabsf(expected[i]));
+    if (fabsf(C[i] - expected[i]) > tolerance) {
+      printf("Failed verification @ element %u of C \nExpected: %f \nActual: "
+             "%f\n", (unsigned)i, expected[i], C[i]);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// parseConvShape reads a convolution layer from "B,C,H,W,F,K,S,P,D": batch,
+// channels, height, width, filters, filter size, stride, padding and
+// dilation, the same both ways. Returns false for a malformed layer.
+bool parseConvShape(const char *text, ConvShape *shape) {
+  unsigned values[9];
+  char end;
+  if (sscanf(text, "%u,%u,%u,%u,%u,%u,%u,%u,%u%c", &values[0], &values[1],
+             &values[2], &values[3], &values[4], &values[5], &values[6],
+             &values[7], &values[8], &end) != 9) {
+    return false;
+  }
+  shape->batch = values[0];
+  shape->channels = values[1];
+  shape->height = values[2];
+  shape->width = values[3];
+  shape->filters = values[4];
+  shape->kernelH = shape->kernelW = values[5];
+  shape->strideH = shape->strideW = values[6];
+  shape->padH = shape->padW = values[7];
+  shape->dilationH = shape->dilationW = values[8];
+  return convOutputHeight(*shape) && convOutputWidth(*shape) && shape->batch &&
+         shape->channels && shape->filters && shape->dilationH;
+}
+
+// runConv runs a convolution layer with random inputs and weights on the GPU
+// with the algorithm and compares it with the direct computation on the CPU
+int runConv(const ConvShape &shape, ConvAlgorithm algorithm) {
+  unsigned outH = convOutputHeight(shape), outW = convOutputWidth(shape);
+  size_t sizes[3] = {
+      (size_t)shape.batch * shape.channels * shape.height * shape.width,
+      (size_t)shape.filters * shape.channels * shape.kernelH * shape.kernelW,
+      (size_t)shape.batch * shape.filters * outH * outW};
+  vector<float> input(sizes[0]), weights(sizes[1]), output(sizes[2]),
+      expected(sizes[2]);
+  matrixPopulateRand(input.data(), 1, sizes[0]);
+  matrixPopulateRand(weights.data(), 1, sizes[1]);
+  printf("Convolving %u %s images of %ux%ux%u with %u %ux%u filters into "
+         "%ux%u\n",
+         shape.batch, shape.layout == CONV_NHWC ? "NHWC" : "NCHW",
+         shape.channels, shape.height, shape.width, shape.filters,
+         shape.kernelH, shape.kernelW, outH, outW);
+  if (algorithm == CONV_AUTO) algorithm = convAlgorithm(shape);
+  printf("Using the %s algorithm\n", convAlgorithmName(algorithm));
+
+  auto perf = perfStart();
+  cpuConv2d(shape, input.data(), weights.data(), expected.data());
+  printf("CPU convolution took %d milliseconds.\n", perfDone(perf));
+
+  cl_platform_id platform;
+  cl_device_id device;
+  char options[STRING_BUFFER_LEN];
+  cl_context context = initOpenCL(&platform, &device);
+  cl_command_queue queue = clCreateCommandQueue(context, device, 0, NULL);
+  unsigned char **opencl_program = read_file("matrix_mult.cl");
+  cl_program program = clCreateProgramWithSource(
+      context, 1, (const char **)opencl_program, NULL, NULL);
+  if (program == NULL) {
+    printf("Program creation failed\n");
+    return 1;
+  }
+  gemmBuildOptions(options, STRING_BUFFER_LEN);
+  if (clBuildProgram(program, 0, NULL, options, NULL, NULL) != CL_SUCCESS) {
+    print_clbuild_errors(program, device);
+  }
+
+  int status;
+  cl_mem buffers[3];
+  float *hosts[3] = {input.data(), weights.data(), NULL};
+  for (unsigned i = 0; i < 3; i++) {
+    buffers[i] = clCreateBuffer(
+        context, CL_MEM_READ_WRITE | (hosts[i] ? CL_MEM_COPY_HOST_PTR : 0),
+        sizes[i] * sizeof(float), hosts[i], &status);
+    checkError(status, "Failed to create buffer");
+    if (status != CL_SUCCESS) return 1;
+  }
+
+  // The first run creates the patch matrix, the second one is timed
+  GemmEngine *gemm = new GemmEngine(context, device, program);
+  Conv2d *conv = new Conv2d(context, program, gemm);
+  cl_event event;
+  status = conv->forward(queue, shape, buffers[0], buffers[1], buffers[2], 0,
+                         NULL, NULL, algorithm);
+  clFinish(queue);
+  perf = perfStart();
+  if (status == CL_SUCCESS) {
+    status = conv->forward(queue, shape, buffers[0], buffers[1], buffers[2], 0,
+                           NULL, &event, algorithm);
+  }
+  checkError(status, "Failed to launch kernel");
+  if (status == CL_SUCCESS) {
+    clWaitForEvents(1, &event);
+    double milliseconds = perfDone(perf);
+    printf("GPU convolution took %.0f milliseconds (%.2f GFLOPS).\n",
+           milliseconds, convFlops(shape) / fmax(milliseconds, 1.0) / 1.0e6);
+    clReleaseEvent(event);
+    status = clEnqueueReadBuffer(queue, buffers[2], CL_TRUE, 0,
+                                 sizes[2] * sizeof(float), output.data(), 0,
+                                 NULL, NULL);
+  }
+  for (unsigned i = 0; i < 3; i++) clReleaseMemObject(buffers[i]);
+  delete conv;
+  delete gemm;
+  clReleaseCommandQueue(queue);
+  clReleaseProgram(program);
+  clReleaseContext(context);
+  if (status != CL_SUCCESS) return 1;
+
+  // The Winograd transforms add and subtract terms larger than the result,
+  // which costs a few more bits of precision
+  float relative = algorithm == CONV_WINOGRAD ? 1.0e-3f : 1.0e-4f;
+  for (size_t i = 0; i < sizes[2]; i++) {
+    float tolerance = relative * fmaxf(1.0f, fabsf(expected[i]));
+    if (fabsf(output[i] - expected[i]) > tolerance) {
+      printf("Failed verification @ element %u of the output \nExpected: %f "
+             "\nActual: %f\n", (unsigned)i, expected[i], output[i]);
+      return 1;
     }
   }
+  return 0;
 }
 
-int main() {
+// Usage: matrix_mult [--kernel=blocked|tiled] [--batch=B] [--threads=T]
+//                    [--int8] [--strassen[=C]] [--devices]
+//                    [--out-of-core[=P]] [--map=DIR] [--sgemm=NN|NT|TN|TT]
+//                    [M N K]
+//        matrix_mult --conv=NCHW|NHWC [--layer=B,C,H,W,F,K,S,P,D]
+//                    [--algorithm=auto|im2col|winograd]
+//        matrix_mult --sweep[=full] [--sizes=S1,S2,...] [--repeat=R]
+//                    [--threads=T] [--output=perfgraph.json]
+// Multiplies B random M x K matrices by B random K x N ones on the CPU and on
+// the GPU and compares the results. Any positive sizes are accepted. With a
+// batch, the GPU runs all the multiplications in a single launch. The CPU
+// uses T threads, one per core by default. --int8 multiplies the inputs
+// quantized to int8 instead of floats. --strassen multiplies square matrices
+// once more with Strassen's algorithm, recursing down to C x C multiplications
+// (GEMM_STRASSEN_CUTOFF by default), and reports its time and error.
+// --devices splits the multiplication over every OpenCL device instead of
+// the first GPU, in proportion to their measured throughput.
+// --out-of-core streams P x P panels through a fixed set of GPU buffers
+// (P fits the device by default), for matrices larger than the device
+// memory. With --map, A, B and X are memory-mapped files in DIR, which may
+// be larger than the host memory too. Only a sample of X is verified.
+// --sgemm runs the BLAS-style sgemm with the transpose flags on strided
+// matrices instead.
+// --conv runs a convolution layer as im2col and a GEMM in the given layout:
+// B images of C x H x W, F filters of K x K, stride S, padding P and
+// dilation D (1,32,56,56,64,3,1,1,1 by default). --algorithm forces im2col
+// or Winograd F(2x2, 3x3), which auto picks for 3x3 layers with stride 1,
+// no dilation and at least CONV_WINOGRAD_FILTERS filters.
+// --sweep benchmarks the CPU and every kernel variant and work-group shape
+// for M = N = K in the given sizes (every combination of them with
+// --sweep=full), R times each, and writes the results to a JSON file.
+int main(int argc, char **argv) {
   char char_buffer[STRING_BUFFER_LEN];
   cl_platform_id platform;
   cl_device_id device;
   cl_context context;
-  cl_context_properties context_properties[] = {CL_CONTEXT_PLATFORM,
-                                                0,
-                                                CL_PRINTF_CALLBACK_ARM,
-                                                (cl_context_properties)callback,
-                                                CL_PRINTF_BUFFERSIZE_ARM,
-                                                0x1000,
-                                                0};
   cl_command_queue queue;
   cl_program program;
-  cl_kernel kernel;
 
   //--------------------------------------------------------------------
 
   // Sizes for the matrices
-  const unsigned M = 128;
-  const unsigned N = 256;
-  const unsigned K = 512;
+  unsigned M = 128;
+  unsigned N = 256;
+  unsigned K = 512;
+  unsigned batch = 1;
+  unsigned threads = 0;
+  GemmVariant variant = GEMM_BLOCKED;
+  bool sweep = false;
+  bool quantized = false;
+  unsigned strassenCutoff = 0;
+  bool multiDevice = false;
+  bool outOfCore = false;
+  unsigned panel = 0;
+  const char *mapDirectory = NULL;
+  string transpose;
+  bool conv = false;
+  ConvAlgorithm algorithm = CONV_AUTO;
+  ConvShape convShape = {1, 32, 56, 56, 64, 3, 3, 1, 1, 1, 1, 1, 1, CONV_NCHW};
+  bool usage = false;
+  GemmSweepConfig sweepConfig;
+  sweepConfig.sizes = parseSizes("128,256,512,1024");
+  sweepConfig.output = "perfgraph.json";
+  int arg = 1;
+  for (; arg < argc && string(argv[arg]).compare(0, 2, "--") == 0; arg++) {
+    string option = argv[arg];
+    if (option == "--kernel=tiled") {
+      variant = GEMM_TILED;
+    } else if (option == "--kernel=blocked") {
+      variant = GEMM_BLOCKED;
+    } else if (option.compare(0, 8, "--batch=") == 0) {
+      batch = atoi(option.c_str() + 8);
+    } else if (option.compare(0, 10, "--threads=") == 0) {
+      threads = atoi(option.c_str() + 10);
+    } else if (option == "--int8") {
+      quantized = true;
+    } else if (option == "--strassen") {
+      strassenCutoff = GEMM_STRASSEN_CUTOFF;
+    } else if (option.compare(0, 11, "--strassen=") == 0) {
+      strassenCutoff = atoi(option.c_str() + 11);
+      if (strassenCutoff == 0) usage = true;
+    } else if (option == "--devices") {
+      multiDevice = true;
+    } else if (option == "--out-of-core") {
+      outOfCore = true;
+    } else if (option.compare(0, 14, "--out-of-core=") == 0) {
+      outOfCore = true;
+      panel = atoi(option.c_str() + 14);
+      if (panel == 0) usage = true;
+    } else if (option.compare(0, 6, "--map=") == 0) {
+      mapDirectory = argv[arg] + 6;
+    } else if (option == "--sgemm=NN" || option == "--sgemm=NT" ||
+               option == "--sgemm=TN" || option == "--sgemm=TT") {
+      transpose = option.substr(8);
+    } else if (option == "--conv=NCHW" || option == "--conv=NHWC") {
+      conv = true;
+      convShape.layout = option == "--conv=NHWC" ? CONV_NHWC : CONV_NCHW;
+    } else if (option.compare(0, 8, "--layer=") == 0) {
+      if (!parseConvShape(argv[arg] + 8, &convShape)) usage = true;
+    } else if (option == "--algorithm=auto") {
+      algorithm = CONV_AUTO;
+    } else if (option == "--algorithm=im2col") {
+      algorithm = CONV_IM2COL;
+    } else if (option == "--algorithm=winograd") {
+      algorithm = CONV_WINOGRAD;
+    } else if (option == "--sweep" || option == "--sweep=full") {
+      sweep = true;
+      sweepConfig.full = option == "--sweep=full";
+    } else if (option.compare(0, 8, "--sizes=") == 0) {
+      sweepConfig.sizes = parseSizes(argv[arg] + 8);
+      if (sweepConfig.sizes.empty()) usage = true;
+    } else if (option.compare(0, 9, "--repeat=") == 0) {
+      sweepConfig.repetitions = atoi(option.c_str() + 9);
+      if (sweepConfig.repetitions == 0) usage = true;
+    } else if (option.compare(0, 9, "--output=") == 0) {
+      sweepConfig.output = argv[arg] + 9;
+    } else {
+      usage = true;
+    }
+  }
+  if (argc - arg == 3) {
+    M = atoi(argv[arg]);
+    N = atoi(argv[arg + 1]);
+    K = atoi(argv[arg + 2]);
+  }
+  if (usage || M == 0 || N == 0 || K == 0 || batch == 0 ||
+      (quantized && batch > 1) ||
+      (strassenCutoff && (batch > 1 || quantized || M != N || N != K)) ||
+      (multiDevice && (batch > 1 || quantized || strassenCutoff)) ||
+      ((outOfCore || mapDirectory) &&
+       (!outOfCore || batch > 1 || quantized || strassenCutoff ||
+        multiDevice)) ||
+      (!transpose.empty() && (batch > 1 || quantized || strassenCutoff ||
+                              multiDevice || outOfCore)) ||
+      (conv && (batch > 1 || quantized || strassenCutoff || multiDevice ||
+                outOfCore || !transpose.empty() || argc - arg != 0)) ||
+      (algorithm == CONV_WINOGRAD && !convWinograd(convShape)) ||
+      (argc - arg != 0 && argc - arg != 3)) {
+    printf(
+        "Usage: %s [--kernel=blocked|tiled] [--batch=B] [--threads=T] "
+        "[--int8] [--strassen[=C]]\n"
+        "       [--devices] [--out-of-core[=P]] [--map=DIR]\n"
+        "       [--sgemm=NN|NT|TN|TT] [M N K]\n"
+        "       %s --conv=NCHW|NHWC [--layer=B,C,H,W,F,K,S,P,D] "
+        "[--algorithm=auto|im2col|winograd]\n"
+        "       %s --sweep[=full] [--sizes=S1,S2,...] [--repeat=R] "
+        "[--threads=T] [--output=perfgraph.json]\n",
+        argv[0], argv[0], argv[0]);
+    return 1;
+  }
+
+  // Every mode takes its inputs from Philox
+  if (!philoxSelfTest()) return 1;
+
+  if (sweep) {
+    sweepConfig.threads = threads;
+    context = initOpenCL(&platform, &device);
+    unsigned char **opencl_program = read_file("matrix_mult.cl");
+    int result =
+        gemmSweep(context, device, (const char *)*opencl_program, sweepConfig);
+    clReleaseContext(context);
+    return result;
+  }
+  if (conv) return runConv(convShape, algorithm);
+  printf("Multiplying %u times %ux%u by %ux%u\n", batch, M, K, K, N);
+  if (outOfCore) return runOutOfCore(mapDirectory, panel, variant, M, N, K);
+
+  // The matrices of the batch are stored one after the other
+  size_t sizeA = (size_t)M * K;
+  size_t sizeB = (size_t)K * N;
+  size_t sizeX = (size_t)M * N;
 
   // Allocate memory for first matrix
-  float *input_a = (float *)malloc(sizeof(float) * M * K);
+  float *input_a = (float *)malloc(sizeof(float) * sizeA * batch);
 
   // Allocate memory for second matrix
-  float *input_b = (float *)malloc(sizeof(float) * K * N);
+  float *input_b = (float *)malloc(sizeof(float) * sizeB * batch);
 
   // Allocate memory for result matrix
-  float *output = (float *)malloc(sizeof(float) * M * N);
+  float *output = (float *)malloc(sizeof(float) * sizeX * batch);
 
   // Allocate memory for reference matrix
-  float *reference = (float *)malloc(sizeof(float) * M * N);
+  float *reference = (float *)malloc(sizeof(float) * sizeX * batch);
 
   // OpenCL buffers
   cl_mem bufferInputA;  // num_devices elements
   cl_mem bufferInputB;  // num_devices elements
   cl_mem bufferOutput;  // num_devices elements
 
-  // Work sizes
-  size_t localWorkSize[2], globalWorkSize[2];
-
-  localWorkSize[0] = 16;
-  localWorkSize[1] = 16;
-  globalWorkSize[0] = M;
-  globalWorkSize[1] = N;
-
   // Populate input matrices with random values
-  matrixPopulateRand(input_a, M, K);
-  matrixPopulateRand(input_b, K, N);
+  ThreadPool pool(threads);
+  matrixPopulateRand(input_a, M * batch, K, &pool);
+  matrixPopulateRand(input_b, K * batch, N, &pool);
 
   // Print matrices to check correctness
   // printf("Matrix A:\n");
@@ -156,34 +829,29 @@ int main() {
   // printf("Matrix B:\n");
   // matrixPrint(input_b, K, N);
 
-  // Execute CPU matrix multiplication
+  // Execute CPU matrix multiplication, it is also the reference for the GPU
   auto perf = perfStart();
-  matrixMultiply(input_a, input_b, reference, M, K, N);
+  for (unsigned b = 0; b < batch; b++) {
+    cpuGemm(input_a + b * sizeA, input_b + b * sizeB, reference + b * sizeX, M,
+            N, K, &pool);
+  }
   auto perfResult = perfDone(perf);
-  printf("CPU computation took %d milliseconds.\n", perfResult);
+  printf("CPU computation took %d milliseconds on %u threads.\n", perfResult,
+         pool.size());
 
   // Print result of multiplication
   // printf("Expected A * B:\n");
   // matrixPrint(reference, M, N);
 
+  if (multiDevice) {
+    unsigned char **opencl_program = read_file("matrix_mult.cl");
+    return runMultiDevice((const char *)*opencl_program, variant, &pool,
+                          input_a, input_b, output, reference, M, N, K);
+  }
+
   // Initialize GPU
   int status;
-
-  clGetPlatformIDs(1, &platform, NULL);
-
-  clGetPlatformInfo(platform, CL_PLATFORM_NAME, STRING_BUFFER_LEN, char_buffer,
-                    NULL);
-  printf("%-40s = %s\n", "CL_PLATFORM_NAME", char_buffer);
-  clGetPlatformInfo(platform, CL_PLATFORM_VENDOR, STRING_BUFFER_LEN,
-                    char_buffer, NULL);
-  printf("%-40s = %s\n", "CL_PLATFORM_VENDOR ", char_buffer);
-  clGetPlatformInfo(platform, CL_PLATFORM_VERSION, STRING_BUFFER_LEN,
-                    char_buffer, NULL);
-  printf("%-40s = %s\n\n", "CL_PLATFORM_VERSION ", char_buffer);
-
-  context_properties[1] = (cl_context_properties)platform;
-  clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 1, &device, NULL);
-  context = clCreateContext(context_properties, 1, &device, NULL, NULL, NULL);
+  context = initOpenCL(&platform, &device);
   queue = clCreateCommandQueue(context, device, 0, NULL);
 
   // Program compilation
@@ -194,22 +862,48 @@ int main() {
     printf("Program creation failed\n");
     return 1;
   }
-  int success = clBuildProgram(program, 0, NULL, NULL, NULL, NULL);
+  gemmBuildOptions(char_buffer, STRING_BUFFER_LEN);
+  int success = clBuildProgram(program, 0, NULL, char_buffer, NULL, NULL);
   if (success != CL_SUCCESS) print_clbuild_errors(program, device);
-  kernel = clCreateKernel(program, "matrix_mult", NULL);
+
+  GemmEngine *gemm = new GemmEngine(context, device, program);
+  if (!gemm->supports(variant)) {
+    printf("The device cannot run the %s kernel with this tile shape\n",
+           gemmVariantName(variant));
+    return 1;
+  }
+  if (quantized) {
+    int result = runQuantized(context, queue, gemm, &pool, input_a, input_b,
+                              reference, M, N, K);
+    delete gemm;
+    clReleaseCommandQueue(queue);
+    clReleaseProgram(program);
+    clReleaseContext(context);
+    return result;
+  }
+  if (!transpose.empty()) {
+    int result = runSgemm(context, queue, gemm, &pool, transpose[0],
+                          transpose[1], M, N, K);
+    delete gemm;
+    clReleaseCommandQueue(queue);
+    clReleaseProgram(program);
+    clReleaseContext(context);
+    return result;
+  }
+  printf("Using the %s kernel\n", gemmVariantName(variant));
 
   // Input buffers.
   bufferInputA = clCreateBuffer(context, CL_MEM_READ_ONLY,
-                                M * K * sizeof(float), NULL, &status);
+                                sizeA * batch * sizeof(float), NULL, &status);
   checkError(status, "Failed to create buffer for input A");
 
   bufferInputB = clCreateBuffer(context, CL_MEM_READ_ONLY,
-                                K * N * sizeof(float), NULL, &status);
+                                sizeB * batch * sizeof(float), NULL, &status);
   checkError(status, "Failed to create buffer for input A");
 
   // Output buffer.
   bufferOutput = clCreateBuffer(context, CL_MEM_WRITE_ONLY,
-                                M * N * sizeof(float), NULL, &status);
+                                sizeX * batch * sizeof(float), NULL, &status);
   checkError(status, "Failed to create buffer for output");
 
   // Transfer inputs to each device. Each of the host buffers supplied to
@@ -218,43 +912,32 @@ int main() {
   cl_event write_event[2];
   cl_event kernel_event, finish_event;
   status = clEnqueueWriteBuffer(queue, bufferInputA, CL_FALSE, 0,
-                                M * K * sizeof(float), input_a, 0, NULL,
-                                &write_event[0]);
+                                sizeA * batch * sizeof(float), input_a, 0,
+                                NULL, &write_event[0]);
   checkError(status, "Failed to transfer input A");
 
   status = clEnqueueWriteBuffer(queue, bufferInputB, CL_FALSE, 0,
-                                K * N * sizeof(float), input_b, 0, NULL,
-                                &write_event[1]);
+                                sizeB * batch * sizeof(float), input_b, 0,
+                                NULL, &write_event[1]);
   checkError(status, "Failed to transfer input B");
 
-  // Set kernel arguments.
-  unsigned argi = 0;
-
-  status = clSetKernelArg(kernel, argi++, sizeof(cl_mem), &bufferInputA);
-  checkError(status, "Failed to set argument 1");
-
-  status = clSetKernelArg(kernel, argi++, sizeof(cl_mem), &bufferInputB);
-  checkError(status, "Failed to set argument 2");
-
-  status = clSetKernelArg(kernel, argi++, sizeof(cl_mem), &bufferOutput);
-  checkError(status, "Failed to set argument 3");
-
-  status = clSetKernelArg(kernel, argi++, sizeof(int), &K);
-  checkError(status, "Failed to set argument 4");
-
-  status = clSetKernelArg(kernel, argi++, sizeof(int), &N);
-  checkError(status, "Failed to set argument 5");
-
-  // Enqueue as many kernels as it fits on the machine
+  // Enqueue the whole batch as a single launch
   perf = perfStart();
-  status = clEnqueueNDRangeKernel(queue, kernel, 2, NULL, globalWorkSize,
-                                  localWorkSize, 2, write_event, &kernel_event);
+  if (batch == 1) {
+    status = gemm->multiply(queue, variant, bufferInputA, bufferInputB,
+                            bufferOutput, M, N, K, 2, write_event,
+                            &kernel_event);
+  } else {
+    status = gemm->multiplyBatched(queue, variant, bufferInputA, sizeA,
+                                   bufferInputB, sizeB, bufferOutput, sizeX, M,
+                                   N, K, batch, 2, write_event, &kernel_event);
+  }
   checkError(status, "Failed to launch kernel");
 
   // // Read the result. This the final operation.
   status = clEnqueueReadBuffer(queue, bufferOutput, CL_TRUE, 0,
-                               M * N * sizeof(float), output, 1, &kernel_event,
-                               &finish_event);
+                               sizeX * batch * sizeof(float), output, 1,
+                               &kernel_event, &finish_event);
   perfResult = perfDone(perf);
   printf("GPU computation took %d milliseconds.\n", perfResult);
 
@@ -270,25 +953,38 @@ int main() {
   float diff = 0.0;
   float actual = 0.0;
   float expected = 0.0;
-  for (unsigned i = 0; i < M; i++) {
-    for (unsigned j = 0; j < N; j++) {
-      actual = output[i * N + j];
-      expected = reference[i * N + j];
-      diff = expected - actual;
-      if (fabsf(diff) > 1.0e-5f) {
-        printf(
-            "Failed verification @ index (%d, %d) \nExpected: %f \nActual: "
-            "%f\n",
-            i, j, expected, actual);
-        return 1;
+  for (unsigned b = 0; b < batch; b++) {
+    for (unsigned i = 0; i < M; i++) {
+      for (unsigned j = 0; j < N; j++) {
+        actual = output[b * sizeX + i * N + j];
+        expected = reference[b * sizeX + i * N + j];
+        diff = expected - actual;
+        // The GPU may contract the products into fused multiply-adds, so the
+        // results are only compared up to a relative tolerance
+        if (fabsf(diff) > 1.0e-4f * fmaxf(1.0f, fabsf(expected))) {
+          printf(
+              "Failed verification @ index (%d, %d) of matrix %d \nExpected: "
+              "%f \nActual: %f\n",
+              i, j, b, expected, actual);
+          return 1;
+        }
       }
     }
   }
 
+  if (strassenCutoff) {
+    int result = runStrassen(context, queue, program, gemm, variant,
+                             bufferInputA, bufferInputB, reference, M,
+                             strassenCutoff);
+    if (result != 0) return result;
+  }
+
   // Release local events.
   clReleaseEvent(write_event[0]);
   clReleaseEvent(write_event[1]);
-  clReleaseKernel(kernel);
+  clReleaseEvent(kernel_event);
+  clReleaseEvent(finish_event);
+  delete gemm;
   clReleaseCommandQueue(queue);
   clReleaseMemObject(bufferInputA);
   clReleaseMemObject(bufferInputB);
@@ -3,8 +3,16 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <algorithm>
 #include <iostream>  // for standard I/O
+#include <string>
+#include <vector>
+#include "common/chunk_stream.hpp"
+#include "common/fuse.hpp"
+#include "common/philox.hpp"
+#include "common/thread_pool.hpp"
 #define STRING_BUFFER_LEN 1024
 using namespace std;
 
@@ -31,9 +39,9 @@ unsigned char **read_file(const char *name) {
   size = ftell(fp);
   fseek(fp, 0, SEEK_SET);
 
-  *output = (unsigned char *)malloc(size);
-  unsigned char **outputstr = (unsigned char **)malloc(sizeof(unsigned char *));
-  *outputstr = (unsigned char *)malloc(size);
+  // The source is passed to clCreateProgramWithSource without a length, so it
+  // has to be null terminated
+  *output = (unsigned char *)malloc(size + 1);
   if (!*output) {
     fclose(fp);
     printf("mem allocate failure:%s", name);
@@ -41,14 +49,11 @@ unsigned char **read_file(const char *name) {
   }
 
   if (!fread(*output, size, 1, fp)) printf("failed to read file\n");
+  (*output)[size] = '\0';
   fclose(fp);
-  printf("file size %d\n", size);
-  printf("-------------------------------------------\n");
-  snprintf((char *)*outputstr, size, "%s\n", *output);
-  printf("%s\n", *outputstr);
-  printf("-------------------------------------------\n");
-  return outputstr;
+  return output;
 }
+
 void callback(const char *buffer, size_t length, size_t final,
               void *user_data) {
   fwrite(buffer, 1, length, stdout);
@@ -58,14 +63,34 @@ void checkError(int status, const char *msg) {
   if (status != CL_SUCCESS) printf("%s\n", msg);
 }
 
-// Randomly generate a floating-point number between -10 and 10.
-float rand_float() { return float(rand()) / float(RAND_MAX) * 20.0f - 10.0f; }
+// The inputs are floats between -10 and 10 from the Philox streams of
+// VECTOR_SEED, VECTOR_SEED + 1 and so on, one per input vector, the same in
+// every mode and on the host and the device
+#define VECTOR_SEED 2018
+#define VECTOR_LOW -10.0f
+#define VECTOR_HIGH 10.0f
+
+// wallSeconds returns a monotonic wall clock time in seconds
+double wallSeconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec * 1.0e-9;
+}
 
-int main() {
+// eventSeconds returns how long a command ran, from its profiling info
+double eventSeconds(cl_event event) {
+  cl_ulong start = 0, end = 0;
+  clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(start),
+                          &start, NULL);
+  clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(end), &end,
+                          NULL);
+  return (end - start) * 1.0e-9;
+}
+
+// initOpenCL prints the first platform and creates a context on its first
+// GPU
+cl_context initOpenCL(cl_platform_id *platform, cl_device_id *device) {
   char char_buffer[STRING_BUFFER_LEN];
-  cl_platform_id platform;
-  cl_device_id device;
-  cl_context context;
   cl_context_properties context_properties[] = {CL_CONTEXT_PLATFORM,
                                                 0,
                                                 CL_PRINTF_CALLBACK_ARM,
@@ -73,12 +98,492 @@ int main() {
                                                 CL_PRINTF_BUFFERSIZE_ARM,
                                                 0x1000,
                                                 0};
+
+  clGetPlatformIDs(1, platform, NULL);
+
+  clGetPlatformInfo(*platform, CL_PLATFORM_NAME, STRING_BUFFER_LEN,
+                    char_buffer, NULL);
+  printf("%-40s = %s\n", "CL_PLATFORM_NAME", char_buffer);
+  clGetPlatformInfo(*platform, CL_PLATFORM_VENDOR, STRING_BUFFER_LEN,
+                    char_buffer, NULL);
+  printf("%-40s = %s\n", "CL_PLATFORM_VENDOR ", char_buffer);
+  clGetPlatformInfo(*platform, CL_PLATFORM_VERSION, STRING_BUFFER_LEN,
+                    char_buffer, NULL);
+  printf("%-40s = %s\n\n", "CL_PLATFORM_VERSION ", char_buffer);
+
+  context_properties[1] = (cl_context_properties)*platform;
+  clGetDeviceIDs(*platform, CL_DEVICE_TYPE_GPU, 1, device, NULL);
+  return clCreateContext(context_properties, 1, device, NULL, NULL, NULL);
+}
+
+// runStream adds the raw floats of the files paths[0] and paths[1] ("-" for
+// the standard input) chunk by chunk and writes the sums to paths[2], when
+// given. Both inputs go through ChunkStreams on an upload queue while the
+// kernel runs on another, so the uploads of chunk i + 1 overlap the addition
+// of chunk i. The sums are read back without waiting into pinned buffers,
+// and each chunk is checked against the CPU and written out one chunk
+// later, so the memory used does not depend on the size of the data.
+// Returns 0 when every sum matches.
+int runStream(cl_context context, cl_device_id device, cl_kernel kernel,
+              char *paths[3], size_t chunk) {
+  const unsigned depth = 2;
+  cl_command_queue queues[2];
+  for (unsigned i = 0; i < 2; i++) {
+    queues[i] = clCreateCommandQueue(context, device, 0, NULL);
+  }
+  ChunkStream *streams[2];
+  bool opened = true;
+  for (unsigned i = 0; i < 2; i++) {
+    streams[i] = new ChunkStream(context, queues[0], chunk, depth);
+    opened = streams[i]->open(paths[i]) && opened;
+  }
+  FILE *output = NULL;
+  if (paths[2]) {
+    output = strcmp(paths[2], "-") == 0 ? stdout : fopen(paths[2], "wb");
+    if (!output) printf("Failed to open %s\n", paths[2]);
+    opened = output && opened;
+  }
+
+  // The sums of chunk i go to sums[i % depth], then to the pinned host
+  // buffer of the same slot
+  cl_int status = CL_SUCCESS;
+  cl_mem sums[depth], pinned[depth];
+  float *mapped[depth];
+  const float *inputs[depth][2];
+  size_t counts[depth] = {0, 0};
+  cl_event reads[depth] = {NULL, NULL};
+  size_t bytes = chunk * sizeof(float);
+  for (unsigned i = 0; i < depth; i++) {
+    sums[i] =
+        clCreateBuffer(context, CL_MEM_WRITE_ONLY, bytes, NULL, &status);
+    checkError(status, "Failed to create buffer for output");
+    pinned[i] = clCreateBuffer(
+        context, CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR, bytes, NULL,
+        &status);
+    checkError(status, "Failed to create buffer for output");
+    mapped[i] = (float *)clEnqueueMapBuffer(queues[1], pinned[i], CL_TRUE,
+                                            CL_MAP_READ, 0, bytes, 0, NULL,
+                                            NULL, &status);
+    checkError(status, "Failed to map the output");
+  }
+  if (!opened) status = CL_INVALID_VALUE;
+
+  unsigned long long n = 0;
+  bool pass = true;
+  double start = wallSeconds();
+  for (unsigned i = 0; status == CL_SUCCESS && pass; i++) {
+    cl_mem buffers[2];
+    cl_event uploaded[2];
+    size_t count[2];
+    unsigned slot = i % depth;
+    for (unsigned k = 0; k < 2; k++) {
+      count[k] = streams[k]->next(&buffers[k], &inputs[slot][k], &uploaded[k]);
+    }
+    if (count[0] != count[1]) printf("The inputs differ in size\n");
+    counts[slot] = count[0] < count[1] ? count[0] : count[1];
+
+    if (counts[slot]) {
+      cl_event kernel_event;
+      unsigned argi = 0;
+      status |= clSetKernelArg(kernel, argi++, sizeof(cl_mem), &buffers[0]);
+      status |= clSetKernelArg(kernel, argi++, sizeof(cl_mem), &buffers[1]);
+      status |= clSetKernelArg(kernel, argi++, sizeof(cl_mem), &sums[slot]);
+      checkError(status, "Failed to set the kernel arguments");
+      if (status != CL_SUCCESS) break;
+      status = clEnqueueNDRangeKernel(queues[1], kernel, 1, NULL,
+                                      &counts[slot], NULL, 2, uploaded,
+                                      &kernel_event);
+      checkError(status, "Failed to launch kernel");
+      if (status != CL_SUCCESS) break;
+      for (unsigned k = 0; k < 2; k++) {
+        clRetainEvent(kernel_event);
+        streams[k]->done(kernel_event);
+      }
+      clReleaseEvent(kernel_event);
+      status = clEnqueueReadBuffer(queues[1], sums[slot], CL_FALSE, 0,
+                                   counts[slot] * sizeof(float), mapped[slot],
+                                   0, NULL, &reads[slot]);
+      checkError(status, "Failed to read the output");
+      clFlush(queues[1]);
+    }
+
+    // Check and write the previous chunk while this one is computed
+    unsigned previous = (i + depth - 1) % depth;
+    if (reads[previous]) {
+      clWaitForEvents(1, &reads[previous]);
+      clReleaseEvent(reads[previous]);
+      reads[previous] = NULL;
+      const float *x = inputs[previous][0], *y = inputs[previous][1];
+      for (size_t j = 0; j < counts[previous] && pass; j++) {
+        if (fabsf(mapped[previous][j] - (x[j] + y[j])) > 1.0e-5f) {
+          printf("Failed verification @ index %llu\nOutput: %f\n"
+                 "Reference: %f\n",
+                 n + j, mapped[previous][j], x[j] + y[j]);
+          pass = false;
+        }
+      }
+      if (output) {
+        fwrite(mapped[previous], sizeof(float), counts[previous], output);
+      }
+      n += counts[previous];
+    }
+    if (counts[slot] == 0) break;
+  }
+  printf("Streamed %llu sums in %.6lf seconds\n", n, wallSeconds() - start);
+
+  for (unsigned i = 0; i < depth; i++) {
+    if (reads[i]) {
+      clWaitForEvents(1, &reads[i]);
+      clReleaseEvent(reads[i]);
+    }
+    clEnqueueUnmapMemObject(queues[1], pinned[i], mapped[i], 0, NULL, NULL);
+  }
+  clFinish(queues[1]);
+  for (unsigned i = 0; i < depth; i++) {
+    clReleaseMemObject(sums[i]);
+    clReleaseMemObject(pinned[i]);
+  }
+  for (unsigned k = 0; k < 2; k++) delete streams[k];
+  if (output && output != stdout) fclose(output);
+  for (unsigned i = 0; i < 2; i++) clReleaseCommandQueue(queues[i]);
+  return status == CL_SUCCESS && pass ? 0 : 1;
+}
+
+// Number of chunks in flight in runPipeline: one uploading, one being added
+// and one reading back
+#define PIPELINE_DEPTH 3
+
+// runPipeline adds N random floats to N others like the whole array mode,
+// but a chunk at a time through PIPELINE_DEPTH slots, each with pinned host
+// buffers for x, y and z and device buffers for them. Uploads go to the first
+// of the numQueues (2 or 3) queues, kernels to the second and readbacks to
+// the last, so the upload of chunk k + 1, the kernel of chunk k and the
+// readback of chunk k - 1 run at the same time, and the random inputs of the
+// next chunk are generated on the host meanwhile. A slot is only reused once
+// its readback has been checked, which bounds the memory used to
+// 6 * PIPELINE_DEPTH chunks whatever N is. Prints the wall time next to the
+// total transfer and kernel times: with enough overlap it approaches the
+// largest of them rather than their sum. Returns 0 when every sum matches.
+int runPipeline(cl_context context, cl_device_id device, cl_kernel kernel,
+                unsigned N, size_t chunk, unsigned numQueues,
+                ThreadPool *pool) {
+  cl_command_queue queues[3];
+  for (unsigned i = 0; i < numQueues; i++) {
+    queues[i] = clCreateCommandQueue(context, device,
+                                     CL_QUEUE_PROFILING_ENABLE, NULL);
+  }
+  cl_command_queue upload = queues[0], compute = queues[1];
+  cl_command_queue readback = queues[numQueues - 1];
+
+  // Slot i holds the pinned host buffers pinned[i][0..2] mapped at
+  // host[i][0..2] and the device buffers buffers[i][0..2], for x, y and z
+  const cl_mem_flags flags[3] = {CL_MEM_READ_ONLY, CL_MEM_READ_ONLY,
+                                 CL_MEM_WRITE_ONLY};
+  const cl_map_flags mapFlags[3] = {CL_MAP_WRITE, CL_MAP_WRITE, CL_MAP_READ};
+  cl_mem pinned[PIPELINE_DEPTH][3], buffers[PIPELINE_DEPTH][3];
+  float *host[PIPELINE_DEPTH][3];
+  size_t counts[PIPELINE_DEPTH] = {0};
+  cl_event events[PIPELINE_DEPTH][4];  // uploads of x and y, kernel, read
+  size_t bytes = chunk * sizeof(float);
+  cl_int status = CL_SUCCESS;
+  for (unsigned i = 0; i < PIPELINE_DEPTH; i++) {
+    for (unsigned k = 0; k < 3; k++) {
+      pinned[i][k] = clCreateBuffer(context, flags[k] | CL_MEM_ALLOC_HOST_PTR,
+                                    bytes, NULL, &status);
+      checkError(status, "Failed to create a pinned buffer");
+      host[i][k] = (float *)clEnqueueMapBuffer(upload, pinned[i][k], CL_TRUE,
+                                               mapFlags[k], 0, bytes, 0, NULL,
+                                               NULL, &status);
+      checkError(status, "Failed to map a pinned buffer");
+      buffers[i][k] =
+          clCreateBuffer(context, flags[k], bytes, NULL, &status);
+      checkError(status, "Failed to create a buffer");
+    }
+  }
+
+  unsigned chunks = (N + chunk - 1) / chunk;
+  double transfer = 0.0, compute_time = 0.0;
+  bool pass = true;
+  double start = wallSeconds();
+  for (unsigned k = 0; k < chunks + PIPELINE_DEPTH && pass; k++) {
+    unsigned slot = k % PIPELINE_DEPTH;
+
+    // Check the chunk that last used this slot before overwriting it
+    if (k >= PIPELINE_DEPTH && counts[slot]) {
+      clWaitForEvents(1, &events[slot][3]);
+      const float *x = host[slot][0], *y = host[slot][1], *z = host[slot][2];
+      size_t first = (size_t)(k - PIPELINE_DEPTH) * chunk;
+      for (size_t j = 0; j < counts[slot] && pass; j++) {
+        if (fabsf(z[j] - (x[j] + y[j])) > 1.0e-5f) {
+          printf("Failed verification @ index %zu\nOutput: %f\n"
+                 "Reference: %f\n",
+                 first + j, z[j], x[j] + y[j]);
+          pass = false;
+        }
+      }
+      transfer += eventSeconds(events[slot][0]) +
+                  eventSeconds(events[slot][1]) + eventSeconds(events[slot][3]);
+      compute_time += eventSeconds(events[slot][2]);
+      for (unsigned e = 0; e < 4; e++) clReleaseEvent(events[slot][e]);
+    }
+    counts[slot] = 0;
+    if (k >= chunks || !pass) continue;
+
+    size_t count = min(chunk, (size_t)N - (size_t)k * chunk);
+    status = CL_SUCCESS;
+    for (unsigned i = 0; i < 3; i++) {
+      status |= clSetKernelArg(kernel, i, sizeof(cl_mem), &buffers[slot][i]);
+    }
+    checkError(status, "Failed to set the kernel arguments");
+    if (status != CL_SUCCESS) break;
+    for (unsigned i = 0; i < 2; i++) {
+      cpuPhiloxUniform(VECTOR_SEED + i, (size_t)k * chunk, host[slot][i],
+                       count, VECTOR_LOW, VECTOR_HIGH, pool);
+    }
+    for (unsigned i = 0; i < 2; i++) {
+      status = clEnqueueWriteBuffer(upload, buffers[slot][i], CL_FALSE, 0,
+                                    count * sizeof(float), host[slot][i], 0,
+                                    NULL, &events[slot][i]);
+      checkError(status, "Failed to transfer an input chunk");
+    }
+    status = clEnqueueNDRangeKernel(compute, kernel, 1, NULL, &count, NULL, 2,
+                                    events[slot], &events[slot][2]);
+    checkError(status, "Failed to launch kernel");
+    status = clEnqueueReadBuffer(readback, buffers[slot][2], CL_FALSE, 0,
+                                 count * sizeof(float), host[slot][2], 1,
+                                 &events[slot][2], &events[slot][3]);
+    checkError(status, "Failed to read an output chunk");
+    if (status != CL_SUCCESS) break;
+    counts[slot] = count;
+    for (unsigned i = 0; i < numQueues; i++) clFlush(queues[i]);
+  }
+  for (unsigned i = 0; i < numQueues; i++) clFinish(queues[i]);
+  double elapsed = wallSeconds() - start;
+  printf("Pipelined %u chunks of %zu floats on %u queues\n", chunks, chunk,
+         numQueues);
+  printf("GPU took %.6lf seconds to run, transfers %.6lf, kernels %.6lf\n",
+         elapsed, transfer, compute_time);
+
+  for (unsigned i = 0; i < PIPELINE_DEPTH; i++) {
+    if (counts[i]) {
+      for (unsigned e = 0; e < 4; e++) clReleaseEvent(events[i][e]);
+    }
+    for (unsigned k = 0; k < 3; k++) {
+      clEnqueueUnmapMemObject(upload, pinned[i][k], host[i][k], 0, NULL,
+                              NULL);
+    }
+  }
+  clFinish(upload);
+  for (unsigned i = 0; i < PIPELINE_DEPTH; i++) {
+    for (unsigned k = 0; k < 3; k++) {
+      clReleaseMemObject(pinned[i][k]);
+      clReleaseMemObject(buffers[i][k]);
+    }
+  }
+  for (unsigned i = 0; i < numQueues; i++) clReleaseCommandQueue(queues[i]);
+  return status == CL_SUCCESS && pass ? 0 : 1;
+}
+
+// checkOutput compares n results to their reference, relative to its size,
+// and prints the first mismatch
+bool checkOutput(const float *output, const float *ref, unsigned n) {
+  for (unsigned j = 0; j < n; j++) {
+    if (fabsf(output[j] - ref[j]) > 1.0e-5f * (1.0f + fabsf(ref[j]))) {
+      printf("Failed verification @ index %u\nOutput: %f\nReference: %f\n", j,
+             output[j], ref[j]);
+      return false;
+    }
+  }
+  return true;
+}
+
+// runFused computes z = a * x + b * y - abs(w) for N random floats in x, y
+// and w, once as a single fused kernel and once an operation at a time
+// through temporaries, like a chain of vector_add style kernels would, and
+// prints the time of both from profiling events. The inputs are generated
+// directly in the device buffers, and on the host for the CPU reference,
+// which both results are checked against, after philox4x32 is checked
+// against its known answers. Returns 0 when they all match.
+int runFused(cl_context context, cl_device_id device, unsigned N,
+             ThreadPool *pool) {
+  cl_command_queue queue =
+      clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, NULL);
+  FuseEngine engine(context, device);
+  const float a = 2.0f, b = 0.5f;
+  size_t bytes = (size_t)N * sizeof(float);
+  vector<float> host[3], ref(N), output(N);
+  cl_mem buffers[3], temps[2], z;
+  cl_int status = CL_SUCCESS;
+  unsigned char **source = read_file("../common/philox.cl");
+  DevicePhilox philox(context, device, (const char *)*source);
+  for (unsigned k = 0; k < 3; k++) {
+    host[k].resize(N);
+    cpuPhiloxUniform(VECTOR_SEED + k, 0, host[k].data(), N, VECTOR_LOW,
+                     VECTOR_HIGH, pool);
+    buffers[k] =
+        clCreateBuffer(context, CL_MEM_READ_ONLY, bytes, NULL, &status);
+    checkError(status, "Failed to create an input buffer");
+    status = philox.uniform(queue, buffers[k], VECTOR_SEED + k, 0, N,
+                            VECTOR_LOW, VECTOR_HIGH);
+    checkError(status, "Failed to generate an input");
+  }
+
+  // The generator must give the answers of the reference implementation, and
+  // the streams of the device must be those of the host, bit for bit
+  bool pass = philoxSelfTest();
+  for (unsigned k = 0; k < 3 && pass; k++) {
+    status = clEnqueueReadBuffer(queue, buffers[k], CL_TRUE, 0, bytes,
+                                 output.data(), 0, NULL, NULL);
+    pass = status == CL_SUCCESS && memcmp(output.data(), host[k].data(),
+                                          bytes) == 0;
+    if (!pass) printf("The device and host streams of input %u differ\n", k);
+  }
+  for (unsigned k = 0; k < 2; k++) {
+    temps[k] = clCreateBuffer(context, CL_MEM_READ_WRITE, bytes, NULL, &status);
+    checkError(status, "Failed to create a temporary buffer");
+  }
+  z = clCreateBuffer(context, CL_MEM_WRITE_ONLY, bytes, NULL, &status);
+  checkError(status, "Failed to create buffer for output");
+
+  FuseVector x(buffers[0], N, host[0].data());
+  FuseVector y(buffers[1], N, host[1].data());
+  FuseVector w(buffers[2], N, host[2].data());
+  FuseVector t0(temps[0], N), t1(temps[1], N);
+  auto expression = a * x + b * y - abs(w);
+  cpuFuse(expression, ref.data(), N);
+
+  // One kernel, then the 5 operations of the expression one by one
+  cl_event fused = NULL, steps[5] = {NULL, NULL, NULL, NULL, NULL};
+  status = engine.run(queue, z, expression, 0, NULL, &fused);
+  checkError(status, "Failed to run the fused kernel");
+  status = clEnqueueReadBuffer(queue, z, CL_TRUE, 0, bytes, output.data(), 0,
+                               NULL, NULL);
+  checkError(status, "Failed to read the output");
+  pass = pass && status == CL_SUCCESS &&
+         checkOutput(output.data(), ref.data(), N);
+
+  engine.run(queue, temps[0], a * x, 0, NULL, &steps[0]);
+  engine.run(queue, temps[1], b * y, 0, NULL, &steps[1]);
+  engine.run(queue, temps[0], t0 + t1, 0, NULL, &steps[2]);
+  engine.run(queue, temps[1], abs(w), 0, NULL, &steps[3]);
+  status = engine.run(queue, z, t0 - t1, 0, NULL, &steps[4]);
+  checkError(status, "Failed to run the separate kernels");
+  status = clEnqueueReadBuffer(queue, z, CL_TRUE, 0, bytes, output.data(), 0,
+                               NULL, NULL);
+  checkError(status, "Failed to read the output");
+  pass = pass && status == CL_SUCCESS &&
+         checkOutput(output.data(), ref.data(), N);
+
+  double separate = 0.0;
+  for (unsigned k = 0; k < 5; k++) {
+    if (!steps[k]) continue;
+    separate += eventSeconds(steps[k]);
+    clReleaseEvent(steps[k]);
+  }
+  printf("z = a * x + b * y - abs(w) on %u floats, %zu kernels built\n", N,
+         engine.kernels());
+  printf("Fused kernel took %.6lf seconds, 5 separate kernels %.6lf\n",
+         eventSeconds(fused), separate);
+  if (fused) clReleaseEvent(fused);
+
+  for (unsigned k = 0; k < 3; k++) clReleaseMemObject(buffers[k]);
+  for (unsigned k = 0; k < 2; k++) clReleaseMemObject(temps[k]);
+  clReleaseMemObject(z);
+  clReleaseCommandQueue(queue);
+  return pass ? 0 : 1;
+}
+
+// Usage: vector_add
+//        vector_add --fused[=N]
+//        vector_add --pipeline[=Q] [--chunk=C]
+//        vector_add --stream=X,Y[,Z] [--chunk=C]
+// Adds two vectors of N random floats on the CPU and on the GPU and compares
+// the results. With --fused, evaluates a chain of element-wise operations
+// on N floats (16777216 by default) as one generated kernel and as separate
+// ones. With --pipeline, does the same a chunk at a time on Q queues
+// (2 or 3, 3 by default), overlapping transfers and kernels. With --stream,
+// adds the raw floats of the files X and Y instead, chunk by chunk, and
+// writes the sums to Z. Any of them may be - for the standard input or
+// output. Chunks are C floats, 1048576 by default.
+int main(int argc, char **argv) {
+  cl_platform_id platform;
+  cl_device_id device;
+  cl_context context;
   cl_command_queue queue;
   cl_program program;
   cl_kernel kernel;
 
   //--------------------------------------------------------------------
+  char *paths[3] = {NULL, NULL, NULL};
+  size_t chunk = 1 << 20;
+  unsigned numQueues = 0, fused = 0;
+  bool usage = false;
+  for (int arg = 1; arg < argc; arg++) {
+    string option = argv[arg];
+    if (option == "--fused") {
+      fused = 1 << 24;
+    } else if (option.compare(0, 8, "--fused=") == 0) {
+      fused = atoi(option.c_str() + 8);
+      usage = usage || fused == 0;
+    } else if (option == "--pipeline") {
+      numQueues = 3;
+    } else if (option.compare(0, 11, "--pipeline=") == 0) {
+      numQueues = atoi(option.c_str() + 11);
+      usage = usage || numQueues < 2 || numQueues > 3;
+    } else if (option.compare(0, 9, "--stream=") == 0) {
+      // The paths are split in place at the commas
+      char *path = argv[arg] + 9;
+      for (unsigned i = 0; i < 3 && path; i++) {
+        paths[i] = path;
+        path = strchr(path, ',');
+        if (path) *path++ = '\0';
+      }
+      usage = usage || !paths[1] || path;
+    } else if (option.compare(0, 8, "--chunk=") == 0) {
+      chunk = atoi(option.c_str() + 8);
+      usage = usage || chunk == 0;
+    } else {
+      usage = true;
+    }
+  }
+  if (usage || (bool)paths[0] + (bool)numQueues + (bool)fused > 1) {
+    printf("Usage: %s\n       %s --fused[=N]\n"
+           "       %s --pipeline[=Q] [--chunk=C]\n"
+           "       %s --stream=X,Y[,Z] [--chunk=C]\n",
+           argv[0], argv[0], argv[0], argv[0]);
+    return 1;
+  }
+  if (fused) {
+    context = initOpenCL(&platform, &device);
+    ThreadPool pool;
+    int result = runFused(context, device, fused, &pool);
+    clReleaseContext(context);
+    return result;
+  }
   const unsigned N = 50000000;
+  if (paths[0] || numQueues) {
+    context = initOpenCL(&platform, &device);
+    unsigned char **opencl_program = read_file("vector_add.cl");
+    program = clCreateProgramWithSource(
+        context, 1, (const char **)opencl_program, NULL, NULL);
+    if (program == NULL) {
+      printf("Program creation failed\n");
+      return 1;
+    }
+    int success = clBuildProgram(program, 0, NULL, NULL, NULL, NULL);
+    if (success != CL_SUCCESS) print_clbuild_errors(program, device);
+    kernel = clCreateKernel(program, "vector_add", NULL);
+    ThreadPool pool;
+    int result =
+        numQueues
+            ? runPipeline(context, device, kernel, N, chunk, numQueues, &pool)
+            : runStream(context, device, kernel, paths, chunk);
+    clReleaseKernel(kernel);
+    clReleaseProgram(program);
+    clReleaseContext(context);
+    return result;
+  }
+
   float *input_a = (float *)malloc(sizeof(float) * N);
   float *input_b = (float *)malloc(sizeof(float) * N);
   float *output = (float *)malloc(sizeof(float) * N);
@@ -88,36 +593,20 @@ int main() {
   cl_mem output_buf;   // num_devices elements
   int status;
 
-  time_t start, end;
-  double diff;
-  for (unsigned j = 0; j < N; ++j) {
-    input_a[j] = rand_float();
-    input_b[j] = rand_float();
-  }
-  time(&start);
+  double start;
+  ThreadPool pool;
+  cpuPhiloxUniform(VECTOR_SEED, 0, input_a, N, VECTOR_LOW, VECTOR_HIGH, &pool);
+  cpuPhiloxUniform(VECTOR_SEED + 1, 0, input_b, N, VECTOR_LOW, VECTOR_HIGH,
+                   &pool);
+  start = wallSeconds();
   for (unsigned j = 0; j < N; ++j) {
     ref_output[j] = input_a[j] + input_b[j];
     // printf("ref %f\n",ref_output[j]);
   }
-  time(&end);
-  diff = difftime(end, start);
-  printf("CPU took %.2lf seconds to run.\n", diff);
-
-  time(&start);
-  clGetPlatformIDs(1, &platform, NULL);
-  clGetPlatformInfo(platform, CL_PLATFORM_NAME, STRING_BUFFER_LEN, char_buffer,
-                    NULL);
-  printf("%-40s = %s\n", "CL_PLATFORM_NAME", char_buffer);
-  clGetPlatformInfo(platform, CL_PLATFORM_VENDOR, STRING_BUFFER_LEN,
-                    char_buffer, NULL);
-  printf("%-40s = %s\n", "CL_PLATFORM_VENDOR ", char_buffer);
-  clGetPlatformInfo(platform, CL_PLATFORM_VERSION, STRING_BUFFER_LEN,
-                    char_buffer, NULL);
-  printf("%-40s = %s\n\n", "CL_PLATFORM_VERSION ", char_buffer);
+  printf("CPU took %.6lf seconds to run.\n", wallSeconds() - start);
 
-  context_properties[1] = (cl_context_properties)platform;
-  clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 1, &device, NULL);
-  context = clCreateContext(context_properties, 1, &device, NULL, NULL, NULL);
+  start = wallSeconds();
+  context = initOpenCL(&platform, &device);
   queue = clCreateCommandQueue(context, device, 0, NULL);
 
   unsigned char **opencl_program = read_file("vector_add.cl");
@@ -179,9 +668,7 @@ int main() {
   status = clEnqueueReadBuffer(queue, output_buf, CL_TRUE, 0, N * sizeof(float),
                                output, 1, &kernel_event, &finish_event);
 
-  time(&end);
-  diff = difftime(end, start);
-  printf("GPU took %.8lf seconds to run.\n", diff);
+  printf("GPU took %.6lf seconds to run.\n", wallSeconds() - start);
   // Verify results.
   bool pass = true;
 
@@ -1,10 +1,23 @@
-__kernel void vector_average(__global const float *x, __global float *restrict z)
-{
-  int i;
-  int offset = get_group_id(0) * get_local_size(0);
-  z[get_group_id(0)] = 0;
-  for (i = 0; i < get_local_size(0); i++) { // size of input buffer
-    z[get_group_id(0)] += x[i + offset];
+// vector_average sums n elements of x scaled by scale into one value per
+// work-group, written to z[get_group_id(0)]. Each work-item first
+// accumulates the elements get_global_size(0) apart from its global id, so
+// any n is covered by any number of work-items, then the work-group adds up
+// its values in a tree in scratch, one float per work-item. The local size
+// must be a power of two.
+__kernel void vector_average(__global const float *x,
+                             __global float *restrict z, unsigned n,
+                             float scale, __local float *scratch) {
+  unsigned lid = get_local_id(0);
+  float sum = 0.0f;
+  for (unsigned i = get_global_id(0); i < n; i += get_global_size(0)) {
+    sum += x[i];
   }
-  // printf("Result %.2f\n", z[get_group_id(0)]);
+  scratch[lid] = sum;
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  for (unsigned stride = get_local_size(0) / 2; stride > 0; stride /= 2) {
+    if (lid < stride) scratch[lid] += scratch[lid + stride];
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+  if (lid == 0) z[get_group_id(0)] = scratch[0] * scale;
 }
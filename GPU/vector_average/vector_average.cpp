@@ -1,10 +1,16 @@
 #include <CL/cl.h>
 #include <CL/cl_ext.h>
+#include <float.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
+#include <algorithm>
 #include <iostream>  // for standard I/O
+#include <string>
+#include <vector>
+#include "common/chunk_stream.hpp"
+#include "common/reduce.hpp"
 #define STRING_BUFFER_LEN 1024
 using namespace std;
 
@@ -30,7 +36,9 @@ unsigned char **read_file(const char *name) {
   size = ftell(fp);
   fseek(fp, 0, SEEK_SET);
 
-  *output = (unsigned char *)malloc(size);
+  // The source is passed to clCreateProgramWithSource without a length, so it
+  // has to be null terminated
+  *output = (unsigned char *)malloc(size + 1);
   if (!*output) {
     fclose(fp);
     printf("mem allocate failure:%s", name);
@@ -38,6 +46,7 @@ unsigned char **read_file(const char *name) {
   }
 
   if (!fread(*output, size, 1, fp)) printf("failed to read file\n");
+  (*output)[size] = '\0';
   fclose(fp);
   return output;
 }
@@ -54,11 +63,10 @@ void checkError(int status, const char *msg) {
 // Randomly generate a floating-point number between -10 and 10.
 float rand_float() { return float(rand()) / float(RAND_MAX) * 20.0f - 10.0f; }
 
-int main() {
+// initOpenCL prints the first platform and creates a context on its first
+// GPU
+cl_context initOpenCL(cl_platform_id *platform, cl_device_id *device) {
   char char_buffer[STRING_BUFFER_LEN];
-  cl_platform_id platform;
-  cl_device_id device;
-  cl_context context;
   cl_context_properties context_properties[] = {CL_CONTEXT_PLATFORM,
                                                 0,
                                                 CL_PRINTF_CALLBACK_ARM,
@@ -66,19 +74,332 @@ int main() {
                                                 CL_PRINTF_BUFFERSIZE_ARM,
                                                 0x1000,
                                                 0};
+
+  clGetPlatformIDs(1, platform, NULL);
+
+  clGetPlatformInfo(*platform, CL_PLATFORM_NAME, STRING_BUFFER_LEN,
+                    char_buffer, NULL);
+  printf("%-40s = %s\n", "CL_PLATFORM_NAME", char_buffer);
+  clGetPlatformInfo(*platform, CL_PLATFORM_VENDOR, STRING_BUFFER_LEN,
+                    char_buffer, NULL);
+  printf("%-40s = %s\n", "CL_PLATFORM_VENDOR ", char_buffer);
+  clGetPlatformInfo(*platform, CL_PLATFORM_VERSION, STRING_BUFFER_LEN,
+                    char_buffer, NULL);
+  printf("%-40s = %s\n\n", "CL_PLATFORM_VERSION ", char_buffer);
+
+  context_properties[1] = (cl_context_properties)*platform;
+  clGetDeviceIDs(*platform, CL_DEVICE_TYPE_GPU, 1, device, NULL);
+  return clCreateContext(context_properties, 1, device, NULL, NULL, NULL);
+}
+
+// checkClose prints the result of a check of actual against expected and
+// returns whether they differ by at most tolerance
+bool checkClose(const char *what, double actual, double expected,
+                double tolerance) {
+  bool passed = fabs(actual - expected) <= tolerance;
+  printf("%-24s %s: %f, expected %f\n", what, passed ? "ok" : "FAILED", actual,
+         expected);
+  return passed;
+}
+
+// runLibrary runs every reduction and scan of DeviceReduce and their CPU
+// equivalents on the n floats of x, which input holds on the device, and
+// compares them with a double precision reference. The float results may
+// differ from it by one epsilon of the sum of |x| per addition on the
+// longest path of each algorithm. Returns 0 when all of them match.
+int runLibrary(cl_context context, cl_device_id device, cl_command_queue queue,
+               cl_mem input, const float *x, unsigned n) {
+  unsigned char **source = read_file("../common/reduce.cl");
+  DeviceReduce reduce(context, device, (const char *)*source);
+  ThreadPool pool;
+  bool passed = true;
+
+  // The references, and the bounds of the device and of the CPU
+  double sum = 0.0, absSum = 0.0, mean, m2 = 0.0;
+  ReduceIndex argmin = {x[0], 0}, argmax = {x[0], 0};
+  for (unsigned i = 0; i < n; i++) {
+    sum += x[i];
+    absSum += fabs(x[i]);
+    if (x[i] < argmin.value) argmin = ReduceIndex{x[i], i};
+    if (x[i] > argmax.value) argmax = ReduceIndex{x[i], i};
+  }
+  mean = sum / n;
+  for (unsigned i = 0; i < n; i++) m2 += (x[i] - mean) * (x[i] - mean);
+  double levels = 2 * ceil(log2((double)n)) + 2;
+  double depths[2] = {ceil((double)n / reduce.threads()) + levels,
+                      ceil((double)n / pool.size()) + pool.size() + 1};
+
+  for (unsigned cpu = 0; cpu < 2; cpu++) {
+    float values[3];
+    ReduceIndex indices[2];
+    ReduceMoments moments;
+    ReduceOp ops[3] = {REDUCE_SUM, REDUCE_MIN, REDUCE_MAX};
+    for (unsigned i = 0; i < 3; i++) {
+      if (cpu) {
+        cpuReduce(ops[i], x, n, &values[i], &pool);
+      } else {
+        checkError(reduce.reduce(queue, ops[i], input, n, &values[i]),
+                   "Failed to reduce");
+      }
+    }
+    for (unsigned i = 0; i < 2; i++) {
+      ReduceOp op = i ? REDUCE_ARGMAX : REDUCE_ARGMIN;
+      if (cpu) {
+        cpuReduce(op, x, n, &indices[i], &pool);
+      } else {
+        checkError(reduce.reduce(queue, op, input, n, &indices[i]),
+                   "Failed to reduce");
+      }
+    }
+    if (cpu) {
+      cpuReduce(REDUCE_MOMENTS, x, n, &moments, &pool);
+    } else {
+      checkError(reduce.reduce(queue, REDUCE_MOMENTS, input, n, &moments),
+                 "Failed to reduce");
+    }
+
+    double tolerance = depths[cpu] * FLT_EPSILON;
+    string name = cpu ? "CPU" : "GPU";
+    passed &= checkClose((name + " sum").c_str(), values[0], sum,
+                         tolerance * absSum);
+    passed &= checkClose((name + " min").c_str(), values[1], argmin.value, 0);
+    passed &= checkClose((name + " max").c_str(), values[2], argmax.value, 0);
+    passed &= checkClose((name + " argmin").c_str(), indices[0].index,
+                         argmin.index, 0);
+    passed &= checkClose((name + " argmax").c_str(), indices[1].index,
+                         argmax.index, 0);
+    passed &= checkClose((name + " mean").c_str(), moments.mean, mean,
+                         tolerance * absSum / n);
+    passed &= checkClose((name + " variance").c_str(), moments.m2 / n, m2 / n,
+                         2 * tolerance * m2 / n);
+  }
+
+  // Inclusive and exclusive sums, checked element by element on the fly
+  vector<float> scanned(n);
+  cl_mem output = clCreateBuffer(context, CL_MEM_READ_WRITE, n * sizeof(float),
+                                 NULL, NULL);
+  for (unsigned mode = 0; mode < 4 && output; mode++) {
+    bool inclusive = mode % 2 == 0, cpu = mode >= 2;
+    if (cpu) {
+      cpuScan(REDUCE_SUM, x, scanned.data(), n, inclusive, &pool);
+    } else {
+      checkError(reduce.scan(queue, REDUCE_SUM, input, output, n, inclusive),
+                 "Failed to scan");
+      clEnqueueReadBuffer(queue, output, CL_TRUE, 0, n * sizeof(float),
+                          scanned.data(), 0, NULL, NULL);
+    }
+    double prefix = 0.0, absPrefix = 0.0, error = 0.0, bound = 0.0;
+    for (unsigned i = 0; i < n; i++) {
+      if (inclusive) {
+        prefix += x[i];
+        absPrefix += fabs(x[i]);
+      }
+      error = fmax(error, fabs(scanned[i] - prefix));
+      bound = fmax(bound, depths[cpu] * FLT_EPSILON * absPrefix);
+      if (!inclusive) {
+        prefix += x[i];
+        absPrefix += fabs(x[i]);
+      }
+    }
+    string name = string(cpu ? "CPU" : "GPU") +
+                  (inclusive ? " inclusive scan" : " exclusive scan");
+    passed &= checkClose((name + " error").c_str(), error, 0.0, bound);
+  }
+  if (output) clReleaseMemObject(output);
+  return passed ? 0 : 1;
+}
+
+// runCompensated sums the n floats of x, which input holds on the device,
+// with a plain float reduction and with compensated summation, on the GPU
+// and on the CPU, and compares them with the double precision sum. A float
+// sum may be off by one epsilon of the sum of |x| per addition on its
+// longest path, which grows with n; the compensated sum by 2 epsilons plus
+// n epsilons squared, which is what it is checked against. Returns 0 when
+// every sum is within its bound.
+int runCompensated(cl_context context, cl_device_id device,
+                   cl_command_queue queue, cl_mem input, const float *x,
+                   unsigned n) {
+  unsigned char **source = read_file("../common/reduce.cl");
+  DeviceReduce reduce(context, device, (const char *)*source);
+  ThreadPool pool;
+
+  double sum = 0.0, absSum = 0.0;
+  for (unsigned i = 0; i < n; i++) {
+    sum += x[i];
+    absSum += fabs(x[i]);
+  }
+  double plainDepth = ceil((double)n / reduce.threads()) +
+                      2 * ceil(log2((double)reduce.threads())) + 1;
+  double compensatedBound =
+      (2 * FLT_EPSILON + n * (double)FLT_EPSILON * FLT_EPSILON) * absSum;
+
+  float plain;
+  ReduceCompensated compensated[2];
+  cl_int status = reduce.reduce(queue, REDUCE_SUM, input, n, &plain);
+  if (status == CL_SUCCESS) {
+    status = reduce.reduce(queue, REDUCE_COMPENSATED, input, n,
+                           &compensated[0]);
+  }
+  checkError(status, "Failed to reduce");
+  if (status != CL_SUCCESS) return 1;
+  cpuReduce(REDUCE_COMPENSATED, x, n, &compensated[1], &pool);
+
+  bool passed = checkClose("GPU float sum", plain, sum,
+                           plainDepth * FLT_EPSILON * absSum);
+  passed &= checkClose("GPU compensated sum",
+                       (double)compensated[0].sum + compensated[0].error, sum,
+                       compensatedBound);
+  passed &= checkClose("CPU compensated sum",
+                       (double)compensated[1].sum + compensated[1].error, sum,
+                       compensatedBound);
+  return passed ? 0 : 1;
+}
+
+// runStream averages the raw floats read from path, "-" for the standard
+// input, in chunks of chunk floats. The chunks go through a ChunkStream on
+// one queue while another reduces them with the compensated sum, so the
+// upload of a chunk overlaps the reduction of the previous one and the
+// memory used does not depend on the size of the data. The reductions of
+// the chunks are read back without waiting and combined on the host in
+// order. The CPU adds up every chunk in double from the pinned copy as it
+// goes by, for the check. Returns 0 when the results match.
+int runStream(const char *path, size_t chunk) {
+  const unsigned depth = 2;
+  cl_platform_id platform;
+  cl_device_id device;
+  cl_context context = initOpenCL(&platform, &device);
+  cl_command_queue queues[2];
+  for (unsigned i = 0; i < 2; i++) {
+    queues[i] = clCreateCommandQueue(context, device, 0, NULL);
+  }
+  unsigned char **source = read_file("../common/reduce.cl");
+  DeviceReduce *reduce =
+      new DeviceReduce(context, device, (const char *)*source);
+  ChunkStream *stream = new ChunkStream(context, queues[0], chunk, depth);
+  cl_int status = stream->open(path) ? CL_SUCCESS : CL_INVALID_VALUE;
+
+  // The state of chunk i goes to states[i % depth] and is combined into
+  // total once pending[i % depth] completes
+  ReduceCompensated total = {0.0f, 0.0f}, states[depth];
+  cl_event pending[depth] = {NULL, NULL};
+  double sum = 0.0, absSum = 0.0;
+  unsigned long long n = 0;
+  unsigned chunks = 0;
+  time_t start, end;
+  time(&start);
+  for (; status == CL_SUCCESS; chunks++) {
+    cl_mem buffer;
+    const float *host;
+    cl_event uploaded;
+    size_t count = stream->next(&buffer, &host, &uploaded);
+    if (count == 0) break;
+
+    unsigned slot = chunks % depth;
+    if (pending[slot]) {
+      clWaitForEvents(1, &pending[slot]);
+      clReleaseEvent(pending[slot]);
+      reduceCombine(REDUCE_COMPENSATED, &total, &states[slot], &total);
+    }
+    status = reduce->enqueueReduce(queues[1], REDUCE_COMPENSATED, buffer,
+                                   count, &states[slot], 1, &uploaded,
+                                   &pending[slot]);
+    if (status != CL_SUCCESS) {
+      pending[slot] = NULL;
+      break;
+    }
+    clFlush(queues[1]);
+    clRetainEvent(pending[slot]);
+    stream->done(pending[slot]);
+
+    for (size_t j = 0; j < count; j++) {
+      sum += host[j];
+      absSum += fabs(host[j]);
+    }
+    n += count;
+  }
+  for (unsigned i = 0; i < depth; i++) {
+    // The chunks still in flight, oldest first
+    unsigned slot = (chunks + i) % depth;
+    if (!pending[slot]) continue;
+    clWaitForEvents(1, &pending[slot]);
+    clReleaseEvent(pending[slot]);
+    pending[slot] = NULL;
+    reduceCombine(REDUCE_COMPENSATED, &total, &states[slot], &total);
+  }
+  time(&end);
+  checkError(status, "Failed to reduce a chunk");
+
+  delete stream;
+  delete reduce;
+  for (unsigned i = 0; i < 2; i++) clReleaseCommandQueue(queues[i]);
+  clReleaseContext(context);
+  if (status != CL_SUCCESS || n == 0) return 1;
+
+  printf("Streamed %llu floats in %.0lf seconds\n", n, difftime(end, start));
+  double average = ((double)total.sum + total.error) / n;
+  double bound = (2 * FLT_EPSILON + n * (double)FLT_EPSILON * FLT_EPSILON) *
+                 absSum / n;
+  return checkClose("GPU streamed average", average, sum / n, bound) ? 0 : 1;
+}
+
+// Usage: vector_average [--library] [--compensated] [N]
+// Averages N random floats (10000000 by default) on the CPU and on the GPU
+// and compares the results. The GPU reduces the input in two passes: a few
+// work-groups per compute unit write one partial sum each, then a single
+// work-group adds the partial sums and divides by N, so only the average is
+// read back. --library checks every reduction and scan of DeviceReduce on
+// the same input as well. --compensated checks the compensated sum of the
+// input against the plain float sum.
+//        vector_average --stream=PATH [--chunk=C]
+// Averages the raw floats of the file PATH, or of the standard input for -,
+// streamed in chunks of C floats (1048576 by default).
+int main(int argc, char **argv) {
+  cl_platform_id platform;
+  cl_device_id device;
+  cl_context context;
   cl_command_queue queue;
   cl_program program;
   cl_kernel kernel;
 
   //--------------------------------------------------------------------
-  const unsigned N = 10000000;
+  unsigned N = 10000000;
+  int arg = 1;
+  bool library = false, compensated = false, usage = false;
+  const char *streamPath = NULL;
+  size_t chunk = 1 << 20;
+  for (; arg < argc && string(argv[arg]).compare(0, 2, "--") == 0; arg++) {
+    string option = argv[arg];
+    if (option == "--library") {
+      library = true;
+    } else if (option == "--compensated") {
+      compensated = true;
+    } else if (option.compare(0, 9, "--stream=") == 0) {
+      streamPath = argv[arg] + 9;
+    } else if (option.compare(0, 8, "--chunk=") == 0) {
+      chunk = atoi(option.c_str() + 8);
+      if (chunk == 0) usage = true;
+    } else {
+      usage = true;
+    }
+  }
+  if (usage || argc - arg > 1 ||
+      (argc - arg == 1 && (N = atoi(argv[arg])) == 0) ||
+      (streamPath && (library || compensated || argc - arg != 0))) {
+    printf("Usage: %s [--library] [--compensated] [N]\n"
+           "       %s --stream=PATH [--chunk=C]\n",
+           argv[0], argv[0]);
+    return 1;
+  }
+  if (streamPath) return runStream(streamPath, chunk);
   float *input_a = (float *)malloc(sizeof(float) * N);
-  float *output;
-  float ref_output = 0;
+  float output;
+  double ref_output = 0.0;
+  double abs_sum = 0.0;
   cl_mem input_a_buf;  // num_devices elements
-  cl_mem output_buf;   // num_devices elements
+  cl_mem partial_buf;  // one partial sum per work-group
+  cl_mem output_buf;   // the average
   size_t max_work_group_size;
-  size_t local_group_size;
+  cl_uint compute_units;
   int status;
 
   time_t start, end;
@@ -86,9 +407,12 @@ int main() {
   for (unsigned j = 0; j < N; ++j) {
     input_a[j] = rand_float();
   }
+  // The reference is accumulated in double, so that it is exact enough to
+  // judge the float sums of the GPU
   time(&start);
   for (unsigned j = 0; j < N; ++j) {
     ref_output += input_a[j];
+    abs_sum += fabs(input_a[j]);
   }
   ref_output = ref_output / N;
   printf("ref %f\n", ref_output);
@@ -97,20 +421,7 @@ int main() {
   printf("CPU took %.2lf seconds to run.\n", diff);
 
   time(&start);
-  clGetPlatformIDs(1, &platform, NULL);
-  clGetPlatformInfo(platform, CL_PLATFORM_NAME, STRING_BUFFER_LEN, char_buffer,
-                    NULL);
-  printf("%-40s = %s\n", "CL_PLATFORM_NAME", char_buffer);
-  clGetPlatformInfo(platform, CL_PLATFORM_VENDOR, STRING_BUFFER_LEN,
-                    char_buffer, NULL);
-  printf("%-40s = %s\n", "CL_PLATFORM_VENDOR ", char_buffer);
-  clGetPlatformInfo(platform, CL_PLATFORM_VERSION, STRING_BUFFER_LEN,
-                    char_buffer, NULL);
-  printf("%-40s = %s\n\n", "CL_PLATFORM_VERSION ", char_buffer);
-
-  context_properties[1] = (cl_context_properties)platform;
-  clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 1, &device, NULL);
-  context = clCreateContext(context_properties, 1, &device, NULL, NULL, NULL);
+  context = initOpenCL(&platform, &device);
   queue = clCreateCommandQueue(context, device, 0, NULL);
 
   unsigned char **opencl_program = read_file("vector_average.cl");
@@ -124,90 +435,124 @@ int main() {
   if (success != CL_SUCCESS) print_clbuild_errors(program, device);
   kernel = clCreateKernel(program, "vector_average", NULL);
 
-  // Get max workgroup size
-  clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size_t),
-                  &max_work_group_size, NULL);
-  printf("max work group size is %d\n", max_work_group_size);
+  // The tree needs a power of two work-group size, the largest the kernel
+  // can run with
+  clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_WORK_GROUP_SIZE,
+                           sizeof(size_t), &max_work_group_size, NULL);
+  size_t local_size = 1;
+  while (local_size * 2 <= max_work_group_size) local_size *= 2;
+  printf("local size is %u\n", (unsigned)local_size);
 
-  // Calculate amount of groups
-  local_group_size = (size_t)ceil(N / (double)max_work_group_size);
-  printf("local_group_size is %d\n", local_group_size);
-
-  output = (float *)malloc(sizeof(float) * local_group_size);
+  // A few work-groups per compute unit keep the GPU busy, and no more than
+  // the second pass can add up in a single work-group
+  clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint),
+                  &compute_units, NULL);
+  size_t groups = min((size_t)compute_units * 4, local_size);
+  groups = max((size_t)1, min(groups, (N + local_size - 1) / local_size));
+  printf("%u work-groups\n", (unsigned)groups);
 
   // Input buffers.
   input_a_buf = clCreateBuffer(context, CL_MEM_READ_ONLY, N * sizeof(float),
                                NULL, &status);
   checkError(status, "Failed to create buffer for input A");
 
-  // Output buffer.
-  output_buf =
-      clCreateBuffer(context, CL_MEM_WRITE_ONLY,
-                     max_work_group_size * sizeof(float), NULL, &status);
+  // Output buffers.
+  partial_buf = clCreateBuffer(context, CL_MEM_READ_WRITE,
+                               groups * sizeof(float), NULL, &status);
+  checkError(status, "Failed to create buffer for the partial sums");
+  output_buf = clCreateBuffer(context, CL_MEM_WRITE_ONLY, sizeof(float), NULL,
+                              &status);
   checkError(status, "Failed to create buffer for output");
 
   // Transfer inputs to each device. Each of the host buffers supplied to
   // clEnqueueWriteBuffer here is already aligned to ensure that DMA is used
   // for the host-to-device transfer.
   cl_event write_event[1];
-  cl_event kernel_event, finish_event;
+  cl_event kernel_event[2], finish_event;
   status =
       clEnqueueWriteBuffer(queue, input_a_buf, CL_FALSE, 0, N * sizeof(float),
                            input_a, 0, NULL, &write_event[0]);
   checkError(status, "Failed to transfer input A");
 
-  // Set kernel arguments.
+  // First pass: one partial sum per work-group
   unsigned argi = 0;
-
+  unsigned count = N;
+  float scale = 1.0f;
   status = clSetKernelArg(kernel, argi++, sizeof(cl_mem), &input_a_buf);
-  checkError(status, "Failed to set argument 1");
+  status |= clSetKernelArg(kernel, argi++, sizeof(cl_mem), &partial_buf);
+  status |= clSetKernelArg(kernel, argi++, sizeof(unsigned), &count);
+  status |= clSetKernelArg(kernel, argi++, sizeof(float), &scale);
+  status |= clSetKernelArg(kernel, argi++, local_size * sizeof(float), NULL);
+  checkError(status, "Failed to set the kernel arguments");
 
-  status = clSetKernelArg(kernel, argi++, sizeof(cl_mem), &output_buf);
-  checkError(status, "Failed to set argument 2");
-
-  // Enqueue as many kernels as it fits on the machine
+  size_t global_size = groups * local_size;
+  status = clEnqueueNDRangeKernel(queue, kernel, 1, NULL, &global_size,
+                                  &local_size, 1, write_event,
+                                  &kernel_event[0]);
+  checkError(status, "Failed to launch kernel");
 
-  status = clEnqueueNDRangeKernel(queue, kernel, 1, NULL, &local_group_size,
-                                  NULL, 1, write_event, &kernel_event);
+  // Second pass: a single work-group adds the partial sums and divides by N.
+  // The arguments are copied at enqueue time, so the kernel can be reused.
+  argi = 0;
+  count = groups;
+  scale = 1.0f / N;
+  status = clSetKernelArg(kernel, argi++, sizeof(cl_mem), &partial_buf);
+  status |= clSetKernelArg(kernel, argi++, sizeof(cl_mem), &output_buf);
+  status |= clSetKernelArg(kernel, argi++, sizeof(unsigned), &count);
+  status |= clSetKernelArg(kernel, argi++, sizeof(float), &scale);
+  checkError(status, "Failed to set the kernel arguments");
+  status = clEnqueueNDRangeKernel(queue, kernel, 1, NULL, &local_size,
+                                  &local_size, 1, &kernel_event[0],
+                                  &kernel_event[1]);
   checkError(status, "Failed to launch kernel");
 
   // Read the result. This the final operation.
-  status = clEnqueueReadBuffer(queue, output_buf, CL_TRUE, 0,
-                               max_work_group_size * sizeof(float), output, 1,
-                               &kernel_event, &finish_event);
+  status = clEnqueueReadBuffer(queue, output_buf, CL_TRUE, 0, sizeof(float),
+                               &output, 1, &kernel_event[1], &finish_event);
+  checkError(status, "Failed to read the output");
 
   time(&end);
   diff = difftime(end, start);
   printf("GPU took %.8lf seconds to run.\n", diff);
-  // Verify results.
-
-  float final_output = 0;
-  for (uint i = 0; i < local_group_size; i++) {
-    final_output += output[i];
-  }
-  final_output = final_output;
+  printf("gpu %f\n", output);
 
-  if (fabsf(final_output - ref_output) > 1.0e-5f) {
-    printf("Failed verification \nOutput: %f\nReference: %f\n", final_output,
+  // Verify results. Every work-item adds N / global_size elements in a row
+  // and the trees add log2(global_size) more levels, each rounding to float,
+  // so the error of the sum is bounded by that many epsilons of sum |x|.
+  double depth = ceil((double)N / global_size) + log2((double)global_size) +
+                 log2((double)local_size) + 1;
+  double tolerance = depth * FLT_EPSILON * abs_sum / N;
+  int result = 0;
+  if (fabs(output - ref_output) > tolerance) {
+    printf("Failed verification \nOutput: %f\nReference: %f\n", output,
            ref_output);
+    result = 1;
+  } else {
+    printf("Passed verification: %f, reference %f, tolerance %g\n", output,
+           ref_output, tolerance);
   }
-  // else {
-  //   printf("PASSED VERIFICATION!! \nOutput: %f\nReference: %f\n",
-  //   final_output,
-  //          ref_output);
-  // }
+  if (library && result == 0) {
+    result = runLibrary(context, device, queue, input_a_buf, input_a, N);
+  }
+  if (compensated && result == 0) {
+    result = runCompensated(context, device, queue, input_a_buf, input_a, N);
+  }
+
   // Release local events.
   clReleaseEvent(write_event[0]);
+  clReleaseEvent(kernel_event[0]);
+  clReleaseEvent(kernel_event[1]);
+  clReleaseEvent(finish_event);
   clReleaseKernel(kernel);
   clReleaseCommandQueue(queue);
   clReleaseMemObject(input_a_buf);
+  clReleaseMemObject(partial_buf);
   clReleaseMemObject(output_buf);
   clReleaseProgram(program);
   clReleaseContext(context);
+  free(input_a);
 
   //--------------------------------------------------------------------
 
-  clFinish(queue);
-
-  return 0;
+  return result;
 }
@@ -1,42 +1,77 @@
 #include "gpu.hpp"
+#include "graph.hpp"
 
 #define STRING_BUFFER_LEN 1024
 
+// 3x3 filters, stored as the 9 x 1 B matrix of the convolution product
+const float GAUSSIAN_KERNEL[9] = {0.077847, 0.123317, 0.077847,
+                                  0.123317, 0.195346, 0.123317,
+                                  0.077847, 0.123317, 0.077847};
+const float SCHARR_X_KERNEL[9] = {3, 0, -3, 10, 0, -10, 3, 0, -3};
+const float SCHARR_Y_KERNEL[9] = {3, 10, 3, 0, 0, 0, -3, -10, -3};
+
 // private non-exported function declarations
 void matToConv(Mat imageMatrix, float *convMatrix, int rows, int cols);
 void convToMat(float *convMatrix, Mat result, int rows, int cols);
 void print_clbuild_errors(cl_program program, cl_device_id device);
 unsigned char **read_file(const char *name);
-void filter(Mat matrix, Mat result, float *kernel, int);
+void filter(GpuStream *stream, Mat matrix, Mat result, float *kernel, int);
+void reserveBuffer(cl_context context, cl_mem *buffer, size_t *capacity,
+                   size_t elements, cl_mem_flags flags, const char *msg);
+void reserveFrame(GpuStream *stream, unsigned pixels);
+void reserveImages(GpuStream *stream, int rows, int cols);
+void reserveMask(GpuStream *stream, unsigned pixels);
+cl_int addBufferGraph(GpuStream *stream, GpuGraph *graph, Mat input,
+                      Mat blurResult, int *scharrX, int *scharrY);
+cl_int addImageGraph(GpuStream *stream, GpuGraph *graph, Mat input,
+                     Mat blurResult, int *scharrX, int *scharrY);
+bool imageFormatSupported(cl_context context, cl_image_format format);
 void checkError(int status, const char *msg);
 float rand_float();
 void matrixPrint(float *matrix, unsigned rows, unsigned cols);
-void matrixMultiply(float *output, float *input_a, float *input_b, unsigned M,
-                    unsigned N, unsigned K);
-
-// cpuMatrixMultiply uses the CPU to multiply two input matrices with proper
-// dimensions
-void cpuMatrixMultiply(float *X, float *A, float *B, unsigned dim1,
-                       unsigned dim2, unsigned dimShared) {
-  for (unsigned i = 0; i < dim1; i++) {
-    for (unsigned j = 0; j < dim2; j++) {
-      for (unsigned k = 0; k < dimShared; k++) {
-        X[i * dim2 + j] += A[i * dimShared + k] * B[k * dim2 + j];
+void matrixMultiply(GpuStream *stream, float *output, float *input_a,
+                    float *input_b, unsigned M, unsigned N, unsigned K);
+
+// cpuMatrixMultiply adds A * B to X on the CPU, for an M x K matrix A and a
+// K x N matrix B, all row major. X is accumulated into, not overwritten, so
+// it must be initialised (to zeros for a plain product). The arguments are in
+// the order of matrixMultiply.
+void cpuMatrixMultiply(float *X, const float *A, const float *B, unsigned M,
+                       unsigned N, unsigned K) {
+  for (unsigned i = 0; i < M; i++) {
+    for (unsigned j = 0; j < N; j++) {
+      for (unsigned k = 0; k < K; k++) {
+        X[i * N + j] += A[i * K + k] * B[k * N + j];
       }
     }
   }
 }
 
-extern cl_platform_id platform;
-extern cl_device_id device;
-extern cl_context context;
-extern cl_command_queue queue;
-extern cl_program program;
-extern cl_kernel kernel;
+// gpuConvPathName returns a printable name for the path
+const char *gpuConvPathName(GpuConvPath path) {
+  switch (path) {
+    case GPU_CONV_BUFFER:
+      return "buffer";
+    case GPU_CONV_IMAGE:
+      return "image";
+    default:
+      return "auto";
+  }
+}
 
-int gpuInitialize() {
-  int status = 0;
+// GpuContext picks the first GPU of the first platform and compiles
+// matrix_mult.cl for it
+GpuContext::GpuContext(GpuConvPath path)
+    : platform(NULL),
+      device(NULL),
+      context(NULL),
+      program(NULL),
+      imageSupport(false),
+      convPath(GPU_CONV_BUFFER),
+      streamsLock(),
+      streams() {
   char char_buffer[STRING_BUFFER_LEN];
+  int status;
 
   cl_context_properties context_properties[] = {
       CL_CONTEXT_PLATFORM,
@@ -61,55 +96,617 @@ int gpuInitialize() {
 
   context_properties[1] = (cl_context_properties)platform;
   clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 1, &device, NULL);
-  context = clCreateContext(context_properties, 1, &device, NULL, NULL, NULL);
-  queue = clCreateCommandQueue(context, device, 0, NULL);
+  context =
+      clCreateContext(context_properties, 1, &device, NULL, NULL, &status);
+  checkError(status, "Failed to create context");
 
   // Program compilation
   unsigned char **opencl_program = read_file("matrix_mult.cl");
   program = clCreateProgramWithSource(context, 1, (const char **)opencl_program,
                                       NULL, NULL);
+  free(*opencl_program);
+  free(opencl_program);
   if (program == NULL) {
     printf("Program creation failed\n");
-    return -1;
+    exit(1);
   }
 
   int success = clBuildProgram(program, 0, NULL, NULL, NULL, NULL);
   if (success != CL_SUCCESS) print_clbuild_errors(program, device);
-  kernel = clCreateKernel(program, "matrix_mult", &status);
 
-  printf("Error code for kernel creation: %d\n", status);
+  // The image path needs sampler support and single channel float images
+  cl_bool images = CL_FALSE;
+  clGetDeviceInfo(device, CL_DEVICE_IMAGE_SUPPORT, sizeof(images), &images,
+                  NULL);
+  cl_image_format format = {CL_R, CL_FLOAT};
+  imageSupport = images && imageFormatSupported(context, format);
+
+  if (path == GPU_CONV_AUTO) {
+    convPath = imageSupport ? GPU_CONV_IMAGE : GPU_CONV_BUFFER;
+  } else if (path == GPU_CONV_IMAGE && !imageSupport) {
+    printf("Image objects are not supported, falling back to buffers\n");
+    convPath = GPU_CONV_BUFFER;
+  } else {
+    convPath = path;
+  }
+  printf("%-40s = %s\n\n", "Convolution path", gpuConvPathName(convPath));
+}
+
+// imageFormatSupported checks that 2D images of the format can be both read
+// and written by kernels
+bool imageFormatSupported(cl_context context, cl_image_format format) {
+  cl_uint count = 0;
+  clGetSupportedImageFormats(context, CL_MEM_READ_WRITE, CL_MEM_OBJECT_IMAGE2D,
+                             0, NULL, &count);
+  if (count == 0) return false;
+
+  cl_image_format *formats =
+      (cl_image_format *)malloc(count * sizeof(cl_image_format));
+  clGetSupportedImageFormats(context, CL_MEM_READ_WRITE, CL_MEM_OBJECT_IMAGE2D,
+                             count, formats, NULL);
+  bool found = false;
+  for (cl_uint i = 0; i < count; i++) {
+    if (formats[i].image_channel_order == format.image_channel_order &&
+        formats[i].image_channel_data_type == format.image_channel_data_type) {
+      found = true;
+    }
+  }
+  free(formats);
+  return found;
+}
 
-  return 0;
+// ~GpuContext releases the streams of every thread before the program and
+// context they were created from
+GpuContext::~GpuContext() {
+  for (map<thread::id, GpuStream *>::iterator it = streams.begin();
+       it != streams.end(); ++it) {
+    delete it->second;
+  }
+  if (program) clReleaseProgram(program);
+  if (context) clReleaseContext(context);
+}
+
+// threadStream returns the stream of the calling thread, creating it on the
+// first call
+GpuStream *GpuContext::threadStream() {
+  lock_guard<mutex> guard(streamsLock);
+  GpuStream *&stream = streams[this_thread::get_id()];
+  if (!stream) stream = new GpuStream(this);
+  return stream;
+}
+
+// releaseThreadStream deletes the stream of the calling thread
+void GpuContext::releaseThreadStream() {
+  lock_guard<mutex> guard(streamsLock);
+  map<thread::id, GpuStream *>::iterator it =
+      streams.find(this_thread::get_id());
+  if (it == streams.end()) return;
+  delete it->second;
+  streams.erase(it);
+}
+
+// GpuStream creates a stream with its own queue and kernels on the shared
+// context. Frame buffers are allocated lazily by the first filter call.
+GpuStream::GpuStream(GpuContext *gpu)
+    : gpu(gpu),
+      queue(NULL),
+      kernel(NULL),
+      bufferInputA(NULL),
+      bufferInputB(NULL),
+      bufferOutput(NULL),
+      capacityA(0),
+      capacityB(0),
+      capacityOutput(0),
+      convMatrix(NULL),
+      output(NULL),
+      capacityConv(0),
+      capacityHost(0),
+      im2colKernel(),
+      gemmKernel(),
+      bufferWeights(),
+      bufferFrame(NULL),
+      bufferConv(NULL),
+      bufferBlur(),
+      bufferEdge(),
+      framePixels(0),
+      convPath(gpu->convPath),
+      imageKernel(),
+      imageFrame(NULL),
+      imageBlur(),
+      imageEdge(),
+      imageRows(0),
+      imageCols(0),
+      histogramKernel(NULL),
+      histogramImageKernel(NULL),
+      otsuKernel(NULL),
+      thresholdKernel(NULL),
+      bufferMagnitude(NULL),
+      bufferMask(NULL),
+      bufferHistogram(NULL),
+      bufferThreshold(NULL),
+      maskPixels(0) {
+  int status;
+
+  // Out-of-order execution lets the independent branches of a frame graph
+  // overlap. Devices without it still honour the event dependencies.
+  cl_command_queue_properties supported = 0;
+  clGetDeviceInfo(gpu->device, CL_DEVICE_QUEUE_PROPERTIES, sizeof(supported),
+                  &supported, NULL);
+  queue = clCreateCommandQueue(
+      gpu->context, gpu->device,
+      supported & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE, &status);
+  checkError(status, "Failed to create command queue");
+
+  // Each stream needs its own kernel instance: clSetKernelArg is not safe to
+  // call on a kernel shared between threads.
+  kernel = clCreateKernel(gpu->program, "matrix_mult", &status);
+  checkError(status, "Failed to create matrix_mult kernel");
+
+  for (int i = 0; i < GPU_EDGE_PASSES; i++) {
+    im2colKernel[i] = clCreateKernel(gpu->program, "im2col", &status);
+    checkError(status, "Failed to create im2col kernel");
+  }
+  for (int i = 0; i < GPU_EDGE_PASSES + 1; i++) {
+    gemmKernel[i] = clCreateKernel(gpu->program, "matrix_mult", &status);
+    checkError(status, "Failed to create matrix_mult kernel");
+  }
+
+  // conv3x3_image is only compiled for devices with image support
+  for (int i = 0; gpu->imageSupport && i < GPU_EDGE_PASSES + 1; i++) {
+    imageKernel[i] = clCreateKernel(gpu->program, "conv3x3_image", &status);
+    checkError(status, "Failed to create conv3x3_image kernel");
+  }
+
+  histogramKernel = clCreateKernel(gpu->program, "edge_histogram", &status);
+  checkError(status, "Failed to create edge_histogram kernel");
+  if (gpu->imageSupport) {
+    histogramImageKernel =
+        clCreateKernel(gpu->program, "edge_histogram_image", &status);
+    checkError(status, "Failed to create edge_histogram_image kernel");
+  }
+  otsuKernel = clCreateKernel(gpu->program, "otsu_threshold", &status);
+  checkError(status, "Failed to create otsu_threshold kernel");
+  thresholdKernel = clCreateKernel(gpu->program, "apply_threshold", &status);
+  checkError(status, "Failed to create apply_threshold kernel");
+
+  bufferHistogram = clCreateBuffer(gpu->context, CL_MEM_READ_WRITE,
+                                   HISTOGRAM_BINS * sizeof(int), NULL, &status);
+  checkError(status, "Failed to create buffer for the histogram");
+  bufferThreshold = clCreateBuffer(gpu->context, CL_MEM_READ_WRITE,
+                                   sizeof(int), NULL, &status);
+  checkError(status, "Failed to create buffer for the threshold");
+
+  // The filter weights never change, upload them once
+  const float *weights[3] = {GAUSSIAN_KERNEL, SCHARR_X_KERNEL,
+                             SCHARR_Y_KERNEL};
+  for (int i = 0; i < 3; i++) {
+    bufferWeights[i] = clCreateBuffer(
+        gpu->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+        9 * sizeof(float), (void *)weights[i], &status);
+    checkError(status, "Failed to create buffer for filter weights");
+  }
+}
+
+// ~GpuStream frees every OpenCL object and buffer owned by the stream
+GpuStream::~GpuStream() {
+  cl_mem buffers[] = {bufferFrame,      bufferConv,       bufferBlur[0],
+                      bufferBlur[1],    bufferEdge[0],    bufferEdge[1],
+                      bufferWeights[0], bufferWeights[1], bufferWeights[2],
+                      bufferInputA,     bufferInputB,     bufferOutput,
+                      imageFrame,       imageBlur[0],     imageBlur[1],
+                      imageEdge[0],     imageEdge[1],     bufferMagnitude,
+                      bufferMask,       bufferHistogram,  bufferThreshold};
+  for (unsigned i = 0; i < sizeof(buffers) / sizeof(cl_mem); i++) {
+    if (buffers[i]) clReleaseMemObject(buffers[i]);
+  }
+  for (int i = 0; i < GPU_EDGE_PASSES; i++) {
+    if (im2colKernel[i]) clReleaseKernel(im2colKernel[i]);
+  }
+  for (int i = 0; i < GPU_EDGE_PASSES + 1; i++) {
+    if (gemmKernel[i]) clReleaseKernel(gemmKernel[i]);
+    if (imageKernel[i]) clReleaseKernel(imageKernel[i]);
+  }
+  cl_kernel maskKernels[] = {histogramKernel, histogramImageKernel,
+                             otsuKernel, thresholdKernel};
+  for (unsigned i = 0; i < sizeof(maskKernels) / sizeof(cl_kernel); i++) {
+    if (maskKernels[i]) clReleaseKernel(maskKernels[i]);
+  }
+  if (kernel) clReleaseKernel(kernel);
+  if (queue) clReleaseCommandQueue(queue);
+  free(convMatrix);
+  free(output);
 }
 
 // gpuGaussianBlur applies a 3x3 gaussian blur on a float matrix
-void gpuGaussianBlur(Mat matrix, Mat result) {
+void gpuGaussianBlur(GpuStream *stream, Mat matrix, Mat result) {
   // printf("Starting gpuGaussianBlur\n");
-  float kernel[9] = {0.077847, 0.123317, 0.077847, 0.123317, 0.195346,
-                     0.123317, 0.077847, 0.123317, 0.077847};
-  filter(matrix, result, kernel, 1);
+  filter(stream, matrix, result, (float *)GAUSSIAN_KERNEL, 1);
 }
 
 // gpuSobelHorizontal applies a 3x3 Sobel / Scharr filter on the x axis
-void gpuSobelHorizontal(Mat matrix, Mat result) {
+void gpuSobelHorizontal(GpuStream *stream, Mat matrix, Mat result) {
   // printf("Starting gpuSobelHorizontal\n");
-  float kernel[9] = {3, 0, -3, 10, 0, -10, 3, 0, -3};
-  filter(matrix, result, kernel, 1);
+  filter(stream, matrix, result, (float *)SCHARR_X_KERNEL, 1);
 }
 
 // gpuSobelVertical applies a 3x3 Sobel / Scharr filter on the y axis
-void gpuSobelVertical(Mat matrix, Mat result) {
+void gpuSobelVertical(GpuStream *stream, Mat matrix, Mat result) {
   // printf("Starting gpuSobelVertical\n");
-  float kernel[9] = {3, 10, 3, 0, 0, 0, -3, -10, -3};
-  filter(matrix, result, kernel, 1);
+  filter(stream, matrix, result, (float *)SCHARR_Y_KERNEL, 1);
+}
+
+// The GpuContext overloads run on the calling thread's stream
+void gpuGaussianBlur(GpuContext *gpu, Mat matrix, Mat result) {
+  gpuGaussianBlur(gpu->threadStream(), matrix, result);
 }
 
-void filter(Mat matrix, Mat result, float *kernel, int numKernels) {
+void gpuSobelHorizontal(GpuContext *gpu, Mat matrix, Mat result) {
+  gpuSobelHorizontal(gpu->threadStream(), matrix, result);
+}
+
+void gpuSobelVertical(GpuContext *gpu, Mat matrix, Mat result) {
+  gpuSobelVertical(gpu->threadStream(), matrix, result);
+}
+
+void gpuEdgeDetect(GpuContext *gpu, Mat gray, Mat blurred, Mat edgeX,
+                   Mat edgeY) {
+  gpuEdgeDetect(gpu->threadStream(), gray, blurred, edgeX, edgeY);
+}
+
+int gpuEdgeMask(GpuContext *gpu, Mat gray, Mat blurred, Mat mask,
+                int threshold) {
+  return gpuEdgeMask(gpu->threadStream(), gray, blurred, mask, threshold);
+}
+
+// reserveFrame allocates the device buffers of the edge pipeline for frames of
+// the given number of pixels, keeping them when they are already big enough
+void reserveFrame(GpuStream *stream, unsigned pixels) {
+  int status;
+  if (stream->bufferFrame && stream->framePixels >= pixels) return;
+
+  cl_mem *buffers[] = {&stream->bufferFrame,   &stream->bufferConv,
+                       &stream->bufferBlur[0], &stream->bufferBlur[1],
+                       &stream->bufferEdge[0], &stream->bufferEdge[1]};
+  for (unsigned i = 0; i < sizeof(buffers) / sizeof(cl_mem *); i++) {
+    if (*buffers[i]) clReleaseMemObject(*buffers[i]);
+    size_t elements = buffers[i] == &stream->bufferConv ? pixels * 9 : pixels;
+    *buffers[i] = clCreateBuffer(stream->gpu->context, CL_MEM_READ_WRITE,
+                                 elements * sizeof(float), NULL, &status);
+    checkError(status, "Failed to create buffer for the edge pipeline");
+  }
+  stream->framePixels = pixels;
+}
+
+// reserveImages allocates the image objects of the edge pipeline for frames
+// of exactly rows x cols pixels
+void reserveImages(GpuStream *stream, int rows, int cols) {
+  int status;
+  if (stream->imageFrame && stream->imageRows == rows &&
+      stream->imageCols == cols) {
+    return;
+  }
+
+  cl_image_format format = {CL_R, CL_FLOAT};
+  cl_mem *images[] = {&stream->imageFrame, &stream->imageBlur[0],
+                      &stream->imageBlur[1], &stream->imageEdge[0],
+                      &stream->imageEdge[1]};
+  for (unsigned i = 0; i < sizeof(images) / sizeof(cl_mem *); i++) {
+    if (*images[i]) clReleaseMemObject(*images[i]);
+    *images[i] = clCreateImage2D(stream->gpu->context, CL_MEM_READ_WRITE,
+                                 &format, cols, rows, 0, NULL, &status);
+    checkError(status, "Failed to create image for the edge pipeline");
+  }
+  stream->imageRows = rows;
+  stream->imageCols = cols;
+}
+
+// addBufferGraph adds the buffer path of the edge pipeline to the graph: every
+// pass expands its input with im2col and multiplies it with the weights.
+//   write -> im2col -> blur -> im2col -> blur -> im2col -> blur -> im2col
+//   blur -> read blurred
+//   im2col -> Scharr x
+//   im2col -> Scharr y
+// The Scharr results are left in bufferEdge, scharrX and scharrY receive the
+// indices of the tasks producing them. Returns an error when a kernel argument
+// cannot be set, in which case the graph must not be submitted.
+cl_int addBufferGraph(GpuStream *stream, GpuGraph *graph, Mat input,
+                      Mat blurResult, int *scharrX, int *scharrY) {
+  cl_int status = CL_SUCCESS;
+  int rows = input.rows;
+  int cols = input.cols;
+  int wA = 9;
+  int wB = 1;
+  int saturate = 1;
+  unsigned pixels = rows * cols;
+  size_t frameBytes = pixels * sizeof(float);
+  size_t convSize[1] = {pixels};
+  size_t gemmSize[2] = {pixels, 1};
+
+  reserveFrame(stream, pixels);
+
+  // Inputs and outputs of every pass: the blurs ping-pong between the two blur
+  // buffers, and the last im2col pass feeds both Scharr filters.
+  cl_mem passInput[GPU_EDGE_PASSES] = {
+      stream->bufferFrame, stream->bufferBlur[0], stream->bufferBlur[1],
+      stream->bufferBlur[0]};
+  cl_mem gemmOutput[GPU_EDGE_PASSES + 1] = {
+      stream->bufferBlur[0], stream->bufferBlur[1], stream->bufferBlur[0],
+      stream->bufferEdge[0], stream->bufferEdge[1]};
+  cl_mem gemmWeights[GPU_EDGE_PASSES + 1] = {
+      stream->bufferWeights[0], stream->bufferWeights[0],
+      stream->bufferWeights[0], stream->bufferWeights[1],
+      stream->bufferWeights[2]};
+
+  for (int i = 0; i < GPU_EDGE_PASSES; i++) {
+    cl_kernel kernel = stream->im2colKernel[i];
+    status |= clSetKernelArg(kernel, 0, sizeof(cl_mem), &passInput[i]);
+    status |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &stream->bufferConv);
+    status |= clSetKernelArg(kernel, 2, sizeof(int), &rows);
+    status |= clSetKernelArg(kernel, 3, sizeof(int), &cols);
+    status |= clSetKernelArg(kernel, 4, sizeof(int), &saturate);
+  }
+  for (int i = 0; i < GPU_EDGE_PASSES + 1; i++) {
+    cl_kernel kernel = stream->gemmKernel[i];
+    status |= clSetKernelArg(kernel, 0, sizeof(cl_mem), &stream->bufferConv);
+    status |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &gemmWeights[i]);
+    status |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &gemmOutput[i]);
+    status |= clSetKernelArg(kernel, 3, sizeof(int), &wA);
+    status |= clSetKernelArg(kernel, 4, sizeof(int), &wB);
+  }
+  if (status != CL_SUCCESS) return CL_INVALID_KERNEL_ARGS;
+
+  int last = gpuGraphAddWrite(graph, stream->bufferFrame, frameBytes,
+                              input.data, {});
+  for (int i = 0; i < GPU_EDGE_PASSES - 1; i++) {
+    last = gpuGraphAddKernel(graph, stream->im2colKernel[i], 1, convSize,
+                             NULL, {last});
+    last = gpuGraphAddKernel(graph, stream->gemmKernel[i], 2, gemmSize, NULL,
+                             {last});
+  }
+  gpuGraphAddRead(graph, stream->bufferBlur[0], frameBytes, blurResult.data,
+                  {last});
+  int edgeInput =
+      gpuGraphAddKernel(graph, stream->im2colKernel[GPU_EDGE_PASSES - 1], 1,
+                        convSize, NULL, {last});
+  *scharrX = gpuGraphAddKernel(graph, stream->gemmKernel[GPU_EDGE_PASSES - 1],
+                               2, gemmSize, NULL, {edgeInput});
+  *scharrY = gpuGraphAddKernel(graph, stream->gemmKernel[GPU_EDGE_PASSES], 2,
+                               gemmSize, NULL, {edgeInput});
+  return CL_SUCCESS;
+}
+
+// addImageGraph adds the image path of the edge pipeline to the graph: every
+// pass is a single conv3x3_image launch, the sampler handles the borders.
+//   write -> blur -> blur -> blur -> read blurred
+//   blur -> Scharr x
+//   blur -> Scharr y
+// The Scharr results are left in imageEdge, scharrX and scharrY receive the
+// indices of the tasks producing them. Returns an error like addBufferGraph.
+cl_int addImageGraph(GpuStream *stream, GpuGraph *graph, Mat input,
+                     Mat blurResult, int *scharrX, int *scharrY) {
+  cl_int status = CL_SUCCESS;
+  int saturate = 1;
+  size_t rows = input.rows;
+  size_t cols = input.cols;
+  size_t imageSize[2] = {cols, rows};
+
+  reserveImages(stream, rows, cols);
+
+  cl_mem passInput[GPU_EDGE_PASSES + 1] = {
+      stream->imageFrame, stream->imageBlur[0], stream->imageBlur[1],
+      stream->imageBlur[0], stream->imageBlur[0]};
+  cl_mem passOutput[GPU_EDGE_PASSES + 1] = {
+      stream->imageBlur[0], stream->imageBlur[1], stream->imageBlur[0],
+      stream->imageEdge[0], stream->imageEdge[1]};
+  cl_mem passWeights[GPU_EDGE_PASSES + 1] = {
+      stream->bufferWeights[0], stream->bufferWeights[0],
+      stream->bufferWeights[0], stream->bufferWeights[1],
+      stream->bufferWeights[2]};
+
+  for (int i = 0; i < GPU_EDGE_PASSES + 1; i++) {
+    cl_kernel kernel = stream->imageKernel[i];
+    status |= clSetKernelArg(kernel, 0, sizeof(cl_mem), &passInput[i]);
+    status |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &passOutput[i]);
+    status |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &passWeights[i]);
+    status |= clSetKernelArg(kernel, 3, sizeof(int), &saturate);
+  }
+  if (status != CL_SUCCESS) return CL_INVALID_KERNEL_ARGS;
+
+  int last = gpuGraphAddWriteImage(graph, stream->imageFrame, cols, rows,
+                                   input.data, {});
+  for (int i = 0; i < GPU_EDGE_PASSES - 1; i++) {
+    last = gpuGraphAddKernel(graph, stream->imageKernel[i], 2, imageSize, NULL,
+                             {last});
+  }
+  gpuGraphAddReadImage(graph, stream->imageBlur[0], cols, rows,
+                       blurResult.data, {last});
+  *scharrX = gpuGraphAddKernel(graph, stream->imageKernel[GPU_EDGE_PASSES - 1],
+                               2, imageSize, NULL, {last});
+  *scharrY = gpuGraphAddKernel(graph, stream->imageKernel[GPU_EDGE_PASSES], 2,
+                               imageSize, NULL, {last});
+  return CL_SUCCESS;
+}
+
+// gpuEdgeDetect runs the whole edge pipeline of a frame on the device: three
+// gaussian blurs followed by the horizontal and vertical Scharr filters.
+void gpuEdgeDetect(GpuStream *stream, Mat gray, Mat blurred, Mat edgeX,
+                   Mat edgeY) {
+  Mat input, blurResult(gray.size(), CV_32FC1), xResult(gray.size(), CV_32FC1),
+      yResult(gray.size(), CV_32FC1);
+  gray.convertTo(input, CV_32FC1);
+  size_t rows = gray.rows;
+  size_t cols = gray.cols;
+
+  GpuGraph graph;
+  int scharrX = 0, scharrY = 0;
+  int status;
+  if (stream->convPath == GPU_CONV_IMAGE) {
+    status =
+        addImageGraph(stream, &graph, input, blurResult, &scharrX, &scharrY);
+    gpuGraphAddReadImage(&graph, stream->imageEdge[0], cols, rows,
+                         xResult.data, {scharrX});
+    gpuGraphAddReadImage(&graph, stream->imageEdge[1], cols, rows,
+                         yResult.data, {scharrY});
+  } else {
+    status =
+        addBufferGraph(stream, &graph, input, blurResult, &scharrX, &scharrY);
+    gpuGraphAddRead(&graph, stream->bufferEdge[0], rows * cols * sizeof(float),
+                    xResult.data, {scharrX});
+    gpuGraphAddRead(&graph, stream->bufferEdge[1], rows * cols * sizeof(float),
+                    yResult.data, {scharrY});
+  }
+
+  checkError(status, "Failed to set the edge detection kernel arguments");
+  if (status != CL_SUCCESS) return;
+
+  status = gpuGraphSubmit(&graph, stream->queue);
+  checkError(status, "Failed to submit the edge detection graph");
+  gpuGraphWait(&graph);
+
+  // Same 8 bit conversion as filter()
+  blurResult.convertTo(blurResult, CV_8U);
+  xResult.convertTo(xResult, CV_8U);
+  yResult.convertTo(yResult, CV_8U);
+  blurResult.copyTo(blurred);
+  xResult.copyTo(edgeX);
+  yResult.copyTo(edgeY);
+}
+
+// reserveMask allocates the buffers of the thresholding stage for frames of
+// the given number of pixels
+void reserveMask(GpuStream *stream, unsigned pixels) {
+  int status;
+  if (stream->bufferMask && stream->maskPixels >= pixels) return;
+
+  cl_mem *buffers[] = {&stream->bufferMagnitude, &stream->bufferMask};
+  for (unsigned i = 0; i < sizeof(buffers) / sizeof(cl_mem *); i++) {
+    if (*buffers[i]) clReleaseMemObject(*buffers[i]);
+    *buffers[i] = clCreateBuffer(stream->gpu->context, CL_MEM_READ_WRITE,
+                                 pixels, NULL, &status);
+    checkError(status, "Failed to create buffer for the edge mask");
+  }
+  stream->maskPixels = pixels;
+}
+
+// gpuEdgeMask runs the edge pipeline and thresholds the gradient magnitude on
+// the device.
+int gpuEdgeMask(GpuStream *stream, Mat gray, Mat blurred, Mat mask,
+                int threshold) {
+  static const int ZERO_HISTOGRAM[HISTOGRAM_BINS] = {0};
+  Mat input, blurResult(gray.size(), CV_32FC1), maskResult(gray.size(), CV_8U);
+  gray.convertTo(input, CV_32FC1);
+  int pixels = gray.rows * gray.cols;
+  int cols = gray.cols;
+  int applied = threshold;
+
+  reserveMask(stream, pixels);
+
+  GpuGraph graph;
+  int scharrX = 0, scharrY = 0;
+  cl_kernel histogramKernel;
+  cl_int status;
+  if (stream->convPath == GPU_CONV_IMAGE) {
+    status =
+        addImageGraph(stream, &graph, input, blurResult, &scharrX, &scharrY);
+    histogramKernel = stream->histogramImageKernel;
+    status |= clSetKernelArg(histogramKernel, 0, sizeof(cl_mem),
+                             &stream->imageEdge[0]);
+    status |= clSetKernelArg(histogramKernel, 1, sizeof(cl_mem),
+                             &stream->imageEdge[1]);
+    status |= clSetKernelArg(histogramKernel, 5, sizeof(int), &cols);
+  } else {
+    status =
+        addBufferGraph(stream, &graph, input, blurResult, &scharrX, &scharrY);
+    histogramKernel = stream->histogramKernel;
+    status |= clSetKernelArg(histogramKernel, 0, sizeof(cl_mem),
+                             &stream->bufferEdge[0]);
+    status |= clSetKernelArg(histogramKernel, 1, sizeof(cl_mem),
+                             &stream->bufferEdge[1]);
+  }
+  status |= clSetKernelArg(histogramKernel, 2, sizeof(cl_mem),
+                           &stream->bufferMagnitude);
+  // Only Otsu reads the histogram, with a fixed threshold the kernel gets NULL
+  // and skips the atomics
+  status |= clSetKernelArg(
+      histogramKernel, 3, sizeof(cl_mem),
+      threshold == GPU_THRESHOLD_OTSU ? &stream->bufferHistogram : NULL);
+  status |= clSetKernelArg(histogramKernel, 4, sizeof(int), &pixels);
+
+  status |= clSetKernelArg(stream->otsuKernel, 0, sizeof(cl_mem),
+                           &stream->bufferHistogram);
+  status |= clSetKernelArg(stream->otsuKernel, 1, sizeof(cl_mem),
+                           &stream->bufferThreshold);
+  status |= clSetKernelArg(stream->otsuKernel, 2, sizeof(int), &pixels);
+
+  status |= clSetKernelArg(stream->thresholdKernel, 0, sizeof(cl_mem),
+                           &stream->bufferMagnitude);
+  status |= clSetKernelArg(stream->thresholdKernel, 1, sizeof(cl_mem),
+                           &stream->bufferThreshold);
+  status |= clSetKernelArg(stream->thresholdKernel, 2, sizeof(cl_mem),
+                           &stream->bufferMask);
+  status |= clSetKernelArg(stream->thresholdKernel, 3, sizeof(int), &pixels);
+  // The frame is left untouched rather than filtered with stale arguments
+  checkError(status, "Failed to set the edge mask kernel arguments");
+  if (status != CL_SUCCESS) return applied;
+
+  // Scharr x, Scharr y -> histogram -> otsu -> threshold -> read mask
+  //                                         -> read threshold
+  // With a fixed threshold the Otsu step is replaced by a write of the value.
+  size_t histogramSize[1] = {HISTOGRAM_GROUPS * HISTOGRAM_LOCAL_SIZE};
+  size_t histogramLocal[1] = {HISTOGRAM_LOCAL_SIZE};
+  size_t otsuSize[1] = {HISTOGRAM_BINS};
+  size_t maskSize[1] = {(size_t)pixels};
+  int histogram, thresholdTask;
+  if (threshold == GPU_THRESHOLD_OTSU) {
+    int clear = gpuGraphAddWrite(&graph, stream->bufferHistogram,
+                                 sizeof(ZERO_HISTOGRAM), ZERO_HISTOGRAM, {});
+    histogram = gpuGraphAddKernel(&graph, histogramKernel, 1, histogramSize,
+                                  histogramLocal, {scharrX, scharrY, clear});
+    thresholdTask = gpuGraphAddKernel(&graph, stream->otsuKernel, 1, otsuSize,
+                                      otsuSize, {histogram});
+    gpuGraphAddRead(&graph, stream->bufferThreshold, sizeof(int), &applied,
+                    {thresholdTask});
+  } else {
+    // The histogram kernel only computes the magnitude
+    histogram = gpuGraphAddKernel(&graph, histogramKernel, 1, histogramSize,
+                                  histogramLocal, {scharrX, scharrY});
+    thresholdTask = gpuGraphAddWrite(&graph, stream->bufferThreshold,
+                                     sizeof(int), &threshold, {});
+  }
+  int apply = gpuGraphAddKernel(&graph, stream->thresholdKernel, 1, maskSize,
+                                NULL, {histogram, thresholdTask});
+  gpuGraphAddRead(&graph, stream->bufferMask, pixels, maskResult.data,
+                  {apply});
+
+  status = gpuGraphSubmit(&graph, stream->queue);
+  checkError(status, "Failed to submit the edge mask graph");
+  gpuGraphWait(&graph);
+
+  blurResult.convertTo(blurResult, CV_8U);
+  blurResult.copyTo(blurred);
+  maskResult.copyTo(mask);
+
+  return applied;
+}
+
+void filter(GpuStream *stream, Mat matrix, Mat result, float *kernel,
+            int numKernels) {
   const int kernelSize = 9;
   const int numElements = matrix.rows * matrix.cols;
-  const int convMatrixSize = numElements * kernelSize;
-  float convMatrix[convMatrixSize] = {0};
-  float *output = (float *)malloc(numElements * sizeof(float));
+
+  // Host buffers are kept on the stream and only grow when the frame does
+  if (stream->capacityConv < (size_t)numElements * kernelSize) {
+    stream->capacityConv = (size_t)numElements * kernelSize;
+    free(stream->convMatrix);
+    stream->convMatrix = (float *)malloc(stream->capacityConv * sizeof(float));
+  }
+  if (stream->capacityHost < (size_t)numElements * numKernels) {
+    stream->capacityHost = (size_t)numElements * numKernels;
+    free(stream->output);
+    stream->output = (float *)malloc(stream->capacityHost * sizeof(float));
+  }
+  float *convMatrix = stream->convMatrix;
+  float *output = stream->output;
   matrix.convertTo(matrix, CV_32FC1);
   Mat temp_result = Mat(matrix.size(), CV_32FC1, 1.f / 255);
   // matrix.copyTo(result);
@@ -132,7 +729,7 @@ void filter(Mat matrix, Mat result, float *kernel, int numKernels) {
 
   // printf("Starting matrixMultiply\n");
   // Execute matrix multiplication
-  matrixMultiply(output, convMatrix, kernel, numElements, numKernels,
+  matrixMultiply(stream, output, convMatrix, kernel, numElements, numKernels,
                  kernelSize);
 
   // printf("Mult result:\n");
@@ -210,8 +807,23 @@ void convToMat(float *convMatrix, Mat result, int rows, int cols) {
   }
 }
 
-void matrixMultiply(float *output, float *input_a, float *input_b, unsigned M,
-                    unsigned N, unsigned K) {
+// reserveBuffer makes sure buffer holds at least the given number of floats,
+// reallocating it only when it has to grow
+void reserveBuffer(cl_context context, cl_mem *buffer, size_t *capacity,
+                   size_t elements, cl_mem_flags flags, const char *msg) {
+  int status;
+  if (*buffer && *capacity >= elements) return;
+  if (*buffer) clReleaseMemObject(*buffer);
+  *buffer =
+      clCreateBuffer(context, flags, elements * sizeof(float), NULL, &status);
+  checkError(status, msg);
+  *capacity = elements;
+}
+
+// matrixMultiply computes output = input_a * input_b on the GPU for an M x K
+// matrix input_a and a K x N matrix input_b, overwriting output
+void matrixMultiply(GpuStream *stream, float *output, float *input_a,
+                    float *input_b, unsigned M, unsigned N, unsigned K) {
   // Work sizes
   // size_t localWorkSize[2];
   size_t globalWorkSize[2];
@@ -222,77 +834,72 @@ void matrixMultiply(float *output, float *input_a, float *input_b, unsigned M,
   globalWorkSize[0] = M;
   globalWorkSize[1] = N;
 
-  // Input buffers.
-  cl_mem bufferInputA = clCreateBuffer(context, CL_MEM_READ_ONLY,
-                                       M * K * sizeof(float), NULL, &status);
-  checkError(status, "Failed to create buffer for input A");
-
-  cl_mem bufferInputB = clCreateBuffer(context, CL_MEM_READ_ONLY,
-                                       K * N * sizeof(float), NULL, &status);
-  checkError(status, "Failed to create buffer for input A");
+  // Input buffers, reused across frames of the same stream.
+  reserveBuffer(stream->gpu->context, &stream->bufferInputA,
+                &stream->capacityA, M * K, CL_MEM_READ_ONLY,
+                "Failed to create buffer for input A");
+  reserveBuffer(stream->gpu->context, &stream->bufferInputB,
+                &stream->capacityB, K * N, CL_MEM_READ_ONLY,
+                "Failed to create buffer for input B");
 
   // Output buffer.
-  cl_mem bufferOutput = clCreateBuffer(context, CL_MEM_WRITE_ONLY,
-                                       M * N * sizeof(float), NULL, &status);
-  checkError(status, "Failed to create buffer for output");
+  reserveBuffer(stream->gpu->context, &stream->bufferOutput,
+                &stream->capacityOutput, M * N, CL_MEM_WRITE_ONLY,
+                "Failed to create buffer for output");
 
   // Transfer inputs to each device. Each of the host buffers supplied to
   // clEnqueueWriteBuffer here is already aligned to ensure that DMA is used
   // for the host-to-device transfer.
   cl_event write_event[2];
   cl_event kernel_event, finish_event;
-  status = clEnqueueWriteBuffer(queue, bufferInputA, CL_FALSE, 0,
-                                M * K * sizeof(float), input_a, 0, NULL,
+  status = clEnqueueWriteBuffer(stream->queue, stream->bufferInputA, CL_FALSE,
+                                0, M * K * sizeof(float), input_a, 0, NULL,
                                 &write_event[0]);
   checkError(status, "Failed to transfer input A");
 
-  status = clEnqueueWriteBuffer(queue, bufferInputB, CL_FALSE, 0,
-                                K * N * sizeof(float), input_b, 0, NULL,
+  status = clEnqueueWriteBuffer(stream->queue, stream->bufferInputB, CL_FALSE,
+                                0, K * N * sizeof(float), input_b, 0, NULL,
                                 &write_event[1]);
   checkError(status, "Failed to transfer input B");
 
   // Set kernel arguments.
   unsigned argi = 0;
 
-  status = clSetKernelArg(kernel, argi++, sizeof(cl_mem), &bufferInputA);
+  status = clSetKernelArg(stream->kernel, argi++, sizeof(cl_mem),
+                          &stream->bufferInputA);
   checkError(status, "Failed to set argument 1");
 
-  status = clSetKernelArg(kernel, argi++, sizeof(cl_mem), &bufferInputB);
+  status = clSetKernelArg(stream->kernel, argi++, sizeof(cl_mem),
+                          &stream->bufferInputB);
   checkError(status, "Failed to set argument 2");
 
-  status = clSetKernelArg(kernel, argi++, sizeof(cl_mem), &bufferOutput);
+  status = clSetKernelArg(stream->kernel, argi++, sizeof(cl_mem),
+                          &stream->bufferOutput);
   checkError(status, "Failed to set argument 3");
 
-  status = clSetKernelArg(kernel, argi++, sizeof(int), &K);
+  status = clSetKernelArg(stream->kernel, argi++, sizeof(int), &K);
   checkError(status, "Failed to set argument 4");
 
-  status = clSetKernelArg(kernel, argi++, sizeof(int), &N);
+  status = clSetKernelArg(stream->kernel, argi++, sizeof(int), &N);
   checkError(status, "Failed to set argument 5");
 
   // Enqueue as many kernels as it fits on the machine
-  status = clEnqueueNDRangeKernel(queue, kernel, 2, NULL, globalWorkSize, NULL,
-                                  2, write_event, &kernel_event);
+  status = clEnqueueNDRangeKernel(stream->queue, stream->kernel, 2, NULL,
+                                  globalWorkSize, NULL, 2, write_event,
+                                  &kernel_event);
   checkError(status, "Failed to launch kernel");
 
   // // Read the result. This the final operation.
-  status = clEnqueueReadBuffer(queue, bufferOutput, CL_TRUE, 0,
+  status = clEnqueueReadBuffer(stream->queue, stream->bufferOutput, CL_TRUE, 0,
                                M * N * sizeof(float), output, 1, &kernel_event,
                                &finish_event);
+  checkError(status, "Failed to read output");
 
   // Release local events.
   clReleaseEvent(write_event[0]);
   clReleaseEvent(write_event[1]);
-  // clReleaseKernel(kernel);
-  // clReleaseCommandQueue(queue);
-  clReleaseMemObject(bufferInputA);
-  clReleaseMemObject(bufferInputB);
-  clReleaseMemObject(bufferOutput);
-  // clReleaseProgram(program);
-  // clReleaseContext(context);
-
-  // //--------------------------------------------------------------------
-
-  // clFinish(queue);
+  clReleaseEvent(kernel_event);
+  clReleaseEvent(finish_event);
 
   return;
 }
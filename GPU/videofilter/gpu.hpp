@@ -9,17 +9,172 @@
 #include <time.h>
 #include <chrono>
 #include <iostream>  // for standard I/O
+#include <map>
+#include <mutex>
+#include <thread>
 #include "opencv2/opencv.hpp"
 
 using namespace cv;
 using namespace std;
 
+// Number of im2col passes in the edge pipeline: three gaussian blurs plus the
+// input shared by both Scharr filters
+#define GPU_EDGE_PASSES 4
+
+// Bins of the gradient magnitude histogram, one per 8 bit value. Must match
+// HISTOGRAM_BINS in matrix_mult.cl.
+#define HISTOGRAM_BINS 256
+// Launch shape of the histogram kernel: every work-group accumulates a private
+// histogram in local memory and merges it into the global one once
+#define HISTOGRAM_GROUPS 64
+#define HISTOGRAM_LOCAL_SIZE 64
+
+// Pass as the threshold of gpuEdgeMask to pick it with Otsu's method
+#define GPU_THRESHOLD_OTSU -1
+
+class GpuStream;
+
+// GpuConvPath selects how the filters read their input. The buffer path
+// expands the image with im2col and multiplies it with the filter weights; the
+// image path reads image2d_t objects through the texture cache and gets the
+// border handling from the sampler (edge pixels are repeated instead of being
+// padded with zeros).
+enum GpuConvPath { GPU_CONV_AUTO, GPU_CONV_BUFFER, GPU_CONV_IMAGE };
+
+// gpuConvPathName returns a printable name for the path
+const char *gpuConvPathName(GpuConvPath path);
+
+// GpuContext owns the OpenCL platform, device, context and compiled program,
+// releasing them when it goes out of scope. It can be shared by any number of
+// threads: everything that cannot be used concurrently (command queues, kernel
+// instances and buffers) belongs to a GpuStream.
+class GpuContext {
+ public:
+  // The requested path is resolved for the device: GPU_CONV_AUTO picks images
+  // when they are supported, and GPU_CONV_IMAGE falls back to buffers when they
+  // are not.
+  explicit GpuContext(GpuConvPath path = GPU_CONV_AUTO);
+  ~GpuContext();
+
+  // threadStream returns the stream of the calling thread, creating it on the
+  // first call. Streams are keyed by thread id and live until the context is
+  // destroyed or the thread releases its own with releaseThreadStream, which
+  // short-lived threads must do before they exit.
+  GpuStream *threadStream();
+
+  // releaseThreadStream deletes the stream of the calling thread, if it has
+  // one. Streams returned to it earlier must no longer be used.
+  void releaseThreadStream();
+
+  cl_platform_id platform;
+  cl_device_id device;
+  cl_context context;
+  cl_program program;
+  bool imageSupport;     // device can sample single channel float images
+  GpuConvPath convPath;  // default path of new streams, never GPU_CONV_AUTO
+
+ private:
+  GpuContext(const GpuContext &);
+  GpuContext &operator=(const GpuContext &);
+
+  mutex streamsLock;
+  map<thread::id, GpuStream *> streams;
+};
+
+// GpuStream holds the OpenCL state owned by a single thread or video stream:
+// its own command queue and kernel instances, plus device and host buffers
+// that are reused from one frame to the next. All streams of a GpuContext
+// share its context and compiled program, so several streams can be filtered
+// concurrently.
+class GpuStream {
+ public:
+  explicit GpuStream(GpuContext *gpu);
+  ~GpuStream();
+
+  GpuContext *gpu;
+  cl_command_queue queue;
+  cl_kernel kernel;
+  cl_mem bufferInputA;
+  cl_mem bufferInputB;
+  cl_mem bufferOutput;
+  size_t capacityA;       // floats allocated in bufferInputA
+  size_t capacityB;       // floats allocated in bufferInputB
+  size_t capacityOutput;  // floats allocated in bufferOutput
+  float *convMatrix;      // host im2col matrix
+  float *output;          // host copy of the multiplication result
+  size_t capacityConv;    // floats allocated in convMatrix
+  size_t capacityHost;    // floats allocated in output
+
+  // Device-resident edge pipeline used by gpuEdgeDetect. Every node of the
+  // frame graph has its own kernel instance so that their arguments can be set
+  // up front.
+  cl_kernel im2colKernel[GPU_EDGE_PASSES];
+  cl_kernel gemmKernel[GPU_EDGE_PASSES + 1];
+  cl_mem bufferWeights[3];  // gaussian, Scharr x and Scharr y
+  cl_mem bufferFrame;
+  cl_mem bufferConv;
+  cl_mem bufferBlur[2];  // ping-pong between the blur passes
+  cl_mem bufferEdge[2];  // Scharr x and Scharr y
+  size_t framePixels;    // pixels the frame buffers were allocated for
+
+  // Image path of gpuEdgeDetect, only used when convPath is GPU_CONV_IMAGE
+  GpuConvPath convPath;
+  cl_kernel imageKernel[GPU_EDGE_PASSES + 1];
+  cl_mem imageFrame;
+  cl_mem imageBlur[2];
+  cl_mem imageEdge[2];
+  int imageRows;  // the images are allocated for exactly this frame size
+  int imageCols;
+
+  // Thresholding stage of gpuEdgeMask
+  cl_kernel histogramKernel;
+  cl_kernel histogramImageKernel;  // only created with image support
+  cl_kernel otsuKernel;
+  cl_kernel thresholdKernel;
+  cl_mem bufferMagnitude;  // 8 bit gradient magnitude
+  cl_mem bufferMask;
+  cl_mem bufferHistogram;  // HISTOGRAM_BINS ints
+  cl_mem bufferThreshold;  // a single int
+  size_t maskPixels;       // pixels the mask buffers were allocated for
+
+ private:
+  GpuStream(const GpuStream &);
+  GpuStream &operator=(const GpuStream &);
+};
+
 // gpuGaussianBlur applies a 3x3 gaussian blur on a float matrix
-void gpuGaussianBlur(Mat matrix, Mat result);
+void gpuGaussianBlur(GpuStream *stream, Mat matrix, Mat result);
+
+void gpuSobelHorizontal(GpuStream *stream, Mat matrix, Mat result);
+
+void gpuSobelVertical(GpuStream *stream, Mat matrix, Mat result);
+
+// gpuEdgeDetect runs the whole edge pipeline of a frame on the device: three
+// gaussian blurs followed by the horizontal and vertical Scharr filters. The
+// work is submitted as a single dependency graph, so both Scharr filters and
+// the read back of the blurred image run concurrently on an out-of-order
+// queue. gray may be the same matrix as blurred.
+void gpuEdgeDetect(GpuStream *stream, Mat gray, Mat blurred, Mat edgeX,
+                   Mat edgeY);
 
-void gpuSobelHorizontal(Mat matrix, Mat result);
+// gpuEdgeMask runs the edge pipeline of gpuEdgeDetect and builds the cartoon
+// edge mask on the device as well: the gradient magnitude (the average of the
+// two Scharr results) is histogrammed, the threshold is picked with Otsu's
+// method unless a fixed one is given, and mask receives 0 on edges and 255
+// elsewhere. Only the blurred image and the mask are read back. Returns the
+// threshold that was applied.
+int gpuEdgeMask(GpuStream *stream, Mat gray, Mat blurred, Mat mask,
+                int threshold = GPU_THRESHOLD_OTSU);
 
-void gpuSobelVertical(Mat matrix, Mat result);
+// The same filters on the calling thread's stream of a shared context. They
+// can be called from several threads at once.
+void gpuGaussianBlur(GpuContext *gpu, Mat matrix, Mat result);
+void gpuSobelHorizontal(GpuContext *gpu, Mat matrix, Mat result);
+void gpuSobelVertical(GpuContext *gpu, Mat matrix, Mat result);
+void gpuEdgeDetect(GpuContext *gpu, Mat gray, Mat blurred, Mat edgeX,
+                   Mat edgeY);
+int gpuEdgeMask(GpuContext *gpu, Mat gray, Mat blurred, Mat mask,
+                int threshold = GPU_THRESHOLD_OTSU);
 
 void gpuFloatMatPrint(Mat matrix);
 
@@ -28,6 +183,5 @@ void gpuIntMatPrint(Mat matrix);
 void gpuCallback(const char *buffer, size_t length, size_t final,
                  void *user_data);
 
-int gpuInitialize();
 
 #endif  // GPU_HPP
\ No newline at end of file
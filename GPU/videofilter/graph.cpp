@@ -0,0 +1,142 @@
+#include "graph.hpp"
+#include <stdio.h>
+
+int addTask(GpuGraph *graph, GpuTask &task, std::initializer_list<int> deps) {
+  task.deps.assign(deps.begin(), deps.end());
+  graph->tasks.push_back(task);
+  return graph->tasks.size() - 1;
+}
+
+// gpuGraphAddWrite adds a host to device transfer and returns its index
+int gpuGraphAddWrite(GpuGraph *graph, cl_mem buffer, size_t size,
+                     const void *host, std::initializer_list<int> deps) {
+  GpuTask task;
+  task.type = GPU_TASK_WRITE;
+  task.buffer = buffer;
+  task.size = size;
+  task.host = (void *)host;
+  return addTask(graph, task, deps);
+}
+
+// gpuGraphAddKernel adds a kernel launch whose arguments are already set and
+// returns its index
+int gpuGraphAddKernel(GpuGraph *graph, cl_kernel kernel, cl_uint dims,
+                      const size_t *global, const size_t *local,
+                      std::initializer_list<int> deps) {
+  GpuTask task;
+  task.type = GPU_TASK_KERNEL;
+  task.kernel = kernel;
+  task.dims = dims;
+  for (cl_uint i = 0; i < dims; i++) {
+    task.global[i] = global[i];
+    if (local) task.local[i] = local[i];
+  }
+  return addTask(graph, task, deps);
+}
+
+// gpuGraphAddRead adds a device to host transfer and returns its index
+int gpuGraphAddRead(GpuGraph *graph, cl_mem buffer, size_t size, void *host,
+                    std::initializer_list<int> deps) {
+  GpuTask task;
+  task.type = GPU_TASK_READ;
+  task.buffer = buffer;
+  task.size = size;
+  task.host = host;
+  return addTask(graph, task, deps);
+}
+
+// gpuGraphAddWriteImage adds a host to device transfer of a whole 2D image
+// and returns its index
+int gpuGraphAddWriteImage(GpuGraph *graph, cl_mem image, size_t width,
+                          size_t height, const void *host,
+                          std::initializer_list<int> deps) {
+  GpuTask task;
+  task.type = GPU_TASK_WRITE_IMAGE;
+  task.buffer = image;
+  task.region[0] = width;
+  task.region[1] = height;
+  task.host = (void *)host;
+  return addTask(graph, task, deps);
+}
+
+// gpuGraphAddReadImage adds a device to host transfer of a whole 2D image and
+// returns its index
+int gpuGraphAddReadImage(GpuGraph *graph, cl_mem image, size_t width,
+                         size_t height, void *host,
+                         std::initializer_list<int> deps) {
+  GpuTask task;
+  task.type = GPU_TASK_READ_IMAGE;
+  task.buffer = image;
+  task.region[0] = width;
+  task.region[1] = height;
+  task.host = host;
+  return addTask(graph, task, deps);
+}
+
+// gpuGraphSubmit enqueues every task on the queue without blocking
+int gpuGraphSubmit(GpuGraph *graph, cl_command_queue queue) {
+  int status = CL_SUCCESS;
+  std::vector<cl_event> waitList;
+  const size_t origin[3] = {0, 0, 0};
+
+  for (unsigned i = 0; i < graph->tasks.size(); i++) {
+    GpuTask &task = graph->tasks[i];
+    waitList.clear();
+    for (unsigned d = 0; d < task.deps.size(); d++) {
+      waitList.push_back(graph->tasks[task.deps[d]].event);
+    }
+    const cl_event *events = waitList.empty() ? NULL : &waitList[0];
+
+    switch (task.type) {
+      case GPU_TASK_WRITE:
+        status = clEnqueueWriteBuffer(queue, task.buffer, CL_FALSE, 0,
+                                      task.size, task.host, waitList.size(),
+                                      events, &task.event);
+        break;
+      case GPU_TASK_KERNEL:
+        status = clEnqueueNDRangeKernel(
+            queue, task.kernel, task.dims, NULL, task.global,
+            task.local[0] ? task.local : NULL, waitList.size(), events,
+            &task.event);
+        break;
+      case GPU_TASK_READ:
+        status = clEnqueueReadBuffer(queue, task.buffer, CL_FALSE, 0,
+                                     task.size, task.host, waitList.size(),
+                                     events, &task.event);
+        break;
+      case GPU_TASK_WRITE_IMAGE: {
+        const size_t region[3] = {task.region[0], task.region[1], 1};
+        status = clEnqueueWriteImage(queue, task.buffer, CL_FALSE, origin,
+                                     region, 0, 0, task.host, waitList.size(),
+                                     events, &task.event);
+        break;
+      }
+      case GPU_TASK_READ_IMAGE: {
+        const size_t region[3] = {task.region[0], task.region[1], 1};
+        status = clEnqueueReadImage(queue, task.buffer, CL_FALSE, origin,
+                                    region, 0, 0, task.host, waitList.size(),
+                                    events, &task.event);
+        break;
+      }
+      default:
+        status = CL_INVALID_VALUE;
+    }
+    if (status != CL_SUCCESS) {
+      printf("Failed to enqueue graph task %u (error %d)\n", i, status);
+      return status;
+    }
+  }
+
+  return clFlush(queue);
+}
+
+// gpuGraphWait blocks until every task has completed and releases the events
+void gpuGraphWait(GpuGraph *graph) {
+  std::vector<cl_event> events;
+  for (unsigned i = 0; i < graph->tasks.size(); i++) {
+    if (graph->tasks[i].event) events.push_back(graph->tasks[i].event);
+  }
+  if (!events.empty()) clWaitForEvents(events.size(), &events[0]);
+  for (unsigned i = 0; i < events.size(); i++) clReleaseEvent(events[i]);
+  graph->tasks.clear();
+}
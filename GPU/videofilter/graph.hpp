@@ -0,0 +1,87 @@
+#ifndef GRAPH_HPP
+#define GRAPH_HPP
+
+#include <CL/cl.h>
+#include <initializer_list>
+#include <vector>
+
+// GpuTaskType lists the operations a GpuGraph can contain
+enum GpuTaskType {
+  GPU_TASK_WRITE,
+  GPU_TASK_KERNEL,
+  GPU_TASK_READ,
+  GPU_TASK_WRITE_IMAGE,
+  GPU_TASK_READ_IMAGE
+};
+
+// GpuTask is one node of a GpuGraph: a transfer or a kernel launch, plus the
+// indices of the tasks it depends on. Kernel arguments are set when the task
+// is added, so every kernel task needs its own cl_kernel instance.
+struct GpuTask {
+  GpuTask()
+      : type(GPU_TASK_KERNEL), buffer(NULL), size(0), host(NULL),
+        kernel(NULL), dims(0), deps(), event(NULL) {
+    global[0] = global[1] = 0;
+    local[0] = local[1] = 0;
+    region[0] = region[1] = 0;
+  }
+  GpuTask(const GpuTask &) = default;
+  GpuTask &operator=(const GpuTask &) = default;
+
+  GpuTaskType type;
+  cl_mem buffer;  // transfers only, a buffer or an image
+  size_t size;
+  size_t region[2];  // image transfers only, width and height in pixels
+  void *host;
+  cl_kernel kernel;  // kernels only
+  cl_uint dims;
+  size_t global[2];
+  size_t local[2];  // all zero to let the runtime choose
+  std::vector<int> deps;
+  cl_event event;
+};
+
+// GpuGraph describes the work of a frame as a dependency graph. Tasks must be
+// added in a topological order (a task may only depend on earlier ones);
+// gpuGraphSubmit turns the dependencies into event wait lists so independent
+// branches can run concurrently on an out-of-order queue.
+struct GpuGraph {
+  GpuGraph() : tasks() {}
+
+  std::vector<GpuTask> tasks;
+};
+
+// gpuGraphAddWrite adds a host to device transfer and returns its index
+int gpuGraphAddWrite(GpuGraph *graph, cl_mem buffer, size_t size,
+                     const void *host, std::initializer_list<int> deps);
+
+// gpuGraphAddKernel adds a kernel launch whose arguments are already set and
+// returns its index. local may be NULL to let the runtime pick the work-group
+// size.
+int gpuGraphAddKernel(GpuGraph *graph, cl_kernel kernel, cl_uint dims,
+                      const size_t *global, const size_t *local,
+                      std::initializer_list<int> deps);
+
+// gpuGraphAddRead adds a device to host transfer and returns its index
+int gpuGraphAddRead(GpuGraph *graph, cl_mem buffer, size_t size, void *host,
+                    std::initializer_list<int> deps);
+
+// gpuGraphAddWriteImage adds a host to device transfer of a whole 2D image
+// and returns its index
+int gpuGraphAddWriteImage(GpuGraph *graph, cl_mem image, size_t width,
+                          size_t height, const void *host,
+                          std::initializer_list<int> deps);
+
+// gpuGraphAddReadImage adds a device to host transfer of a whole 2D image and
+// returns its index
+int gpuGraphAddReadImage(GpuGraph *graph, cl_mem image, size_t width,
+                         size_t height, void *host,
+                         std::initializer_list<int> deps);
+
+// gpuGraphSubmit enqueues every task on the queue without blocking
+int gpuGraphSubmit(GpuGraph *graph, cl_command_queue queue);
+
+// gpuGraphWait blocks until every task has completed and releases the events
+void gpuGraphWait(GpuGraph *graph);
+
+#endif  // GRAPH_HPP
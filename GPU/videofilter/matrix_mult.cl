@@ -11,3 +11,211 @@ __kernel void matrix_mult(__global const float *A, __global const float *B,
   }
   X[tx * wB + ty] = curVal;
 }
+
+// im2col expands every pixel of a rows x cols image into the row of its 3x3
+// neighbourhood consumed by matrix_mult, padding the borders with zeros (same
+// layout as matToConv on the host). When saturate is set the pixels are first
+// rounded and clamped to [0, 255], like the 8 bit conversion done between two
+// filter passes on the host.
+__kernel void im2col(__global const float *image, __global float *conv,
+                     int rows, int cols, int saturate) {
+
+  int idx = get_global_id(0);
+  int i = idx / cols;
+  int j = idx % cols;
+
+  int k = 0;
+  int di, dj;
+  for (di = -1; di <= 1; di++) {
+    for (dj = -1; dj <= 1; dj++) {
+      int y = i + di;
+      int x = j + dj;
+      float curVal = 0;
+      if ((y >= 0) && (y < rows) && (x >= 0) && (x < cols)) {
+        curVal = image[y * cols + x];
+        if (saturate) curVal = clamp(rint(curVal), 0.0f, 255.0f);
+      }
+      conv[idx * 9 + k] = curVal;
+      k++;
+    }
+  }
+}
+
+#ifdef __IMAGE_SUPPORT__
+// Out of range reads return the closest edge pixel, so the borders need no
+// explicit checks.
+__constant sampler_t edgeSampler = CLK_NORMALIZED_COORDS_FALSE |
+                                   CLK_ADDRESS_CLAMP_TO_EDGE |
+                                   CLK_FILTER_NEAREST;
+
+// conv3x3_image applies a 3x3 filter (same weight layout as im2col) directly on
+// an image object, going through the texture cache. When saturate is set the
+// input pixels are first rounded and clamped to [0, 255].
+__kernel void conv3x3_image(__read_only image2d_t src,
+                            __write_only image2d_t dst,
+                            __constant float *weights, int saturate) {
+
+  int x = get_global_id(0);
+  int y = get_global_id(1);
+
+  float curVal = 0;
+  int k = 0;
+  int di, dj;
+  for (di = -1; di <= 1; di++) {
+    for (dj = -1; dj <= 1; dj++) {
+      float pixel = read_imagef(src, edgeSampler, (int2)(x + dj, y + di)).x;
+      if (saturate) pixel = clamp(rint(pixel), 0.0f, 255.0f);
+      curVal += weights[k] * pixel;
+      k++;
+    }
+  }
+  write_imagef(dst, (int2)(x, y), (float4)(curVal, 0.0f, 0.0f, 0.0f));
+}
+#endif
+
+#define HISTOGRAM_BINS 256
+
+// edgeMagnitude mirrors addWeighted(edge_x, 0.5, edge_y, 0.5) on the 8 bit
+// Scharr results
+uchar edgeMagnitude(float x, float y) {
+  x = clamp(rint(x), 0.0f, 255.0f);
+  y = clamp(rint(y), 0.0f, 255.0f);
+  return (uchar)clamp(rint(0.5f * x + 0.5f * y), 0.0f, 255.0f);
+}
+
+// histogramClear zeroes the work-group's private histogram
+void histogramClear(__local int *bins) {
+  int b;
+  for (b = get_local_id(0); b < HISTOGRAM_BINS; b += get_local_size(0)) {
+    bins[b] = 0;
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+}
+
+// histogramMerge adds the work-group's histogram to the global one, so there
+// is a single global atomic per bin and work-group. Nothing is merged when
+// histogram is NULL.
+void histogramMerge(__local int *bins, __global int *histogram) {
+  int b;
+  barrier(CLK_LOCAL_MEM_FENCE);
+  if (!histogram) return;
+  for (b = get_local_id(0); b < HISTOGRAM_BINS; b += get_local_size(0)) {
+    if (bins[b]) atomic_add(&histogram[b], bins[b]);
+  }
+}
+
+// edge_histogram combines the two Scharr results into the 8 bit gradient
+// magnitude and accumulates its histogram, unless histogram is NULL as with a
+// fixed threshold. Work-items stride over the image so any global size can be
+// used.
+__kernel void edge_histogram(__global const float *edgeX,
+                             __global const float *edgeY,
+                             __global uchar *magnitude,
+                             __global int *histogram, int pixels) {
+
+  __local int bins[HISTOGRAM_BINS];
+  histogramClear(bins);
+
+  int i;
+  for (i = get_global_id(0); i < pixels; i += get_global_size(0)) {
+    uchar value = edgeMagnitude(edgeX[i], edgeY[i]);
+    magnitude[i] = value;
+    if (histogram) atomic_inc(&bins[value]);
+  }
+
+  histogramMerge(bins, histogram);
+}
+
+#ifdef __IMAGE_SUPPORT__
+// edge_histogram_image is edge_histogram for the image path
+__kernel void edge_histogram_image(__read_only image2d_t edgeX,
+                                   __read_only image2d_t edgeY,
+                                   __global uchar *magnitude,
+                                   __global int *histogram, int pixels,
+                                   int cols) {
+
+  __local int bins[HISTOGRAM_BINS];
+  histogramClear(bins);
+
+  int i;
+  for (i = get_global_id(0); i < pixels; i += get_global_size(0)) {
+    int2 pos = (int2)(i % cols, i / cols);
+    uchar value = edgeMagnitude(read_imagef(edgeX, edgeSampler, pos).x,
+                                read_imagef(edgeY, edgeSampler, pos).x);
+    magnitude[i] = value;
+    if (histogram) atomic_inc(&bins[value]);
+  }
+
+  histogramMerge(bins, histogram);
+}
+#endif
+
+// otsu_threshold picks the threshold maximising the between-class variance of
+// the histogram, i.e. what threshold(..., THRESH_OTSU) computes on the host.
+// Runs as a single work-group with one work-item per bin: the class weights
+// and means come from a prefix sum in local memory, and the best threshold
+// from a max reduction.
+__kernel __attribute__((reqd_work_group_size(HISTOGRAM_BINS, 1, 1)))
+void otsu_threshold(__global const int *histogram, __global int *threshold,
+                    int pixels) {
+
+  __local float count[HISTOGRAM_BINS];
+  __local float sum[HISTOGRAM_BINS];
+  __local float variance[HISTOGRAM_BINS];
+  __local int index[HISTOGRAM_BINS];
+
+  int t = get_local_id(0);
+  count[t] = histogram[t];
+  sum[t] = (float)t * histogram[t];
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  // Inclusive prefix sums of the counts and of the weighted counts
+  int offset;
+  for (offset = 1; offset < HISTOGRAM_BINS; offset <<= 1) {
+    float c = t >= offset ? count[t - offset] : 0.0f;
+    float s = t >= offset ? sum[t - offset] : 0.0f;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    count[t] += c;
+    sum[t] += s;
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+
+  // Between-class variance when the pixels <= t form the first class
+  float total = (float)pixels;
+  float w0 = count[t] / total;
+  float w1 = 1.0f - w0;
+  float mu = sum[HISTOGRAM_BINS - 1] / total;
+  float mu0 = sum[t] / total;
+  variance[t] = 0.0f;
+  if ((w0 > 0.0f) && (w1 > 0.0f)) {
+    float diff = mu * w0 - mu0;
+    variance[t] = diff * diff / (w0 * w1);
+  }
+  index[t] = t;
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  // Max reduction, the lowest threshold wins ties
+  for (offset = HISTOGRAM_BINS / 2; offset > 0; offset >>= 1) {
+    if (t < offset) {
+      float other = variance[t + offset];
+      if ((other > variance[t]) ||
+          ((other == variance[t]) && (index[t + offset] < index[t]))) {
+        variance[t] = other;
+        index[t] = index[t + offset];
+      }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+
+  if (t == 0) threshold[0] = index[0];
+}
+
+// apply_threshold builds the edge mask like threshold(THRESH_BINARY_INV):
+// pixels above the threshold become 0 (an edge), the others 255
+__kernel void apply_threshold(__global const uchar *magnitude,
+                              __global const int *threshold,
+                              __global uchar *mask, int pixels) {
+
+  int i = get_global_id(0);
+  if (i < pixels) mask[i] = magnitude[i] > threshold[0] ? 0 : 255;
+}
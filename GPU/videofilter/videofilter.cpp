@@ -1,8 +1,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
+#include <condition_variable>
 #include <fstream>
 #include <iostream>  // for standard I/O
+#include <mutex>
+#include <thread>
+#include <vector>
 #include "gpu.hpp"
 #include "opencv2/opencv.hpp"
 #include "perf.hpp"
@@ -11,73 +15,112 @@ using namespace cv;
 using namespace std;
 #define SHOW
 
-cl_platform_id platform;
-cl_device_id device;
-cl_context context;
-cl_command_queue queue;
-cl_program program;
-cl_kernel kernel;
+// Number of frames processed from every input stream
+#define MAX_FRAMES 10
 
-int main(int, char **) {
-  // Initialize GPU
-  gpuInitialize();
-  // gpuShowInfo();
-  VideoCapture camera("./bourne.mp4");
-  if (!camera.isOpened())  // check if we succeeded
-    return -1;
+// RoundScheduler keeps the streams in lockstep: a stream may only start frame
+// n + 1 once every other active stream has finished frame n, so a fast feed
+// cannot monopolise the device while the slower ones starve.
+struct RoundScheduler {
+  explicit RoundScheduler(unsigned streams)
+      : lock(), roundDone(), active(streams), arrived(0), round(0) {}
 
-  const string NAME = "./output.avi";  // Form the new name with container
-  int ex = static_cast<int>(CV_FOURCC('M', 'J', 'P', 'G'));
-  Size S = Size((int)camera.get(CV_CAP_PROP_FRAME_WIDTH),  // Acquire input size
-                (int)camera.get(CV_CAP_PROP_FRAME_HEIGHT));
-  // Size S =Size(1280,720);
-  cout << "SIZE:" << S << endl;
+  mutex lock;
+  condition_variable roundDone;
+  unsigned active;
+  unsigned arrived;
+  unsigned long round;
+};
 
-  VideoWriter outputVideo;  // Open the output
-  outputVideo.open(NAME, ex, 25, S, true);
+// schedulerNextRound blocks until every active stream has finished its frame
+void schedulerNextRound(RoundScheduler *scheduler) {
+  unique_lock<mutex> guard(scheduler->lock);
+  unsigned long round = scheduler->round;
+  if (++scheduler->arrived == scheduler->active) {
+    scheduler->arrived = 0;
+    scheduler->round++;
+    scheduler->roundDone.notify_all();
+    return;
+  }
+  while (scheduler->round == round) scheduler->roundDone.wait(guard);
+}
 
-  if (!outputVideo.isOpened()) {
-    cout << "Could not open the output video for write: " << NAME << endl;
-    return -1;
+// schedulerLeave removes a finished stream, releasing the others if they were
+// only waiting for it
+void schedulerLeave(RoundScheduler *scheduler) {
+  lock_guard<mutex> guard(scheduler->lock);
+  scheduler->active--;
+  if (scheduler->active > 0 && scheduler->arrived == scheduler->active) {
+    scheduler->arrived = 0;
+    scheduler->round++;
+    scheduler->roundDone.notify_all();
   }
-  int totalTime = 0;
+}
+
+// StreamJob describes one input video and collects its statistics
+struct StreamJob {
+  StreamJob()
+      : input(), output(), show(false), threshold(GPU_THRESHOLD_OTSU),
+        lastThreshold(0), frames(0), totalTime(0), status(EXIT_SUCCESS) {}
+
+  string input;
+  string output;
+  bool show;
+  int threshold;      // edge threshold, or GPU_THRESHOLD_OTSU
+  int lastThreshold;  // threshold applied to the last frame
+  int frames;
+  int totalTime;
+  int status;
+};
+
+// processStream filters up to MAX_FRAMES frames of one video with its own
+// GpuStream, writing the cartoonised result to job->output
+void processStream(StreamJob *job, GpuContext *gpu,
+                   RoundScheduler *scheduler) {
+  GpuStream stream(gpu);
+  VideoCapture camera(job->input);
+  VideoWriter outputVideo;  // Open the output
   int count = 0;
+
+  if (!camera.isOpened()) {  // check if we succeeded
+    cout << "Could not open the input video: " << job->input << endl;
+    job->status = EXIT_FAILURE;
+  } else {
+    int ex = static_cast<int>(CV_FOURCC('M', 'J', 'P', 'G'));
+    Size S =
+        Size((int)camera.get(CV_CAP_PROP_FRAME_WIDTH),  // Acquire input size
+             (int)camera.get(CV_CAP_PROP_FRAME_HEIGHT));
+    cout << job->input << " SIZE:" << S << endl;
+    outputVideo.open(job->output, ex, 25, S, true);
+    if (!outputVideo.isOpened()) {
+      cout << "Could not open the output video for write: " << job->output
+           << endl;
+      job->status = EXIT_FAILURE;
+    }
+  }
+
   const char *windowName = "filter";  // Name shown in the GUI window.
-#ifdef SHOW
-  namedWindow(windowName);  // Resizable window, might not work on Windows.
-#endif
-  while (true) {
+  while (job->status == EXIT_SUCCESS) {
     Mat cameraFrame, displayframe;
     count = count + 1;
-    if (count > 10) break;
+    if (count > MAX_FRAMES) break;
     camera >> cameraFrame;
+    if (cameraFrame.empty()) break;
     Mat filterframe = Mat(cameraFrame.size(), CV_8UC3);
-    Mat grayframe, edge, edge_inv;
+    Mat grayframe, edge_inv;
     cvtColor(cameraFrame, grayframe, CV_BGR2GRAY);
-    Mat edge_x = Mat(grayframe.size(), CV_8U);
-    Mat edge_y = Mat(grayframe.size(), CV_8U);
-    // CPU computation
+    Mat edge = Mat(grayframe.size(), CV_8U);
+    // GPU computation
     auto perf = perfStart();
-    gpuGaussianBlur(grayframe, grayframe);
-    gpuGaussianBlur(grayframe, grayframe);
-    gpuGaussianBlur(grayframe, grayframe);
-    gpuSobelHorizontal(grayframe, edge_x);
-    gpuSobelVertical(grayframe, edge_y);
-    // printf("Edge x matrix (size %dx%d): \n", edge_x.rows, edge_x.cols);
-    // gpuIntMatPrint(edge_x);
-    // printf("Edge y matrix: \n");
-    // gpuIntMatPrint(edge_y);
+    job->lastThreshold =
+        gpuEdgeMask(&stream, grayframe, grayframe, edge, job->threshold);
 
     // GaussianBlur(grayframe, grayframe, Size(3, 3), 0, 0);
     // GaussianBlur(grayframe, grayframe, Size(3, 3), 0, 0);
     // GaussianBlur(grayframe, grayframe, Size(3, 3), 0, 0);
     // Scharr(grayframe, edge_x, CV_8U, 0, 1, 1, 0, BORDER_DEFAULT);
     // Scharr(grayframe, edge_y, CV_8U, 1, 0, 1, 0, BORDER_DEFAULT);
-    addWeighted(edge_x, 0.5, edge_y, 0.5, 0, edge);
-    threshold(edge, edge, 80, 255, THRESH_BINARY_INV);
     auto perfResult = perfDone(perf);
-    // printf("Frame %d - computation took %d milliseconds.\n", count,
-    // perfResult);
 
     cvtColor(edge, edge_inv, CV_GRAY2BGR);
     // Clear the output image to black, so that the cartoon line drawings will
@@ -87,13 +130,172 @@ int main(int, char **) {
     cvtColor(displayframe, displayframe, CV_GRAY2BGR);
     outputVideo << displayframe;
 #ifdef SHOW
-    imshow(windowName, displayframe);
+    // HighGUI is not thread safe, only a single stream may show its frames
+    if (job->show) imshow(windowName, displayframe);
 #endif
-    totalTime += perfResult;
+    job->totalTime += perfResult;
+    job->frames++;
+
+    schedulerNextRound(scheduler);
   }
+  schedulerLeave(scheduler);
+
   outputVideo.release();
   camera.release();
-  printf("FPS %.2lf .\n", ((float)count) / (totalTime / 1000.0));
+}
+
+// benchmarkPaths filters the first frames of the input once with every
+// convolution path and prints the frame rate of each of them
+int benchmarkPaths(GpuContext *gpu, const string &input, int threshold) {
+  const GpuConvPath paths[] = {GPU_CONV_BUFFER, GPU_CONV_IMAGE};
+
+  for (unsigned p = 0; p < sizeof(paths) / sizeof(GpuConvPath); p++) {
+    if (paths[p] == GPU_CONV_IMAGE && !gpu->imageSupport) {
+      printf("Path %s: not supported by the device\n",
+             gpuConvPathName(paths[p]));
+      continue;
+    }
+    GpuStream stream(gpu);
+    stream.convPath = paths[p];
+
+    VideoCapture camera(input);
+    if (!camera.isOpened()) {
+      cout << "Could not open the input video: " << input << endl;
+      return EXIT_FAILURE;
+    }
+
+    // The first frame allocates the device memory and is not timed
+    int frames = -1;
+    int totalTime = 0;
+    while (frames < MAX_FRAMES) {
+      Mat cameraFrame, grayframe;
+      camera >> cameraFrame;
+      if (cameraFrame.empty()) break;
+      cvtColor(cameraFrame, grayframe, CV_BGR2GRAY);
+      Mat edge = Mat(grayframe.size(), CV_8U);
+      auto perf = perfStart();
+      gpuEdgeMask(&stream, grayframe, grayframe, edge, threshold);
+      if (frames >= 0) totalTime += perfDone(perf);
+      frames++;
+    }
+    camera.release();
+    // The clock counts whole milliseconds, a short clip may not reach one
+    if (frames > 0 && totalTime > 0) {
+      printf("Path %s: FPS %.2lf .\n", gpuConvPathName(paths[p]),
+             ((float)frames) / (totalTime / 1000.0));
+    } else {
+      printf("Path %s: FPS n/a .\n", gpuConvPathName(paths[p]));
+    }
+  }
 
   return EXIT_SUCCESS;
 }
+
+// Usage: videofilter [--path=auto|buffer|image] [--threshold=otsu|N] [--bench]
+//                    [input.mp4 ...]
+// Every input is filtered as an independent stream with its own command queue,
+// kernel and buffers. Without inputs ./bourne.mp4 is used. --path selects how
+// the filters read their input, --threshold the edge threshold, from 0 to 255
+// (Otsu's method on every frame by default), --bench compares the frame rate
+// of the paths on the first input instead of writing videos.
+int main(int argc, char **argv) {
+  vector<StreamJob> jobs;
+  GpuConvPath path = GPU_CONV_AUTO;
+  bool bench = false;
+  int edgeThreshold = GPU_THRESHOLD_OTSU;
+  bool usage = false;
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    if (arg == "--path=buffer") {
+      path = GPU_CONV_BUFFER;
+    } else if (arg == "--path=image") {
+      path = GPU_CONV_IMAGE;
+    } else if (arg == "--path=auto") {
+      path = GPU_CONV_AUTO;
+    } else if (arg == "--threshold=otsu") {
+      edgeThreshold = GPU_THRESHOLD_OTSU;
+    } else if (arg.compare(0, 12, "--threshold=") == 0) {
+      const char *value = arg.c_str() + 12;
+      char *end;
+      long parsed = strtol(value, &end, 10);
+      if (end == value || *end || parsed < 0 || parsed > 255) {
+        usage = true;
+      } else {
+        edgeThreshold = parsed;
+      }
+    } else if (arg == "--bench") {
+      bench = true;
+    } else {
+      StreamJob job;
+      job.input = arg;
+      jobs.push_back(job);
+    }
+  }
+  if (usage) {
+    printf(
+        "Usage: %s [--path=auto|buffer|image] [--threshold=otsu|N] [--bench]\n"
+        "       [input.mp4 ...]\n"
+        "N is a fixed edge threshold from 0 to 255\n",
+        argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (jobs.empty()) {
+    StreamJob job;
+    job.input = "./bourne.mp4";
+    jobs.push_back(job);
+  }
+  for (unsigned i = 0; i < jobs.size(); i++) {
+    // Form the new name with container
+    jobs[i].output = jobs.size() == 1
+                         ? string("./output.avi")
+                         : "./output_" + to_string(i) + ".avi";
+    jobs[i].show = jobs.size() == 1;
+    jobs[i].threshold = edgeThreshold;
+  }
+
+  // Initialize GPU
+  GpuContext gpu(path);
+  // gpuShowInfo();
+
+  if (bench) return benchmarkPaths(&gpu, jobs[0].input, edgeThreshold);
+
+#ifdef SHOW
+  if (jobs.size() == 1) {
+    namedWindow("filter");  // Resizable window, might not work on Windows.
+  }
+#endif
+
+  RoundScheduler scheduler(jobs.size());
+
+  auto wallClock = perfStart();
+  vector<thread> workers;
+  for (unsigned i = 1; i < jobs.size(); i++) {
+    workers.push_back(thread(processStream, &jobs[i], &gpu, &scheduler));
+  }
+  // The first stream runs on the main thread, which owns the GUI window
+  processStream(&jobs[0], &gpu, &scheduler);
+  for (unsigned i = 0; i < workers.size(); i++) workers[i].join();
+  int wallTime = perfDone(wallClock);
+
+  int status = EXIT_SUCCESS;
+  int totalFrames = 0;
+  for (unsigned i = 0; i < jobs.size(); i++) {
+    if (jobs[i].frames > 0 && jobs[i].totalTime > 0) {
+      printf("Stream %u (%s): FPS %.2lf, threshold %d .\n", i,
+             jobs[i].input.c_str(),
+             ((float)jobs[i].frames) / (jobs[i].totalTime / 1000.0),
+             jobs[i].lastThreshold);
+    } else {
+      printf("Stream %u (%s): FPS n/a, threshold %d .\n", i,
+             jobs[i].input.c_str(), jobs[i].lastThreshold);
+    }
+    totalFrames += jobs[i].frames;
+    if (jobs[i].status != EXIT_SUCCESS) status = jobs[i].status;
+  }
+  if (jobs.size() > 1 && totalFrames > 0 && wallTime > 0) {
+    printf("Aggregate FPS over %u streams %.2lf .\n", (unsigned)jobs.size(),
+           ((float)totalFrames) / (wallTime / 1000.0));
+  }
+
+  return status;
+}